@@ -1,7 +1,22 @@
 #include <libgupnp/gupnp-control-point.h>
+#include <libgupnp/gupnp-root-device.h>
 #include <libgupnp-av/gupnp-av.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib/gstdio.h>
+#include <gobject/gvaluecollector.h>
+#include <json-glib/json-glib.h>
+#include <libxml/xmlreader.h>
 #include <string.h>
 #include <semaphore.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <glib-unix.h>
 
 typedef void (* MetadataFunc) (const char *metadata,
                                gpointer    user_data);
@@ -17,20 +32,221 @@ typedef void (* MetadataFunc) (const char *metadata,
 
 #define OBJECT_CLASS_CONTAINER "object.container"
 
+#define DIDL_LITE_HEADER \
+        "<DIDL-Lite xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" " \
+        "xmlns:dc=\"http://purl.org/dc/elements/1.1/\" " \
+        "xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" " \
+        "xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\">"
+#define DIDL_LITE_FOOTER "</DIDL-Lite>"
+
 #define MAX_BROWSE 64
 
+#define MEDIA_HTTP_PATH "/media/"
+#define MAX_HTTP_HEADER 8192
+
 static int upnp_port = 0;
+static int http_port = 0;
+static int http_threads = 32;
+static gboolean daemon_mode = FALSE;
+static char *socket_path = NULL;
+static char *call_method = NULL;
+static char *call_params = NULL;
+static char *record_path = NULL;
+static char *replay_path = NULL;
+static double replay_speed = 1.0;
+static int cache_budget_kib = 32 * 1024;
+static char **bench_didl_files = NULL;
+static int bench_didl_synthetic = 0;
+static int bench_play_rounds = 0;
+static int mock_latency_ms = 0;
+static int mock_failure_rate = 0;
+static int farm_servers = 0;
+static int farm_renderers = 0;
+static int farm_churn = 0;
+static int soak_seconds = 0;
+static int soak_interval = 60;
+static int soak_max_growth = 25;
+static int soak_max_stall_ms = 250;
+static int soak_max_p95_ms = 1000;
+static int action_timeout_ms = 5000;
+static int parse_threads = 0;
+static int shard_count = 0;
+static int discovery_fetches = 8;
+static char **ignore_patterns = NULL;
+static gboolean keep_duplicates = FALSE;
+static char *trace_path = NULL;
+static char *status_shm_name = NULL;
+static int stall_threshold_ms = 0;
+static char *art_dir = NULL;
+static int art_cache_kib = 8192;
+static int art_threads = 4;
+#ifdef CP_ALLOC_STATS
+static gboolean alloc_stats = TRUE;
+#else
+static gboolean alloc_stats = FALSE;
+#endif
 
+static GOptionEntry entries[] =
+{
+        { "port", 'p', 0,
+          G_OPTION_ARG_INT, &upnp_port,
+          "Network PORT to use for UPnP", "PORT" },
+        { "http-port", 0, 0,
+          G_OPTION_ARG_INT, &http_port,
+          "PORT to serve local files on (0 picks a free one)", "PORT" },
+        { "http-threads", 0, 0,
+          G_OPTION_ARG_INT, &http_threads,
+          "Maximum number of concurrent renderer streams", "N" },
+        { "daemon", 'd', 0,
+          G_OPTION_ARG_NONE, &daemon_mode,
+          "Keep running and serve JSON-RPC clients instead of the menu", NULL },
+        { "socket", 0, 0,
+          G_OPTION_ARG_FILENAME, &socket_path,
+          "Unix socket PATH of the daemon", "PATH" },
+        { "call", 'c', 0,
+          G_OPTION_ARG_STRING, &call_method,
+          "Send METHOD to a running daemon and print the reply", "METHOD" },
+        { "params", 0, 0,
+          G_OPTION_ARG_STRING, &call_params,
+          "JSON object with the parameters for --call", "JSON" },
+        { "record", 0, 0,
+          G_OPTION_ARG_FILENAME, &record_path,
+          "Record SSDP and SOAP traffic with timings to FILE", "FILE" },
+        { "replay", 0, 0,
+          G_OPTION_ARG_FILENAME, &replay_path,
+          "Replay a recording from FILE instead of using the network", "FILE" },
+        { "replay-speed", 0, 0,
+          G_OPTION_ARG_DOUBLE, &replay_speed,
+          "Replay latencies FACTOR times faster, 0 for no delays", "FACTOR" },
+        { "cache-budget", 0, 0,
+          G_OPTION_ARG_INT, &cache_budget_kib,
+          "Memory budget of the browse cache in KiB, 0 for unlimited", "KIB" },
+        { "action-timeout", 0, 0,
+          G_OPTION_ARG_INT, &action_timeout_ms,
+          "Give up on a device after MS milliseconds without an answer", "MS" },
+        { "shards", 0, 0,
+          G_OPTION_ARG_INT, &shard_count,
+          "Spread devices over N threads with their own main context", "N" },
+        { "discovery-fetches", 0, 0,
+          G_OPTION_ARG_INT, &discovery_fetches,
+          "Fetch at most N device descriptions at a time", "N" },
+        { "ignore", 0, 0,
+          G_OPTION_ARG_STRING_ARRAY, &ignore_patterns,
+          "Never fetch devices whose USN matches PATTERN", "PATTERN" },
+        { "keep-duplicates", 0, 0,
+          G_OPTION_ARG_NONE, &keep_duplicates,
+          "Show every server's copy of a track when browsing all servers",
+          NULL },
+        { "trace", 0, 0,
+          G_OPTION_ARG_FILENAME, &trace_path,
+          "Write a Chrome trace of discovery, browsing and control to FILE",
+          "FILE" },
+        { "status-shm", 0, 0,
+          G_OPTION_ARG_STRING, &status_shm_name,
+          "Publish device and renderer status in shared memory NAME",
+          "NAME" },
+        { "art-cache", 0, 0,
+          G_OPTION_ARG_INT, &art_cache_kib,
+          "Keep KIB of album art in memory", "KIB" },
+        { "art-downloads", 0, 0,
+          G_OPTION_ARG_INT, &art_threads,
+          "Download at most N album art images at a time", "N" },
+        { "art-dir", 0, 0,
+          G_OPTION_ARG_FILENAME, &art_dir,
+          "Cache album art in DIR instead of the user cache", "DIR" },
+        { "stall-threshold", 0, 0,
+          G_OPTION_ARG_INT, &stall_threshold_ms,
+          "Watch the main loop and log stalls longer than MS "
+          "milliseconds", "MS" },
+        { "alloc-stats", 0, 0,
+          G_OPTION_ARG_NONE, &alloc_stats,
+          "Account memory per subsystem for the stats command", NULL },
+        { "parse-threads", 0, 0,
+          G_OPTION_ARG_INT, &parse_threads,
+          "Number of threads parsing Browse results (0 is one per core)", "N" },
+        { "bench-didl", 0, 0,
+          G_OPTION_ARG_FILENAME_ARRAY, &bench_didl_files,
+          "Measure DIDL-Lite parsing on a payload or --record FILE", "FILE" },
+        { "bench-didl-synthetic", 0, 0,
+          G_OPTION_ARG_INT, &bench_didl_synthetic,
+          "Measure DIDL-Lite parsing on a generated page of N items", "N" },
+        { "bench-play", 0, 0,
+          G_OPTION_ARG_INT, &bench_play_rounds,
+          "Measure select-to-PLAYING latency on a mock renderer N times", "N" },
+        { "mock-latency", 0, 0,
+          G_OPTION_ARG_INT, &mock_latency_ms,
+          "Delay every answer of the mock devices by MS milliseconds", "MS" },
+        { "mock-failure-rate", 0, 0,
+          G_OPTION_ARG_INT, &mock_failure_rate,
+          "Fail PERCENT of the actions sent to mock devices", "PERCENT" },
+        { "farm-servers", 0, 0,
+          G_OPTION_ARG_INT, &farm_servers,
+          "Start N mock servers and measure discovery and control", "N" },
+        { "farm-renderers", 0, 0,
+          G_OPTION_ARG_INT, &farm_renderers,
+          "Start N mock renderers and measure discovery and control", "N" },
+        { "farm-churn", 0, 0,
+          G_OPTION_ARG_INT, &farm_churn,
+          "Replace N farm devices per second (at most 1000) after the "
+          "fan-out rounds", "N" },
+        { "soak", 0, 0,
+          G_OPTION_ARG_INT, &soak_seconds,
+          "Exercise mock devices for SECONDS and check for drift", "SECONDS" },
+        { "soak-interval", 0, 0,
+          G_OPTION_ARG_INT, &soak_interval,
+          "Sample resources and latencies every SECONDS during --soak",
+          "SECONDS" },
+        { "soak-max-growth", 0, 0,
+          G_OPTION_ARG_INT, &soak_max_growth,
+          "Fail --soak if RSS or descriptors grow by PERCENT", "PERCENT" },
+        { "soak-max-stall", 0, 0,
+          G_OPTION_ARG_INT, &soak_max_stall_ms,
+          "Fail --soak if the main loop stalls for MS milliseconds", "MS" },
+        { "soak-max-p95", 0, 0,
+          G_OPTION_ARG_INT, &soak_max_p95_ms,
+          "Fail --soak if the action latency p95 exceeds MS", "MS" },
+        { NULL }
+};
+
+static GMainLoop *main_loop;
 static GUPnPContextManager *context_manager;
 
 static GHashTable *server_table = NULL;
 static GHashTable *browse_table = NULL;
 static GHashTable *renderer_table = NULL;
+static GHashTable *browsed_table = NULL;
+
+/* Bumped whenever objects enter or leave browse_table */
+static guint browse_generation = 0;
+
+/* Browse results are parsed on these threads, see didl_batch_parse () */
+static GThreadPool *didl_pool = NULL;
+
+/* Browsed containers, most recently used first */
+static GQueue cache_lru = G_QUEUE_INIT;
+static gsize cache_bytes = 0;
+static gsize cache_budget = 0;
+
+/* The container the menu is showing, it and its ancestors are never
+ * evicted */
+static char nav_server_udn[256];
+static char nav_object_id[256];
 
-static sem_t browse_sem, play_sem, duration_sem;
+/* browsed_table keys -> GUINT_TO_POINTER (pin count) of containers a
+ * path lookup is going to read, never evicted either */
+static GHashTable *cache_pins = NULL;
+
+static sem_t browse_sem, duration_sem;
 
 static char current_renderer[256];
 
+/* Guards renderer_table against lookups from shards and the local
+ * state and controls of every RendererData, the menu and RPC threads
+ * change them while the shards complete them */
+static GMutex renderer_state_lock;
+
+static char *local_host_ip = NULL;
+
 
 typedef enum 
 {
@@ -39,25 +255,110 @@ typedef enum
 	STOPPED
 } player_status;
 
-static player_status current_status = STOPPED;
+static const char *player_status_names[] = { "PLAYING", "PAUSED", "STOPPED" };
+
 
+typedef struct _CachedContainer CachedContainer;
+typedef struct _AggregateServer AggregateServer;
+typedef struct _Hydrate Hydrate;
+
+/* How much of an object a Browse asks for.  Listings only need what
+ * the menus show, the rest is filled in by cache_hydrate () for the
+ * objects someone looks at or plays.  Servers ignoring the Filter send
+ * everything anyway. */
+typedef enum
+{
+	FILTER_LISTING,
+	FILTER_PLAYBACK,
+	FILTER_FULL,
+	N_FILTER_PROFILES
+} FilterProfile;
+
+static const char *filter_profile_names[] = { "listing", "playback", "full" };
+
+/* DIDL-Lite parsed per profile, to see what the Filter saves */
+static gsize filter_bytes[N_FILTER_PROFILES];
+static gsize filter_objects[N_FILTER_PROFILES];
+static gint hydrate_requests = 0;
+static gint hydrate_objects = 0;
+
+/* id, parentID, restricted, dc:title and upnp:class always come.
+ * Listings keep the artist, album and art, which the menus, playlist
+ * matching and artwork use; without res they get no fingerprint, so
+ * only objects browsed or hydrated for playback count as duplicates. */
+static const char *filter_profile_filters[] =
+{
+	"@childCount,dc:creator,upnp:artist,upnp:album,upnp:albumArtURI",
+	"@childCount,res,res@protocolInfo,res@duration,res@size,"
+	"dc:creator,upnp:artist,upnp:album,upnp:albumArtURI",
+	"*"
+};
 
 typedef struct
 {
 	char *title;
 	char *parent_id;
 	char *class;
-        GUPnPDIDLLiteResource *resource;
-
+	char *artist;
+	char *album;
+	char *art_uri;
+	char *uri;
+	char *protocol_info;
+	/* See container_fingerprint () */
+	guint64 fingerprint;
+	/* What the server was asked for, at least FILTER_PLAYBACK when
+	 * it sent a res anyway */
+	FilterProfile detail;
+
+	CachedContainer *owner;
+	gsize size;
 } Container;
 
+/* The children of one browsed container, the unit the cache evicts */
+struct _CachedContainer
+{
+	char *key;
+	char *udn;
+	char *id;
+
+	GPtrArray *children;
+	gsize bytes;
+	gboolean complete;
+
+	/* Casefolded title -> GPtrArray of the children's ids, built
+	 * by cache_find_children () and counted in bytes */
+	GHashTable *titles;
+	gsize titles_bytes;
+
+	GList *lru_link;
+};
+
 typedef struct
 {
 	char *friendly_name;
         GUPnPServiceProxy *content_dir;
 	GUPnPDeviceInfo  *info;
+
+	/* What mem_alloc () was told about */
+	gsize mem_size;
 } MediaServers;
 
+typedef enum
+{
+	CONTROL_VOLUME,
+	CONTROL_MUTE,
+	CONTROL_SEEK,
+	N_CONTROLS
+} RendererControlType;
+
+/* At most one request of each kind is on the wire per renderer */
+typedef struct
+{
+	gboolean in_flight;
+	gboolean dirty;
+	gint64 target;
+} RendererControl;
+
 typedef struct {
 	char *friendly_name;
 	GUPnPServiceProxy *av_transport;
@@ -65,6 +366,39 @@ typedef struct {
 	GUPnPServiceProxy *rendering_control;
 
 	char *sink_protocol_info;
+
+	/* Transport state and media, from GetTransportInfo and
+	 * GetMediaInfo at discovery and AVTransport events after that */
+	player_status status;
+	char *uri;
+	char *metadata;
+	/* dc:title of metadata */
+	char *title;
+
+	/* What the renderer is doing as far as we know, changed as soon
+	 * as the user asks and corrected from events and position polls */
+	int volume;
+	gboolean mute;
+	gint64 position;
+	gint64 duration;
+	/* Volume steps taken while volume was still -1, added once
+	 * GetVolume answers */
+	int volume_delta;
+	gboolean volume_query;
+
+	RendererControl controls[N_CONTROLS];
+
+	/* QueueEntry to play next, the queue moves on whenever the
+	 * renderer stops by itself while queue_playing */
+	GQueue queue;
+	gboolean queue_playing;
+	/* Set from sending a queued URI until the renderer reports
+	 * PLAYING, the STOPPED many send when their URI is replaced is
+	 * not a track ending */
+	gboolean queue_loading;
+
+	/* What mem_alloc () was told about */
+	gsize mem_size;
 } RendererData;
 	
 typedef struct
@@ -74,6 +408,15 @@ typedef struct
 	gchar *id;
 
 	guint32 starting_index;
+
+	CachedContainer *cache;
+
+	FilterProfile profile;
+
+	/* Set for the pages of an aggregated view */
+	AggregateServer *aggregate;
+	/* Set for the pages cache_hydrate () asked for */
+	Hydrate *hydrate;
 } BrowseData;
 
 typedef struct
@@ -85,13 +428,183 @@ typedef struct
 	gpointer user_data;
 } BrowseMetadataData;
 
+/* A thread waiting for its playback request to reach PLAYING, see
+ * play_wait_init () */
+typedef struct
+{
+	sem_t sem;
+	gboolean ok;
+} PlayWait;
+
 typedef struct
 {
 	GCallback callback;
 
-	GUPnPDIDLLiteResource *resource;
+	char *uri;
+	PlayWait *wait;
 } SetAVTransportURIData;
 
+typedef struct
+{
+	char *path;
+	char *mime_type;
+	goffset size;
+} LocalMedia;
+
+static GHashTable *local_media_table = NULL;
+static GMutex local_media_lock;
+static guint local_media_next_id = 1;
+static GThreadedSocketService *http_service = NULL;
+
+
+/* Allocation accounting.  Whoever allocates or frees an object the
+ * control point keeps reports it under a subsystem tag, so a leak
+ * shows up as live bytes that only grow.  Built in with
+ * -DCP_ALLOC_STATS or switched on with --alloc-stats. */
+typedef enum
+{
+        MEM_DISCOVERY,
+        MEM_BROWSE_CACHE,
+        MEM_DIDL_PARSE,
+        MEM_CONTROL,
+        MEM_ARTWORK,
+        N_MEM_TAGS
+} MemTag;
+
+static const char *mem_tag_names[] =
+{
+        "discovery",
+        "browse_cache",
+        "didl_parse",
+        "control",
+        "artwork"
+};
+
+typedef struct
+{
+        gssize live_bytes;
+        gssize live_blocks;
+        gssize peak_bytes;
+        gssize allocs;
+        gssize alloc_bytes;
+} MemCounters;
+
+static MemCounters mem_counters[N_MEM_TAGS];
+
+/* Peaks are rare, only raising one takes the lock */
+static GMutex mem_peak_lock;
+
+static void
+mem_alloc (MemTag tag,
+           gsize  bytes)
+{
+        MemCounters *counters = &mem_counters[tag];
+        gssize       live;
+
+        if (!alloc_stats)
+                return;
+
+        g_atomic_pointer_add (&counters->allocs, 1);
+        g_atomic_pointer_add (&counters->alloc_bytes, bytes);
+        g_atomic_pointer_add (&counters->live_blocks, 1);
+        live = g_atomic_pointer_add (&counters->live_bytes, bytes) + bytes;
+
+        if (live > (gssize) g_atomic_pointer_get (&counters->peak_bytes)) {
+                g_mutex_lock (&mem_peak_lock);
+                if (live > counters->peak_bytes)
+                        counters->peak_bytes = live;
+                g_mutex_unlock (&mem_peak_lock);
+        }
+}
+
+static void
+mem_free (MemTag tag,
+          gsize  bytes)
+{
+        MemCounters *counters = &mem_counters[tag];
+
+        if (!alloc_stats)
+                return;
+
+        g_atomic_pointer_add (&counters->live_blocks, -1);
+        g_atomic_pointer_add (&counters->live_bytes, -(gssize) bytes);
+}
+
+static void
+mem_object_finalized_cb (gpointer user_data,
+                         GObject *object)
+{
+        GTypeQuery query;
+
+        g_type_query (G_OBJECT_TYPE (object), &query);
+        mem_free (GPOINTER_TO_INT (user_data), query.instance_size);
+}
+
+/* Counts a libgupnp object under @tag until it is finalized, an object
+ * must only be tracked once */
+static void
+mem_track_object (MemTag   tag,
+                  gpointer object)
+{
+        GTypeQuery query;
+
+        if (!alloc_stats || object == NULL)
+                return;
+
+        g_type_query (G_OBJECT_TYPE (object), &query);
+        mem_alloc (tag, query.instance_size);
+        g_object_weak_ref (G_OBJECT (object),
+                           mem_object_finalized_cb,
+                           GINT_TO_POINTER (tag));
+}
+
+typedef struct
+{
+        MemCounters counters;
+        double      alloc_rate;
+} MemSnapshot;
+
+static GMutex mem_report_lock;
+/* Set when the program starts */
+static gint64 mem_report_time = 0;
+static gssize mem_report_allocs[N_MEM_TAGS];
+
+/* Fills @snapshots with one entry per tag, the allocation rate is per
+ * second since the previous report */
+static void
+mem_snapshot (MemSnapshot *snapshots)
+{
+        gint64 now = g_get_monotonic_time ();
+        double elapsed;
+        int    i;
+
+        g_mutex_lock (&mem_report_lock);
+        elapsed = (double) (now - mem_report_time) / G_USEC_PER_SEC;
+
+        for (i = 0; i < N_MEM_TAGS; i++) {
+                MemCounters *counters = &mem_counters[i];
+                MemCounters *snapshot = &snapshots[i].counters;
+
+                snapshot->live_bytes =
+                        (gssize) g_atomic_pointer_get (&counters->live_bytes);
+                snapshot->live_blocks =
+                        (gssize) g_atomic_pointer_get (&counters->live_blocks);
+                snapshot->peak_bytes =
+                        (gssize) g_atomic_pointer_get (&counters->peak_bytes);
+                snapshot->allocs =
+                        (gssize) g_atomic_pointer_get (&counters->allocs);
+                snapshot->alloc_bytes =
+                        (gssize) g_atomic_pointer_get (&counters->alloc_bytes);
+
+                snapshots[i].alloc_rate = elapsed > 0 ?
+                        (snapshot->allocs - mem_report_allocs[i]) / elapsed :
+                        0;
+                mem_report_allocs[i] = snapshot->allocs;
+        }
+
+        mem_report_time = now;
+        g_mutex_unlock (&mem_report_lock);
+}
 
 static GUPnPServiceProxy *
 get_content_dir (GUPnPDeviceProxy *proxy)
@@ -131,1094 +644,14168 @@ void add_media_server(GUPnPDeviceProxy  *proxy)
 		server->friendly_name = friendly_name;
 		server->content_dir = content_dir;
 		server->info = info;
+		server->mem_size = sizeof (MediaServers) + strlen (udn) + 1 +
+				   (friendly_name ? strlen (friendly_name) + 1 : 0);
+		mem_alloc (MEM_DISCOVERY, server->mem_size);
+		mem_track_object (MEM_DISCOVERY, content_dir);
 		
 		g_hash_table_insert(server_table, udn, server);
 
 		server_present = TRUE;
 			
+	} else {
+		g_free(udn);
+		g_free(friendly_name);
+		g_object_unref(content_dir);
 	}
 
 }
 
 static void
-get_protocol_info_cb (GUPnPServiceProxy       *cm,
-                      GUPnPServiceProxyAction *action,
-                      gpointer                 user_data)
+media_server_free (MediaServers *server)
 {
+	g_free (server->friendly_name);
+	if (server->content_dir != NULL)
+		g_object_unref (server->content_dir);
+	mem_free (MEM_DISCOVERY, server->mem_size);
+	free (server);
+}
 
-        gchar      *sink_protocol_info;
-        char *udn;
-        GError      *error;
+/* --trace FILE records spans into per-thread buffers and writes them as
+ * Chrome Trace Event JSON on exit, for chrome://tracing or Perfetto.
+ * Each buffer is only written by its own thread and publishes events by
+ * bumping its count, so recording takes no lock. */
+#define TRACE_BUFFER_EVENTS 16384
 
-        udn = g_strdup(gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (cm)));
+typedef enum
+{
+        TRACE_COMPLETE,
+        TRACE_ASYNC_BEGIN,
+        TRACE_ASYNC_END,
+        TRACE_INSTANT
+} TracePhase;
 
-        error = NULL;
-        if (!gupnp_service_proxy_end_action (cm,
-                                             action,
-                                             &error,
-                                             "Sink",
-                                             G_TYPE_STRING,
-                                             &sink_protocol_info,
-                                             NULL)) {
-                g_warning ("Failed to get sink protocol info from "
-                           "media renderer '%s':%s\n",
-                           udn,
-                           error->message);
-                g_error_free (error);
+static const char *trace_phases[] = { "X", "b", "e", "i" };
 
-                goto return_point;
-        }
+typedef struct
+{
+        TracePhase phase;
+        gint64     ts;
+        gint64     dur;
+        guint64    id;
+        char       name[32];
+        char       detail[64];
+} TraceEvent;
 
-        if (sink_protocol_info) {
-		RendererData *data;
-		data = (RendererData*)g_hash_table_lookup(renderer_table, udn);
-		data->sink_protocol_info = sink_protocol_info;
-        }
+typedef struct _TraceBuffer TraceBuffer;
 
-return_point:
-        g_object_unref (cm);
+struct _TraceBuffer
+{
+        TraceBuffer *next;
+        gint         tid;
+        char         thread_name[32];
+        gint         count;
+        gint         dropped;
+        TraceEvent   events[TRACE_BUFFER_EVENTS];
+};
+
+static TraceBuffer *trace_buffers = NULL;
+static gint trace_next_tid = 1;
+static GPrivate trace_buffer_key;
+
+static TraceBuffer *
+trace_buffer_get (void)
+{
+        TraceBuffer *buffer;
+
+        buffer = g_private_get (&trace_buffer_key);
+        if (buffer != NULL)
+                return buffer;
+
+        /* Buffers outlive their threads, their events are dumped at exit */
+        buffer = g_malloc0 (sizeof (TraceBuffer));
+        buffer->tid = g_atomic_int_add (&trace_next_tid, 1);
+        prctl (PR_GET_NAME, buffer->thread_name, 0, 0, 0);
+        do
+                buffer->next = g_atomic_pointer_get (&trace_buffers);
+        while (!g_atomic_pointer_compare_and_exchange (&trace_buffers,
+                                                       buffer->next,
+                                                       buffer));
+        g_private_set (&trace_buffer_key, buffer);
+
+        return buffer;
 }
 
-static GUPnPServiceProxy *
-get_connection_manager (GUPnPDeviceProxy *proxy)
+static void
+trace_record (TracePhase  phase,
+              const char *name,
+              const char *detail,
+              gint64      ts,
+              gint64      dur,
+              guint64     id)
 {
+        TraceBuffer *buffer;
+        TraceEvent  *event;
+        gint         count;
 
-        GUPnPDeviceInfo  *info;
-        GUPnPServiceInfo *cm;
+        if (trace_path == NULL)
+                return;
 
-        info = GUPNP_DEVICE_INFO (proxy);
+        buffer = trace_buffer_get ();
+        count = buffer->count;
+        if (count == TRACE_BUFFER_EVENTS) {
+                g_atomic_int_inc (&buffer->dropped);
 
-        cm = gupnp_device_info_get_service (info, CONNECTION_MANAGER);
+                return;
+        }
 
-        return GUPNP_SERVICE_PROXY (cm);
+        event = &buffer->events[count];
+        event->phase = phase;
+        event->ts = ts;
+        event->dur = dur;
+        event->id = id;
+        g_strlcpy (event->name, name, sizeof (event->name));
+        g_strlcpy (event->detail,
+                   detail != NULL ? detail : "",
+                   sizeof (event->detail));
+
+        g_atomic_int_set (&buffer->count, count + 1);
 }
 
-static GUPnPServiceProxy *
-get_rendering_control (GUPnPDeviceProxy *proxy)
+/* Start of a span for trace_complete (), 0 when not tracing */
+static gint64
+trace_begin (void)
 {
+        return trace_path != NULL ? g_get_monotonic_time () : 0;
+}
 
-        GUPnPDeviceInfo  *info;
-        GUPnPServiceInfo *rendering_control;
+static void
+trace_complete (const char *name,
+                const char *detail,
+                gint64      start)
+{
+        if (start != 0)
+                trace_record (TRACE_COMPLETE,
+                              name,
+                              detail,
+                              start,
+                              g_get_monotonic_time () - start,
+                              0);
+}
 
-        info = GUPNP_DEVICE_INFO (proxy);
+/* Spans that end on another thread or in a later callback, begin and
+ * end are matched by @id */
+static void
+trace_async (TracePhase  phase,
+             const char *name,
+             const char *detail,
+             guint64     id)
+{
+        if (trace_path != NULL)
+                trace_record (phase,
+                              name,
+                              detail,
+                              g_get_monotonic_time (),
+                              0,
+                              id);
+}
 
-        rendering_control = gupnp_device_info_get_service (info,
-                                                           RENDERING_CONTROL);
+static void
+trace_instant (const char *name,
+               const char *detail)
+{
+        if (trace_path != NULL)
+                trace_record (TRACE_INSTANT,
+                              name,
+                              detail,
+                              g_get_monotonic_time (),
+                              0,
+                              0);
+}
 
-        return GUPNP_SERVICE_PROXY (rendering_control);
+/* sem_wait () for the user side, what it waited on shows up as a span */
+static void
+trace_sem_wait (sem_t      *sem,
+                const char *name)
+{
+        gint64 start = trace_begin ();
+
+        sem_wait (sem);
+        trace_complete (name, NULL, start);
 }
 
-static GUPnPServiceProxy *
-get_av_transport (GUPnPDeviceProxy *renderer)
+static void
+trace_dump (const char *path)
 {
+        JsonBuilder   *builder;
+        JsonGenerator *generator;
+        JsonNode      *root;
+        TraceBuffer   *buffer;
+        GError        *error = NULL;
+        gint           pid = getpid ();
+        gint           i, count;
+
+        builder = json_builder_new ();
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "traceEvents");
+        json_builder_begin_array (builder);
+
+        for (buffer = g_atomic_pointer_get (&trace_buffers);
+             buffer != NULL;
+             buffer = buffer->next) {
+                json_builder_begin_object (builder);
+                json_builder_set_member_name (builder, "name");
+                json_builder_add_string_value (builder, "thread_name");
+                json_builder_set_member_name (builder, "ph");
+                json_builder_add_string_value (builder, "M");
+                json_builder_set_member_name (builder, "pid");
+                json_builder_add_int_value (builder, pid);
+                json_builder_set_member_name (builder, "tid");
+                json_builder_add_int_value (builder, buffer->tid);
+                json_builder_set_member_name (builder, "args");
+                json_builder_begin_object (builder);
+                json_builder_set_member_name (builder, "name");
+                json_builder_add_string_value (builder, buffer->thread_name);
+                json_builder_end_object (builder);
+                json_builder_end_object (builder);
+
+                count = g_atomic_int_get (&buffer->count);
+                for (i = 0; i < count; i++) {
+                        TraceEvent *event = &buffer->events[i];
+
+                        json_builder_begin_object (builder);
+                        json_builder_set_member_name (builder, "name");
+                        json_builder_add_string_value (builder, event->name);
+                        json_builder_set_member_name (builder, "cat");
+                        json_builder_add_string_value (builder,
+                                                       "control-point");
+                        json_builder_set_member_name (builder, "ph");
+                        json_builder_add_string_value
+                                (builder, trace_phases[event->phase]);
+                        json_builder_set_member_name (builder, "ts");
+                        json_builder_add_int_value (builder, event->ts);
+                        json_builder_set_member_name (builder, "pid");
+                        json_builder_add_int_value (builder, pid);
+                        json_builder_set_member_name (builder, "tid");
+                        json_builder_add_int_value (builder, buffer->tid);
+
+                        if (event->phase == TRACE_COMPLETE) {
+                                json_builder_set_member_name (builder, "dur");
+                                json_builder_add_int_value (builder,
+                                                            event->dur);
+                        } else if (event->phase == TRACE_INSTANT) {
+                                json_builder_set_member_name (builder, "s");
+                                json_builder_add_string_value (builder, "t");
+                        } else {
+                                char *id;
+
+                                id = g_strdup_printf ("0x%" G_GINT64_MODIFIER
+                                                      "x",
+                                                      event->id);
+                                json_builder_set_member_name (builder, "id");
+                                json_builder_add_string_value (builder, id);
+                                g_free (id);
+                        }
 
-        GUPnPDeviceInfo  *info;
-        GUPnPServiceInfo *av_transport;
+                        json_builder_set_member_name (builder, "args");
+                        json_builder_begin_object (builder);
+                        json_builder_set_member_name (builder, "detail");
+                        json_builder_add_string_value (builder,
+                                                       event->detail);
+                        json_builder_end_object (builder);
+                        json_builder_end_object (builder);
+                }
 
-        info = GUPNP_DEVICE_INFO (renderer);
+                if (buffer->dropped > 0)
+                        g_warning ("Trace buffer of '%s' was full, dropped "
+                                   "%d events",
+                                   buffer->thread_name,
+                                   buffer->dropped);
+        }
 
-        av_transport = gupnp_device_info_get_service (info, AV_TRANSPORT);
+        json_builder_end_array (builder);
+        json_builder_set_member_name (builder, "displayTimeUnit");
+        json_builder_add_string_value (builder, "ms");
+        json_builder_end_object (builder);
+
+        root = json_builder_get_root (builder);
+        generator = json_generator_new ();
+        json_generator_set_root (generator, root);
+        if (!json_generator_to_file (generator, path, &error)) {
+                g_warning ("Failed to write trace to %s: %s",
+                           path,
+                           error->message);
+                g_error_free (error);
+        }
 
-        return GUPNP_SERVICE_PROXY (av_transport);
+        json_node_unref (root);
+        g_object_unref (generator);
+        g_object_unref (builder);
 }
 
-
-void
-add_media_renderer (GUPnPDeviceProxy *proxy)
+/* SIGINT and SIGTERM end the main loop so the trace is written and
+ * the status segment removed */
+static gboolean
+quit_cb (gpointer user_data)
 {
+        g_main_loop_quit (main_loop);
 
-        char        *udn;
-        GUPnPServiceProxy *cm;
-        GUPnPServiceProxy *av_transport;
-        GUPnPServiceProxy *rendering_control;
-	GUPnPDeviceInfo  *info;
-	char *name;
-	
+        return FALSE;
+}
 
-        udn = g_strdup(gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy)));
-        if (udn == NULL)
-                return;
+/* Resources seen on the network, until their description arrives */
+static void
+trace_resource_available_cb (GSSDPResourceBrowser *browser,
+                             const char           *usn,
+                             GList                *locations,
+                             gpointer              user_data)
+{
+        const char *end;
+        char       *udn;
+
+        end = strstr (usn, "::");
+        udn = end != NULL ? g_strndup (usn, end - usn) : g_strdup (usn);
+        trace_instant ("ssdp available", usn);
+        trace_async (TRACE_ASYNC_BEGIN, "description", udn, g_str_hash (udn));
+        g_free (udn);
+}
 
-        cm = get_connection_manager (proxy);
-        if (G_UNLIKELY (cm == NULL))
-                return;
+static void
+trace_device_described (GUPnPDeviceProxy *proxy)
+{
+        const char *udn;
 
+        udn = gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy));
+        trace_async (TRACE_ASYNC_END, "description", udn, g_str_hash (udn));
+}
 
-        av_transport = get_av_transport (proxy);
-        if (av_transport == NULL)
-		goto no_av_transport;
+/* Main loop watchdog.  A G_PRIORITY_HIGH probe runs on the main loop
+ * every WATCHDOG_PROBE_MS, how late it runs is the dispatch latency
+ * every other callback sees too, kept in a histogram of power of two
+ * milliseconds.  A thread of its own notices when the probe stops
+ * running for --stall-threshold MS and logs what the main thread said
+ * it was in: the action callback, posted closure or SSDP handler
+ * entered with watchdog_enter (). */
+#define WATCHDOG_PROBE_MS 20
+/* Below 1 ms, below 2 ms, ... and 4096 ms or more */
+#define WATCHDOG_BUCKETS 14
+#define WATCHDOG_STALLS 16
+
+/* What the main thread is running, both strings live at least until
+ * the matching watchdog_leave () */
+typedef struct
+{
+        const char *kind;
+        const char *what;
+} WatchdogSection;
 
+typedef struct
+{
+        char   what[96];
+        /* g_get_real_time () it started, duration so far */
+        gint64 start;
+        gint64 duration;
+} WatchdogStall;
+
+static GThread *watchdog_thread = NULL;
+static GThread *watchdog_main_thread = NULL;
+static GMutex watchdog_lock;
+static GCond watchdog_cond;
+
+/* Everything below is guarded by watchdog_lock */
+static gboolean watchdog_quit = FALSE;
+static WatchdogSection watchdog_section;
+static gint64 watchdog_heartbeat = 0;
+static guint64 watchdog_histogram[WATCHDOG_BUCKETS];
+static guint64 watchdog_probes = 0;
+static gint64 watchdog_max_lag = 0;
+/* The last WATCHDOG_STALLS stalls, stall_count % WATCHDOG_STALLS is
+ * the next to go */
+static WatchdogStall watchdog_stalls[WATCHDOG_STALLS];
+static guint watchdog_stall_count = 0;
+static WatchdogStall *watchdog_current_stall = NULL;
+
+/* Tells the watchdog the main thread runs the @kind @what, no-op on
+ * other threads */
+static WatchdogSection
+watchdog_enter (const char *kind,
+                const char *what)
+{
+        WatchdogSection previous = { NULL, NULL };
 
-        rendering_control = get_rendering_control (proxy);
-        if (rendering_control == NULL) 
-                goto no_rendering_control;
+        if (watchdog_main_thread == NULL ||
+            g_thread_self () != watchdog_main_thread)
+                return previous;
 
+        g_mutex_lock (&watchdog_lock);
+        previous = watchdog_section;
+        watchdog_section.kind = kind;
+        watchdog_section.what = what;
+        g_mutex_unlock (&watchdog_lock);
 
-        gupnp_service_proxy_begin_action (g_object_ref (cm),
-					  "GetProtocolInfo",
-                                          get_protocol_info_cb,
-                                          NULL,
-                                          NULL);
-	info = GUPNP_DEVICE_INFO (proxy);
-	name = gupnp_device_info_get_friendly_name (info);
-	if (name == NULL)
-                name = g_strdup (udn);
+        return previous;
+}
 
-	if(NULL == g_hash_table_lookup(renderer_table, udn)){
-		RendererData *renderer = (RendererData*)malloc(sizeof(RendererData));
+/* Goes back to what watchdog_enter () returned */
+static void
+watchdog_leave (WatchdogSection previous)
+{
+        if (watchdog_main_thread == NULL ||
+            g_thread_self () != watchdog_main_thread)
+                return;
 
-		renderer->friendly_name = name;
-		renderer->av_transport = av_transport;
-		renderer->cm= cm;
-		renderer->rendering_control = rendering_control;
-		renderer->sink_protocol_info = NULL;
-		
-	
-		g_hash_table_insert(renderer_table, udn, renderer);
+        g_mutex_lock (&watchdog_lock);
+        watchdog_section = previous;
+        g_mutex_unlock (&watchdog_lock);
+}
 
-	}
-	
-	
-/*
-        gupnp_service_proxy_begin_action (g_object_ref (av_transport),
-                                          "GetTransportInfo",
-                                          get_transport_info_cb,
-                                          NULL,
-                                          "InstanceID", G_TYPE_UINT, 0,
-                                          NULL);
+static gboolean
+watchdog_probe_cb (gpointer user_data)
+{
+        gint64         now = g_get_monotonic_time ();
+        gint64         lag = 0;
+        WatchdogStall  stall;
+        gboolean       recovered = FALSE;
+        int            bucket;
+
+        g_mutex_lock (&watchdog_lock);
+        if (watchdog_heartbeat != 0)
+                lag = MAX (now - watchdog_heartbeat -
+                           WATCHDOG_PROBE_MS * 1000, 0);
+        watchdog_heartbeat = now;
+
+        for (bucket = 0;
+             bucket < WATCHDOG_BUCKETS - 1 && lag >= (1000 << bucket);
+             bucket++);
+        watchdog_histogram[bucket]++;
+        watchdog_probes++;
+        watchdog_max_lag = MAX (watchdog_max_lag, lag);
+
+        if (watchdog_current_stall != NULL) {
+                watchdog_current_stall->duration = lag;
+                stall = *watchdog_current_stall;
+                watchdog_current_stall = NULL;
+                recovered = TRUE;
+        }
+        g_mutex_unlock (&watchdog_lock);
 
-        gupnp_service_proxy_begin_action (g_object_ref (av_transport),
-                                          "GetMediaInfo",
-                                          get_media_info_cb,
-                                          NULL,
-                                          "InstanceID", G_TYPE_UINT, 0,
-                                          NULL);
+        if (recovered) {
+                g_warning ("Main loop stalled for %.1f ms in %s",
+                           stall.duration / 1000.0,
+                           stall.what);
+                trace_instant ("main loop stall", stall.what);
+        }
 
-        gupnp_service_proxy_begin_action (g_object_ref (rendering_control),
-                                          "GetVolume",
-                                          get_volume_cb,
-                                          NULL,
-                                          "InstanceID", G_TYPE_UINT, 0,
-                                          "Channel", G_TYPE_STRING, "Master",
-                                          NULL);
-*/
-//	g_object_unref (rendering_control);
-no_rendering_control:
-	puts("No Rendering Control");
-//        g_object_unref (av_transport);
-no_av_transport:
-	puts("No AV Transport");
-//        g_object_unref (cm);
-	
+        return TRUE;
 }
 
-
-void remove_media_server(GUPnPDeviceProxy  *proxy)
+static gpointer
+watchdog_thread_func (gpointer user_data)
 {
-	GUPnPDeviceInfo   *info;
-	char *udn;
+        gint64 threshold = (gint64) stall_threshold_ms * 1000;
+
+        g_mutex_lock (&watchdog_lock);
+        while (!watchdog_quit) {
+                gint64 now = g_get_monotonic_time ();
+                gint64 silent = now - watchdog_heartbeat -
+                                WATCHDOG_PROBE_MS * 1000;
+
+                if (watchdog_current_stall != NULL)
+                        watchdog_current_stall->duration = silent;
+                else if (watchdog_heartbeat != 0 && silent >= threshold) {
+                        WatchdogStall *stall;
+                        char           what[sizeof (stall->what)];
+
+                        stall = &watchdog_stalls[watchdog_stall_count++ %
+                                                 WATCHDOG_STALLS];
+                        if (watchdog_section.what != NULL)
+                                g_snprintf (stall->what,
+                                            sizeof (stall->what),
+                                            "%s %s",
+                                            watchdog_section.kind,
+                                            watchdog_section.what);
+                        else
+                                g_strlcpy (stall->what,
+                                           "a source without a name",
+                                           sizeof (stall->what));
+                        stall->start = g_get_real_time () - silent;
+                        stall->duration = silent;
+                        watchdog_current_stall = stall;
+                        g_strlcpy (what, stall->what, sizeof (what));
+
+                        /* Said now, the loop may never come back */
+                        g_mutex_unlock (&watchdog_lock);
+                        g_warning ("Main loop stuck for %d ms in %s",
+                                   (int) (silent / 1000),
+                                   what);
+                        g_mutex_lock (&watchdog_lock);
+                }
 
-	info = GUPNP_DEVICE_INFO(proxy);
-	udn = g_strdup(gupnp_device_info_get_udn(info));
+                g_cond_wait_until (&watchdog_cond,
+                                   &watchdog_lock,
+                                   now + WATCHDOG_PROBE_MS * 1000);
+        }
+        g_mutex_unlock (&watchdog_lock);
 
-	g_hash_table_remove(server_table, udn);
+        return NULL;
 }
 
-void
-remove_media_renderer (GUPnPDeviceProxy *proxy)
+/* Call on the main thread */
+static void
+watchdog_start (void)
 {
-	GUPnPDeviceInfo   *info;
-	char *udn;
+        GSource *probe;
 
-	info = GUPNP_DEVICE_INFO(proxy);
-	udn = g_strdup(gupnp_device_info_get_udn(info));
+        watchdog_main_thread = g_thread_self ();
 
-	g_hash_table_remove(renderer_table, udn);
+        probe = g_timeout_source_new (WATCHDOG_PROBE_MS);
+        g_source_set_priority (probe, G_PRIORITY_HIGH);
+        g_source_set_callback (probe, watchdog_probe_cb, NULL, NULL);
+        g_source_set_name (probe, "watchdog probe");
+        g_source_attach (probe, NULL);
+        g_source_unref (probe);
+
+        watchdog_thread = g_thread_new ("watchdog", watchdog_thread_func, NULL);
 }
 
 static void
-dms_proxy_available_cb (GUPnPControlPoint *cp,
-                        GUPnPDeviceProxy  *proxy)
+watchdog_stop (void)
 {
-        add_media_server (proxy);
+        if (watchdog_thread == NULL)
+                return;
+
+        g_mutex_lock (&watchdog_lock);
+        watchdog_quit = TRUE;
+        g_cond_signal (&watchdog_cond);
+        g_mutex_unlock (&watchdog_lock);
+
+        g_thread_join (watchdog_thread);
+        watchdog_thread = NULL;
 }
 
-static void
-dms_proxy_unavailable_cb (GUPnPControlPoint *cp,
-                          GUPnPDeviceProxy  *proxy)
+/* Upper bound in ms of the bucket holding the @percent percentile */
+static int
+watchdog_percentile (const guint64 *histogram,
+                     guint64        probes,
+                     int            percent)
 {
-        remove_media_server (proxy);
-}
+        guint64 seen = 0;
+        int     bucket;
 
-static void
-dmr_proxy_available_cb (GUPnPControlPoint *cp,
-                        GUPnPDeviceProxy  *proxy)
-{
+        for (bucket = 0; bucket < WATCHDOG_BUCKETS - 1; bucket++) {
+                seen += histogram[bucket];
+                if (seen * 100 >= probes * percent)
+                        break;
+        }
 
-        add_media_renderer (proxy);
+        return 1 << bucket;
 }
 
+typedef struct
+{
+        guint64       histogram[WATCHDOG_BUCKETS];
+        guint64       probes;
+        gint64        max_lag;
+        guint         stall_count;
+        WatchdogStall stalls[WATCHDOG_STALLS];
+        guint         n_stalls;
+} WatchdogSnapshot;
+
+/* The stalls come newest first */
 static void
-dmr_proxy_unavailable_cb (GUPnPControlPoint *cp,
-                          GUPnPDeviceProxy  *proxy)
+watchdog_snapshot (WatchdogSnapshot *snapshot)
+{
+        guint i;
+
+        g_mutex_lock (&watchdog_lock);
+        memcpy (snapshot->histogram,
+                watchdog_histogram,
+                sizeof (watchdog_histogram));
+        snapshot->probes = watchdog_probes;
+        snapshot->max_lag = watchdog_max_lag;
+        snapshot->stall_count = watchdog_stall_count;
+        snapshot->n_stalls = MIN (watchdog_stall_count, WATCHDOG_STALLS);
+        for (i = 0; i < snapshot->n_stalls; i++)
+                snapshot->stalls[i] =
+                        watchdog_stalls[(watchdog_stall_count - 1 - i) %
+                                        WATCHDOG_STALLS];
+        g_mutex_unlock (&watchdog_lock);
+}
+
+/* A GSource running closures posted from other threads.  Posting is a
+ * queue push and a wakeup, one dispatch drains whatever has piled up. */
+typedef struct
+{
+        GSource      source;
+        GAsyncQueue *queue;
+} MessageSource;
+
+typedef struct
 {
+        GSourceFunc func;
+        gpointer    data;
+        /* The function's name, for the watchdog */
+        const char *name;
+} Message;
+
+static gboolean
+message_source_prepare (GSource *source,
+                        gint    *timeout)
+{
+        *timeout = -1;
 
-        remove_media_renderer (proxy);
+        return g_async_queue_length (((MessageSource *) source)->queue) > 0;
 }
 
+static gboolean
+message_source_check (GSource *source)
+{
+        return g_async_queue_length (((MessageSource *) source)->queue) > 0;
+}
 
-static void
-on_context_available (GUPnPContextManager *context_manager,
-                      GUPnPContext        *context,
-                      gpointer             user_data)
+static gboolean
+message_source_dispatch (GSource    *source,
+                         GSourceFunc callback,
+                         gpointer    user_data)
 {
-        GUPnPControlPoint *dms_cp;
-        GUPnPControlPoint *dmr_cp;
+        MessageSource *messages = (MessageSource *) source;
+        Message       *message;
 
-        dms_cp = gupnp_control_point_new (context, MEDIA_SERVER);
-	dmr_cp = gupnp_control_point_new (context, MEDIA_RENDERER);
+        while ((message = g_async_queue_try_pop (messages->queue)) != NULL) {
+                WatchdogSection previous;
 
-        g_signal_connect (dms_cp,
-                          "device-proxy-available",
-                          G_CALLBACK (dms_proxy_available_cb),
-                          NULL);
-        g_signal_connect (dms_cp,
-                          "device-proxy-unavailable",
-                          G_CALLBACK (dms_proxy_unavailable_cb),
-                          NULL);
+                previous = watchdog_enter ("closure", message->name);
+                message->func (message->data);
+                watchdog_leave (previous);
+                g_slice_free (Message, message);
+        }
 
-	g_signal_connect (dmr_cp,
-                          "device-proxy-available",
-                          G_CALLBACK (dmr_proxy_available_cb),
-                          NULL);
+        return TRUE;
+}
 
-        gssdp_resource_browser_set_active (GSSDP_RESOURCE_BROWSER (dms_cp),
-                                           TRUE);
-	gssdp_resource_browser_set_active (GSSDP_RESOURCE_BROWSER (dmr_cp),
-                                           TRUE);
+static void
+message_source_finalize (GSource *source)
+{
+        g_async_queue_unref (((MessageSource *) source)->queue);
+}
 
-        /* Let context manager take care of the control point life cycle */
-        gupnp_context_manager_manage_control_point (context_manager, dms_cp);
-	gupnp_context_manager_manage_control_point (context_manager, dmr_cp);
+static GSourceFuncs message_source_funcs =
+{
+        message_source_prepare,
+        message_source_check,
+        message_source_dispatch,
+        message_source_finalize
+};
+
+static MessageSource *
+message_source_new (GMainContext *context)
+{
+        MessageSource *messages;
 
-        /* We don't need to keep our own references to the control points */
-        g_object_unref (dms_cp);
-	g_object_unref (dmr_cp);
+        messages = (MessageSource *) g_source_new (&message_source_funcs,
+                                                   sizeof (MessageSource));
+        messages->queue = g_async_queue_new ();
+        g_source_attach ((GSource *) messages, context);
 
+        return messages;
 }
 
 static void
-browse_data_free (BrowseData *data)
+message_post_named (MessageSource *messages,
+                    GSourceFunc    func,
+                    gpointer       data,
+                    const char    *name)
 {
+        Message *message;
 
-        g_free (data->id);
-        g_object_unref (data->content_dir);
-        g_slice_free (BrowseData, data);
+        message = g_slice_new (Message);
+        message->func = func;
+        message->data = data;
+        message->name = name;
+        g_async_queue_push (messages->queue, message);
+
+        g_main_context_wakeup (g_source_get_context ((GSource *) messages));
 }
 
-static BrowseData *
-browse_data_new (GUPnPServiceProxy *content_dir,
-                 const char        *id,
-                 guint32            starting_index)
+/* Closures are named after their function, so a stall can be pinned on
+ * one.  The *_named variants pass a name through. */
+#define message_post(messages, func, data) \
+        message_post_named (messages, func, data, #func)
+
+/* With --shards N, discovery and SOAP for a device run on one of N
+ * threads, each with its own GMainContext and context manager.  The
+ * device tables stay with the main loop: shards post what they found
+ * there, and everyone else posts actions to the shard owning the
+ * proxy. */
+typedef struct
 {
+        guint                index;
+        GThread             *thread;
+        GMainContext        *context;
+        GMainLoop           *loop;
+        MessageSource       *messages;
+        GUPnPContextManager *manager;
+} Shard;
 
-        BrowseData *data;
+#define SHARD_KEY "control-point-shard"
 
-        data = g_slice_new (BrowseData);
-        data->content_dir = g_object_ref (content_dir);
-        data->id = g_strdup (id);
-        data->starting_index = starting_index;
+static Shard *shards = NULL;
+static MessageSource *main_messages = NULL;
 
-        return data;
-}
+/* The shard the calling thread runs, NULL on the main loop */
+static GPrivate current_shard;
 
+/* Runs @func on the main loop, right away if we are on it */
 static void
-on_didl_object_available (GUPnPDIDLLiteParser *parser,
-                          GUPnPDIDLLiteObject *object,
-                          gpointer             user_data)
+main_invoke_named (GSourceFunc  func,
+                   gpointer     data,
+                   const char  *name)
 {
-        BrowseData   *browse_data;
-	char *id;
-	char *title;
-	GList *resources;
+        WatchdogSection previous;
+
+        if (g_main_context_is_owner (g_main_context_default ())) {
+                previous = watchdog_enter ("closure", name);
+                func (data);
+                watchdog_leave (previous);
+        } else
+                message_post_named (main_messages, func, data, name);
+}
 
+#define main_invoke(func, data) main_invoke_named (func, data, #func)
 
-	Container *c = (Container*)malloc(sizeof(Container));
-	
-	c->title = g_strdup(gupnp_didl_lite_object_get_title(object));
-	c->parent_id = g_strdup(gupnp_didl_lite_object_get_parent_id(object));
-	c->class = g_strdup(gupnp_didl_lite_object_get_upnp_class(object));
-
-	resources = gupnp_didl_lite_object_get_resources(object);
-	if(resources != NULL) {
-		c->resource = (GUPnPDIDLLiteResource*)resources->data;
-		puts(gupnp_didl_lite_resource_get_uri(c->resource));
-	}
-	id = g_strdup(gupnp_didl_lite_object_get_id(object));
-	puts("----------");
-	puts(c->title);
-	puts(id);
-	puts(c->parent_id);
-	puts(c->class);
-	
-	puts("----------");
-	
-	g_hash_table_insert(browse_table, id, c);
-	
-        return;
+typedef struct
+{
+        GSourceFunc func;
+        gpointer    data;
+
+        GMutex   lock;
+        GCond    cond;
+        gboolean done;
+} MainCall;
+
+static gboolean
+main_call_cb (gpointer user_data)
+{
+        MainCall *call = (MainCall *) user_data;
+
+        call->func (call->data);
+
+        g_mutex_lock (&call->lock);
+        call->done = TRUE;
+        g_cond_signal (&call->cond);
+        g_mutex_unlock (&call->lock);
+
+        return FALSE;
 }
 
+/* Runs @func on the main loop and waits for it to return.  Threads
+ * reading what only the main loop may touch, the device and browse
+ * tables, do it this way and take copies back. */
 static void
-browse_cb (GUPnPServiceProxy       *content_dir,
-           GUPnPServiceProxyAction *action,
-           gpointer                 user_data)
+main_call_named (GSourceFunc  func,
+                 gpointer     data,
+                 const char  *name)
 {
-	BrowseData *data;
-        char       *didl_xml;
-        guint32     number_returned;
-        guint32     total_matches;
-        GError     *error;
+        MainCall call;
 
-        data = (BrowseData *) user_data;
-        didl_xml = NULL;
-        error = NULL;
+        if (g_main_context_is_owner (g_main_context_default ())) {
+                func (data);
 
-        gupnp_service_proxy_end_action (content_dir,
-                                        action,
-                                        &error,
-                                        /* OUT args */
-                                        "Result",
-                                        G_TYPE_STRING,
-                                        &didl_xml,
-                                        "NumberReturned",
-                                        G_TYPE_UINT,
-                                        &number_returned,
-                                        "TotalMatches",
-                                        G_TYPE_UINT,
-                                        &total_matches,
-                                        NULL);
-        if (didl_xml) {
-                GUPnPDIDLLiteParser *parser;
-                GError              *error;
+                return;
+        }
 
-                error = NULL;
-                parser = gupnp_didl_lite_parser_new ();
-
-                g_signal_connect (parser,
-                                  "object-available",
-                                  G_CALLBACK (on_didl_object_available),
-                                  data);
-
-                /* Only try to parse DIDL if server claims that there was a
-                 * result */
-                if (number_returned > 0)
-                        if (!gupnp_didl_lite_parser_parse_didl (parser,
-                                                                didl_xml,
-                                                                &error)) {
-                                g_warning ("Error while browsing %s: %s",
-                                           data->id,
-                                           error->message);
-                                g_error_free (error);
-                        }
-		sem_post(&browse_sem);
+        call.func = func;
+        call.data = data;
+        call.done = FALSE;
+        g_mutex_init (&call.lock);
+        g_cond_init (&call.cond);
 
-                g_object_unref (parser);
-                g_free (didl_xml);
+        main_invoke_named (main_call_cb, &call, name);
 
-	} else if (error) {
-                GUPnPServiceInfo *info;
+        g_mutex_lock (&call.lock);
+        while (!call.done)
+                g_cond_wait (&call.cond, &call.lock);
+        g_mutex_unlock (&call.lock);
 
-                info = GUPNP_SERVICE_INFO (content_dir);
-                g_warning ("Failed to browse '%s': %s",
-                           gupnp_service_info_get_location (info),
-                           error->message);
+        g_mutex_clear (&call.lock);
+        g_cond_clear (&call.cond);
+}
 
-                g_error_free (error);
-		sem_post(&browse_sem);
-        }
+#define main_call(func, data) main_call_named (func, data, #func)
 
-        browse_data_free (data);
+/* Runs @func on the thread owning @context, right away if we
+ * are on it */
+static void
+context_invoke_named (GUPnPContext *context,
+                      GSourceFunc   func,
+                      gpointer      data,
+                      const char   *name)
+{
+        Shard *shard;
+
+        shard = g_object_get_data (G_OBJECT (context), SHARD_KEY);
+        if (shard == NULL)
+                main_invoke_named (func, data, name);
+        else if (g_main_context_is_owner (shard->context))
+                func (data);
+        else
+                message_post_named (shard->messages, func, data, name);
 }
 
+#define context_invoke(context, func, data) \
+        context_invoke_named (context, func, data, #func)
 
 static void
-browse (GUPnPServiceProxy *content_dir,
-        const char        *container_id,
-        guint32            starting_index,
-        guint32            requested_count)
+proxy_invoke_named (GUPnPServiceProxy *proxy,
+                    GSourceFunc        func,
+                    gpointer           data,
+                    const char        *name)
 {
+        context_invoke_named (gupnp_service_info_get_context
+                                      (GUPNP_SERVICE_INFO (proxy)),
+                              func,
+                              data,
+                              name);
+}
 
-        BrowseData *data;
+#define proxy_invoke(proxy, func, data) \
+        proxy_invoke_named (proxy, func, data, #func)
 
-        data = browse_data_new (content_dir,
-                                container_id,
-                                starting_index);
+static gboolean
+proxy_unref_cb (gpointer data)
+{
+        g_object_unref (data);
 
-        gupnp_service_proxy_begin_action
-		(content_dir,
-		 "Browse",
-		 browse_cb,
-		 data,
-		 /* IN args */
-		 "ObjectID",
-		 G_TYPE_STRING,
-		 container_id,
-		 "BrowseFlag",
-		 G_TYPE_STRING,
-		 "BrowseDirectChildren",
-		 "Filter",
-		 G_TYPE_STRING,
-		 "@childCount",
-		 "StartingIndex",
-		 G_TYPE_UINT,
-		 starting_index,
-		 "RequestedCount",
-		 G_TYPE_UINT,
-		 requested_count,
-		 "SortCriteria",
-		 G_TYPE_STRING,
-		 "",
-		 NULL);
+        return FALSE;
 }
 
-static BrowseMetadataData *
-browse_metadata_data_new (MetadataFunc callback,
-                          const char  *id,
-                          gpointer     user_data)
+/* Drops a proxy on its own thread, finalizing a subscribed one talks to
+ * the device */
+static void
+proxy_release (GUPnPServiceProxy *proxy)
 {
+        if (proxy != NULL)
+                proxy_invoke (proxy, proxy_unref_cb, proxy);
+}
 
-        BrowseMetadataData *data;
+/* A track waiting in a renderer's queue */
+typedef struct
+{
+	char *uri;
+	char *metadata;
+	gsize size;
+} QueueEntry;
+
+static QueueEntry *
+queue_entry_new (const char *uri,
+                 const char *metadata)
+{
+	QueueEntry *entry;
 
-        data = g_slice_new (BrowseMetadataData);
-        data->callback = callback;
-        data->id = g_strdup (id);
-        data->user_data = user_data;
+	entry = g_slice_new (QueueEntry);
+	entry->uri = g_strdup (uri);
+	entry->metadata = g_strdup (metadata);
+	entry->size = sizeof (QueueEntry) + strlen (uri) + 1 +
+		      (metadata != NULL ? strlen (metadata) + 1 : 0);
+	mem_alloc (MEM_CONTROL, entry->size);
 
-        return data;
+	return entry;
 }
 
 static void
-on_didl_item_available (GUPnPDIDLLiteParser *parser,
-                        GUPnPDIDLLiteObject *object,
-                        gpointer             user_data)
+queue_entry_free (QueueEntry *entry)
 {
+	mem_free (MEM_CONTROL, entry->size);
+	g_free (entry->uri);
+	g_free (entry->metadata);
+	g_slice_free (QueueEntry, entry);
+}
 
-        GUPnPDIDLLiteResource **resource;
-        char                   *sink_protocol_info;
-        gboolean                lenient_mode;
-	RendererData *data = NULL;
+static void
+renderer_data_free (RendererData *renderer)
+{
+	if (renderer->sink_protocol_info != NULL)
+		mem_free (MEM_DISCOVERY,
+			  strlen (renderer->sink_protocol_info) + 1);
+	g_free (renderer->friendly_name);
+	g_free (renderer->sink_protocol_info);
+	g_free (renderer->uri);
+	g_free (renderer->metadata);
+	g_free (renderer->title);
+	g_queue_foreach (&renderer->queue, (GFunc) queue_entry_free, NULL);
+	g_queue_clear (&renderer->queue);
+	proxy_release (renderer->av_transport);
+	proxy_release (renderer->cm);
+	proxy_release (renderer->rendering_control);
+	mem_free (MEM_DISCOVERY, renderer->mem_size);
+	free (renderer);
+}
 
-        resource = (GUPnPDIDLLiteResource **) user_data;
+/* Whether shard @index manages the device announced as @usn */
+static gboolean
+shard_owns (guint       index,
+            const char *usn)
+{
+        const char *end;
+        guint       hash;
 
+        end = strstr (usn, "::");
+        hash = g_str_hash (usn);
+        if (end != NULL) {
+                char *udn = g_strndup (usn, end - usn);
 
-	data = (RendererData*)g_hash_table_lookup(renderer_table, current_renderer);
-	sink_protocol_info = data->sink_protocol_info;
-        
-        *resource = gupnp_didl_lite_object_get_compat_resource
-		(object,
-		 sink_protocol_info,
-		 lenient_mode);
-        g_free (sink_protocol_info);
+                hash = g_str_hash (udn);
+                g_free (udn);
+        }
 
+        return hash % shard_count == index;
 }
 
-
-static GUPnPDIDLLiteResource *
-find_compat_res_from_metadata (const char *metadata)
+/* Keeps other shards' devices from reaching the control point, so their
+ * descriptions are never fetched here */
+static void
+shard_filter_cb (GSSDPResourceBrowser *browser,
+                 const char           *usn,
+                 GList                *locations,
+                 gpointer              user_data)
 {
+        Shard *shard = (Shard *) user_data;
 
-        GUPnPDIDLLiteParser   *parser;
-        GUPnPDIDLLiteResource *resource;
-        GError                *error;
+        if (!shard_owns (shard->index, usn))
+                g_signal_stop_emission_by_name (browser, "resource-available");
+}
 
-        parser = gupnp_didl_lite_parser_new ();
-        resource = NULL;
-        error = NULL;
+static void on_context_available (GUPnPContextManager *context_manager,
+                                  GUPnPContext        *context,
+                                  gpointer             user_data);
 
-        g_signal_connect (parser,
-                          "item-available",
-                          G_CALLBACK (on_didl_item_available),
-                          &resource);
+static gpointer
+shard_run (gpointer user_data)
+{
+        Shard *shard = (Shard *) user_data;
 
-        /* Assumption: metadata only contains a single didl object */
-        gupnp_didl_lite_parser_parse_didl (parser, metadata, &error);
-        if (error) {
-                g_warning ("%s\n", error->message);
+        g_main_context_push_thread_default (shard->context);
+        g_private_set (&current_shard, shard);
 
-                g_error_free (error);
-        }
+        /* Every shard has its own HTTP server for events */
+        shard->manager = gupnp_context_manager_create
+                (upnp_port != 0 ? upnp_port + shard->index : 0);
+        g_signal_connect (shard->manager,
+                          "context-available",
+                          G_CALLBACK (on_context_available),
+                          NULL);
 
-        g_object_unref (parser);
+        g_main_loop_run (shard->loop);
 
-        return resource;
+        g_object_unref (shard->manager);
+        g_main_context_pop_thread_default (shard->context);
+
+        return NULL;
 }
 
 static void
-browse_metadata_data_free (BrowseMetadataData *data)
+shards_start (void)
 {
+        int i;
 
-        g_free (data->id);
-        g_slice_free (BrowseMetadataData, data);
+        shards = g_new0 (Shard, shard_count);
+        for (i = 0; i < shard_count; i++) {
+                char *name;
+
+                shards[i].index = i;
+                shards[i].context = g_main_context_new ();
+                shards[i].loop = g_main_loop_new (shards[i].context, FALSE);
+                shards[i].messages = message_source_new (shards[i].context);
+
+                name = g_strdup_printf ("shard-%d", i);
+                shards[i].thread = g_thread_new (name, shard_run, &shards[i]);
+                g_free (name);
+        }
 }
 
-static SetAVTransportURIData *
-set_av_transport_uri_data_new (GCallback              callback,
-                               GUPnPDIDLLiteResource *resource)
-{
-        printf("On %s function\n",__func__);
-        SetAVTransportURIData *data;
+/* Consecutive failures after which a device is left alone for a while */
+#define HEALTH_MAX_FAILURES 5
+#define HEALTH_MIN_COOLDOWN (5 * G_USEC_PER_SEC)
+#define HEALTH_MAX_COOLDOWN (300 * G_USEC_PER_SEC)
 
-        data = g_slice_new (SetAVTransportURIData);
+typedef enum
+{
+        ACTION_OK,
+        ACTION_FAULT,
+        ACTION_ERROR,
+        ACTION_TIMEOUT
+} ActionOutcome;
 
-        data->callback = callback;
-        data->resource = resource; /* Steal the ref */
+typedef struct
+{
+        guint    requests;
+        guint    faults;
+        guint    errors;
+        guint    timeouts;
+        guint    failures;
+
+        /* Moving averages of answered requests: 1.0 means every recent
+         * one worked, latency is in microseconds */
+        double   score;
+        gint64   latency;
+
+        /* While the circuit is open nothing is sent, afterwards a single
+         * request probes whether the device is back */
+        gint64   cooldown;
+        gint64   open_until;
+        gboolean probing;
+} DeviceHealth;
+
+static GHashTable *health_table = NULL;
+static GMutex health_lock;
+
+/* Must be called with health_lock held */
+static DeviceHealth *
+device_health_get (const char *udn)
+{
+        DeviceHealth *health;
+
+        if (health_table == NULL)
+                health_table = g_hash_table_new_full (g_str_hash,
+                                                      g_str_equal,
+                                                      g_free,
+                                                      g_free);
+
+        health = g_hash_table_lookup (health_table, udn);
+        if (health == NULL) {
+                health = g_new0 (DeviceHealth, 1);
+                health->score = 1.0;
+                g_hash_table_insert (health_table, g_strdup (udn), health);
+        }
 
-        return data;
+        return health;
 }
 
 static void
-set_av_transport_uri_data_free (SetAVTransportURIData *data)
+device_health_record (const char    *udn,
+                      ActionOutcome  outcome,
+                      gint64         latency)
 {
-        printf("On %s function\n",__func__);
-        g_object_unref (data->resource);
-        g_slice_free (SetAVTransportURIData, data);
+        DeviceHealth *health;
+
+        g_mutex_lock (&health_lock);
+        health = device_health_get (udn);
+        health->requests++;
+
+        /* A SOAP fault is still an answer, only silence and broken
+         * transfers count against the device */
+        switch (outcome) {
+        case ACTION_FAULT:
+                health->faults++;
+                /* fall through */
+        case ACTION_OK:
+                health->score = health->score * 0.9 + 0.1;
+                health->latency = health->latency == 0 ?
+                                  latency :
+                                  (health->latency * 7 + latency) / 8;
+                health->failures = 0;
+                health->cooldown = 0;
+                health->open_until = 0;
+                health->probing = FALSE;
+                break;
+        case ACTION_ERROR:
+        case ACTION_TIMEOUT:
+                if (outcome == ACTION_ERROR)
+                        health->errors++;
+                else
+                        health->timeouts++;
+                health->score *= 0.9;
+                health->failures++;
+
+                if (health->probing ||
+                    health->failures >= HEALTH_MAX_FAILURES) {
+                        health->cooldown = health->cooldown == 0 ?
+                                HEALTH_MIN_COOLDOWN :
+                                MIN (health->cooldown * 2,
+                                     HEALTH_MAX_COOLDOWN);
+                        health->open_until = g_get_monotonic_time () +
+                                             health->cooldown;
+                        health->probing = FALSE;
+
+                        g_warning ("'%s' is not responding, leaving it alone "
+                                   "for %d s",
+                                   udn,
+                                   (int) (health->cooldown / G_USEC_PER_SEC));
+                }
+                break;
+        }
+        g_mutex_unlock (&health_lock);
 }
 
-
-static void
-set_av_transport_uri_cb (GUPnPServiceProxy       *av_transport,
-                         GUPnPServiceProxyAction *action,
-                         gpointer                 user_data)
+/* Whether a request to @udn may go out now */
+static gboolean
+device_health_allow (const char *udn)
 {
-        printf("On %s function\n",__func__);
-        SetAVTransportURIData *data;
-        GError                *error;
-
-        data = (SetAVTransportURIData *) user_data;
+        DeviceHealth *health = NULL;
+        gboolean      allow = TRUE;
+
+        g_mutex_lock (&health_lock);
+        if (health_table != NULL)
+                health = g_hash_table_lookup (health_table, udn);
+
+        if (health != NULL && health->open_until != 0) {
+                if (g_get_monotonic_time () < health->open_until ||
+                    health->probing)
+                        allow = FALSE;
+                else
+                        health->probing = TRUE;
+        }
+        g_mutex_unlock (&health_lock);
 
-        error = NULL;
-        if (gupnp_service_proxy_end_action (av_transport,
-                                            action,
-                                            &error,
-                                            NULL)) {
-		sem_post(&play_sem);
-		
-	} else {
-                const char *udn;
+        return allow;
+}
 
-                udn = gupnp_service_info_get_udn
-			(GUPNP_SERVICE_INFO (av_transport));
+/* Whether @udn's circuit is open, the menu and RPC mark such devices */
+static gboolean
+device_health_is_failing (const char *udn)
+{
+        DeviceHealth *health = NULL;
+        gboolean      failing;
 
-                g_warning ("Failed to set URI '%s' on %s: %s",
-                           gupnp_didl_lite_resource_get_uri (data->resource),
-                           udn,
-                           error->message);
+        g_mutex_lock (&health_lock);
+        if (health_table != NULL)
+                health = g_hash_table_lookup (health_table, udn);
+        failing = health != NULL && health->open_until != 0;
+        g_mutex_unlock (&health_lock);
 
-                g_error_free (error);
-        }
-	
-        set_av_transport_uri_data_free (data);
-//        g_object_unref (av_transport);
+        return failing;
 }
 
-
-
-void set_av_transport_uri(const char *metadata, GUPnPServiceProxy *av_transport)
+static double
+device_health_score (const char *udn)
 {
-	GUPnPDIDLLiteResource *resource;
-	const char *uri;
-	SetAVTransportURIData *data;
+        DeviceHealth *health = NULL;
+        double        score;
 
+        g_mutex_lock (&health_lock);
+        if (health_table != NULL)
+                health = g_hash_table_lookup (health_table, udn);
+        score = health != NULL ? health->score : 1.0;
+        g_mutex_unlock (&health_lock);
 
+        return score;
+}
+
+/* Whether @udn is a better source for a track than @other: the
+ * healthier one, or between two about as healthy the faster.  Unknown
+ * devices count as healthy and slow, ties go by UDN so the choice does
+ * not depend on who answered first. */
+static gboolean
+device_health_prefer (const char *udn,
+                      const char *other)
+{
+        DeviceHealth *health = NULL, *other_health = NULL;
+        double        score, other_score;
+        gint64        latency, other_latency;
+
+        g_mutex_lock (&health_lock);
+        if (health_table != NULL) {
+                health = g_hash_table_lookup (health_table, udn);
+                other_health = g_hash_table_lookup (health_table, other);
+        }
+        score = health != NULL ? health->score : 1.0;
+        other_score = other_health != NULL ? other_health->score : 1.0;
+        latency = health != NULL && health->latency != 0 ?
+                  health->latency : G_MAXINT64;
+        other_latency = other_health != NULL && other_health->latency != 0 ?
+                        other_health->latency : G_MAXINT64;
+        g_mutex_unlock (&health_lock);
+
+        if (ABS (score - other_score) > 0.05)
+                return score > other_score;
+        if (latency != other_latency)
+                return latency < other_latency;
+
+        return strcmp (udn, other) < 0;
+}
+
+static void
+device_health_forget (const char *udn)
+{
+        g_mutex_lock (&health_lock);
+        if (health_table != NULL)
+                g_hash_table_remove (health_table, udn);
+        g_mutex_unlock (&health_lock);
+}
+
+/* The frequent actions have fixed arguments except for the last one of
+ * Seek, SetVolume and SetMute, so each thread sending actions builds
+ * their argument lists once and only patches that value per call */
+typedef enum
+{
+        TEMPLATE_NONE,
+        TEMPLATE_GET_POSITION_INFO,
+        TEMPLATE_PLAY,
+        TEMPLATE_PAUSE,
+        TEMPLATE_STOP,
+        TEMPLATE_SEEK,
+        TEMPLATE_SET_VOLUME,
+        TEMPLATE_SET_MUTE,
+        N_TEMPLATES
+} ActionTemplateId;
+
+typedef struct
+{
+        const char *name;
+        GList      *in_names;
+        GList      *in_values;
+
+        /* The value replaced for every call, NULL if there is none */
+        GValue     *patch;
+} ActionTemplate;
+
+static void g_value_free (gpointer data);
+
+static GValue *
+action_template_add (ActionTemplate *template,
+                     const char     *name,
+                     GType           type)
+{
+        GValue *value;
+
+        value = g_slice_new0 (GValue);
+        g_value_init (value, type);
+
+        template->in_names = g_list_append (template->in_names,
+                                            (gpointer) name);
+        template->in_values = g_list_append (template->in_values, value);
+
+        return value;
+}
+
+static ActionTemplate *
+action_templates_new (void)
+{
+        ActionTemplate *templates;
+        int             i;
+
+        templates = g_new0 (ActionTemplate, N_TEMPLATES);
+        templates[TEMPLATE_GET_POSITION_INFO].name = "GetPositionInfo";
+        templates[TEMPLATE_PLAY].name = "Play";
+        templates[TEMPLATE_PAUSE].name = "Pause";
+        templates[TEMPLATE_STOP].name = "Stop";
+        templates[TEMPLATE_SEEK].name = "Seek";
+        templates[TEMPLATE_SET_VOLUME].name = "SetVolume";
+        templates[TEMPLATE_SET_MUTE].name = "SetMute";
+
+        for (i = TEMPLATE_NONE + 1; i < N_TEMPLATES; i++)
+                g_value_set_uint (action_template_add (&templates[i],
+                                                       "InstanceID",
+                                                       G_TYPE_UINT),
+                                  0);
+
+        g_value_set_uint (action_template_add (&templates[TEMPLATE_PLAY],
+                                               "Speed",
+                                               G_TYPE_UINT),
+                          1);
+
+        g_value_set_static_string
+                (action_template_add (&templates[TEMPLATE_SEEK],
+                                      "Unit",
+                                      G_TYPE_STRING),
+                 "REL_TIME");
+        templates[TEMPLATE_SEEK].patch =
+                action_template_add (&templates[TEMPLATE_SEEK],
+                                     "Target",
+                                     G_TYPE_STRING);
+
+        g_value_set_static_string
+                (action_template_add (&templates[TEMPLATE_SET_VOLUME],
+                                      "Channel",
+                                      G_TYPE_STRING),
+                 "Master");
+        templates[TEMPLATE_SET_VOLUME].patch =
+                action_template_add (&templates[TEMPLATE_SET_VOLUME],
+                                     "DesiredVolume",
+                                     G_TYPE_UINT);
+
+        g_value_set_static_string
+                (action_template_add (&templates[TEMPLATE_SET_MUTE],
+                                      "Channel",
+                                      G_TYPE_STRING),
+                 "Master");
+        templates[TEMPLATE_SET_MUTE].patch =
+                action_template_add (&templates[TEMPLATE_SET_MUTE],
+                                     "DesiredMute",
+                                     G_TYPE_BOOLEAN);
+
+        return templates;
+}
+
+static void
+action_templates_free (gpointer data)
+{
+        ActionTemplate *templates = (ActionTemplate *) data;
+        int             i;
+
+        for (i = 0; i < N_TEMPLATES; i++) {
+                g_list_free (templates[i].in_names);
+                g_list_free_full (templates[i].in_values, g_value_free);
+        }
+        g_free (templates);
+}
+
+static GPrivate action_templates_key =
+        G_PRIVATE_INIT (action_templates_free);
+
+/* Every SOAP action goes through action_begin () and action_end (), so
+ * each one either gets its answer, or fails once its deadline passes or
+ * while its device is being left alone.  The callback runs in all three
+ * cases, which is what keeps the semaphores from blocking forever.
+ * Actions are sent, timed and answered on the thread owning the proxy,
+ * whichever thread asked for them. */
+typedef struct
+{
+        GUPnPServiceProxy              *proxy;
+        GUPnPServiceProxyAction        *action;
+        GUPnPServiceProxyActionCallback callback;
+        gpointer                        user_data;
+
+        char                           *name;
+        GList                          *in_names;
+        GList                          *in_values;
+
+        /* Or a template and the value to patch into it */
+        ActionTemplateId                template_id;
+        GValue                          patch;
+        char                            patch_string[32];
+
+        GSource                        *timeout;
+        gint64                          start;
+} PendingAction;
+
+static char action_timed_out_tag;
+static char action_refused_tag;
+#define ACTION_TIMED_OUT ((GUPnPServiceProxyAction *) &action_timed_out_tag)
+#define ACTION_REFUSED ((GUPnPServiceProxyAction *) &action_refused_tag)
+
+/* The action whose callback is running, action_end () takes its latency
+ * from there */
+static GPrivate current_action;
+
+static void
+pending_action_free (PendingAction *pending)
+{
+        if (pending->timeout != NULL) {
+                g_source_destroy (pending->timeout);
+                g_source_unref (pending->timeout);
+        }
+        g_object_unref (pending->proxy);
+        g_free (pending->name);
+        g_list_free_full (pending->in_names, g_free);
+        g_list_free_full (pending->in_values, g_value_free);
+        if (G_IS_VALUE (&pending->patch))
+                g_value_unset (&pending->patch);
+        g_slice_free (PendingAction, pending);
+        mem_free (MEM_CONTROL, sizeof (PendingAction));
+}
+
+/* This thread's templates, made on first use */
+static ActionTemplate *
+action_template_get (ActionTemplateId template_id)
+{
+        ActionTemplate *templates;
+
+        templates = g_private_get (&action_templates_key);
+        if (templates == NULL) {
+                templates = action_templates_new ();
+                g_private_set (&action_templates_key, templates);
+        }
+
+        return &templates[template_id];
+}
+
+static const char *
+pending_action_name (PendingAction *pending)
+{
+        if (pending->template_id != TEMPLATE_NONE)
+                return action_template_get (pending->template_id)->name;
+
+        return pending->name;
+}
+
+static void
+pending_action_finish (PendingAction           *pending,
+                       GUPnPServiceProxyAction *action)
+{
+        WatchdogSection previous;
+
+        trace_async (TRACE_ASYNC_END,
+                     pending_action_name (pending),
+                     action == ACTION_TIMED_OUT ? "timed out" :
+                     action == ACTION_REFUSED ? "refused" : NULL,
+                     GPOINTER_TO_SIZE (pending));
+
+        previous = watchdog_enter ("action", pending_action_name (pending));
+        g_private_set (&current_action, pending);
+        pending->callback (pending->proxy, action, pending->user_data);
+        g_private_set (&current_action, NULL);
+        watchdog_leave (previous);
+
+        pending_action_free (pending);
+}
+
+static void
+action_done_cb (GUPnPServiceProxy       *proxy,
+                GUPnPServiceProxyAction *action,
+                gpointer                 user_data)
+{
+        pending_action_finish ((PendingAction *) user_data, action);
+}
+
+static gboolean
+action_timeout_cb (gpointer user_data)
+{
+        PendingAction *pending = (PendingAction *) user_data;
+
+        gupnp_service_proxy_cancel_action (pending->proxy, pending->action);
+        pending_action_finish (pending, ACTION_TIMED_OUT);
+
+        return FALSE;
+}
+
+static gboolean
+action_refused_cb (gpointer user_data)
+{
+        pending_action_finish ((PendingAction *) user_data, ACTION_REFUSED);
+
+        return FALSE;
+}
+
+/* The arguments are serialized right away, so this thread's template
+ * is free for the next call once this returns */
+static GUPnPServiceProxyAction *
+action_template_send (PendingAction *pending)
+{
+        ActionTemplate          *template;
+        GUPnPServiceProxyAction *action;
+
+        template = action_template_get (pending->template_id);
+
+        if (template->patch != NULL) {
+                if (G_VALUE_HOLDS_STRING (template->patch))
+                        g_value_set_static_string (template->patch,
+                                                   pending->patch_string);
+                else
+                        g_value_copy (&pending->patch, template->patch);
+        }
+
+        action = gupnp_service_proxy_begin_action_list (pending->proxy,
+                                                        template->name,
+                                                        template->in_names,
+                                                        template->in_values,
+                                                        action_done_cb,
+                                                        pending);
+
+        if (template->patch != NULL && G_VALUE_HOLDS_STRING (template->patch))
+                g_value_set_static_string (template->patch, "");
+
+        return action;
+}
+
+/* Runs on the thread owning the proxy */
+static gboolean
+action_send_cb (gpointer user_data)
+{
+        PendingAction *pending = (PendingAction *) user_data;
+        GMainContext  *context = g_main_context_get_thread_default ();
+        const char    *udn;
+
+        udn = gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (pending->proxy));
+
+        /* The span starts when the action was asked for, time spent
+         * waiting for this thread included */
+        if (trace_path != NULL)
+                trace_record (TRACE_ASYNC_BEGIN,
+                              pending_action_name (pending),
+                              udn,
+                              pending->start,
+                              0,
+                              GPOINTER_TO_SIZE (pending));
+
+        if (!device_health_allow (udn)) {
+                /* Never call back before action_begin () returned */
+                pending->timeout = g_idle_source_new ();
+                g_source_set_callback (pending->timeout,
+                                       action_refused_cb,
+                                       pending,
+                                       NULL);
+                g_source_attach (pending->timeout, context);
+
+                return FALSE;
+        }
+
+        if (pending->template_id != TEMPLATE_NONE)
+                pending->action = action_template_send (pending);
+        else
+                pending->action = gupnp_service_proxy_begin_action_list
+                        (pending->proxy,
+                         pending->name,
+                         pending->in_names,
+                         pending->in_values,
+                         action_done_cb,
+                         pending);
+
+        if (action_timeout_ms > 0) {
+                pending->timeout = g_timeout_source_new (action_timeout_ms);
+                g_source_set_callback (pending->timeout,
+                                       action_timeout_cb,
+                                       pending,
+                                       NULL);
+                g_source_attach (pending->timeout, context);
+        }
+
+        return FALSE;
+}
+
+static PendingAction *
+pending_action_new (GUPnPServiceProxy              *proxy,
+                    GUPnPServiceProxyActionCallback callback,
+                    gpointer                        user_data)
+{
+        PendingAction *pending;
+
+        pending = g_slice_new0 (PendingAction);
+        mem_alloc (MEM_CONTROL, sizeof (PendingAction));
+        pending->proxy = g_object_ref (proxy);
+        pending->callback = callback;
+        pending->user_data = user_data;
+        pending->start = g_get_monotonic_time ();
+
+        return pending;
+}
+
+/* gupnp_service_proxy_begin_action () with a deadline of
+ * --action-timeout milliseconds, callable from any thread */
+static void
+action_begin (GUPnPServiceProxy              *proxy,
+              const char                     *name,
+              GUPnPServiceProxyActionCallback callback,
+              gpointer                        user_data,
+              ...)
+{
+        PendingAction *pending;
+        const char    *arg_name;
+        va_list        args;
+
+        pending = pending_action_new (proxy, callback, user_data);
+        pending->name = g_strdup (name);
+
+        /* The arguments are copied, the caller's may be gone by the time
+         * the owning thread sends them */
+        va_start (args, user_data);
+        while ((arg_name = va_arg (args, const char *)) != NULL) {
+                GValue *value;
+                GType   type;
+                char   *collect_error = NULL;
+
+                type = va_arg (args, GType);
+                value = g_slice_new0 (GValue);
+                G_VALUE_COLLECT_INIT (value, type, args, 0, &collect_error);
+                if (collect_error != NULL) {
+                        g_warning ("Bad argument '%s' for '%s': %s",
+                                   arg_name,
+                                   name,
+                                   collect_error);
+                        g_free (collect_error);
+                        g_slice_free (GValue, value);
+
+                        break;
+                }
+
+                pending->in_names = g_list_prepend (pending->in_names,
+                                                    g_strdup (arg_name));
+                pending->in_values = g_list_prepend (pending->in_values,
+                                                     value);
+        }
+        va_end (args);
+
+        pending->in_names = g_list_reverse (pending->in_names);
+        pending->in_values = g_list_reverse (pending->in_values);
+
+        proxy_invoke (proxy, action_send_cb, pending);
+}
+
+/* action_begin () for one of the templated actions, @patch is the value
+ * of its last argument if it has one */
+static void
+action_begin_template (GUPnPServiceProxy              *proxy,
+                       ActionTemplateId                template_id,
+                       const GValue                   *patch,
+                       GUPnPServiceProxyActionCallback callback,
+                       gpointer                        user_data)
+{
+        PendingAction *pending;
+
+        pending = pending_action_new (proxy, callback, user_data);
+        pending->template_id = template_id;
+
+        if (patch != NULL && G_VALUE_HOLDS_STRING (patch))
+                g_strlcpy (pending->patch_string,
+                           g_value_get_string (patch),
+                           sizeof (pending->patch_string));
+        else if (patch != NULL) {
+                g_value_init (&pending->patch, G_VALUE_TYPE (patch));
+                g_value_copy (patch, &pending->patch);
+        }
+
+        proxy_invoke (proxy, action_send_cb, pending);
+}
+
+static void soak_record_action (gint64 latency);
+
+/* gupnp_service_proxy_end_action () for actions started with
+ * action_begin (), also tells the device's health what happened */
+static gboolean
+action_end (GUPnPServiceProxy       *proxy,
+            GUPnPServiceProxyAction *action,
+            GError                 **error,
+            ...)
+{
+        PendingAction *pending;
+        const char    *udn;
+        GError        *local_error = NULL;
+        gboolean       ok;
+        gint64         latency;
+        va_list        args;
+
+        udn = gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (proxy));
+
+        if (action == ACTION_REFUSED) {
+                g_set_error (error,
+                             G_IO_ERROR,
+                             G_IO_ERROR_BUSY,
+                             "Device is not responding, not retrying yet");
+
+                return FALSE;
+        }
+
+        if (action == ACTION_TIMED_OUT) {
+                g_set_error (error,
+                             G_IO_ERROR,
+                             G_IO_ERROR_TIMED_OUT,
+                             "No answer within %d ms",
+                             action_timeout_ms);
+                device_health_record (udn, ACTION_TIMEOUT, 0);
+
+                return FALSE;
+        }
+
+        va_start (args, error);
+        ok = gupnp_service_proxy_end_action_valist (proxy,
+                                                    action,
+                                                    &local_error,
+                                                    args);
+        va_end (args);
+
+        pending = g_private_get (&current_action);
+        latency = pending != NULL ?
+                  g_get_monotonic_time () - pending->start : 0;
+
+        if (ok) {
+                device_health_record (udn, ACTION_OK, latency);
+                soak_record_action (latency);
+        } else if (local_error != NULL &&
+                 local_error->domain == GUPNP_CONTROL_ERROR)
+                device_health_record (udn, ACTION_FAULT, latency);
+        else
+                device_health_record (udn, ACTION_ERROR, 0);
+
+        if (local_error != NULL)
+                g_propagate_error (error, local_error);
+
+        return ok;
+}
+
+static void
+get_protocol_info_cb (GUPnPServiceProxy       *cm,
+                      GUPnPServiceProxyAction *action,
+                      gpointer                 user_data)
+{
+
+        gchar      *sink_protocol_info;
+        char *udn;
+        GError      *error;
+
+        udn = g_strdup(gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (cm)));
+
+        error = NULL;
+        if (!action_end (cm,
+                         action,
+                         &error,
+                         "Sink",
+                         G_TYPE_STRING,
+                         &sink_protocol_info,
+                         NULL)) {
+                g_warning ("Failed to get sink protocol info from "
+                           "media renderer '%s':%s\n",
+                           udn,
+                           error->message);
+                g_error_free (error);
+
+                goto return_point;
+        }
+
+        if (sink_protocol_info) {
+		RendererData *data;
+
+		g_mutex_lock (&renderer_state_lock);
+		data = (RendererData*)g_hash_table_lookup(renderer_table, udn);
+		if (data != NULL) {
+			if (data->sink_protocol_info != NULL) {
+				mem_free (MEM_DISCOVERY,
+					  strlen (data->sink_protocol_info) + 1);
+				g_free (data->sink_protocol_info);
+			}
+			data->sink_protocol_info = sink_protocol_info;
+			mem_alloc (MEM_DISCOVERY,
+				   strlen (sink_protocol_info) + 1);
+		} else
+			g_free (sink_protocol_info);
+		g_mutex_unlock (&renderer_state_lock);
+        }
+
+return_point:
+        g_object_unref (cm);
+}
+
+static GUPnPServiceProxy *
+get_connection_manager (GUPnPDeviceProxy *proxy)
+{
+
+        GUPnPDeviceInfo  *info;
+        GUPnPServiceInfo *cm;
+
+        info = GUPNP_DEVICE_INFO (proxy);
+
+        cm = gupnp_device_info_get_service (info, CONNECTION_MANAGER);
+
+        return GUPNP_SERVICE_PROXY (cm);
+}
+
+static GUPnPServiceProxy *
+get_rendering_control (GUPnPDeviceProxy *proxy)
+{
+
+        GUPnPDeviceInfo  *info;
+        GUPnPServiceInfo *rendering_control;
+
+        info = GUPNP_DEVICE_INFO (proxy);
+
+        rendering_control = gupnp_device_info_get_service (info,
+                                                           RENDERING_CONTROL);
+
+        return GUPNP_SERVICE_PROXY (rendering_control);
+}
+
+static GUPnPServiceProxy *
+get_av_transport (GUPnPDeviceProxy *renderer)
+{
+
+        GUPnPDeviceInfo  *info;
+        GUPnPServiceInfo *av_transport;
+
+        info = GUPNP_DEVICE_INFO (renderer);
+
+        av_transport = gupnp_device_info_get_service (info, AV_TRANSPORT);
+
+        return GUPNP_SERVICE_PROXY (av_transport);
+}
+
+static const char *control_actions[N_CONTROLS] =
+{
+        "SetVolume",
+        "SetMute",
+        "Seek"
+};
+
+/* "H:MM:SS[.F]" to seconds, -1 for NOT_IMPLEMENTED and friends */
+static gint64
+parse_duration (const char *duration)
+{
+        guint hours, minutes, seconds;
+
+        if (duration == NULL ||
+            sscanf (duration, "%u:%u:%u", &hours, &minutes, &seconds) != 3)
+                return -1;
+
+        return (gint64) hours * 3600 + minutes * 60 + seconds;
+}
+
+static void
+format_duration (gint64 seconds,
+                 char  *buffer,
+                 gsize  size)
+{
+        g_snprintf (buffer,
+                    size,
+                    "%u:%02u:%02u",
+                    (guint) (seconds / 3600),
+                    (guint) (seconds / 60 % 60),
+                    (guint) (seconds % 60));
+}
+
+static void renderer_control_send (RendererData        *renderer,
+                                   RendererControlType  type);
+
+static void
+renderer_control_cb (GUPnPServiceProxy       *proxy,
+                     GUPnPServiceProxyAction *action,
+                     gpointer                 user_data)
+{
+        RendererControlType type = GPOINTER_TO_INT (user_data);
+        RendererData       *renderer;
+        const char         *udn;
+        GError             *error;
+
+        udn = gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (proxy));
+
+        error = NULL;
+        if (!action_end (proxy, action, &error, NULL)) {
+                g_warning ("Failed to send action '%s' to '%s': %s",
+                           control_actions[type],
+                           udn,
+                           error->message);
+                g_error_free (error);
+        }
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL) {
+                renderer->controls[type].in_flight = FALSE;
+
+                /* Whatever was asked for meanwhile goes out as one request */
+                if (renderer->controls[type].dirty)
+                        renderer_control_send (renderer, type);
+        }
+        g_mutex_unlock (&renderer_state_lock);
+}
+
+/* Must be called with renderer_state_lock held */
+static void
+renderer_control_send (RendererData        *renderer,
+                       RendererControlType  type)
+{
+        RendererControl  *control = &renderer->controls[type];
+        GValue            value = G_VALUE_INIT;
+        char              target[32];
+
+        control->in_flight = TRUE;
+        control->dirty = FALSE;
+
+        switch (type) {
+        case CONTROL_VOLUME:
+                g_value_init (&value, G_TYPE_UINT);
+                g_value_set_uint (&value, control->target);
+                action_begin_template (renderer->rendering_control,
+                                       TEMPLATE_SET_VOLUME,
+                                       &value,
+                                       renderer_control_cb,
+                                       GINT_TO_POINTER (type));
+                break;
+        case CONTROL_MUTE:
+                g_value_init (&value, G_TYPE_BOOLEAN);
+                g_value_set_boolean (&value, control->target != 0);
+                action_begin_template (renderer->rendering_control,
+                                       TEMPLATE_SET_MUTE,
+                                       &value,
+                                       renderer_control_cb,
+                                       GINT_TO_POINTER (type));
+                break;
+        case CONTROL_SEEK:
+                format_duration (control->target, target, sizeof (target));
+                g_value_init (&value, G_TYPE_STRING);
+                g_value_set_static_string (&value, target);
+                action_begin_template (renderer->av_transport,
+                                       TEMPLATE_SEEK,
+                                       &value,
+                                       renderer_control_cb,
+                                       GINT_TO_POINTER (type));
+                break;
+        default:
+                g_assert_not_reached ();
+        }
+
+        g_value_unset (&value);
+}
+
+/* Shows @value locally right away and sends it unless a request of the
+ * same kind is still on the wire, in which case it only replaces what
+ * goes out next.  Holding a key down costs at most two requests. */
+static void
+renderer_control_set (RendererData        *renderer,
+                      RendererControlType  type,
+                      gint64               value)
+{
+        RendererControl *control = &renderer->controls[type];
+
+        switch (type) {
+        case CONTROL_VOLUME:
+                value = CLAMP (value, 0, 100);
+                renderer->volume = value;
+                break;
+        case CONTROL_MUTE:
+                value = value != 0;
+                renderer->mute = value;
+                break;
+        case CONTROL_SEEK:
+                if (renderer->duration > 0)
+                        value = MIN (value, renderer->duration);
+                value = MAX (value, 0);
+                renderer->position = value;
+                break;
+        default:
+                g_assert_not_reached ();
+        }
+
+        control->target = value;
+        if (control->in_flight)
+                control->dirty = TRUE;
+        else
+                renderer_control_send (renderer, type);
+}
+
+/* The control functions below look @udn up under renderer_state_lock
+ * and return FALSE if it is gone; nothing keeps a RendererData past
+ * the unlock */
+static gboolean
+renderer_set_volume (const char *udn,
+                     int         volume)
+{
+        RendererData *renderer;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL)
+                renderer_control_set (renderer, CONTROL_VOLUME, volume);
+        g_mutex_unlock (&renderer_state_lock);
+
+        return renderer != NULL;
+}
+
+static void get_volume_cb (GUPnPServiceProxy       *rendering_control,
+                           GUPnPServiceProxyAction *action,
+                           gpointer                 user_data);
+
+static gboolean
+renderer_change_volume (const char *udn,
+                        int         delta)
+{
+        RendererData      *renderer;
+        GUPnPServiceProxy *rendering_control = NULL;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL && renderer->volume >= 0)
+                renderer_control_set (renderer,
+                                      CONTROL_VOLUME,
+                                      (gint64) renderer->volume + delta);
+        else if (renderer != NULL) {
+                /* Nothing to step from yet, renderer_report () adds
+                 * the steps to what GetVolume says */
+                renderer->volume_delta += delta;
+                if (!renderer->volume_query) {
+                        renderer->volume_query = TRUE;
+                        rendering_control =
+                                g_object_ref (renderer->rendering_control);
+                }
+        }
+        g_mutex_unlock (&renderer_state_lock);
+
+        if (rendering_control != NULL) {
+                action_begin (rendering_control,
+                              "GetVolume",
+                              get_volume_cb,
+                              GINT_TO_POINTER (CONTROL_VOLUME),
+                              "InstanceID", G_TYPE_UINT, 0,
+                              "Channel", G_TYPE_STRING, "Master",
+                              NULL);
+                g_object_unref (rendering_control);
+        }
+
+        return renderer != NULL;
+}
+
+static gboolean
+renderer_toggle_mute (const char *udn)
+{
+        RendererData *renderer;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL)
+                renderer_control_set (renderer, CONTROL_MUTE, !renderer->mute);
+        g_mutex_unlock (&renderer_state_lock);
+
+        return renderer != NULL;
+}
+
+static gboolean
+renderer_set_mute (const char *udn,
+                   gboolean    mute)
+{
+        RendererData *renderer;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL)
+                renderer_control_set (renderer, CONTROL_MUTE, mute);
+        g_mutex_unlock (&renderer_state_lock);
+
+        return renderer != NULL;
+}
+
+static gboolean
+renderer_seek (const char *udn,
+               gint64      position)
+{
+        RendererData *renderer;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL)
+                renderer_control_set (renderer, CONTROL_SEEK, position);
+        g_mutex_unlock (&renderer_state_lock);
+
+        return renderer != NULL;
+}
+
+static gboolean
+renderer_skip (const char *udn,
+               gint64      offset)
+{
+        RendererData *renderer;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL)
+                renderer_control_set (renderer,
+                                      CONTROL_SEEK,
+                                      renderer->position + offset);
+        g_mutex_unlock (&renderer_state_lock);
+
+        return renderer != NULL;
+}
+
+/* The volume (-1 while unknown) and mute of @udn as far as we know,
+ * FALSE if it is gone */
+static gboolean
+renderer_get_levels (const char *udn,
+                     int        *volume,
+                     gboolean   *mute)
+{
+        RendererData *renderer;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL) {
+                *volume = renderer->volume;
+                *mute = renderer->mute;
+        }
+        g_mutex_unlock (&renderer_state_lock);
+
+        return renderer != NULL;
+}
+
+/* A reference to the AVTransport of @udn, NULL if it is gone */
+static GUPnPServiceProxy *
+renderer_ref_av_transport (const char *udn)
+{
+        RendererData      *renderer;
+        GUPnPServiceProxy *av_transport = NULL;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL)
+                av_transport = g_object_ref (renderer->av_transport);
+        g_mutex_unlock (&renderer_state_lock);
+
+        return av_transport;
+}
+
+/* Takes the renderer's word for it, unless the user has moved on since
+ * and a newer value is still being sent */
+static void
+renderer_report (const char          *udn,
+                 RendererControlType  type,
+                 gint64               value)
+{
+        RendererData *renderer;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL && !renderer->controls[type].in_flight) {
+                switch (type) {
+                case CONTROL_VOLUME:
+                        renderer->volume = value;
+                        renderer->volume_query = FALSE;
+                        if (renderer->volume_delta != 0) {
+                                value += renderer->volume_delta;
+                                renderer->volume_delta = 0;
+                                renderer_control_set (renderer,
+                                                      CONTROL_VOLUME,
+                                                      value);
+                        }
+                        break;
+                case CONTROL_MUTE:
+                        renderer->mute = value != 0;
+                        break;
+                case CONTROL_SEEK:
+                        renderer->position = value;
+                        break;
+                default:
+                        g_assert_not_reached ();
+                }
+        }
+        g_mutex_unlock (&renderer_state_lock);
+}
+
+static player_status
+transport_state_to_status (const char *state)
+{
+        if (!strcmp (state, "PLAYING") || !strcmp (state, "TRANSITIONING"))
+                return PLAYING;
+        if (g_str_has_prefix (state, "PAUSED_"))
+                return PAUSED;
+
+        return STOPPED;
+}
+
+/* What the cache says @udn is doing, STOPPED once it is gone */
+static player_status
+renderer_get_status (const char *udn)
+{
+        RendererData  *renderer;
+        player_status  status = STOPPED;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL)
+                status = renderer->status;
+        g_mutex_unlock (&renderer_state_lock);
+
+        return status;
+}
+
+/* Used both for what the user just asked for and for what the renderer
+ * reports, the next event corrects a wrong guess */
+static void
+renderer_set_status (const char    *udn,
+                     player_status  status)
+{
+        RendererData *renderer;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL)
+                renderer->status = status;
+        g_mutex_unlock (&renderer_state_lock);
+}
+
+/* Takes the TransportState of an event, returns whether a queued track
+ * ended by itself: PLAYING to STOPPED while no queued URI is being
+ * loaded.  A Stop from us has set STOPPED already. */
+static gboolean
+renderer_report_transport (const char *udn,
+                           const char *state)
+{
+        RendererData  *renderer;
+        player_status  status = transport_state_to_status (state);
+        gboolean       finished = FALSE;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL) {
+                /* TRANSITIONING counts as PLAYING, but not here */
+                if (!strcmp (state, "PLAYING"))
+                        renderer->queue_loading = FALSE;
+                finished = !renderer->queue_loading &&
+                           status == STOPPED &&
+                           renderer->status == PLAYING;
+                renderer->status = status;
+        }
+        g_mutex_unlock (&renderer_state_lock);
+
+        return finished;
+}
+
+static char *didl_first_title (const char *didl);
+static void local_media_release (const char *uri);
+
+static void
+renderer_report_media (const char *udn,
+                       const char *uri,
+                       const char *metadata)
+{
+        RendererData *renderer;
+        char         *title = NULL;
+        gboolean      changed = FALSE;
+
+        /* Events and polls mostly repeat what is cached, the metadata
+         * is only parsed, outside the lock, when it is new */
+        if (metadata != NULL) {
+                g_mutex_lock (&renderer_state_lock);
+                renderer = g_hash_table_lookup (renderer_table, udn);
+                changed = renderer != NULL &&
+                          ((uri != NULL &&
+                            g_strcmp0 (uri, renderer->uri) != 0) ||
+                           g_strcmp0 (metadata, renderer->metadata) != 0);
+                g_mutex_unlock (&renderer_state_lock);
+        }
+        if (changed)
+                title = didl_first_title (metadata);
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL && uri != NULL &&
+            g_strcmp0 (uri, renderer->uri) != 0) {
+                char *old_uri = renderer->uri;
+
+                renderer->uri = g_strdup (uri);
+                local_media_release (old_uri);
+                g_free (old_uri);
+                g_free (renderer->metadata);
+                renderer->metadata = NULL;
+                g_clear_pointer (&renderer->title, g_free);
+                renderer->position = 0;
+                renderer->duration = -1;
+        }
+        if (renderer != NULL && changed &&
+            g_strcmp0 (metadata, renderer->metadata) != 0) {
+                g_free (renderer->metadata);
+                renderer->metadata = g_strdup (metadata);
+                g_free (renderer->title);
+                renderer->title = title;
+                title = NULL;
+        }
+        g_mutex_unlock (&renderer_state_lock);
+
+        g_free (title);
+}
+
+static void renderer_queue_advance (const char *udn);
+
+static void
+queue_play_cb (GUPnPServiceProxy       *av_transport,
+               GUPnPServiceProxyAction *action,
+               gpointer                 user_data)
+{
+        const char *udn;
+        GError     *error = NULL;
+
+        udn = gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (av_transport));
+
+        if (action_end (av_transport, action, &error, NULL))
+                renderer_set_status (udn, PLAYING);
+        else {
+                g_warning ("Failed to play the next queued track on %s: %s",
+                           udn,
+                           error->message);
+                g_error_free (error);
+        }
+}
+
+static void
+queue_uri_set_cb (GUPnPServiceProxy       *av_transport,
+                  GUPnPServiceProxyAction *action,
+                  gpointer                 user_data)
+{
+        QueueEntry *entry = (QueueEntry *) user_data;
+        const char *udn;
+        GError     *error = NULL;
+
+        udn = gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (av_transport));
+
+        if (action_end (av_transport, action, &error, NULL))
+                action_begin_template (av_transport,
+                                       TEMPLATE_PLAY,
+                                       NULL,
+                                       queue_play_cb,
+                                       NULL);
+        else {
+                /* Skip what the renderer can not take */
+                g_warning ("Failed to set queued URI '%s' on %s: %s",
+                           entry->uri,
+                           udn,
+                           error->message);
+                g_error_free (error);
+                renderer_queue_advance (udn);
+        }
+
+        queue_entry_free (entry);
+}
+
+/* Sends the next queued track to @udn, the queue stops once empty */
+static void
+renderer_queue_advance (const char *udn)
+{
+        RendererData      *renderer;
+        QueueEntry        *entry = NULL;
+        GUPnPServiceProxy *av_transport = NULL;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL && renderer->queue_playing) {
+                entry = g_queue_pop_head (&renderer->queue);
+                if (entry != NULL)
+                        av_transport = g_object_ref (renderer->av_transport);
+                else
+                        renderer->queue_playing = FALSE;
+                renderer->queue_loading = entry != NULL;
+        }
+        g_mutex_unlock (&renderer_state_lock);
+
+        if (entry == NULL)
+                return;
+
+        action_begin (av_transport,
+                      "SetAVTransportURI",
+                      queue_uri_set_cb,
+                      entry,
+                      "InstanceID",
+                      G_TYPE_UINT,
+                      0,
+                      "CurrentURI",
+                      G_TYPE_STRING,
+                      entry->uri,
+                      "CurrentURIMetaData",
+                      G_TYPE_STRING,
+                      entry->metadata != NULL ? entry->metadata : "",
+                      NULL);
+        proxy_release (av_transport);
+}
+
+/* Replaces @udn's queue with @entries, which it takes, and starts it */
+static void
+renderer_queue_load (const char *udn,
+                     GPtrArray  *entries)
+{
+        RendererData *renderer;
+        guint         i;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL) {
+                g_queue_foreach (&renderer->queue,
+                                 (GFunc) queue_entry_free,
+                                 NULL);
+                g_queue_clear (&renderer->queue);
+                for (i = 0; i < entries->len; i++)
+                        g_queue_push_tail (&renderer->queue,
+                                           g_ptr_array_index (entries, i));
+                renderer->queue_playing = TRUE;
+        } else
+                g_ptr_array_foreach (entries, (GFunc) queue_entry_free, NULL);
+        g_mutex_unlock (&renderer_state_lock);
+
+        g_ptr_array_unref (entries);
+        renderer_queue_advance (udn);
+}
+
+/* Whether @udn's queue moves on by itself.  Stopping or playing
+ * something else halts it, renderer_queue_next () resumes. */
+static gboolean
+renderer_queue_is_playing (const char *udn)
+{
+        RendererData *renderer;
+        gboolean      playing = FALSE;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL)
+                playing = renderer->queue_playing;
+        g_mutex_unlock (&renderer_state_lock);
+
+        return playing;
+}
+
+static void
+renderer_queue_halt (const char *udn)
+{
+        RendererData *renderer;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL) {
+                renderer->queue_playing = FALSE;
+                renderer->queue_loading = FALSE;
+        }
+        g_mutex_unlock (&renderer_state_lock);
+}
+
+/* Skips to the next queued track, returns FALSE if there is none */
+static gboolean
+renderer_queue_next (const char *udn)
+{
+        RendererData *renderer;
+        gboolean      queued = FALSE;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer != NULL && !g_queue_is_empty (&renderer->queue)) {
+                renderer->queue_playing = TRUE;
+                queued = TRUE;
+        }
+        g_mutex_unlock (&renderer_state_lock);
+
+        if (queued)
+                renderer_queue_advance (udn);
+
+        return queued;
+}
+
+static void
+get_transport_info_cb (GUPnPServiceProxy       *av_transport,
+                       GUPnPServiceProxyAction *action,
+                       gpointer                 user_data)
+{
+        const char *udn;
+        char       *state = NULL;
+        GError     *error = NULL;
+
+        udn = gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (av_transport));
+
+        if (!action_end (av_transport,
+                         action,
+                         &error,
+                         "CurrentTransportState", G_TYPE_STRING, &state,
+                         NULL)) {
+                g_warning ("Failed to get transport info from '%s': %s",
+                           udn,
+                           error->message);
+                g_error_free (error);
+
+                return;
+        }
+
+        if (state != NULL)
+                renderer_set_status (udn, transport_state_to_status (state));
+        g_free (state);
+}
+
+static void
+get_media_info_cb (GUPnPServiceProxy       *av_transport,
+                   GUPnPServiceProxyAction *action,
+                   gpointer                 user_data)
+{
+        const char *udn;
+        char       *uri = NULL, *metadata = NULL;
+        GError     *error = NULL;
+
+        udn = gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (av_transport));
+
+        if (!action_end (av_transport,
+                         action,
+                         &error,
+                         "CurrentURI", G_TYPE_STRING, &uri,
+                         "CurrentURIMetaData", G_TYPE_STRING, &metadata,
+                         NULL)) {
+                g_warning ("Failed to get media info from '%s': %s",
+                           udn,
+                           error->message);
+                g_error_free (error);
+
+                return;
+        }
+
+        renderer_report_media (udn, uri, metadata);
+        g_free (uri);
+        g_free (metadata);
+}
+
+static void
+get_volume_cb (GUPnPServiceProxy       *rendering_control,
+               GUPnPServiceProxyAction *action,
+               gpointer                 user_data)
+{
+        RendererControlType type = GPOINTER_TO_INT (user_data);
+        const char         *udn;
+        guint               volume = 0;
+        gboolean            mute = FALSE;
+        GError             *error = NULL;
+        gboolean            ok;
+
+        udn = gupnp_service_info_get_udn
+                (GUPNP_SERVICE_INFO (rendering_control));
+
+        if (type == CONTROL_VOLUME)
+                ok = action_end (rendering_control,
+                                 action,
+                                 &error,
+                                 "CurrentVolume", G_TYPE_UINT, &volume,
+                                 NULL);
+        else
+                ok = action_end (rendering_control,
+                                 action,
+                                 &error,
+                                 "CurrentMute", G_TYPE_BOOLEAN, &mute,
+                                 NULL);
+        if (!ok) {
+                RendererData *renderer;
+
+                g_warning ("Failed to send action '%s' to '%s': %s",
+                           type == CONTROL_VOLUME ? "GetVolume" : "GetMute",
+                           udn,
+                           error->message);
+                g_error_free (error);
+
+                /* The steps waiting for it are lost, the next one asks
+                 * again */
+                g_mutex_lock (&renderer_state_lock);
+                renderer = g_hash_table_lookup (renderer_table, udn);
+                if (renderer != NULL && type == CONTROL_VOLUME) {
+                        renderer->volume_query = FALSE;
+                        renderer->volume_delta = 0;
+                }
+                g_mutex_unlock (&renderer_state_lock);
+
+                return;
+        }
+
+        renderer_report (udn, type, type == CONTROL_VOLUME ? volume : mute);
+}
+
+static void
+renderer_query_transport (GUPnPServiceProxy *av_transport)
+{
+        action_begin (av_transport,
+                      "GetTransportInfo",
+                      get_transport_info_cb,
+                      NULL,
+                      "InstanceID", G_TYPE_UINT, 0,
+                      NULL);
+}
+
+/* Fills the cache in before the first events arrive */
+static void
+renderer_query_state (RendererData *renderer)
+{
+        renderer_query_transport (renderer->av_transport);
+
+        action_begin (renderer->av_transport,
+                      "GetMediaInfo",
+                      get_media_info_cb,
+                      NULL,
+                      "InstanceID", G_TYPE_UINT, 0,
+                      NULL);
+
+        action_begin (renderer->rendering_control,
+                      "GetVolume",
+                      get_volume_cb,
+                      GINT_TO_POINTER (CONTROL_VOLUME),
+                      "InstanceID", G_TYPE_UINT, 0,
+                      "Channel", G_TYPE_STRING, "Master",
+                      NULL);
+
+        action_begin (renderer->rendering_control,
+                      "GetMute",
+                      get_volume_cb,
+                      GINT_TO_POINTER (CONTROL_MUTE),
+                      "InstanceID", G_TYPE_UINT, 0,
+                      "Channel", G_TYPE_STRING, "Master",
+                      NULL);
+}
+
+/* The parser keeps no state between calls, the shards share it */
+static GUPnPLastChangeParser *
+last_change_parser_get (void)
+{
+        static gsize parser = 0;
+
+        if (g_once_init_enter (&parser))
+                g_once_init_leave (&parser,
+                                   (gsize) gupnp_last_change_parser_new ());
+
+        return (GUPnPLastChangeParser *) parser;
+}
+
+static void
+av_transport_last_change_cb (GUPnPServiceProxy *av_transport,
+                             const char        *variable,
+                             GValue            *value,
+                             gpointer           user_data)
+{
+        const char *udn;
+        char       *state = NULL, *uri = NULL, *metadata = NULL;
+        GError     *error;
+
+        udn = gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (av_transport));
+
+        error = NULL;
+        if (!gupnp_last_change_parser_parse_last_change
+                        (last_change_parser_get (),
+                         0,
+                         g_value_get_string (value),
+                         &error,
+                         "TransportState", G_TYPE_STRING, &state,
+                         "AVTransportURI", G_TYPE_STRING, &uri,
+                         "AVTransportURIMetaData", G_TYPE_STRING, &metadata,
+                         NULL)) {
+                g_warning ("Failed to parse LastChange from '%s': %s",
+                           udn,
+                           error->message);
+                g_error_free (error);
+
+                return;
+        }
+
+        /* Only a track ending by itself moves the queue on */
+        if (state != NULL && renderer_report_transport (udn, state))
+                renderer_queue_advance (udn);
+        renderer_report_media (udn, uri, metadata);
+
+        g_free (state);
+        g_free (uri);
+        g_free (metadata);
+}
+
+static void
+rendering_control_last_change_cb (GUPnPServiceProxy *rendering_control,
+                                  const char        *variable,
+                                  GValue            *value,
+                                  gpointer           user_data)
+{
+        const char *udn;
+        guint       volume = G_MAXUINT;
+        gboolean    mute = -1;
+        GError     *error;
+
+        udn = gupnp_service_info_get_udn
+                (GUPNP_SERVICE_INFO (rendering_control));
+
+        error = NULL;
+        if (!gupnp_last_change_parser_parse_last_change
+                        (last_change_parser_get (),
+                         0,
+                         g_value_get_string (value),
+                         &error,
+                         "Volume", G_TYPE_UINT, &volume,
+                         "Mute", G_TYPE_BOOLEAN, &mute,
+                         NULL)) {
+                g_warning ("Failed to parse LastChange from '%s': %s",
+                           udn,
+                           error->message);
+                g_error_free (error);
+
+                return;
+        }
+
+        /* Variables missing from the event keep their sentinel */
+        if (volume != G_MAXUINT)
+                renderer_report (udn, CONTROL_VOLUME, volume);
+        if (mute != -1)
+                renderer_report (udn, CONTROL_MUTE, mute);
+}
+
+static gboolean
+rendering_control_subscribe (gpointer data)
+{
+        GUPnPServiceProxy *rendering_control = GUPNP_SERVICE_PROXY (data);
+
+        gupnp_service_proxy_add_notify (rendering_control,
+                                        "LastChange",
+                                        G_TYPE_STRING,
+                                        rendering_control_last_change_cb,
+                                        NULL);
+        gupnp_service_proxy_set_subscribed (rendering_control, TRUE);
+        g_object_unref (rendering_control);
+
+        return FALSE;
+}
+
+static gboolean
+av_transport_subscribe (gpointer data)
+{
+        GUPnPServiceProxy *av_transport = GUPNP_SERVICE_PROXY (data);
+
+        gupnp_service_proxy_add_notify (av_transport,
+                                        "LastChange",
+                                        G_TYPE_STRING,
+                                        av_transport_last_change_cb,
+                                        NULL);
+        gupnp_service_proxy_set_subscribed (av_transport, TRUE);
+        g_object_unref (av_transport);
+
+        return FALSE;
+}
+
+void
+add_media_renderer (GUPnPDeviceProxy *proxy)
+{
+
+        char        *udn;
+        GUPnPServiceProxy *cm;
+        GUPnPServiceProxy *av_transport;
+        GUPnPServiceProxy *rendering_control;
+	GUPnPDeviceInfo  *info;
+	char *name;
+	
+
+        udn = g_strdup(gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy)));
+        if (udn == NULL)
+                return;
+
+        cm = get_connection_manager (proxy);
+        if (G_UNLIKELY (cm == NULL))
+                return;
+
+
+        av_transport = get_av_transport (proxy);
+        if (av_transport == NULL)
+		goto no_av_transport;
+
+
+        rendering_control = get_rendering_control (proxy);
+        if (rendering_control == NULL) 
+                goto no_rendering_control;
+
+
+        action_begin (g_object_ref (cm),
+		      "GetProtocolInfo",
+                      get_protocol_info_cb,
+                      NULL,
+                      NULL);
+	info = GUPNP_DEVICE_INFO (proxy);
+	name = gupnp_device_info_get_friendly_name (info);
+	if (name == NULL)
+                name = g_strdup (udn);
+
+	if(NULL == g_hash_table_lookup(renderer_table, udn)){
+		RendererData *renderer = (RendererData*)calloc(1, sizeof(RendererData));
+
+		renderer->friendly_name = name;
+		renderer->av_transport = av_transport;
+		renderer->cm= cm;
+		renderer->rendering_control = rendering_control;
+		renderer->sink_protocol_info = NULL;
+		renderer->status = STOPPED;
+		renderer->volume = -1;
+		renderer->duration = -1;
+		renderer->mem_size = sizeof (RendererData) + strlen (udn) + 1 +
+				     strlen (name) + 1;
+		mem_alloc (MEM_DISCOVERY, renderer->mem_size);
+		mem_track_object (MEM_CONTROL, av_transport);
+		mem_track_object (MEM_CONTROL, cm);
+		mem_track_object (MEM_CONTROL, rendering_control);
+		
+	
+		g_mutex_lock(&renderer_state_lock);
+		g_hash_table_insert(renderer_table, udn, renderer);
+		g_mutex_unlock(&renderer_state_lock);
+
+		/* Subscribing talks to the device, do it from its shard */
+		proxy_invoke (rendering_control,
+			      rendering_control_subscribe,
+			      g_object_ref (rendering_control));
+		proxy_invoke (av_transport,
+			      av_transport_subscribe,
+			      g_object_ref (av_transport));
+
+		renderer_query_state (renderer);
+	} else {
+		g_free (udn);
+		g_free (name);
+		g_object_unref (rendering_control);
+		g_object_unref (av_transport);
+		g_object_unref (cm);
+	}
+
+	return;
+
+no_rendering_control:
+	puts("No Rendering Control");
+	g_object_unref (av_transport);
+	g_object_unref (cm);
+	g_free (udn);
+
+	return;
+
+no_av_transport:
+	puts("No AV Transport");
+	g_object_unref (cm);
+	g_free (udn);
+}
+
+
+static void cache_remove_server (const char *udn);
+
+void remove_media_server(GUPnPDeviceProxy  *proxy)
+{
+	GUPnPDeviceInfo   *info;
+	char *udn;
+
+	info = GUPNP_DEVICE_INFO(proxy);
+	udn = g_strdup(gupnp_device_info_get_udn(info));
+
+	g_hash_table_remove(server_table, udn);
+	cache_remove_server(udn);
+	device_health_forget(udn);
+	g_free(udn);
+}
+
+void
+remove_media_renderer (GUPnPDeviceProxy *proxy)
+{
+	GUPnPDeviceInfo   *info;
+	RendererData *renderer;
+	char *udn, *uri;
+
+	info = GUPNP_DEVICE_INFO(proxy);
+	udn = g_strdup(gupnp_device_info_get_udn(info));
+
+	/* Pending controls look the renderer up under the same lock */
+	g_mutex_lock(&renderer_state_lock);
+	renderer = g_hash_table_lookup(renderer_table, udn);
+	uri = renderer != NULL ? g_strdup(renderer->uri) : NULL;
+	g_hash_table_remove(renderer_table, udn);
+	local_media_release(uri);
+	g_mutex_unlock(&renderer_state_lock);
+	g_free(uri);
+	device_health_forget(udn);
+	g_free(udn);
+}
+
+/* The device tables belong to the main loop, shards hand over what
+ * they discovered */
+static gboolean
+add_media_server_cb (gpointer data)
+{
+        add_media_server (GUPNP_DEVICE_PROXY (data));
+        g_object_unref (data);
+
+        return FALSE;
+}
+
+static gboolean
+remove_media_server_cb (gpointer data)
+{
+        remove_media_server (GUPNP_DEVICE_PROXY (data));
+        g_object_unref (data);
+
+        return FALSE;
+}
+
+static gboolean
+add_media_renderer_cb (gpointer data)
+{
+        add_media_renderer (GUPNP_DEVICE_PROXY (data));
+        g_object_unref (data);
+
+        return FALSE;
+}
+
+static gboolean
+remove_media_renderer_cb (gpointer data)
+{
+        remove_media_renderer (GUPNP_DEVICE_PROXY (data));
+        g_object_unref (data);
+
+        return FALSE;
+}
+
+static void
+dms_proxy_available_cb (GUPnPControlPoint *cp,
+                        GUPnPDeviceProxy  *proxy)
+{
+        trace_device_described (proxy);
+        mem_track_object (MEM_DISCOVERY, proxy);
+        main_invoke (add_media_server_cb, g_object_ref (proxy));
+}
+
+static void
+dms_proxy_unavailable_cb (GUPnPControlPoint *cp,
+                          GUPnPDeviceProxy  *proxy)
+{
+        main_invoke (remove_media_server_cb, g_object_ref (proxy));
+}
+
+static void
+dmr_proxy_available_cb (GUPnPControlPoint *cp,
+                        GUPnPDeviceProxy  *proxy)
+{
+        trace_device_described (proxy);
+        mem_track_object (MEM_DISCOVERY, proxy);
+        main_invoke (add_media_renderer_cb, g_object_ref (proxy));
+}
+
+static void
+dmr_proxy_unavailable_cb (GUPnPControlPoint *cp,
+                          GUPnPDeviceProxy  *proxy)
+{
+
+        main_invoke (remove_media_renderer_cb, g_object_ref (proxy));
+}
+
+
+typedef struct
+{
+        gint64 time;
+        gint64 duration;
+        char  *response;
+        char  *content_type;
+        guint  status;
+
+        /* The exact and loose queues holding it, one reference each */
+        GQueue *exact;
+        GQueue *loose;
+        guint   refs;
+} CapturedExchange;
+
+typedef struct
+{
+        char       *origin;
+        SoupServer *server;
+        guint       port;
+
+        /* method, path, SOAPAction and body -> GQueue of CapturedExchange,
+         * and the same without the body for requests that drifted */
+        GHashTable *exact;
+        GHashTable *loose;
+} ReplayHost;
+
+typedef struct
+{
+        gint64 time;
+        gboolean alive;
+        char  *target;
+        char  *usn;
+        char  *location;
+} CapturedAnnouncement;
+
+typedef struct
+{
+        SoupServer *server;
+        SoupMessage *msg;
+} ReplayDelay;
+
+static FILE *capture_file = NULL;
+static GMutex capture_lock;
+static gint64 capture_start = 0;
+
+static GHashTable *replay_hosts = NULL;
+static GPtrArray *replay_announcements = NULL;
+static gboolean replay_started = FALSE;
+
+static void
+capture_write (JsonBuilder *builder)
+{
+        JsonGenerator *generator;
+        JsonNode      *root;
+        char          *line;
+
+        root = json_builder_get_root (builder);
+        generator = json_generator_new ();
+        json_generator_set_root (generator, root);
+        line = json_generator_to_data (generator, NULL);
+
+        g_mutex_lock (&capture_lock);
+        fprintf (capture_file, "%s\n", line);
+        fflush (capture_file);
+        g_mutex_unlock (&capture_lock);
+
+        g_free (line);
+        json_node_unref (root);
+        g_object_unref (generator);
+}
+
+static void
+capture_add_header (const char *name,
+                    const char *value,
+                    gpointer    user_data)
+{
+        JsonBuilder *builder = (JsonBuilder *) user_data;
+
+        json_builder_set_member_name (builder, name);
+        json_builder_add_string_value (builder, value);
+}
+
+static void
+capture_ssdp_cb (GSSDPClient        *client,
+                 const char         *from_ip,
+                 guint               from_port,
+                 int                 type,
+                 SoupMessageHeaders *headers,
+                 gpointer            user_data)
+{
+        JsonBuilder *builder;
+
+        builder = json_builder_new ();
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "kind");
+        json_builder_add_string_value (builder, "ssdp");
+        json_builder_set_member_name (builder, "time_us");
+        json_builder_add_int_value (builder,
+                                    g_get_monotonic_time () - capture_start);
+        json_builder_set_member_name (builder, "from");
+        json_builder_add_string_value (builder, from_ip);
+        json_builder_set_member_name (builder, "type");
+        json_builder_add_int_value (builder, type);
+        json_builder_set_member_name (builder, "headers");
+        json_builder_begin_object (builder);
+        soup_message_headers_foreach (headers, capture_add_header, builder);
+        json_builder_end_object (builder);
+        json_builder_end_object (builder);
+
+        capture_write (builder);
+        g_object_unref (builder);
+}
+
+static void
+capture_http_finished_cb (SoupMessage *msg,
+                          gpointer     user_data)
+{
+        JsonBuilder *builder;
+        SoupBuffer  *request;
+        char        *uri;
+        const char  *soap_action, *content_type;
+        gint64       start, now;
+
+        start = *(gint64 *) g_object_get_data (G_OBJECT (msg), "capture-start");
+        now = g_get_monotonic_time ();
+
+        uri = soup_uri_to_string (soup_message_get_uri (msg), FALSE);
+        soap_action = soup_message_headers_get_one (msg->request_headers,
+                                                    "SOAPAction");
+        content_type = soup_message_headers_get_one (msg->response_headers,
+                                                     "Content-Type");
+        request = soup_message_body_flatten (msg->request_body);
+
+        builder = json_builder_new ();
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "kind");
+        json_builder_add_string_value (builder, "http");
+        json_builder_set_member_name (builder, "time_us");
+        json_builder_add_int_value (builder, start - capture_start);
+        json_builder_set_member_name (builder, "duration_us");
+        json_builder_add_int_value (builder, now - start);
+        json_builder_set_member_name (builder, "method");
+        json_builder_add_string_value (builder, msg->method);
+        json_builder_set_member_name (builder, "uri");
+        json_builder_add_string_value (builder, uri);
+        json_builder_set_member_name (builder, "soap_action");
+        json_builder_add_string_value (builder, soap_action ? soap_action : "");
+        json_builder_set_member_name (builder, "request");
+        json_builder_add_string_value (builder,
+                                       request->length ? request->data : "");
+        json_builder_set_member_name (builder, "status");
+        json_builder_add_int_value (builder, msg->status_code);
+        json_builder_set_member_name (builder, "content_type");
+        json_builder_add_string_value (builder,
+                                       content_type ? content_type : "");
+        json_builder_set_member_name (builder, "response");
+        json_builder_add_string_value (builder,
+                                       msg->response_body->data ?
+                                       msg->response_body->data : "");
+        json_builder_end_object (builder);
+
+        capture_write (builder);
+
+        g_object_unref (builder);
+        soup_buffer_free (request);
+        g_free (uri);
+}
+
+/* Every description fetch, SOAP action and subscription goes through the
+ * context's session, so this sees them all with their real timings */
+static void
+capture_http_queued_cb (SoupSession *session,
+                        SoupMessage *msg,
+                        gpointer     user_data)
+{
+        gint64 *start;
+
+        start = g_new (gint64, 1);
+        *start = g_get_monotonic_time ();
+        g_object_set_data_full (G_OBJECT (msg), "capture-start", start, g_free);
+
+        g_signal_connect (msg,
+                          "finished",
+                          G_CALLBACK (capture_http_finished_cb),
+                          NULL);
+}
+
+static void
+capture_attach (GUPnPContext *context)
+{
+        g_signal_connect (context,
+                          "message-received",
+                          G_CALLBACK (capture_ssdp_cb),
+                          NULL);
+        g_signal_connect (gupnp_context_get_session (context),
+                          "request-queued",
+                          G_CALLBACK (capture_http_queued_cb),
+                          NULL);
+}
+
+static gboolean
+capture_open (const char *path)
+{
+        capture_file = fopen (path, "w");
+        if (capture_file == NULL) {
+                g_printerr ("Failed to open %s: %s\n", path, strerror (errno));
+
+                return FALSE;
+        }
+
+        capture_start = g_get_monotonic_time ();
+
+        return TRUE;
+}
+
+static void
+captured_exchange_unref (CapturedExchange *exchange)
+{
+        if (--exchange->refs > 0)
+                return;
+
+        g_free (exchange->response);
+        g_free (exchange->content_type);
+        g_slice_free (CapturedExchange, exchange);
+}
+
+static void
+exchange_queue_free (GQueue *queue)
+{
+        g_queue_free_full (queue, (GDestroyNotify) captured_exchange_unref);
+}
+
+static void
+replay_host_free (ReplayHost *host)
+{
+        g_hash_table_unref (host->exact);
+        g_hash_table_unref (host->loose);
+        g_clear_object (&host->server);
+        g_free (host->origin);
+        g_slice_free (ReplayHost, host);
+}
+
+static ReplayHost *
+replay_host_get (const char *uri)
+{
+        ReplayHost *host;
+        SoupURI    *soup_uri;
+        char       *origin;
+
+        soup_uri = soup_uri_new (uri);
+        if (soup_uri == NULL)
+                return NULL;
+
+        origin = g_strdup_printf ("%s:%u",
+                                  soup_uri_get_host (soup_uri),
+                                  soup_uri_get_port (soup_uri));
+        soup_uri_free (soup_uri);
+
+        host = g_hash_table_lookup (replay_hosts, origin);
+        if (host == NULL) {
+                host = g_slice_new0 (ReplayHost);
+                host->origin = origin;
+                host->exact = g_hash_table_new_full
+                        (g_str_hash,
+                         g_str_equal,
+                         g_free,
+                         (GDestroyNotify) exchange_queue_free);
+                host->loose = g_hash_table_new_full
+                        (g_str_hash,
+                         g_str_equal,
+                         g_free,
+                         (GDestroyNotify) exchange_queue_free);
+                g_hash_table_insert (replay_hosts, origin, host);
+        } else
+                g_free (origin);
+
+        return host;
+}
+
+static char *
+replay_key (const char *method,
+            const char *path,
+            const char *soap_action,
+            const char *body)
+{
+        return g_strconcat (method, " ", path, " ", soap_action,
+                            body ? "\n" : NULL, body, NULL);
+}
+
+static void
+replay_add_exchange (JsonObject *record)
+{
+        CapturedExchange *exchange;
+        ReplayHost       *host;
+        SoupURI          *uri;
+        GQueue           *queue;
+        const char       *method, *soap_action, *request;
+        char             *path, *key;
+
+        host = replay_host_get (json_object_get_string_member (record, "uri"));
+        if (host == NULL)
+                return;
+
+        uri = soup_uri_new (json_object_get_string_member (record, "uri"));
+        path = soup_uri_to_string (uri, TRUE);
+        soup_uri_free (uri);
+
+        method = json_object_get_string_member (record, "method");
+        soap_action = json_object_get_string_member (record, "soap_action");
+        request = json_object_get_string_member (record, "request");
+
+        exchange = g_slice_new0 (CapturedExchange);
+        exchange->time = json_object_get_int_member (record, "time_us");
+        exchange->duration = json_object_get_int_member (record, "duration_us");
+        exchange->status = json_object_get_int_member (record, "status");
+        exchange->content_type = g_strdup (json_object_get_string_member
+                                           (record, "content_type"));
+        exchange->response = g_strdup (json_object_get_string_member
+                                       (record, "response"));
+
+        key = replay_key (method, path, soap_action, request);
+        queue = g_hash_table_lookup (host->exact, key);
+        if (queue == NULL) {
+                queue = g_queue_new ();
+                g_hash_table_insert (host->exact, key, queue);
+        } else
+                g_free (key);
+        g_queue_push_tail (queue, exchange);
+        exchange->exact = queue;
+
+        key = replay_key (method, path, soap_action, NULL);
+        queue = g_hash_table_lookup (host->loose, key);
+        if (queue == NULL) {
+                queue = g_queue_new ();
+                g_hash_table_insert (host->loose, key, queue);
+        } else
+                g_free (key);
+        g_queue_push_tail (queue, exchange);
+        exchange->loose = queue;
+        exchange->refs = 2;
+
+        g_free (path);
+}
+
+static void
+replay_add_announcement (JsonObject *record)
+{
+        CapturedAnnouncement *announcement;
+        JsonObject           *headers;
+        const char           *nts, *target, *usn, *location;
+
+        headers = json_object_get_object_member (record, "headers");
+
+        if (json_object_has_member (headers, "NT"))
+                target = json_object_get_string_member (headers, "NT");
+        else if (json_object_has_member (headers, "ST"))
+                target = json_object_get_string_member (headers, "ST");
+        else
+                return;
+
+        if (!json_object_has_member (headers, "USN"))
+                return;
+        usn = json_object_get_string_member (headers, "USN");
+
+        nts = json_object_has_member (headers, "NTS") ?
+              json_object_get_string_member (headers, "NTS") : "ssdp:alive";
+        location = json_object_has_member (headers, "LOCATION") ?
+                   json_object_get_string_member (headers, "LOCATION") : NULL;
+
+        if (strcmp (nts, "ssdp:byebye") && location == NULL)
+                return;
+
+        announcement = g_slice_new0 (CapturedAnnouncement);
+        announcement->time = json_object_get_int_member (record, "time_us");
+        announcement->alive = strcmp (nts, "ssdp:byebye") != 0;
+        announcement->target = g_strdup (target);
+        announcement->usn = g_strdup (usn);
+        announcement->location = g_strdup (location);
+
+        if (location != NULL)
+                replay_host_get (location);
+
+        g_ptr_array_add (replay_announcements, announcement);
+}
+
+static void
+captured_announcement_free (CapturedAnnouncement *announcement)
+{
+        g_free (announcement->target);
+        g_free (announcement->usn);
+        g_free (announcement->location);
+        g_slice_free (CapturedAnnouncement, announcement);
+}
+
+/* Points @text at the stand-ins instead of the recorded hosts */
+static char *
+replay_rewrite (const char *text)
+{
+        GHashTableIter iter;
+        gpointer       value;
+        char          *result;
+
+        result = g_strdup (text);
+
+        g_hash_table_iter_init (&iter, replay_hosts);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+                ReplayHost *host = (ReplayHost *) value;
+                char      **parts;
+                char       *origin, *local;
+
+                origin = g_strconcat ("http://", host->origin, NULL);
+                local = g_strdup_printf ("http://127.0.0.1:%u", host->port);
+
+                parts = g_strsplit (result, origin, -1);
+                g_free (result);
+                result = g_strjoinv (local, parts);
+
+                g_strfreev (parts);
+                g_free (local);
+                g_free (origin);
+        }
+
+        return result;
+}
+
+static gboolean
+replay_unpause_cb (gpointer user_data)
+{
+        ReplayDelay *delay = (ReplayDelay *) user_data;
+
+        soup_server_unpause_message (delay->server, delay->msg);
+
+        g_object_unref (delay->msg);
+        g_slice_free (ReplayDelay, delay);
+
+        return FALSE;
+}
+
+static void
+replay_consume (GQueue           *queue,
+                CapturedExchange *exchange)
+{
+        /* Keep giving the last answer once the recording runs out */
+        if (queue->length > 1 && g_queue_remove (queue, exchange))
+                captured_exchange_unref (exchange);
+}
+
+static CapturedExchange *
+replay_next_exchange (GHashTable *table,
+                      const char *key)
+{
+        CapturedExchange *exchange;
+        GQueue           *queue;
+
+        queue = g_hash_table_lookup (table, key);
+        if (queue == NULL)
+                return NULL;
+
+        /* Answer repeated requests in the recorded order.  An answer is
+         * used up in both queues at once, so a request that drifted does
+         * not get an answer again that its exact twin already got.  The
+         * caller owns the returned reference */
+        exchange = g_queue_peek_head (queue);
+        exchange->refs++;
+        replay_consume (exchange->exact, exchange);
+        replay_consume (exchange->loose, exchange);
+
+        return exchange;
+}
+
+static void
+replay_server_cb (SoupServer        *server,
+                  SoupMessage       *msg,
+                  const char        *path,
+                  GHashTable        *query,
+                  SoupClientContext *client,
+                  gpointer           user_data)
+{
+        ReplayHost       *host = (ReplayHost *) user_data;
+        CapturedExchange *exchange;
+        SoupBuffer       *request;
+        const char       *soap_action;
+        char             *full_path, *key, *body;
+        gint64            delay;
+
+        soap_action = soup_message_headers_get_one (msg->request_headers,
+                                                    "SOAPAction");
+        if (soap_action == NULL)
+                soap_action = "";
+
+        full_path = soup_uri_to_string (soup_message_get_uri (msg), TRUE);
+        request = soup_message_body_flatten (msg->request_body);
+
+        key = replay_key (msg->method,
+                          full_path,
+                          soap_action,
+                          request->length ? request->data : "");
+        exchange = replay_next_exchange (host->exact, key);
+        g_free (key);
+
+        if (exchange == NULL) {
+                key = replay_key (msg->method, full_path, soap_action, NULL);
+                exchange = replay_next_exchange (host->loose, key);
+                g_free (key);
+        }
+
+        soup_buffer_free (request);
+        g_free (full_path);
+
+        if (exchange == NULL) {
+                soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+
+                return;
+        }
+
+        body = replay_rewrite (exchange->response);
+        soup_message_set_status (msg, exchange->status);
+        soup_message_set_response (msg,
+                                   *exchange->content_type ?
+                                   exchange->content_type : "text/xml",
+                                   SOUP_MEMORY_TAKE,
+                                   body,
+                                   strlen (body));
+        delay = exchange->duration;
+        captured_exchange_unref (exchange);
+
+        if (replay_speed <= 0)
+                return;
+
+        delay = (gint64) (delay / replay_speed) / 1000;
+        if (delay > 0) {
+                ReplayDelay *data;
+
+                data = g_slice_new (ReplayDelay);
+                data->server = server;
+                data->msg = g_object_ref (msg);
+
+                soup_server_pause_message (server, msg);
+                g_timeout_add (delay, replay_unpause_cb, data);
+        }
+}
+
+static gboolean
+replay_load (const char *path)
+{
+        GHashTableIter iter;
+        gpointer       value;
+        GError        *error = NULL;
+        char          *contents;
+        char         **lines;
+        guint          i;
+
+        if (!g_file_get_contents (path, &contents, NULL, &error)) {
+                g_printerr ("Failed to read %s: %s\n", path, error->message);
+                g_error_free (error);
+
+                return FALSE;
+        }
+
+        replay_hosts = g_hash_table_new_full (g_str_hash,
+                                              g_str_equal,
+                                              NULL,
+                                              (GDestroyNotify) replay_host_free);
+        replay_announcements = g_ptr_array_new_with_free_func
+                ((GDestroyNotify) captured_announcement_free);
+
+        lines = g_strsplit (contents, "\n", -1);
+        g_free (contents);
+
+        for (i = 0; lines[i] != NULL; i++) {
+                JsonParser *parser;
+                JsonObject *record;
+                const char *kind;
+
+                if (*lines[i] == '\0')
+                        continue;
+
+                parser = json_parser_new ();
+                if (!json_parser_load_from_data (parser, lines[i], -1, NULL) ||
+                    !JSON_NODE_HOLDS_OBJECT (json_parser_get_root (parser))) {
+                        g_warning ("Skipping malformed record on line %u",
+                                   i + 1);
+                        g_object_unref (parser);
+
+                        continue;
+                }
+
+                record = json_node_get_object (json_parser_get_root (parser));
+                kind = json_object_get_string_member (record, "kind");
+                if (!g_strcmp0 (kind, "http"))
+                        replay_add_exchange (record);
+                else if (!g_strcmp0 (kind, "ssdp"))
+                        replay_add_announcement (record);
+
+                g_object_unref (parser);
+        }
+        g_strfreev (lines);
+
+        /* One stand-in per recorded host keeps every path, relative or
+         * absolute, valid after only the host part is rewritten */
+        g_hash_table_iter_init (&iter, replay_hosts);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+                ReplayHost *host = (ReplayHost *) value;
+                GSList     *uris;
+
+                host->server = soup_server_new (NULL, NULL);
+                soup_server_add_handler (host->server,
+                                         NULL,
+                                         replay_server_cb,
+                                         host,
+                                         NULL);
+                if (!soup_server_listen_local (host->server,
+                                               0,
+                                               SOUP_SERVER_LISTEN_IPV4_ONLY,
+                                               &error)) {
+                        g_printerr ("Failed to start stand-in for %s: %s\n",
+                                    host->origin,
+                                    error->message);
+                        g_error_free (error);
+
+                        return FALSE;
+                }
+
+                uris = soup_server_get_uris (host->server);
+                host->port = soup_uri_get_port (uris->data);
+                g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+        }
+
+        return TRUE;
+}
+
+typedef struct
+{
+        CapturedAnnouncement *announcement;
+        GSSDPResourceBrowser *browser;
+} ReplayAnnouncementData;
+
+static gboolean
+replay_announce_cb (gpointer user_data)
+{
+        ReplayAnnouncementData *data = (ReplayAnnouncementData *) user_data;
+
+        /* Go through the browser's own signals so the control point does
+         * exactly what it does for a packet from the network */
+        if (data->announcement->alive) {
+                GList *locations;
+                char  *location;
+
+                location = replay_rewrite (data->announcement->location);
+                locations = g_list_append (NULL, location);
+
+                g_signal_emit_by_name (data->browser,
+                                       "resource-available",
+                                       data->announcement->usn,
+                                       locations);
+
+                g_list_free_full (locations, g_free);
+        } else
+                g_signal_emit_by_name (data->browser,
+                                       "resource-unavailable",
+                                       data->announcement->usn);
+
+        g_object_unref (data->browser);
+        g_slice_free (ReplayAnnouncementData, data);
+
+        return FALSE;
+}
+
+static gboolean
+replay_target_matches (const char *target,
+                       const char *cp_target)
+{
+        const char *version;
+
+        /* Both are "urn:...:Type:N", ignore the version like gssdp does */
+        version = strrchr (cp_target, ':');
+
+        return !strncmp (target, cp_target, version - cp_target);
+}
+
+/* Schedules the recorded announcements on the control points, the
+ * network itself is never touched while replaying */
+static void
+replay_start (GUPnPControlPoint *dms_cp,
+              GUPnPControlPoint *dmr_cp)
+{
+        guint i;
+
+        replay_started = TRUE;
+
+        for (i = 0; i < replay_announcements->len; i++) {
+                CapturedAnnouncement   *announcement;
+                ReplayAnnouncementData *data;
+                GUPnPControlPoint      *cp;
+                gint64                  delay = 0;
+
+                announcement = g_ptr_array_index (replay_announcements, i);
+
+                if (replay_target_matches (announcement->target, MEDIA_SERVER))
+                        cp = dms_cp;
+                else if (replay_target_matches (announcement->target,
+                                                MEDIA_RENDERER))
+                        cp = dmr_cp;
+                else
+                        continue;
+
+                if (replay_speed > 0)
+                        delay = (gint64) (announcement->time / replay_speed)
+                                / 1000;
+
+                data = g_slice_new (ReplayAnnouncementData);
+                data->announcement = announcement;
+                data->browser = g_object_ref (GSSDP_RESOURCE_BROWSER (cp));
+
+                g_timeout_add (delay, replay_announce_cb, data);
+        }
+}
+
+#define MOCK_SCPD_HEADER \
+        "<?xml version=\"1.0\"?>" \
+        "<scpd xmlns=\"urn:schemas-upnp-org:service-1-0\">" \
+        "<specVersion><major>1</major><minor>0</minor></specVersion>"
+
+static const char mock_av_transport_scpd[] =
+        MOCK_SCPD_HEADER
+        "<actionList>"
+        "<action><name>SetAVTransportURI</name><argumentList>"
+        "<argument><name>InstanceID</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_InstanceID</relatedStateVariable></argument>"
+        "<argument><name>CurrentURI</name><direction>in</direction>"
+        "<relatedStateVariable>AVTransportURI</relatedStateVariable></argument>"
+        "<argument><name>CurrentURIMetaData</name><direction>in</direction>"
+        "<relatedStateVariable>AVTransportURIMetaData</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "<action><name>Play</name><argumentList>"
+        "<argument><name>InstanceID</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_InstanceID</relatedStateVariable></argument>"
+        "<argument><name>Speed</name><direction>in</direction>"
+        "<relatedStateVariable>TransportPlaySpeed</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "<action><name>Pause</name><argumentList>"
+        "<argument><name>InstanceID</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_InstanceID</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "<action><name>Seek</name><argumentList>"
+        "<argument><name>InstanceID</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_InstanceID</relatedStateVariable></argument>"
+        "<argument><name>Unit</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_SeekMode</relatedStateVariable></argument>"
+        "<argument><name>Target</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_SeekTarget</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "<action><name>Stop</name><argumentList>"
+        "<argument><name>InstanceID</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_InstanceID</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "<action><name>GetPositionInfo</name><argumentList>"
+        "<argument><name>InstanceID</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_InstanceID</relatedStateVariable></argument>"
+        "<argument><name>TrackDuration</name><direction>out</direction>"
+        "<relatedStateVariable>CurrentTrackDuration</relatedStateVariable></argument>"
+        "<argument><name>RelTime</name><direction>out</direction>"
+        "<relatedStateVariable>RelativeTimePosition</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "<action><name>GetTransportInfo</name><argumentList>"
+        "<argument><name>InstanceID</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_InstanceID</relatedStateVariable></argument>"
+        "<argument><name>CurrentTransportState</name><direction>out</direction>"
+        "<relatedStateVariable>TransportState</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "<action><name>GetMediaInfo</name><argumentList>"
+        "<argument><name>InstanceID</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_InstanceID</relatedStateVariable></argument>"
+        "<argument><name>CurrentURI</name><direction>out</direction>"
+        "<relatedStateVariable>AVTransportURI</relatedStateVariable></argument>"
+        "<argument><name>CurrentURIMetaData</name><direction>out</direction>"
+        "<relatedStateVariable>AVTransportURIMetaData</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "</actionList>"
+        "<serviceStateTable>"
+        "<stateVariable sendEvents=\"yes\"><name>LastChange</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_InstanceID</name>"
+        "<dataType>ui4</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>AVTransportURI</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>AVTransportURIMetaData</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_SeekMode</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_SeekTarget</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>TransportPlaySpeed</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>CurrentTrackDuration</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>RelativeTimePosition</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>TransportState</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "</serviceStateTable></scpd>";
+
+static const char mock_connection_manager_scpd[] =
+        MOCK_SCPD_HEADER
+        "<actionList>"
+        "<action><name>GetProtocolInfo</name><argumentList>"
+        "<argument><name>Source</name><direction>out</direction>"
+        "<relatedStateVariable>SourceProtocolInfo</relatedStateVariable></argument>"
+        "<argument><name>Sink</name><direction>out</direction>"
+        "<relatedStateVariable>SinkProtocolInfo</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "</actionList>"
+        "<serviceStateTable>"
+        "<stateVariable sendEvents=\"yes\"><name>SourceProtocolInfo</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"yes\"><name>SinkProtocolInfo</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "</serviceStateTable></scpd>";
+
+static const char mock_rendering_control_scpd[] =
+        MOCK_SCPD_HEADER
+        "<actionList>"
+        "<action><name>SetVolume</name><argumentList>"
+        "<argument><name>InstanceID</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_InstanceID</relatedStateVariable></argument>"
+        "<argument><name>Channel</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_Channel</relatedStateVariable></argument>"
+        "<argument><name>DesiredVolume</name><direction>in</direction>"
+        "<relatedStateVariable>Volume</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "<action><name>GetMute</name><argumentList>"
+        "<argument><name>InstanceID</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_InstanceID</relatedStateVariable></argument>"
+        "<argument><name>Channel</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_Channel</relatedStateVariable></argument>"
+        "<argument><name>CurrentMute</name><direction>out</direction>"
+        "<relatedStateVariable>Mute</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "<action><name>SetMute</name><argumentList>"
+        "<argument><name>InstanceID</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_InstanceID</relatedStateVariable></argument>"
+        "<argument><name>Channel</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_Channel</relatedStateVariable></argument>"
+        "<argument><name>DesiredMute</name><direction>in</direction>"
+        "<relatedStateVariable>Mute</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "<action><name>GetVolume</name><argumentList>"
+        "<argument><name>InstanceID</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_InstanceID</relatedStateVariable></argument>"
+        "<argument><name>Channel</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_Channel</relatedStateVariable></argument>"
+        "<argument><name>CurrentVolume</name><direction>out</direction>"
+        "<relatedStateVariable>Volume</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "</actionList>"
+        "<serviceStateTable>"
+        "<stateVariable sendEvents=\"yes\"><name>LastChange</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_InstanceID</name>"
+        "<dataType>ui4</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>Mute</name>"
+        "<dataType>boolean</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_Channel</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>Volume</name>"
+        "<dataType>ui2</dataType></stateVariable>"
+        "</serviceStateTable></scpd>";
+
+static const char mock_content_directory_scpd[] =
+        MOCK_SCPD_HEADER
+        "<actionList>"
+        "<action><name>Browse</name><argumentList>"
+        "<argument><name>ObjectID</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_ObjectID</relatedStateVariable></argument>"
+        "<argument><name>BrowseFlag</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_BrowseFlag</relatedStateVariable></argument>"
+        "<argument><name>Filter</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_Filter</relatedStateVariable></argument>"
+        "<argument><name>StartingIndex</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_Index</relatedStateVariable></argument>"
+        "<argument><name>RequestedCount</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_Count</relatedStateVariable></argument>"
+        "<argument><name>SortCriteria</name><direction>in</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_SortCriteria</relatedStateVariable></argument>"
+        "<argument><name>Result</name><direction>out</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_Result</relatedStateVariable></argument>"
+        "<argument><name>NumberReturned</name><direction>out</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_Count</relatedStateVariable></argument>"
+        "<argument><name>TotalMatches</name><direction>out</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_Count</relatedStateVariable></argument>"
+        "<argument><name>UpdateID</name><direction>out</direction>"
+        "<relatedStateVariable>A_ARG_TYPE_UpdateID</relatedStateVariable></argument>"
+        "</argumentList></action>"
+        "</actionList>"
+        "<serviceStateTable>"
+        "<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_ObjectID</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_BrowseFlag</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_Filter</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_Index</name>"
+        "<dataType>ui4</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_Count</name>"
+        "<dataType>ui4</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_SortCriteria</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_Result</name>"
+        "<dataType>string</dataType></stateVariable>"
+        "<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_UpdateID</name>"
+        "<dataType>ui4</dataType></stateVariable>"
+        "</serviceStateTable></scpd>";
+
+typedef struct
+{
+        const char *type;
+        const char *id;
+        const char *name;
+        const char *scpd;
+} MockService;
+
+static const MockService mock_renderer_services[] =
+{
+        { AV_TRANSPORT ":1", "AVTransport", "avt", mock_av_transport_scpd },
+        { CONNECTION_MANAGER ":1", "ConnectionManager", "cm",
+          mock_connection_manager_scpd },
+        { RENDERING_CONTROL ":1", "RenderingControl", "rc",
+          mock_rendering_control_scpd },
+        { NULL }
+};
+
+/* A MediaRenderer stand-in running on one of our own contexts, answers
+ * every action after @latency_ms */
+typedef struct
+{
+        GUPnPRootDevice *device;
+        char            *udn;
+        char            *description;
+        guint            latency_ms;
+        GUPnPService    *av_transport;
+        GUPnPService    *cm;
+        GUPnPService    *rendering_control;
+        char            *uri;
+        const char      *state;
+        guint            volume;
+        gboolean         mute;
+} MockRenderer;
+
+/* Answers @action, or fails it as often as --mock-failure-rate asks */
+static void
+mock_return (GUPnPServiceAction *action)
+{
+        if (mock_failure_rate > 0 &&
+            g_random_int_range (0, 100) < mock_failure_rate)
+                gupnp_service_action_return_error (action,
+                                                   501,
+                                                   "Action Failed");
+        else
+                gupnp_service_action_return (action);
+}
+
+static gboolean
+mock_reply_cb (gpointer user_data)
+{
+        mock_return ((GUPnPServiceAction *) user_data);
+
+        return FALSE;
+}
+
+static void
+mock_reply (guint               latency_ms,
+            GUPnPServiceAction *action)
+{
+        GSource *source;
+
+        if (latency_ms == 0) {
+                mock_return (action);
+
+                return;
+        }
+
+        /* The device may live on a shard */
+        source = g_timeout_source_new (latency_ms);
+        g_source_set_callback (source, mock_reply_cb, action, NULL);
+        g_source_attach (source, g_main_context_get_thread_default ());
+        g_source_unref (source);
+}
+
+static void
+mock_set_uri_cb (GUPnPService       *service,
+                 GUPnPServiceAction *action,
+                 gpointer            user_data)
+{
+        MockRenderer *renderer = (MockRenderer *) user_data;
+
+        g_free (renderer->uri);
+        gupnp_service_action_get (action,
+                                  "CurrentURI", G_TYPE_STRING, &renderer->uri,
+                                  NULL);
+        renderer->state = "STOPPED";
+
+        mock_reply (renderer->latency_ms, action);
+}
+
+static void
+mock_transport_cb (GUPnPService       *service,
+                   GUPnPServiceAction *action,
+                   gpointer            user_data)
+{
+        MockRenderer *renderer = (MockRenderer *) user_data;
+        const char   *name;
+
+        name = gupnp_service_action_get_name (action);
+        if (!strcmp (name, "Play"))
+                renderer->state = "PLAYING";
+        else if (!strcmp (name, "Pause"))
+                renderer->state = "PAUSED_PLAYBACK";
+        else if (!strcmp (name, "Stop"))
+                renderer->state = "STOPPED";
+
+        mock_reply (renderer->latency_ms, action);
+}
+
+static void
+mock_position_cb (GUPnPService       *service,
+                  GUPnPServiceAction *action,
+                  gpointer            user_data)
+{
+        MockRenderer *renderer = (MockRenderer *) user_data;
+
+        gupnp_service_action_set (action,
+                                  "TrackDuration", G_TYPE_STRING, "0:05:21",
+                                  "RelTime", G_TYPE_STRING, "0:00:00",
+                                  NULL);
+
+        mock_reply (renderer->latency_ms, action);
+}
+
+static void
+mock_transport_info_cb (GUPnPService       *service,
+                        GUPnPServiceAction *action,
+                        gpointer            user_data)
+{
+        MockRenderer *renderer = (MockRenderer *) user_data;
+
+        gupnp_service_action_set (action,
+                                  "CurrentTransportState", G_TYPE_STRING,
+                                  renderer->state,
+                                  NULL);
+
+        mock_reply (renderer->latency_ms, action);
+}
+
+static void
+mock_media_info_cb (GUPnPService       *service,
+                    GUPnPServiceAction *action,
+                    gpointer            user_data)
+{
+        MockRenderer *renderer = (MockRenderer *) user_data;
+
+        gupnp_service_action_set (action,
+                                  "CurrentURI", G_TYPE_STRING,
+                                  renderer->uri != NULL ? renderer->uri : "",
+                                  "CurrentURIMetaData", G_TYPE_STRING, "",
+                                  NULL);
+
+        mock_reply (renderer->latency_ms, action);
+}
+
+static void
+mock_protocol_info_cb (GUPnPService       *service,
+                       GUPnPServiceAction *action,
+                       gpointer            user_data)
+{
+        MockRenderer *renderer = (MockRenderer *) user_data;
+
+        gupnp_service_action_set (action,
+                                  "Source", G_TYPE_STRING, "",
+                                  "Sink", G_TYPE_STRING, "http-get:*:*:*",
+                                  NULL);
+
+        mock_reply (renderer->latency_ms, action);
+}
+
+static void
+mock_volume_cb (GUPnPService       *service,
+                GUPnPServiceAction *action,
+                gpointer            user_data)
+{
+        MockRenderer *renderer = (MockRenderer *) user_data;
+        const char   *name;
+
+        name = gupnp_service_action_get_name (action);
+        if (!strcmp (name, "SetVolume"))
+                gupnp_service_action_get (action,
+                                          "DesiredVolume", G_TYPE_UINT,
+                                          &renderer->volume,
+                                          NULL);
+        else if (!strcmp (name, "SetMute"))
+                gupnp_service_action_get (action,
+                                          "DesiredMute", G_TYPE_BOOLEAN,
+                                          &renderer->mute,
+                                          NULL);
+        else if (!strcmp (name, "GetMute"))
+                gupnp_service_action_set (action,
+                                          "CurrentMute", G_TYPE_BOOLEAN,
+                                          renderer->mute,
+                                          NULL);
+        else
+                gupnp_service_action_set (action,
+                                          "CurrentVolume", G_TYPE_UINT,
+                                          renderer->volume,
+                                          NULL);
+
+        mock_reply (renderer->latency_ms, action);
+}
+
+/* All mock devices share one directory, the SCPDs are the same for all
+ * of them and only the descriptions differ.  Control and event URLs are
+ * per device, a context has one handler per path. */
+static char *mock_dir = NULL;
+static GMutex mock_dir_lock;
+
+/* Writes a device description and the SCPDs of @services into
+ * mock_dir, returns the description's file name */
+static char *
+mock_write_description (const char        *device_type,
+                        const char        *name,
+                        const char        *udn,
+                        const MockService *services)
+{
+        GString    *description;
+        GError     *error = NULL;
+        const char *prefix;
+        char       *file, *path;
+        guint       i;
+
+        g_mutex_lock (&mock_dir_lock);
+        if (mock_dir == NULL)
+                mock_dir = g_dir_make_tmp ("control-point-mock-XXXXXX",
+                                           &error);
+        g_mutex_unlock (&mock_dir_lock);
+
+        if (error != NULL) {
+                g_warning ("Failed to create mock device: %s", error->message);
+                g_error_free (error);
+
+                return NULL;
+        }
+
+        /* Our UDNs are "uuid:" and a random UUID */
+        prefix = udn + strlen ("uuid:");
+
+        description = g_string_new (NULL);
+        g_string_append_printf
+                (description,
+                 "<?xml version=\"1.0\"?>"
+                 "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+                 "<specVersion><major>1</major><minor>0</minor></specVersion>"
+                 "<device><deviceType>%s</deviceType>"
+                 "<friendlyName>%s</friendlyName>"
+                 "<manufacturer>control-point</manufacturer>"
+                 "<modelName>mock</modelName>"
+                 "<UDN>%s</UDN><serviceList>",
+                 device_type,
+                 name,
+                 udn);
+
+        for (i = 0; services[i].type != NULL; i++) {
+                g_string_append_printf
+                        (description,
+                         "<service><serviceType>%s</serviceType>"
+                         "<serviceId>urn:upnp-org:serviceId:%s</serviceId>"
+                         "<SCPDURL>/%s.xml</SCPDURL>"
+                         "<controlURL>/%s/%s/control</controlURL>"
+                         "<eventSubURL>/%s/%s/event</eventSubURL></service>",
+                         services[i].type,
+                         services[i].id,
+                         services[i].name,
+                         prefix,
+                         services[i].name,
+                         prefix,
+                         services[i].name);
+
+                path = g_strdup_printf ("%s/%s.xml",
+                                        mock_dir,
+                                        services[i].name);
+                if (!g_file_test (path, G_FILE_TEST_EXISTS))
+                        g_file_set_contents (path,
+                                             services[i].scpd,
+                                             -1,
+                                             NULL);
+                g_free (path);
+        }
+
+        g_string_append (description, "</serviceList></device></root>");
+
+        file = g_strdup_printf ("%s.xml", prefix);
+        path = g_build_filename (mock_dir, file, NULL);
+        g_file_set_contents (path, description->str, -1, NULL);
+        g_free (path);
+        g_string_free (description, TRUE);
+
+        return file;
+}
+
+static void
+mock_remove_description (const char *file)
+{
+        char *path;
+
+        path = g_build_filename (mock_dir, file, NULL);
+        g_unlink (path);
+        g_free (path);
+}
+
+/* Leaves no trace of the mocks behind once they are all gone */
+static void
+mock_dir_remove (const MockService *services)
+{
+        char *path;
+        guint i;
+
+        for (i = 0; services[i].type != NULL; i++) {
+                path = g_strdup_printf ("%s/%s.xml",
+                                        mock_dir,
+                                        services[i].name);
+                g_unlink (path);
+                g_free (path);
+        }
+}
+
+static GUPnPService *
+mock_get_service (GUPnPRootDevice *device,
+                  const char      *type)
+{
+        return GUPNP_SERVICE (gupnp_device_info_get_service
+                              (GUPNP_DEVICE_INFO (device), type));
+}
+
+static MockRenderer *
+mock_renderer_new (GUPnPContext *context,
+                   const char   *name,
+                   guint         latency_ms)
+{
+        MockRenderer *renderer;
+        GUPnPService *service;
+        GError       *error = NULL;
+        char         *uuid;
+
+        renderer = g_slice_new0 (MockRenderer);
+        renderer->latency_ms = latency_ms;
+        renderer->state = "NO_MEDIA_PRESENT";
+        renderer->volume = 50;
+
+        uuid = g_uuid_string_random ();
+        renderer->udn = g_strconcat ("uuid:", uuid, NULL);
+        g_free (uuid);
+
+        renderer->description =
+                mock_write_description (MEDIA_RENDERER,
+                                        name,
+                                        renderer->udn,
+                                        mock_renderer_services);
+        if (renderer->description != NULL)
+                renderer->device = gupnp_root_device_new (context,
+                                                          renderer->description,
+                                                          mock_dir,
+                                                          &error);
+
+        if (renderer->device == NULL) {
+                if (error) {
+                        g_warning ("Failed to create mock renderer: %s",
+                                   error->message);
+                        g_error_free (error);
+                }
+                if (renderer->description != NULL) {
+                        mock_remove_description (renderer->description);
+                        g_free (renderer->description);
+                }
+                g_free (renderer->udn);
+                g_slice_free (MockRenderer, renderer);
+
+                return NULL;
+        }
+
+        /* The services only live as long as we hold them */
+        service = mock_get_service (renderer->device, AV_TRANSPORT);
+        renderer->av_transport = service;
+        g_signal_connect (service,
+                          "action-invoked::SetAVTransportURI",
+                          G_CALLBACK (mock_set_uri_cb),
+                          renderer);
+        g_signal_connect (service,
+                          "action-invoked::Play",
+                          G_CALLBACK (mock_transport_cb),
+                          renderer);
+        g_signal_connect (service,
+                          "action-invoked::Pause",
+                          G_CALLBACK (mock_transport_cb),
+                          renderer);
+        g_signal_connect (service,
+                          "action-invoked::Stop",
+                          G_CALLBACK (mock_transport_cb),
+                          renderer);
+        g_signal_connect (service,
+                          "action-invoked::Seek",
+                          G_CALLBACK (mock_transport_cb),
+                          renderer);
+        g_signal_connect (service,
+                          "action-invoked::GetPositionInfo",
+                          G_CALLBACK (mock_position_cb),
+                          renderer);
+        g_signal_connect (service,
+                          "action-invoked::GetTransportInfo",
+                          G_CALLBACK (mock_transport_info_cb),
+                          renderer);
+        g_signal_connect (service,
+                          "action-invoked::GetMediaInfo",
+                          G_CALLBACK (mock_media_info_cb),
+                          renderer);
+
+        service = mock_get_service (renderer->device, CONNECTION_MANAGER);
+        renderer->cm = service;
+        g_signal_connect (service,
+                          "action-invoked::GetProtocolInfo",
+                          G_CALLBACK (mock_protocol_info_cb),
+                          renderer);
+
+        service = mock_get_service (renderer->device, RENDERING_CONTROL);
+        renderer->rendering_control = service;
+        g_signal_connect (service,
+                          "action-invoked::GetVolume",
+                          G_CALLBACK (mock_volume_cb),
+                          renderer);
+        g_signal_connect (service,
+                          "action-invoked::SetVolume",
+                          G_CALLBACK (mock_volume_cb),
+                          renderer);
+        g_signal_connect (service,
+                          "action-invoked::GetMute",
+                          G_CALLBACK (mock_volume_cb),
+                          renderer);
+        g_signal_connect (service,
+                          "action-invoked::SetMute",
+                          G_CALLBACK (mock_volume_cb),
+                          renderer);
+
+        gupnp_root_device_set_available (renderer->device, TRUE);
+
+        return renderer;
+}
+
+static void
+mock_renderer_free (MockRenderer *renderer)
+{
+        mock_remove_description (renderer->description);
+        g_object_unref (renderer->av_transport);
+        g_object_unref (renderer->cm);
+        g_object_unref (renderer->rendering_control);
+        g_object_unref (renderer->device);
+        g_free (renderer->uri);
+        g_free (renderer->udn);
+        g_free (renderer->description);
+        g_slice_free (MockRenderer, renderer);
+}
+
+static const MockService mock_server_services[] =
+{
+        { CONTENT_DIR ":1", "ContentDirectory", "cds",
+          mock_content_directory_scpd },
+        { NULL }
+};
+
+/* The mock server's tree: every container down to MOCK_SERVER_DEPTH
+ * holds MOCK_SERVER_CONTAINERS containers, and every container holds
+ * MOCK_SERVER_ITEMS tracks.  Ids are paths like "0/2/1". */
+#define MOCK_SERVER_DEPTH 3
+#define MOCK_SERVER_CONTAINERS 4
+#define MOCK_SERVER_ITEMS 16
+
+/* A MediaServer stand-in serving a generated tree */
+typedef struct
+{
+        GUPnPRootDevice *device;
+        char            *udn;
+        char            *description;
+        guint            latency_ms;
+        GUPnPService    *content_dir;
+} MockServer;
+
+static guint
+mock_server_depth (const char *id)
+{
+        guint depth = 0;
+
+        for (; *id != '\0'; id++)
+                if (*id == '/')
+                        depth++;
+
+        return depth;
+}
+
+static void
+mock_browse_cb (GUPnPService       *service,
+                GUPnPServiceAction *action,
+                gpointer            user_data)
+{
+        MockServer *server = (MockServer *) user_data;
+        GString    *didl;
+        char       *id = NULL;
+        guint       start = 0, count = 0, containers, total, i, returned;
+        guint       child_total;
+
+        gupnp_service_action_get (action,
+                                  "ObjectID", G_TYPE_STRING, &id,
+                                  "StartingIndex", G_TYPE_UINT, &start,
+                                  "RequestedCount", G_TYPE_UINT, &count,
+                                  NULL);
+        if (id == NULL)
+                id = g_strdup ("0");
+
+        containers = mock_server_depth (id) < MOCK_SERVER_DEPTH ?
+                     MOCK_SERVER_CONTAINERS : 0;
+        total = containers + MOCK_SERVER_ITEMS;
+        /* What browsing one of the containers below will return */
+        child_total = MOCK_SERVER_ITEMS +
+                      (mock_server_depth (id) + 1 < MOCK_SERVER_DEPTH ?
+                       MOCK_SERVER_CONTAINERS : 0);
+        if (count == 0 || count > total)
+                count = total;
+
+        didl = g_string_new (DIDL_LITE_HEADER);
+        for (i = start, returned = 0; i < total && returned < count;
+             i++, returned++) {
+                if (i < containers)
+                        g_string_append_printf
+                                (didl,
+                                 "<container id=\"%s/%u\" parentID=\"%s\" "
+                                 "restricted=\"1\" childCount=\"%u\">"
+                                 "<dc:title>Folder %u</dc:title>"
+                                 "<upnp:class>object.container.storageFolder"
+                                 "</upnp:class></container>",
+                                 id, i, id, child_total, i);
+                else
+                        g_string_append_printf
+                                (didl,
+                                 "<item id=\"%s/t%u\" parentID=\"%s\" "
+                                 "restricted=\"1\">"
+                                 "<dc:title>Track %u</dc:title>"
+                                 "<upnp:class>object.item.audioItem.musicTrack"
+                                 "</upnp:class>"
+                                 "<res protocolInfo=\"http-get:*:audio/mpeg:*\" "
+                                 "duration=\"0:05:21.000\">"
+                                 "http://127.0.0.1:9/mock/%u.mp3</res></item>",
+                                 id, i, id, i, i);
+        }
+        g_string_append (didl, DIDL_LITE_FOOTER);
+
+        gupnp_service_action_set (action,
+                                  "Result", G_TYPE_STRING, didl->str,
+                                  "NumberReturned", G_TYPE_UINT, returned,
+                                  "TotalMatches", G_TYPE_UINT, total,
+                                  "UpdateID", G_TYPE_UINT, 1,
+                                  NULL);
+        g_string_free (didl, TRUE);
+        g_free (id);
+
+        mock_reply (server->latency_ms, action);
+}
+
+static MockServer *
+mock_server_new (GUPnPContext *context,
+                 const char   *name,
+                 guint         latency_ms)
+{
+        MockServer *server;
+        GError     *error = NULL;
+        char       *uuid;
+
+        server = g_slice_new0 (MockServer);
+        server->latency_ms = latency_ms;
+
+        uuid = g_uuid_string_random ();
+        server->udn = g_strconcat ("uuid:", uuid, NULL);
+        g_free (uuid);
+
+        server->description = mock_write_description (MEDIA_SERVER,
+                                                      name,
+                                                      server->udn,
+                                                      mock_server_services);
+        if (server->description != NULL)
+                server->device = gupnp_root_device_new (context,
+                                                        server->description,
+                                                        mock_dir,
+                                                        &error);
+
+        if (server->device == NULL) {
+                if (error) {
+                        g_warning ("Failed to create mock server: %s",
+                                   error->message);
+                        g_error_free (error);
+                }
+                if (server->description != NULL) {
+                        mock_remove_description (server->description);
+                        g_free (server->description);
+                }
+                g_free (server->udn);
+                g_slice_free (MockServer, server);
+
+                return NULL;
+        }
+
+        server->content_dir = mock_get_service (server->device, CONTENT_DIR);
+        g_signal_connect (server->content_dir,
+                          "action-invoked::Browse",
+                          G_CALLBACK (mock_browse_cb),
+                          server);
+
+        gupnp_root_device_set_available (server->device, TRUE);
+
+        return server;
+}
+
+static void
+mock_server_free (MockServer *server)
+{
+        mock_remove_description (server->description);
+        g_object_unref (server->content_dir);
+        g_object_unref (server->device);
+        g_free (server->udn);
+        g_free (server->description);
+        g_slice_free (MockServer, server);
+}
+
+/* Only created for --bench-play */
+static MockRenderer *bench_renderer = NULL;
+
+/* The context --soak and --farm create their devices on */
+static GUPnPContext *mock_context = NULL;
+
+/* Discovery pipeline.  Every resource-available is held back here
+ * before GUPnP fetches the description: ignored USNs are dropped,
+ * a UDN another context already found is skipped, each UDN is fetched
+ * at most once every DISCOVERY_REFETCH_SECONDS and at most
+ * --discovery-fetches descriptions are on the wire per control point.
+ * Accepted announcements are emitted again with the filter stepping
+ * aside, which lets GUPnP go ahead. */
+#define DISCOVERY_REFETCH_SECONDS 30
+#define DISCOVERY_FETCH_TIMEOUT 10
+
+typedef struct
+{
+        char   *usn;
+        char   *udn;
+        GList  *locations;
+        gint64  not_before;
+} DiscoveryPending;
+
+typedef struct
+{
+        GUPnPControlPoint *cp;
+        GQueue             pending;
+
+        /* UDN -> timeout GSource of the fetches on the wire */
+        GHashTable        *fetching;
+
+        /* UDN -> when its description was last asked for */
+        GHashTable        *fetched_at;
+
+        GSource           *pump;
+        gboolean           replaying;
+} DiscoveryQueue;
+
+/* "target udn" -> the DiscoveryQueue that found it first */
+static GHashTable *discovery_claims = NULL;
+static GMutex discovery_lock;
+
+static gint discovery_ignored = 0;
+static gint discovery_duplicates = 0;
+static gint discovery_delayed = 0;
+static gint discovery_fetched = 0;
+
+static char *
+discovery_udn (const char *usn)
+{
+        const char *end = strstr (usn, "::");
+
+        return end != NULL ? g_strndup (usn, end - usn) : g_strdup (usn);
+}
+
+static char *
+discovery_claim_key (DiscoveryQueue *queue,
+                     const char     *udn)
+{
+        return g_strconcat (gssdp_resource_browser_get_target
+                                (GSSDP_RESOURCE_BROWSER (queue->cp)),
+                            " ",
+                            udn,
+                            NULL);
+}
+
+/* Whether @queue may go on with @udn, the first context to ask wins */
+static gboolean
+discovery_claim (DiscoveryQueue *queue,
+                 const char     *udn)
+{
+        DiscoveryQueue *owner;
+        char           *key;
+
+        key = discovery_claim_key (queue, udn);
+
+        g_mutex_lock (&discovery_lock);
+        if (discovery_claims == NULL)
+                discovery_claims = g_hash_table_new_full (g_str_hash,
+                                                          g_str_equal,
+                                                          g_free,
+                                                          NULL);
+        owner = g_hash_table_lookup (discovery_claims, key);
+        if (owner == NULL) {
+                g_hash_table_insert (discovery_claims, key, queue);
+                owner = queue;
+        } else
+                g_free (key);
+        g_mutex_unlock (&discovery_lock);
+
+        return owner == queue;
+}
+
+/* A byebye heard by any context ends the claim, whichever context
+ * holds it, so that the next announcement on another interface is
+ * fetched instead of being dropped as a duplicate */
+static void
+discovery_release (DiscoveryQueue *queue,
+                   const char     *udn)
+{
+        char *key;
+
+        key = discovery_claim_key (queue, udn);
+
+        g_mutex_lock (&discovery_lock);
+        if (discovery_claims != NULL)
+                g_hash_table_remove (discovery_claims, key);
+        g_mutex_unlock (&discovery_lock);
+
+        g_free (key);
+}
+
+static void
+discovery_pending_free (DiscoveryPending *pending)
+{
+        g_free (pending->usn);
+        g_free (pending->udn);
+        g_list_free_full (pending->locations, g_free);
+        g_slice_free (DiscoveryPending, pending);
+}
+
+static void discovery_pump (DiscoveryQueue *queue);
+
+static gboolean
+discovery_pump_cb (gpointer user_data)
+{
+        DiscoveryQueue *queue = (DiscoveryQueue *) user_data;
+
+        g_source_unref (queue->pump);
+        queue->pump = NULL;
+        discovery_pump (queue);
+
+        return FALSE;
+}
+
+static void
+discovery_pump_later (DiscoveryQueue *queue,
+                      guint           seconds)
+{
+        if (queue->pump != NULL)
+                return;
+
+        queue->pump = g_timeout_source_new_seconds (seconds);
+        g_source_set_callback (queue->pump, discovery_pump_cb, queue, NULL);
+        g_source_attach (queue->pump, g_main_context_get_thread_default ());
+}
+
+/* Frees the slot of a fetch that finished or was given up on */
+static void
+discovery_fetch_done (DiscoveryQueue *queue,
+                      const char     *udn)
+{
+        GSource *timeout;
+
+        timeout = g_hash_table_lookup (queue->fetching, udn);
+        if (timeout == NULL)
+                return;
+
+        g_source_destroy (timeout);
+        g_hash_table_remove (queue->fetching, udn);
+        discovery_pump (queue);
+}
+
+typedef struct
+{
+        DiscoveryQueue *queue;
+        char           *udn;
+} DiscoveryFetch;
+
+static void
+discovery_fetch_free (gpointer data)
+{
+        DiscoveryFetch *fetch = (DiscoveryFetch *) data;
+
+        g_free (fetch->udn);
+        g_slice_free (DiscoveryFetch, fetch);
+}
+
+/* GUPnP says nothing when a description can not be fetched.  The claim
+ * goes too, another context may reach the device where this one could
+ * not. */
+static gboolean
+discovery_fetch_timeout_cb (gpointer user_data)
+{
+        DiscoveryFetch *fetch = (DiscoveryFetch *) user_data;
+
+        discovery_release (fetch->queue, fetch->udn);
+        discovery_fetch_done (fetch->queue, fetch->udn);
+
+        return FALSE;
+}
+
+/* Starts as many ready fetches as the limit allows */
+static void
+discovery_pump (DiscoveryQueue *queue)
+{
+        GList  *l, *next;
+        gint64  now = g_get_monotonic_time ();
+
+        for (l = queue->pending.head;
+             l != NULL &&
+             g_hash_table_size (queue->fetching) < (guint) discovery_fetches;
+             l = next) {
+                DiscoveryPending *pending = l->data;
+                DiscoveryFetch   *fetch;
+                GSource          *timeout;
+                gint64           *fetched_at;
+
+                next = l->next;
+                if (pending->not_before > now ||
+                    g_hash_table_contains (queue->fetching, pending->udn))
+                        continue;
+
+                g_queue_delete_link (&queue->pending, l);
+
+                fetch = g_slice_new (DiscoveryFetch);
+                fetch->queue = queue;
+                fetch->udn = g_strdup (pending->udn);
+                timeout = g_timeout_source_new_seconds
+                                (DISCOVERY_FETCH_TIMEOUT);
+                g_source_set_callback (timeout,
+                                       discovery_fetch_timeout_cb,
+                                       fetch,
+                                       discovery_fetch_free);
+                g_source_attach (timeout,
+                                 g_main_context_get_thread_default ());
+                g_hash_table_insert (queue->fetching,
+                                     g_strdup (pending->udn),
+                                     timeout);
+                fetched_at = g_new (gint64, 1);
+                *fetched_at = now;
+                g_hash_table_insert (queue->fetched_at,
+                                     g_strdup (pending->udn),
+                                     fetched_at);
+                g_atomic_int_inc (&discovery_fetched);
+
+                queue->replaying = TRUE;
+                g_signal_emit_by_name (queue->cp,
+                                       "resource-available",
+                                       pending->usn,
+                                       pending->locations);
+                queue->replaying = FALSE;
+
+                discovery_pending_free (pending);
+
+                /* A cached description completes, and pumps, right away */
+                next = queue->pending.head;
+        }
+
+        if (!g_queue_is_empty (&queue->pending))
+                discovery_pump_later (queue, 1);
+}
+
+static void
+discovery_announce (GSSDPResourceBrowser *browser,
+                    const char           *usn,
+                    GList                *locations,
+                    gpointer              user_data)
+{
+        DiscoveryQueue   *queue = (DiscoveryQueue *) user_data;
+        DiscoveryPending *pending;
+        GList            *l;
+        gint64           *fetched_at;
+        char            **pattern;
+        char             *udn;
+
+        if (queue->replaying)
+                return;
+
+        /* GUPnP only goes ahead when we emit it again */
+        g_signal_stop_emission_by_name (browser, "resource-available");
+
+        for (pattern = ignore_patterns;
+             pattern != NULL && *pattern != NULL;
+             pattern++)
+                if (g_pattern_match_simple (*pattern, usn)) {
+                        g_atomic_int_inc (&discovery_ignored);
+
+                        return;
+                }
+
+        udn = discovery_udn (usn);
+        if (!discovery_claim (queue, udn)) {
+                g_atomic_int_inc (&discovery_duplicates);
+                g_free (udn);
+
+                return;
+        }
+
+        /* A newer announcement replaces the one still waiting */
+        for (l = queue->pending.head; l != NULL; l = l->next) {
+                pending = l->data;
+                if (!strcmp (pending->usn, usn)) {
+                        g_queue_delete_link (&queue->pending, l);
+                        discovery_pending_free (pending);
+                        g_atomic_int_inc (&discovery_duplicates);
+
+                        break;
+                }
+        }
+
+        pending = g_slice_new0 (DiscoveryPending);
+        pending->usn = g_strdup (usn);
+        pending->udn = udn;
+        pending->locations = g_list_copy_deep (locations,
+                                               (GCopyFunc) g_strdup,
+                                               NULL);
+
+        /* Devices flapping between byebye and alive are not fetched
+         * again every time */
+        fetched_at = g_hash_table_lookup (queue->fetched_at, udn);
+        if (fetched_at != NULL &&
+            g_get_monotonic_time () - *fetched_at <
+            (gint64) DISCOVERY_REFETCH_SECONDS * G_USEC_PER_SEC) {
+                pending->not_before = *fetched_at +
+                        (gint64) DISCOVERY_REFETCH_SECONDS * G_USEC_PER_SEC;
+                g_atomic_int_inc (&discovery_delayed);
+        }
+
+        g_queue_push_tail (&queue->pending, pending);
+        discovery_pump (queue);
+}
+
+static void
+discovery_available_cb (GSSDPResourceBrowser *browser,
+                        const char           *usn,
+                        GList                *locations,
+                        gpointer              user_data)
+{
+        WatchdogSection previous;
+
+        previous = watchdog_enter ("ssdp", "resource-available");
+        discovery_announce (browser, usn, locations, user_data);
+        watchdog_leave (previous);
+}
+
+static void
+discovery_unavailable_cb (GSSDPResourceBrowser *browser,
+                          const char           *usn,
+                          gpointer              user_data)
+{
+        DiscoveryQueue *queue = (DiscoveryQueue *) user_data;
+        GList          *l;
+        char           *udn;
+        WatchdogSection previous;
+
+        previous = watchdog_enter ("ssdp", "resource-unavailable");
+        for (l = queue->pending.head; l != NULL; l = l->next) {
+                DiscoveryPending *pending = l->data;
+
+                if (!strcmp (pending->usn, usn)) {
+                        g_queue_delete_link (&queue->pending, l);
+                        discovery_pending_free (pending);
+
+                        break;
+                }
+        }
+
+        udn = discovery_udn (usn);
+        discovery_release (queue, udn);
+        discovery_fetch_done (queue, udn);
+        g_free (udn);
+        watchdog_leave (previous);
+}
+
+static void
+discovery_proxy_available_cb (GUPnPControlPoint *cp,
+                              GUPnPDeviceProxy  *proxy,
+                              gpointer           user_data)
+{
+        discovery_fetch_done ((DiscoveryQueue *) user_data,
+                              gupnp_device_info_get_udn
+                                        (GUPNP_DEVICE_INFO (proxy)));
+}
+
+static void
+discovery_queue_free (gpointer data)
+{
+        DiscoveryQueue *queue = (DiscoveryQueue *) data;
+        GHashTableIter  iter;
+        gpointer        key, value;
+
+        if (queue->pump != NULL) {
+                g_source_destroy (queue->pump);
+                g_source_unref (queue->pump);
+        }
+
+        g_hash_table_iter_init (&iter, queue->fetching);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+                g_source_destroy ((GSource *) value);
+        g_hash_table_unref (queue->fetching);
+        g_hash_table_unref (queue->fetched_at);
+
+        g_queue_foreach (&queue->pending,
+                         (GFunc) discovery_pending_free,
+                         NULL);
+        g_queue_clear (&queue->pending);
+
+        /* Other contexts may pick up what this one had found */
+        g_mutex_lock (&discovery_lock);
+        if (discovery_claims != NULL) {
+                g_hash_table_iter_init (&iter, discovery_claims);
+                while (g_hash_table_iter_next (&iter, &key, &value))
+                        if (value == queue)
+                                g_hash_table_iter_remove (&iter);
+        }
+        g_mutex_unlock (&discovery_lock);
+
+        g_slice_free (DiscoveryQueue, queue);
+}
+
+/* Puts @cp's discovery through the pipeline, lives as long as @cp */
+static void
+discovery_queue_attach (GUPnPControlPoint *cp)
+{
+        DiscoveryQueue *queue;
+
+        queue = g_slice_new0 (DiscoveryQueue);
+        queue->cp = cp;
+        g_queue_init (&queue->pending);
+        queue->fetching = g_hash_table_new_full (g_str_hash,
+                                                 g_str_equal,
+                                                 g_free,
+                                                 (GDestroyNotify)
+                                                 g_source_unref);
+        queue->fetched_at = g_hash_table_new_full (g_str_hash,
+                                                   g_str_equal,
+                                                   g_free,
+                                                   g_free);
+
+        g_signal_connect (cp,
+                          "resource-available",
+                          G_CALLBACK (discovery_available_cb),
+                          queue);
+        g_signal_connect (cp,
+                          "resource-unavailable",
+                          G_CALLBACK (discovery_unavailable_cb),
+                          queue);
+        g_signal_connect (cp,
+                          "device-proxy-available",
+                          G_CALLBACK (discovery_proxy_available_cb),
+                          queue);
+
+        g_object_set_data_full (G_OBJECT (cp),
+                                "discovery-queue",
+                                queue,
+                                discovery_queue_free);
+}
+
+static void
+on_context_available (GUPnPContextManager *context_manager,
+                      GUPnPContext        *context,
+                      gpointer             user_data)
+{
+        GUPnPControlPoint *dms_cp;
+        GUPnPControlPoint *dmr_cp;
+        Shard             *shard;
+
+        /* Local files are served on the address of the first usable
+         * interface, the renderers have to reach us there */
+        if (local_host_ip == NULL) {
+                char *ip = g_strdup (gupnp_context_get_host_ip (context));
+
+                /* Shards may race here */
+                if (!g_atomic_pointer_compare_and_exchange (&local_host_ip,
+                                                            NULL,
+                                                            ip))
+                        g_free (ip);
+        }
+
+        /* Actions for this context's devices are sent from its thread */
+        shard = g_private_get (&current_shard);
+        g_object_set_data (G_OBJECT (context), SHARD_KEY, shard);
+
+        if (capture_file != NULL)
+                capture_attach (context);
+
+        if (bench_play_rounds > 0 && bench_renderer == NULL)
+                g_atomic_pointer_set (&bench_renderer,
+                                      mock_renderer_new (context,
+                                                         "Benchmark renderer",
+                                                         mock_latency_ms));
+
+        if ((soak_seconds > 0 || farm_servers > 0 || farm_renderers > 0) &&
+            g_atomic_pointer_compare_and_exchange (&mock_context,
+                                                   NULL,
+                                                   context))
+                g_object_ref (context);
+
+        dms_cp = gupnp_control_point_new (context, MEDIA_SERVER);
+	dmr_cp = gupnp_control_point_new (context, MEDIA_RENDERER);
+
+        if (shard != NULL) {
+                g_signal_connect (dms_cp,
+                                  "resource-available",
+                                  G_CALLBACK (shard_filter_cb),
+                                  shard);
+                g_signal_connect (dmr_cp,
+                                  "resource-available",
+                                  G_CALLBACK (shard_filter_cb),
+                                  shard);
+        }
+
+        discovery_queue_attach (dms_cp);
+        discovery_queue_attach (dmr_cp);
+
+        if (trace_path != NULL) {
+                g_signal_connect (dms_cp,
+                                  "resource-available",
+                                  G_CALLBACK (trace_resource_available_cb),
+                                  NULL);
+                g_signal_connect (dmr_cp,
+                                  "resource-available",
+                                  G_CALLBACK (trace_resource_available_cb),
+                                  NULL);
+        }
+
+        g_signal_connect (dms_cp,
+                          "device-proxy-available",
+                          G_CALLBACK (dms_proxy_available_cb),
+                          NULL);
+        g_signal_connect (dms_cp,
+                          "device-proxy-unavailable",
+                          G_CALLBACK (dms_proxy_unavailable_cb),
+                          NULL);
+
+	g_signal_connect (dmr_cp,
+                          "device-proxy-available",
+                          G_CALLBACK (dmr_proxy_available_cb),
+                          NULL);
+        g_signal_connect (dmr_cp,
+                          "device-proxy-unavailable",
+                          G_CALLBACK (dmr_proxy_unavailable_cb),
+                          NULL);
+
+        if (replay_hosts != NULL) {
+                /* Replayed devices only ever come from the capture */
+                if (!replay_started)
+                        replay_start (dms_cp, dmr_cp);
+        } else {
+                gssdp_resource_browser_set_active
+                        (GSSDP_RESOURCE_BROWSER (dms_cp), TRUE);
+                gssdp_resource_browser_set_active
+                        (GSSDP_RESOURCE_BROWSER (dmr_cp), TRUE);
+        }
+
+        /* Let context manager take care of the control point life cycle */
+        gupnp_context_manager_manage_control_point (context_manager, dms_cp);
+	gupnp_context_manager_manage_control_point (context_manager, dmr_cp);
+
+        /* We don't need to keep our own references to the control points */
+        g_object_unref (dms_cp);
+	g_object_unref (dmr_cp);
+
+}
+
+static void
+browse_data_free (BrowseData *data)
+{
+
+        g_free (data->id);
+        g_object_unref (data->content_dir);
+        g_slice_free (BrowseData, data);
+}
+
+static BrowseData *
+browse_data_new (GUPnPServiceProxy *content_dir,
+                 const char        *id,
+                 guint32            starting_index)
+{
+
+        BrowseData *data;
+
+        data = g_slice_new (BrowseData);
+        data->content_dir = g_object_ref (content_dir);
+        data->id = g_strdup (id);
+        data->starting_index = starting_index;
+        data->cache = NULL;
+        data->profile = FILTER_LISTING;
+        data->aggregate = NULL;
+        data->hydrate = NULL;
+
+        return data;
+}
+
+static void art_known_ref (const char *uri);
+static void art_known_unref (const char *uri);
+
+/* Rough per-entry cost of a GHashTable slot: key, value and hash */
+#define HASH_ENTRY_OVERHEAD (2 * sizeof (gpointer) + sizeof (guint))
+
+static gsize
+container_size (const char *id,
+                Container  *c)
+{
+	gsize size;
+
+	size = sizeof (Container) + HASH_ENTRY_OVERHEAD + strlen (id) + 1;
+	size += c->title ? strlen (c->title) + 1 : 0;
+	size += c->parent_id ? strlen (c->parent_id) + 1 : 0;
+	size += c->class ? strlen (c->class) + 1 : 0;
+	size += c->artist ? strlen (c->artist) + 1 : 0;
+	size += c->album ? strlen (c->album) + 1 : 0;
+	size += c->art_uri ? strlen (c->art_uri) + 1 : 0;
+	size += c->uri ? strlen (c->uri) + 1 : 0;
+	size += c->protocol_info ? strlen (c->protocol_info) + 1 : 0;
+
+	return size;
+}
+
+static void
+container_free (Container *c)
+{
+	if (c->owner != NULL) {
+		c->owner->bytes -= c->size;
+		cache_bytes -= c->size;
+		mem_free (MEM_BROWSE_CACHE, c->size);
+		art_known_unref (c->art_uri);
+	}
+
+	g_free (c->title);
+	g_free (c->parent_id);
+	g_free (c->class);
+	g_free (c->artist);
+	g_free (c->album);
+	g_free (c->art_uri);
+	g_free (c->uri);
+	g_free (c->protocol_info);
+	free (c);
+}
+
+/* DIDL-Lite for CurrentURIMetaData, written from what the cache keeps
+ * of @c rather than kept verbatim for every browsed item.  NULL if @c
+ * has no res. */
+static char *
+container_metadata (const char *id,
+                    Container  *c)
+{
+	GUPnPDIDLLiteWriter *writer;
+	GUPnPDIDLLiteObject *object;
+	GUPnPDIDLLiteResource *res;
+	GUPnPProtocolInfo *protocol_info = NULL;
+	char *metadata;
+
+	if (c->uri == NULL)
+		return NULL;
+
+	writer = gupnp_didl_lite_writer_new (NULL);
+	object = GUPNP_DIDL_LITE_OBJECT (gupnp_didl_lite_writer_add_item (writer));
+	gupnp_didl_lite_object_set_id (object, id);
+	gupnp_didl_lite_object_set_parent_id (object,
+					      c->parent_id ? c->parent_id : "-1");
+	gupnp_didl_lite_object_set_restricted (object, TRUE);
+	if (c->title != NULL)
+		gupnp_didl_lite_object_set_title (object, c->title);
+	if (c->class != NULL)
+		gupnp_didl_lite_object_set_upnp_class (object, c->class);
+	if (c->artist != NULL) {
+		GUPnPDIDLLiteContributor *artist;
+
+		artist = gupnp_didl_lite_object_add_artist (object);
+		gupnp_didl_lite_contributor_set_name (artist, c->artist);
+		g_object_unref (artist);
+	}
+	if (c->album != NULL)
+		gupnp_didl_lite_object_set_album (object, c->album);
+	if (c->art_uri != NULL)
+		gupnp_didl_lite_object_set_album_art (object, c->art_uri);
+
+	res = gupnp_didl_lite_object_add_resource (object);
+	gupnp_didl_lite_resource_set_uri (res, c->uri);
+	if (c->protocol_info != NULL)
+		protocol_info = gupnp_protocol_info_new_from_string
+			(c->protocol_info, NULL);
+	if (protocol_info != NULL) {
+		gupnp_didl_lite_resource_set_protocol_info (res, protocol_info);
+		g_object_unref (protocol_info);
+	}
+
+	metadata = gupnp_didl_lite_writer_get_string (writer);
+
+	g_object_unref (res);
+	g_object_unref (object);
+	g_object_unref (writer);
+
+	return metadata;
+}
+
+/* Content fingerprints.  The same track shared by several servers has
+ * a different id and URI on each, what stays is what the DIDL-Lite says
+ * about it.  container_fingerprint () hashes the normalized title,
+ * artist, album, duration and size into 64 bits, 0 meaning "no
+ * fingerprint", and a FingerprintSet maps them to whatever the caller
+ * keeps per track in 16 bytes a slot, so the whole cache is checked
+ * for duplicates in one pass without a string per object. */
+#define FNV_OFFSET_BASIS G_GUINT64_CONSTANT (14695981039346656037)
+#define FNV_PRIME G_GUINT64_CONSTANT (1099511628211)
+
+static guint64
+fingerprint_add_byte (guint64 hash,
+                      guchar  byte)
+{
+	return (hash ^ byte) * FNV_PRIME;
+}
+
+/* Only letters and digits, lower case and without accents, so "Café"
+ * and "cafe " are the same */
+static guint64
+fingerprint_add_text (guint64     hash,
+                      const char *text)
+{
+	char *normalized;
+	const char *p;
+
+	normalized = text ? g_utf8_normalize (text, -1, G_NORMALIZE_ALL) : NULL;
+	if (normalized != NULL)
+		for (p = normalized; *p != '\0'; p = g_utf8_next_char (p)) {
+			gunichar ch = g_utf8_get_char (p);
+
+			if (!g_unichar_isalnum (ch))
+				continue;
+
+			ch = g_unichar_tolower (ch);
+			hash = fingerprint_add_byte (hash, ch & 0xff);
+			hash = fingerprint_add_byte (hash, (ch >> 8) & 0xff);
+			hash = fingerprint_add_byte (hash, ch >> 16);
+		}
+	g_free (normalized);
+
+	/* Keeps "ab" + "c" apart from "a" + "bc" */
+	return fingerprint_add_byte (hash, 0xff);
+}
+
+static guint64
+fingerprint_add_number (guint64 hash,
+                        guint64 number)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		hash = fingerprint_add_byte (hash, (number >> (i * 8)) & 0xff);
+
+	return hash;
+}
+
+/* Whole seconds of a res duration, H+:MM:SS[.F+] */
+static guint
+didl_duration_seconds (const char *duration)
+{
+	guint hours, minutes, seconds;
+
+	if (duration == NULL ||
+	    sscanf (duration, "%u:%u:%u", &hours, &minutes, &seconds) != 3)
+		return 0;
+
+	return hours * 3600 + minutes * 60 + seconds;
+}
+
+/* 0 for containers and objects without a title */
+static guint64
+container_fingerprint (const Container *c,
+                       const char      *duration,
+                       const char      *size)
+{
+	guint64 hash = FNV_OFFSET_BASIS;
+
+	if (c->title == NULL ||
+	    (c->class != NULL &&
+	     g_str_has_prefix (c->class, OBJECT_CLASS_CONTAINER)))
+		return 0;
+
+	hash = fingerprint_add_text (hash, c->title);
+	hash = fingerprint_add_text (hash, c->artist);
+	hash = fingerprint_add_text (hash, c->album);
+	hash = fingerprint_add_number (hash, didl_duration_seconds (duration));
+	hash = fingerprint_add_number (hash,
+				       size ? g_ascii_strtoull (size, NULL, 10) : 0);
+
+	/* FNV leaves the low bits the set probes with poorly mixed */
+	hash ^= hash >> 33;
+	hash *= G_GUINT64_CONSTANT (0xff51afd7ed558ccd);
+	hash ^= hash >> 33;
+
+	return hash != 0 ? hash : 1;
+}
+
+typedef struct
+{
+	guint64 fingerprint;
+	gpointer value;
+} FingerprintSlot;
+
+/* Open addressing with linear probing, fingerprint 0 marks a free slot */
+typedef struct
+{
+	FingerprintSlot *slots;
+	gsize mask;
+	gsize count;
+} FingerprintSet;
+
+static void
+fingerprint_set_alloc (FingerprintSet *set,
+                       gsize           capacity)
+{
+	set->slots = g_new0 (FingerprintSlot, capacity);
+	set->mask = capacity - 1;
+	mem_alloc (MEM_BROWSE_CACHE, capacity * sizeof (FingerprintSlot));
+}
+
+/* Sized for @expected fingerprints, it grows past them anyway */
+static FingerprintSet *
+fingerprint_set_new (gsize expected)
+{
+	FingerprintSet *set;
+	gsize capacity = 16;
+
+	while (capacity < expected + expected / 2)
+		capacity *= 2;
+
+	set = g_slice_new0 (FingerprintSet);
+	fingerprint_set_alloc (set, capacity);
+
+	return set;
+}
+
+static void
+fingerprint_set_free (FingerprintSet *set)
+{
+	mem_free (MEM_BROWSE_CACHE, (set->mask + 1) * sizeof (FingerprintSlot));
+	g_free (set->slots);
+	g_slice_free (FingerprintSet, set);
+}
+
+static FingerprintSlot *
+fingerprint_set_probe (FingerprintSet *set,
+                       guint64         fingerprint)
+{
+	gsize i = fingerprint & set->mask;
+
+	while (set->slots[i].fingerprint != 0 &&
+	       set->slots[i].fingerprint != fingerprint)
+		i = (i + 1) & set->mask;
+
+	return &set->slots[i];
+}
+
+/* The value stored with @fingerprint, NULL if there is none */
+static gpointer
+fingerprint_set_lookup (FingerprintSet *set,
+                        guint64         fingerprint)
+{
+	return fingerprint_set_probe (set, fingerprint)->value;
+}
+
+/* Where the value of @fingerprint goes, a new slot holds NULL.  Only
+ * valid until the next call. */
+static gpointer *
+fingerprint_set_slot (FingerprintSet *set,
+                      guint64         fingerprint)
+{
+	FingerprintSlot *slot;
+
+	/* Kept at most three quarters full so probes stay short */
+	if ((set->count + 1) * 4 > (set->mask + 1) * 3) {
+		FingerprintSlot *old = set->slots;
+		gsize i, capacity = set->mask + 1;
+
+		fingerprint_set_alloc (set, capacity * 2);
+		for (i = 0; i < capacity; i++)
+			if (old[i].fingerprint != 0)
+				*fingerprint_set_probe (set, old[i].fingerprint) =
+					old[i];
+		mem_free (MEM_BROWSE_CACHE, capacity * sizeof (FingerprintSlot));
+		g_free (old);
+	}
+
+	slot = fingerprint_set_probe (set, fingerprint);
+	if (slot->fingerprint == 0) {
+		slot->fingerprint = fingerprint;
+		set->count++;
+	}
+
+	return &slot->value;
+}
+
+/* Walks the set, start with *@index at 0 */
+static gboolean
+fingerprint_set_next (FingerprintSet *set,
+                      gsize          *index,
+                      guint64        *fingerprint,
+                      gpointer       *value)
+{
+	for (; *index <= set->mask; (*index)++) {
+		FingerprintSlot *slot = &set->slots[*index];
+
+		if (slot->fingerprint != 0) {
+			*fingerprint = slot->fingerprint;
+			*value = slot->value;
+			(*index)++;
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Object ids are only unique per server, so objects and browsed
+ * containers are keyed by both */
+static char *
+browse_object_key (const char *udn,
+                   const char *id)
+{
+	return g_strconcat (udn, "/", id, NULL);
+}
+
+static Container *
+browse_lookup (const char *udn,
+               const char *id)
+{
+	Container *c;
+	char *key;
+
+	key = browse_object_key (udn, id);
+	c = g_hash_table_lookup (browse_table, key);
+	g_free (key);
+
+	return c;
+}
+
+/* The object id in @c's browse_table key @key */
+static const char *
+browse_key_id (const char      *key,
+               const Container *c)
+{
+	return key + strlen (c->owner->udn) + 1;
+}
+
+/* Drops the children of @entry from browse_table, keeps the entry */
+static void
+cached_container_clear (CachedContainer *entry)
+{
+	guint i;
+
+	for (i = 0; i < entry->children->len; i++) {
+		Container *c;
+		char *key;
+
+		key = browse_object_key (entry->udn,
+					 g_ptr_array_index (entry->children, i));
+		c = g_hash_table_lookup (browse_table, key);
+
+		/* A later browse of another container of the same server
+		 * may have listed this child again */
+		if (c != NULL && c->owner == entry)
+			g_hash_table_remove (browse_table, key);
+		g_free (key);
+	}
+
+	if (entry->titles != NULL) {
+		g_hash_table_unref (entry->titles);
+		entry->titles = NULL;
+		entry->bytes -= entry->titles_bytes;
+		cache_bytes -= entry->titles_bytes;
+		mem_free (MEM_BROWSE_CACHE, entry->titles_bytes);
+		entry->titles_bytes = 0;
+	}
+
+	g_ptr_array_set_size (entry->children, 0);
+	entry->complete = FALSE;
+	browse_generation++;
+}
+
+static void
+cached_container_free (CachedContainer *entry)
+{
+	cached_container_clear (entry);
+
+	g_queue_delete_link (&cache_lru, entry->lru_link);
+	cache_bytes -= entry->bytes;
+	mem_free (MEM_BROWSE_CACHE, entry->bytes);
+
+	g_ptr_array_unref (entry->children);
+	g_free (entry->key);
+	g_free (entry->udn);
+	g_free (entry->id);
+	g_slice_free (CachedContainer, entry);
+}
+
+static char *
+browse_cache_key (GUPnPServiceProxy *content_dir,
+                  const char        *id)
+{
+        return browse_object_key (gupnp_service_info_get_udn
+                                  (GUPNP_SERVICE_INFO (content_dir)),
+                                  id);
+}
+
+static void
+cache_touch (CachedContainer *entry)
+{
+	g_queue_unlink (&cache_lru, entry->lru_link);
+	g_queue_push_head_link (&cache_lru, entry->lru_link);
+}
+
+/* Returns the entry for @id, creating it or emptying it for a fresh
+ * browse */
+static CachedContainer *
+cache_begin_browse (GUPnPServiceProxy *content_dir,
+                    const char        *id)
+{
+	CachedContainer *entry;
+	char *key;
+
+	key = browse_cache_key (content_dir, id);
+	entry = g_hash_table_lookup (browsed_table, key);
+	if (entry != NULL) {
+		g_free (key);
+		cached_container_clear (entry);
+		cache_touch (entry);
+
+		return entry;
+	}
+
+	entry = g_slice_new0 (CachedContainer);
+	entry->key = key;
+	entry->udn = g_strdup (gupnp_service_info_get_udn
+			       (GUPNP_SERVICE_INFO (content_dir)));
+	entry->id = g_strdup (id);
+	entry->children = g_ptr_array_new_with_free_func (g_free);
+	entry->bytes = sizeof (CachedContainer) + HASH_ENTRY_OVERHEAD +
+		       2 * strlen (key) + 2;
+	cache_bytes += entry->bytes;
+	mem_alloc (MEM_BROWSE_CACHE, entry->bytes);
+
+	g_queue_push_head (&cache_lru, entry);
+	entry->lru_link = cache_lru.head;
+
+	g_hash_table_insert (browsed_table, entry->key, entry);
+
+	return entry;
+}
+
+/* Returns the entry for @id if its children are all in browse_table */
+static CachedContainer *
+cache_lookup (GUPnPServiceProxy *content_dir,
+              const char        *id)
+{
+	CachedContainer *entry;
+	char *key;
+
+	key = browse_cache_key (content_dir, id);
+	entry = g_hash_table_lookup (browsed_table, key);
+	g_free (key);
+
+	if (entry == NULL || !entry->complete)
+		return NULL;
+
+	cache_touch (entry);
+
+	return entry;
+}
+
+/* The children of @entry titled @title, whatever the case, or NULL.
+ * The ids belong to @entry. */
+static GPtrArray *
+cache_find_children (CachedContainer *entry,
+                     const char      *title)
+{
+	GPtrArray *ids;
+	char *key;
+	guint i;
+
+	if (entry->titles == NULL) {
+		entry->titles = g_hash_table_new_full
+			(g_str_hash,
+			 g_str_equal,
+			 g_free,
+			 (GDestroyNotify) g_ptr_array_unref);
+
+		for (i = 0; i < entry->children->len; i++) {
+			char *id = g_ptr_array_index (entry->children, i);
+			Container *c;
+
+			c = browse_lookup (entry->udn, id);
+			if (c == NULL || c->owner != entry || c->title == NULL)
+				continue;
+
+			key = g_utf8_casefold (c->title, -1);
+			ids = g_hash_table_lookup (entry->titles, key);
+			if (ids == NULL) {
+				ids = g_ptr_array_new ();
+				g_hash_table_insert (entry->titles, key, ids);
+				entry->titles_bytes += HASH_ENTRY_OVERHEAD +
+					sizeof (GPtrArray) + strlen (key) + 1;
+			} else
+				g_free (key);
+
+			g_ptr_array_add (ids, id);
+			entry->titles_bytes += sizeof (gpointer);
+		}
+
+		entry->bytes += entry->titles_bytes;
+		cache_bytes += entry->titles_bytes;
+		mem_alloc (MEM_BROWSE_CACHE, entry->titles_bytes);
+	}
+
+	key = g_utf8_casefold (title, -1);
+	ids = g_hash_table_lookup (entry->titles, key);
+	g_free (key);
+
+	return ids;
+}
+
+static void
+cache_set_navigation (const char *udn,
+                      const char *id)
+{
+	g_strlcpy (nav_server_udn, udn, sizeof (nav_server_udn));
+	g_strlcpy (nav_object_id, id, sizeof (nav_object_id));
+}
+
+/* Keeps @id on @content_dir in the cache, whether it is there yet or
+ * not, until cache_unpin () */
+static void
+cache_pin (GUPnPServiceProxy *content_dir,
+           const char        *id)
+{
+	char *key;
+	guint count;
+
+	if (cache_pins == NULL)
+		cache_pins = g_hash_table_new_full (g_str_hash,
+						    g_str_equal,
+						    g_free,
+						    NULL);
+
+	key = browse_cache_key (content_dir, id);
+	count = GPOINTER_TO_UINT (g_hash_table_lookup (cache_pins, key));
+	g_hash_table_insert (cache_pins, key, GUINT_TO_POINTER (count + 1));
+}
+
+static void
+cache_unpin (GUPnPServiceProxy *content_dir,
+             const char        *id)
+{
+	char *key;
+	guint count;
+
+	key = browse_cache_key (content_dir, id);
+	count = GPOINTER_TO_UINT (g_hash_table_lookup (cache_pins, key));
+	if (count > 1)
+		g_hash_table_insert (cache_pins, key, GUINT_TO_POINTER (count - 1));
+	else {
+		g_hash_table_remove (cache_pins, key);
+		g_free (key);
+	}
+}
+
+static gboolean
+cache_is_pinned (CachedContainer *entry)
+{
+	const char *id = nav_object_id;
+	guint depth;
+
+	if (cache_pins != NULL && g_hash_table_contains (cache_pins, entry->key))
+		return TRUE;
+
+	if (strcmp (entry->udn, nav_server_udn))
+		return FALSE;
+
+	/* Walk from the shown container up to the root */
+	for (depth = 0; depth < MAX_BROWSE; depth++) {
+		Container *c;
+
+		if (!strcmp (entry->id, id))
+			return TRUE;
+
+		c = browse_lookup (entry->udn, id);
+		if (c == NULL || c->parent_id == NULL)
+			break;
+
+		id = c->parent_id;
+	}
+
+	return FALSE;
+}
+
+/* Evicts whole containers, least recently used first, until the cache
+ * fits in its budget again.  @keep is the container just browsed. */
+static void
+cache_enforce_budget (CachedContainer *keep)
+{
+	GList *link;
+
+	if (cache_budget == 0)
+		return;
+
+	link = cache_lru.tail;
+	while (cache_bytes > cache_budget && link != NULL) {
+		CachedContainer *entry = link->data;
+
+		link = link->prev;
+
+		if (entry == keep || cache_is_pinned (entry))
+			continue;
+
+		g_hash_table_remove (browsed_table, entry->key);
+	}
+}
+
+/* Forgets everything browsed on @udn, used when the server leaves */
+static void
+cache_remove_server (const char *udn)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init (&iter, browsed_table);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		CachedContainer *entry = (CachedContainer *) value;
+
+		if (!strcmp (entry->udn, udn))
+			g_hash_table_iter_remove (&iter);
+	}
+}
+
+typedef struct
+{
+	/* A copy of the server's friendly name, NULL once it left */
+	char *name;
+	guint containers;
+	guint objects;
+	gsize bytes;
+} ServerCacheStats;
+
+/* What the menu's memory stats and the stats method show of the tables
+ * the main loop owns, taken in one go by memory_stats_collect () */
+typedef struct
+{
+	guint servers;
+	guint renderers;
+	gsize device_bytes;
+	guint objects;
+	gsize cache_bytes;
+	/* udn -> ServerCacheStats for every server with cached content */
+	GHashTable *per_server;
+} MemoryStats;
+
+static void
+server_cache_stats_free (ServerCacheStats *server)
+{
+	g_free (server->name);
+	g_free (server);
+}
+
+static gboolean
+device_tables_size_cb (gpointer user_data)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	gsize size = 0;
+
+	g_hash_table_iter_init (&iter, server_table);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		MediaServers *server = (MediaServers *) value;
+
+		size += sizeof (MediaServers) + HASH_ENTRY_OVERHEAD;
+		size += strlen (key) + 1;
+		size += server->friendly_name ?
+			strlen (server->friendly_name) + 1 : 0;
+	}
+
+	/* Shards fill in sink_protocol_info under the lock */
+	g_mutex_lock (&renderer_state_lock);
+	g_hash_table_iter_init (&iter, renderer_table);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		RendererData *renderer = (RendererData *) value;
+
+		size += sizeof (RendererData) + HASH_ENTRY_OVERHEAD;
+		size += strlen (key) + 1;
+		size += renderer->friendly_name ?
+			strlen (renderer->friendly_name) + 1 : 0;
+		size += renderer->sink_protocol_info ?
+			strlen (renderer->sink_protocol_info) + 1 : 0;
+	}
+	g_mutex_unlock (&renderer_state_lock);
+
+	*(gsize *) user_data = size;
+
+	return FALSE;
+}
+
+static gboolean
+cache_collect_stats_cb (gpointer user_data)
+{
+	GHashTable *stats = (GHashTable *) user_data;
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init (&iter, browsed_table);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		CachedContainer *entry = (CachedContainer *) value;
+		ServerCacheStats *server;
+
+		server = g_hash_table_lookup (stats, entry->udn);
+		if (server == NULL) {
+			server = g_new0 (ServerCacheStats, 1);
+			g_hash_table_insert (stats, g_strdup (entry->udn), server);
+		}
+
+		server->containers++;
+		server->objects += entry->children->len;
+		server->bytes += entry->bytes;
+	}
+
+	return FALSE;
+}
+
+static gboolean
+memory_stats_cb (gpointer user_data)
+{
+	MemoryStats *stats = (MemoryStats *) user_data;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	device_tables_size_cb (&stats->device_bytes);
+	cache_collect_stats_cb (stats->per_server);
+
+	g_hash_table_iter_init (&iter, stats->per_server);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		ServerCacheStats *server = (ServerCacheStats *) value;
+		MediaServers *s;
+
+		s = g_hash_table_lookup (server_table, key);
+		if (s != NULL)
+			server->name = g_strdup (s->friendly_name);
+	}
+
+	stats->servers = g_hash_table_size (server_table);
+	stats->objects = g_hash_table_size (browse_table);
+	stats->cache_bytes = cache_bytes;
+
+	g_mutex_lock (&renderer_state_lock);
+	stats->renderers = g_hash_table_size (renderer_table);
+	g_mutex_unlock (&renderer_state_lock);
+
+	return FALSE;
+}
+
+/* Fills in @stats on the main loop, free with memory_stats_clear () */
+static void
+memory_stats_collect (MemoryStats *stats)
+{
+	memset (stats, 0, sizeof (MemoryStats));
+	stats->per_server = g_hash_table_new_full
+		(g_str_hash,
+		 g_str_equal,
+		 g_free,
+		 (GDestroyNotify) server_cache_stats_free);
+	main_call (memory_stats_cb, stats);
+}
+
+static void
+memory_stats_clear (MemoryStats *stats)
+{
+	g_hash_table_unref (stats->per_server);
+}
+
+/* Artwork.  upnp:albumArtURI, or else a JPEG_TN or PNG_TN res, is kept
+ * with every browsed object.  art_request () fetches it on art_pool, at
+ * most --art-downloads at a time and two per server, images someone is
+ * looking at before prefetches.  Images are kept in a memory LRU capped
+ * at --art-cache KiB and on disk, named by the SHA-1 of their URI with
+ * the ETag next to them, so an image is only downloaded again when the
+ * server says it changed. */
+#define ART_DISK_MAX_AGE (24 * 3600)
+#define ART_MAX_BYTES (4 * 1024 * 1024)
+#define ART_TIMEOUT_SECONDS 10
+#define ART_DOWNLOADS_PER_HOST 2
+/* Children of a browse whose art is prefetched, about one screen */
+#define ART_PREFETCH_ITEMS 16
+
+typedef enum
+{
+	ART_PREFETCH,
+	ART_VISIBLE
+} ArtPriority;
+
+/* Gets the image, NULL if it could not be fetched */
+typedef void (* ArtFunc) (const char *uri,
+                          GBytes     *image,
+                          gpointer    user_data);
+
+typedef struct
+{
+	char *uri;
+	GBytes *image;
+	gsize size;
+	GList *lru_link;
+} ArtEntry;
+
+typedef struct
+{
+	ArtFunc func;
+	gpointer user_data;
+} ArtWaiter;
+
+/* A download asked for, queued or running */
+typedef struct
+{
+	GSList *waiters;
+	ArtPriority priority;
+	gboolean running;
+} ArtPending;
+
+typedef struct
+{
+	char *uri;
+	ArtPriority priority;
+	guint sequence;
+} ArtJob;
+
+typedef struct
+{
+	char *uri;
+	GBytes *image;
+	GSList *waiters;
+} ArtDelivery;
+
+/* Downloads running for one host and the jobs waiting for a slot, in
+ * art_job_compare () order */
+typedef struct
+{
+	guint running;
+	GQueue waiting;
+} ArtHost;
+
+static GMutex art_lock;
+/* URI -> ArtEntry, most recently used first in art_lru */
+static GHashTable *art_table = NULL;
+static GQueue art_lru = G_QUEUE_INIT;
+static gsize art_bytes = 0;
+static gsize art_budget = 0;
+/* URI -> ArtPending */
+static GHashTable *art_pending = NULL;
+/* "host:port" -> ArtHost */
+static GHashTable *art_hosts = NULL;
+static guint art_sequence = 0;
+
+/* art_uri of every object in browse_table -> GUINT_TO_POINTER (count),
+ * only those are fetched for the art method.  Main loop only. */
+static GHashTable *art_known = NULL;
+
+static GThreadPool *art_pool = NULL;
+static SoupSession *art_session = NULL;
+
+static gint art_hits = 0;
+static gint art_disk_hits = 0;
+static gint art_downloads = 0;
+static gint art_not_modified = 0;
+static gint art_failures = 0;
+
+static void
+art_known_ref (const char *uri)
+{
+	guint count;
+
+	if (uri == NULL)
+		return;
+
+	if (art_known == NULL)
+		art_known = g_hash_table_new_full (g_str_hash,
+						   g_str_equal,
+						   g_free,
+						   NULL);
+
+	count = GPOINTER_TO_UINT (g_hash_table_lookup (art_known, uri));
+	g_hash_table_replace (art_known,
+			      g_strdup (uri),
+			      GUINT_TO_POINTER (count + 1));
+}
+
+static void
+art_known_unref (const char *uri)
+{
+	guint count;
+
+	if (uri == NULL || art_known == NULL)
+		return;
+
+	count = GPOINTER_TO_UINT (g_hash_table_lookup (art_known, uri));
+	if (count > 1)
+		g_hash_table_replace (art_known,
+				      g_strdup (uri),
+				      GUINT_TO_POINTER (count - 1));
+	else
+		g_hash_table_remove (art_known, uri);
+}
+
+static void
+art_entry_free (ArtEntry *entry)
+{
+	mem_free (MEM_ARTWORK, entry->size);
+	art_bytes -= entry->size;
+	g_queue_delete_link (&art_lru, entry->lru_link);
+	g_bytes_unref (entry->image);
+	g_free (entry->uri);
+	g_slice_free (ArtEntry, entry);
+}
+
+/* Visible first, then in the order asked for */
+static gint
+art_job_compare (gconstpointer a,
+                 gconstpointer b,
+                 gpointer      user_data)
+{
+	const ArtJob *job_a = a;
+	const ArtJob *job_b = b;
+
+	if (job_a->priority != job_b->priority)
+		return job_a->priority > job_b->priority ? -1 : 1;
+
+	return job_a->sequence < job_b->sequence ? -1 :
+	       job_a->sequence > job_b->sequence;
+}
+
+/* Must be called with art_lock held */
+static void
+art_queue_job (const char  *uri,
+               ArtPriority  priority)
+{
+	ArtJob *job;
+
+	job = g_slice_new (ArtJob);
+	job->uri = g_strdup (uri);
+	job->priority = priority;
+	job->sequence = art_sequence++;
+	g_thread_pool_push (art_pool, job, NULL);
+}
+
+static void
+art_job_free (ArtJob *job)
+{
+	g_free (job->uri);
+	g_slice_free (ArtJob, job);
+}
+
+static void
+art_host_free (ArtHost *host)
+{
+	g_queue_free_full (&host->waiting, (GDestroyNotify) art_job_free);
+	g_slice_free (ArtHost, host);
+}
+
+/* "host:port" of @uri, the scheme and path left out */
+static char *
+art_host_name (const char *uri)
+{
+	const char *start, *end;
+
+	start = strstr (uri, "://");
+	start = start != NULL ? start + 3 : uri;
+	end = strchr (start, '/');
+
+	return end != NULL ? g_strndup (start, end - start) : g_strdup (start);
+}
+
+/* Takes a download slot on @job's host, or parks @job until
+ * art_host_kick () finds one free.  Must be called with art_lock held. */
+static gboolean
+art_host_acquire (ArtJob *job)
+{
+	ArtHost *host;
+	char *name;
+
+	name = art_host_name (job->uri);
+	host = g_hash_table_lookup (art_hosts, name);
+	if (host == NULL) {
+		host = g_slice_new0 (ArtHost);
+		g_queue_init (&host->waiting);
+		g_hash_table_insert (art_hosts, name, host);
+	} else
+		g_free (name);
+
+	if (host->running >= ART_DOWNLOADS_PER_HOST) {
+		g_queue_insert_sorted (&host->waiting,
+				       job,
+				       art_job_compare,
+				       NULL);
+
+		return FALSE;
+	}
+
+	host->running++;
+
+	return TRUE;
+}
+
+/* Hands the best job waiting on @uri's host to the pool if a slot is
+ * free, with @release giving back the slot of a finished download.
+ * A job that turns out not to be needed any more kicks again, so
+ * nothing is left parked.  Must be called with art_lock held. */
+static void
+art_host_kick (const char *uri,
+               gboolean    release)
+{
+	ArtHost *host;
+	ArtJob *next;
+	char *name;
+
+	name = art_host_name (uri);
+	host = g_hash_table_lookup (art_hosts, name);
+	if (host != NULL) {
+		if (release)
+			host->running--;
+		next = host->running < ART_DOWNLOADS_PER_HOST ?
+		       g_queue_pop_head (&host->waiting) : NULL;
+		if (next != NULL)
+			g_thread_pool_push (art_pool, next, NULL);
+		else if (host->running == 0 &&
+			 g_queue_is_empty (&host->waiting))
+			g_hash_table_remove (art_hosts, name);
+	}
+	g_free (name);
+}
+
+static char *
+art_disk_path (const char *uri,
+               const char *suffix)
+{
+	char *sha1, *name, *path;
+
+	sha1 = g_compute_checksum_for_string (G_CHECKSUM_SHA1, uri, -1);
+	name = g_strconcat (sha1, suffix, NULL);
+	path = g_build_filename (art_dir, name, NULL);
+	g_free (sha1);
+	g_free (name);
+
+	return path;
+}
+
+/* The image cached on disk for @uri and its ETag.  @fresh says whether
+ * it was checked with the server within ART_DISK_MAX_AGE. */
+static GBytes *
+art_disk_load (const char *uri,
+               char      **etag,
+               gboolean   *fresh)
+{
+	GStatBuf st;
+	char *path, *etag_path, *contents;
+	gsize length;
+	GBytes *image = NULL;
+
+	*etag = NULL;
+	*fresh = FALSE;
+
+	path = art_disk_path (uri, NULL);
+	etag_path = art_disk_path (uri, ".etag");
+
+	if (g_file_get_contents (path, &contents, &length, NULL)) {
+		image = g_bytes_new_take (contents, length);
+		g_file_get_contents (etag_path, etag, NULL, NULL);
+		if (*etag != NULL && (*etag)[0] == '\0')
+			g_clear_pointer (etag, g_free);
+
+		/* The ETag file is rewritten whenever the server is asked */
+		if (g_stat (etag_path, &st) == 0)
+			*fresh = g_get_real_time () / G_USEC_PER_SEC -
+				 st.st_mtime < ART_DISK_MAX_AGE;
+	}
+
+	g_free (path);
+	g_free (etag_path);
+
+	return image;
+}
+
+static void
+art_disk_store (const char *uri,
+                GBytes     *image,
+                const char *etag)
+{
+	char *path, *etag_path;
+	GError *error = NULL;
+
+	path = art_disk_path (uri, NULL);
+	etag_path = art_disk_path (uri, ".etag");
+
+	if (image != NULL &&
+	    !g_file_set_contents (path,
+				  g_bytes_get_data (image, NULL),
+				  g_bytes_get_size (image),
+				  &error)) {
+		g_warning ("Could not cache artwork in %s: %s",
+			   path,
+			   error->message);
+		g_clear_error (&error);
+	} else
+		g_file_set_contents (etag_path, etag ? etag : "", -1, NULL);
+
+	g_free (path);
+	g_free (etag_path);
+}
+
+/* GET @uri, conditional on @etag if there is one.  Returns the status,
+ * @image and @new_etag are only set for 200. */
+static guint
+art_download (const char *uri,
+              const char *etag,
+              GBytes    **image,
+              char      **new_etag)
+{
+	SoupMessage *msg;
+	guint status;
+
+	msg = soup_message_new ("GET", uri);
+	if (msg == NULL)
+		return SOUP_STATUS_MALFORMED;
+
+	if (etag != NULL)
+		soup_message_headers_append (msg->request_headers,
+					     "If-None-Match",
+					     etag);
+
+	status = soup_session_send_message (art_session, msg);
+	if (status == SOUP_STATUS_OK &&
+	    msg->response_body->length <= ART_MAX_BYTES) {
+		*image = g_bytes_new (msg->response_body->data,
+				      msg->response_body->length);
+		*new_etag = g_strdup (soup_message_headers_get_one
+					(msg->response_headers, "ETag"));
+	} else if (status == SOUP_STATUS_OK)
+		status = SOUP_STATUS_REQUEST_ENTITY_TOO_LARGE;
+
+	g_object_unref (msg);
+
+	return status;
+}
+
+static gboolean
+art_deliver_cb (gpointer user_data)
+{
+	ArtDelivery *delivery = (ArtDelivery *) user_data;
+	GSList *l;
+
+	for (l = delivery->waiters; l != NULL; l = l->next) {
+		ArtWaiter *waiter = l->data;
+
+		waiter->func (delivery->uri, delivery->image, waiter->user_data);
+		g_slice_free (ArtWaiter, waiter);
+	}
+
+	g_slist_free (delivery->waiters);
+	if (delivery->image != NULL)
+		g_bytes_unref (delivery->image);
+	g_free (delivery->uri);
+	g_slice_free (ArtDelivery, delivery);
+
+	return FALSE;
+}
+
+/* Must be called with art_lock held, takes @image */
+static void
+art_remember (const char *uri,
+              GBytes     *image)
+{
+	ArtEntry *entry;
+	gsize size;
+
+	size = sizeof (ArtEntry) + strlen (uri) + 1 + g_bytes_get_size (image);
+	if (size > art_budget) {
+		g_bytes_unref (image);
+
+		return;
+	}
+
+	while (art_bytes + size > art_budget && art_lru.tail != NULL)
+		g_hash_table_remove (art_table,
+				     ((ArtEntry *) art_lru.tail->data)->uri);
+
+	entry = g_slice_new (ArtEntry);
+	entry->uri = g_strdup (uri);
+	entry->image = image;
+	entry->size = size;
+	g_queue_push_head (&art_lru, entry);
+	entry->lru_link = art_lru.head;
+	art_bytes += size;
+	mem_alloc (MEM_ARTWORK, size);
+
+	g_hash_table_replace (art_table, entry->uri, entry);
+}
+
+/* Runs on an art_pool thread */
+static void
+art_fetch_job (gpointer data,
+               gpointer user_data)
+{
+	ArtJob *job = (ArtJob *) data;
+	ArtPending *pending;
+	ArtDelivery *delivery;
+	GBytes *image, *downloaded = NULL;
+	char *etag, *new_etag = NULL;
+	gboolean fresh;
+	gint64 start = trace_begin ();
+	guint status;
+
+	/* A visible request queues a second job for the same URI.  A job
+	 * whose host is busy waits there instead of holding a thread that
+	 * another server's image could use. */
+	g_mutex_lock (&art_lock);
+	pending = g_hash_table_lookup (art_pending, job->uri);
+	if (pending == NULL || pending->running) {
+		art_host_kick (job->uri, FALSE);
+		g_mutex_unlock (&art_lock);
+		art_job_free (job);
+
+		return;
+	}
+	if (!art_host_acquire (job)) {
+		g_mutex_unlock (&art_lock);
+
+		return;
+	}
+	pending->running = TRUE;
+	g_mutex_unlock (&art_lock);
+
+	image = art_disk_load (job->uri, &etag, &fresh);
+	if (image != NULL && fresh)
+		g_atomic_int_inc (&art_disk_hits);
+	else {
+		status = art_download (job->uri, etag, &downloaded, &new_etag);
+		if (status == SOUP_STATUS_OK) {
+			g_atomic_int_inc (&art_downloads);
+			art_disk_store (job->uri, downloaded, new_etag);
+			if (image != NULL)
+				g_bytes_unref (image);
+			image = downloaded;
+		} else if (status == SOUP_STATUS_NOT_MODIFIED && image != NULL) {
+			g_atomic_int_inc (&art_not_modified);
+			art_disk_store (job->uri, NULL, etag);
+		} else {
+			/* A stale image beats none */
+			g_atomic_int_inc (&art_failures);
+			if (image == NULL)
+				g_warning ("Could not fetch artwork %s: %u",
+					   job->uri,
+					   status);
+		}
+	}
+	trace_complete ("art fetch", job->uri, start);
+
+	delivery = g_slice_new (ArtDelivery);
+	delivery->uri = job->uri;
+	delivery->image = image;
+
+	g_mutex_lock (&art_lock);
+	pending = g_hash_table_lookup (art_pending, job->uri);
+	delivery->waiters = pending->waiters;
+	pending->waiters = NULL;
+	g_hash_table_remove (art_pending, job->uri);
+	if (image != NULL)
+		art_remember (job->uri, g_bytes_ref (image));
+	art_host_kick (job->uri, TRUE);
+	g_mutex_unlock (&art_lock);
+
+	if (delivery->waiters != NULL)
+		main_invoke (art_deliver_cb, delivery);
+	else
+		art_deliver_cb (delivery);
+
+	g_free (etag);
+	g_free (new_etag);
+	g_slice_free (ArtJob, job);
+}
+
+static void
+art_pending_free (ArtPending *pending)
+{
+	g_slice_free (ArtPending, pending);
+}
+
+/* Fetches the image at @uri unless it is in memory already.  @func, if
+ * any, runs on the main thread, or right away for an image in memory.
+ * Asking again while the download is queued joins it, a visible
+ * request moves it up the queue. */
+static void
+art_request (const char  *uri,
+             ArtPriority  priority,
+             ArtFunc      func,
+             gpointer     user_data)
+{
+	ArtEntry *entry;
+	ArtPending *pending;
+	GBytes *image = NULL;
+
+	if (uri == NULL || art_pool == NULL) {
+		if (func != NULL)
+			func (uri, NULL, user_data);
+
+		return;
+	}
+
+	g_mutex_lock (&art_lock);
+	entry = g_hash_table_lookup (art_table, uri);
+	if (entry != NULL) {
+		g_atomic_int_inc (&art_hits);
+		g_queue_unlink (&art_lru, entry->lru_link);
+		g_queue_push_head_link (&art_lru, entry->lru_link);
+		image = g_bytes_ref (entry->image);
+	} else {
+		pending = g_hash_table_lookup (art_pending, uri);
+		if (pending == NULL) {
+			pending = g_slice_new0 (ArtPending);
+			pending->priority = priority;
+			g_hash_table_insert (art_pending, g_strdup (uri), pending);
+			art_queue_job (uri, priority);
+		} else if (priority > pending->priority && !pending->running) {
+			pending->priority = priority;
+			art_queue_job (uri, priority);
+		}
+
+		if (func != NULL) {
+			ArtWaiter *waiter = g_slice_new (ArtWaiter);
+
+			waiter->func = func;
+			waiter->user_data = user_data;
+			pending->waiters = g_slist_prepend (pending->waiters,
+							    waiter);
+		}
+	}
+	g_mutex_unlock (&art_lock);
+
+	if (image != NULL) {
+		if (func != NULL)
+			func (uri, image, user_data);
+		g_bytes_unref (image);
+	}
+}
+
+/* art_wait () and the waiter it leaves behind if it gives up */
+typedef struct
+{
+	GMutex lock;
+	GCond cond;
+	GBytes *image;
+	gboolean done;
+	gint ref_count;
+} ArtWait;
+
+static void
+art_wait_unref (ArtWait *wait)
+{
+	if (!g_atomic_int_dec_and_test (&wait->ref_count))
+		return;
+
+	if (wait->image != NULL)
+		g_bytes_unref (wait->image);
+	g_mutex_clear (&wait->lock);
+	g_cond_clear (&wait->cond);
+	g_slice_free (ArtWait, wait);
+}
+
+static void
+art_wait_cb (const char *uri,
+             GBytes     *image,
+             gpointer    user_data)
+{
+	ArtWait *wait = (ArtWait *) user_data;
+
+	g_mutex_lock (&wait->lock);
+	wait->image = image ? g_bytes_ref (image) : NULL;
+	wait->done = TRUE;
+	g_cond_signal (&wait->cond);
+	g_mutex_unlock (&wait->lock);
+
+	art_wait_unref (wait);
+}
+
+/* Fetches @uri as a visible image and waits at most
+ * ART_TIMEOUT_SECONDS for it, not to be called on the main thread */
+static GBytes *
+art_wait (const char *uri)
+{
+	ArtWait *wait;
+	GBytes *image;
+	gint64 deadline;
+
+	wait = g_slice_new0 (ArtWait);
+	g_mutex_init (&wait->lock);
+	g_cond_init (&wait->cond);
+	wait->ref_count = 2;
+
+	art_request (uri, ART_VISIBLE, art_wait_cb, wait);
+
+	deadline = g_get_monotonic_time () +
+		(gint64) ART_TIMEOUT_SECONDS * G_USEC_PER_SEC;
+	g_mutex_lock (&wait->lock);
+	while (!wait->done)
+		if (!g_cond_wait_until (&wait->cond, &wait->lock, deadline))
+			break;
+	image = wait->image ? g_bytes_ref (wait->image) : NULL;
+	g_mutex_unlock (&wait->lock);
+
+	art_wait_unref (wait);
+
+	return image;
+}
+
+static gboolean
+art_init (void)
+{
+	if (art_dir == NULL)
+		art_dir = g_build_filename (g_get_user_cache_dir (),
+					    "dlna-control-point",
+					    "art",
+					    NULL);
+	if (g_mkdir_with_parents (art_dir, 0700) < 0) {
+		g_warning ("Could not create artwork cache %s: %s",
+			   art_dir,
+			   g_strerror (errno));
+
+		return FALSE;
+	}
+
+	art_budget = (gsize) MAX (art_cache_kib, 0) * 1024;
+	art_threads = MAX (art_threads, 1);
+	art_table = g_hash_table_new_full (g_str_hash,
+					   g_str_equal,
+					   NULL,
+					   (GDestroyNotify) art_entry_free);
+	art_pending = g_hash_table_new_full (g_str_hash,
+					     g_str_equal,
+					     g_free,
+					     (GDestroyNotify) art_pending_free);
+	art_hosts = g_hash_table_new_full (g_str_hash,
+					   g_str_equal,
+					   g_free,
+					   (GDestroyNotify) art_host_free);
+
+	/* art_host_acquire () keeps to the same limit per server */
+	art_session = soup_session_new_with_options
+		(SOUP_SESSION_MAX_CONNS, art_threads,
+		 SOUP_SESSION_MAX_CONNS_PER_HOST, ART_DOWNLOADS_PER_HOST,
+		 SOUP_SESSION_TIMEOUT, ART_TIMEOUT_SECONDS,
+		 NULL);
+
+	art_pool = g_thread_pool_new (art_fetch_job,
+				      NULL,
+				      art_threads,
+				      FALSE,
+				      NULL);
+	g_thread_pool_set_sort_function (art_pool, art_job_compare, NULL);
+
+	return TRUE;
+}
+
+typedef struct
+{
+	const char *udn;
+	GUPnPServiceProxy *content_dir;
+} ServerLookup;
+
+static gboolean
+server_lookup_cb (gpointer user_data)
+{
+	ServerLookup *lookup = (ServerLookup *) user_data;
+	MediaServers *server;
+
+	server = g_hash_table_lookup (server_table, lookup->udn);
+	if (server != NULL)
+		lookup->content_dir = g_object_ref (server->content_dir);
+
+	return FALSE;
+}
+
+/* A reference to the ContentDirectory of @udn, NULL if there is no
+ * such server */
+static GUPnPServiceProxy *
+server_ref_content_dir (const char *udn)
+{
+	ServerLookup lookup;
+
+	lookup.udn = udn;
+	lookup.content_dir = NULL;
+	main_call (server_lookup_cb, &lookup);
+
+	return lookup.content_dir;
+}
+
+/* What the user and RPC threads get to see of a cached object.  The
+ * cache belongs to the main loop, they take copies through
+ * cache_copy (). */
+typedef struct
+{
+	const char *udn;
+	const char *id;
+
+	/* Set if the object is cached */
+	gboolean found;
+	char *parent_id;
+	char *class;
+	char *uri;
+	char *metadata;
+	FilterProfile detail;
+} CacheCopy;
+
+static gboolean
+cache_copy_cb (gpointer user_data)
+{
+	CacheCopy *copy = (CacheCopy *) user_data;
+	Container *c;
+
+	c = browse_lookup (copy->udn, copy->id);
+	if (c == NULL)
+		return FALSE;
+
+	copy->found = TRUE;
+	copy->parent_id = g_strdup (c->parent_id);
+	copy->class = g_strdup (c->class);
+	copy->uri = g_strdup (c->uri);
+	copy->metadata = container_metadata (copy->id, c);
+	copy->detail = c->detail;
+
+	return FALSE;
+}
+
+/* Returns FALSE if @id of @udn is not cached, free @copy with
+ * cache_copy_clear () either way */
+static gboolean
+cache_copy (const char *udn,
+            const char *id,
+            CacheCopy  *copy)
+{
+	memset (copy, 0, sizeof (CacheCopy));
+	copy->udn = udn;
+	copy->id = id;
+	main_call (cache_copy_cb, copy);
+
+	return copy->found;
+}
+
+static void
+cache_copy_clear (CacheCopy *copy)
+{
+	g_free (copy->parent_id);
+	g_free (copy->class);
+	g_free (copy->uri);
+	g_free (copy->metadata);
+}
+
+typedef struct
+{
+	const char *udn;
+	const char *id;
+
+	GString *text;
+	guint shown;
+} CacheListing;
+
+static gboolean
+cache_list_children_cb (gpointer user_data)
+{
+	CacheListing *listing = (CacheListing *) user_data;
+	CachedContainer *entry;
+	char *key;
+	guint i;
+
+	key = browse_object_key (listing->udn, listing->id);
+	entry = g_hash_table_lookup (browsed_table, key);
+	g_free (key);
+	if (entry == NULL)
+		return FALSE;
+
+	for (i = 0; i < entry->children->len; i++) {
+		const char *id = g_ptr_array_index (entry->children, i);
+		Container *c;
+
+		c = browse_lookup (entry->udn, id);
+		if (c == NULL || c->owner != entry)
+			continue;
+
+		g_string_append_printf (listing->text,
+					"  %u . %s->id:%s\n",
+					++listing->shown,
+					c->title ? c->title : "",
+					id);
+		art_request (c->art_uri, ART_VISIBLE, NULL, NULL);
+	}
+
+	return FALSE;
+}
+
+/* Prints the cached children of @id on @udn the way the menus list
+ * them and returns how many there are */
+static guint
+cache_print_children (const char *udn,
+                      const char *id)
+{
+	CacheListing listing;
+
+	listing.udn = udn;
+	listing.id = id;
+	listing.text = g_string_new (NULL);
+	listing.shown = 0;
+	main_call (cache_list_children_cb, &listing);
+
+	fputs (listing.text->str, stdout);
+	g_string_free (listing.text, TRUE);
+
+	return listing.shown;
+}
+
+typedef struct
+{
+	GString *text;
+	guint servers;
+	guint renderers;
+} ServerListing;
+
+/* Lists server_table on the main loop, which adds and frees servers */
+static gboolean
+server_list_cb (gpointer user_data)
+{
+	ServerListing *listing = (ServerListing *) user_data;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init (&iter, server_table);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		MediaServers *s = (MediaServers *) value;
+
+		listing->servers++;
+		if (listing->text != NULL)
+			g_string_append_printf (listing->text,
+						"%u . %s->%s\n",
+						listing->servers,
+						s->friendly_name,
+						(const char *) key);
+	}
+
+	g_mutex_lock (&renderer_state_lock);
+	listing->renderers = g_hash_table_size (renderer_table);
+	g_mutex_unlock (&renderer_state_lock);
+
+	return FALSE;
+}
+
+/* Whether any server or renderer was found yet */
+static gboolean
+server_any_known (void)
+{
+	ServerListing listing;
+
+	memset (&listing, 0, sizeof (ServerListing));
+	main_call (server_list_cb, &listing);
+
+	return listing.servers != 0 || listing.renderers != 0;
+}
+
+/* Prints the known servers the way the menu lists them, the UDN typed
+ * in is looked up again when it is used */
+static void
+server_print_list (void)
+{
+	ServerListing listing;
+
+	memset (&listing, 0, sizeof (ServerListing));
+	listing.text = g_string_new (NULL);
+	main_call (server_list_cb, &listing);
+
+	fputs (listing.text->str, stdout);
+	g_string_free (listing.text, TRUE);
+}
+
+/* Copies of the same track on different servers in browse_table, found
+ * in one pass by duplicates_scan () */
+typedef struct
+{
+	/* Objects with a fingerprint, distinct fingerprints, fingerprints
+	 * on more than one server, and the copies that are not the
+	 * preferred one with what they take in the cache */
+	guint objects;
+	guint tracks;
+	guint groups;
+	guint duplicates;
+	gsize bytes;
+
+	/* Fingerprint -> browse_table key of the preferred copy */
+	FingerprintSet *preferred;
+	/* Fingerprint -> GUINT_TO_POINTER (number of copies), groups only */
+	FingerprintSet *copies;
+} DuplicateScan;
+
+static void
+duplicates_scan (DuplicateScan *scan)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	memset (scan, 0, sizeof (DuplicateScan));
+	scan->preferred = fingerprint_set_new (g_hash_table_size (browse_table));
+	scan->copies = fingerprint_set_new (0);
+
+	g_hash_table_iter_init (&iter, browse_table);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		Container *c = (Container *) value;
+		Container *kept;
+		gpointer *preferred, *copies;
+
+		if (c->fingerprint == 0 || c->owner == NULL)
+			continue;
+
+		scan->objects++;
+		preferred = fingerprint_set_slot (scan->preferred,
+						  c->fingerprint);
+		if (*preferred == NULL) {
+			*preferred = key;
+			continue;
+		}
+
+		/* One server listing a track under Albums and Artists is
+		 * not a duplicate */
+		kept = g_hash_table_lookup (browse_table, *preferred);
+		if (!strcmp (c->owner->udn, kept->owner->udn))
+			continue;
+
+		copies = fingerprint_set_slot (scan->copies, c->fingerprint);
+		*copies = GUINT_TO_POINTER (MAX (GPOINTER_TO_UINT (*copies), 1) + 1);
+		scan->duplicates++;
+
+		if (device_health_prefer (c->owner->udn, kept->owner->udn)) {
+			scan->bytes += kept->size;
+			*preferred = key;
+		} else
+			scan->bytes += c->size;
+	}
+
+	scan->tracks = scan->preferred->count;
+	scan->groups = scan->copies->count;
+}
+
+static void
+duplicates_scan_clear (DuplicateScan *scan)
+{
+	fingerprint_set_free (scan->preferred);
+	fingerprint_set_free (scan->copies);
+}
+
+static const char *
+server_friendly_name (const char *udn)
+{
+	MediaServers *s;
+
+	s = g_hash_table_lookup (server_table, udn);
+
+	return s != NULL ? s->friendly_name : "(gone)";
+}
+
+typedef struct
+{
+	guint limit;
+	GString *text;
+} DuplicateListing;
+
+/* Scans browse_table and writes the report on the main loop */
+static gboolean
+duplicates_list_cb (gpointer user_data)
+{
+	DuplicateListing *listing = (DuplicateListing *) user_data;
+	DuplicateScan scan;
+	guint64 fingerprint;
+	gpointer value;
+	guint limit = listing->limit;
+	gsize i = 0;
+
+	duplicates_scan (&scan);
+	g_string_append_printf (listing->text,
+	       "%u tracks in %u objects, %u on several servers with %u extra "
+	       "copies taking %" G_GSIZE_FORMAT " bytes\n",
+	       scan.tracks,
+	       scan.objects,
+	       scan.groups,
+	       scan.duplicates,
+	       scan.bytes);
+
+	while (limit > 0 &&
+	       fingerprint_set_next (scan.copies, &i, &fingerprint, &value)) {
+		const char *id;
+		Container *c;
+
+		id = fingerprint_set_lookup (scan.preferred, fingerprint);
+		c = g_hash_table_lookup (browse_table, id);
+		g_string_append_printf (listing->text,
+		       "  %s - %s: %u copies, playing from %s->id:%s\n",
+		       c->artist ? c->artist : "?",
+		       c->title,
+		       GPOINTER_TO_UINT (value),
+		       server_friendly_name (c->owner->udn),
+		       browse_key_id (id, c));
+		limit--;
+	}
+
+	duplicates_scan_clear (&scan);
+
+	return FALSE;
+}
+
+/* Prints what duplicates_scan () found and at most @limit groups */
+static void
+print_duplicates (guint limit)
+{
+	DuplicateListing listing;
+
+	listing.limit = limit;
+	listing.text = g_string_new (NULL);
+	main_call (duplicates_list_cb, &listing);
+
+	fputs (listing.text->str, stdout);
+	g_string_free (listing.text, TRUE);
+}
+
+static void
+print_watchdog_stats (void)
+{
+	WatchdogSnapshot snapshot;
+	gint64 now = g_get_real_time ();
+	guint i;
+
+	if (watchdog_thread == NULL) {
+		puts("Main loop watchdog is off, start with --stall-threshold");
+
+		return;
+	}
+
+	watchdog_snapshot (&snapshot);
+	printf("Main loop: %" G_GUINT64_FORMAT " probes, dispatch latency "
+	       "p50 < %d ms, p99 < %d ms, max %.1f ms, %u stalls\n",
+	       snapshot.probes,
+	       watchdog_percentile (snapshot.histogram, snapshot.probes, 50),
+	       watchdog_percentile (snapshot.histogram, snapshot.probes, 99),
+	       snapshot.max_lag / 1000.0,
+	       snapshot.stall_count);
+	for (i = 0; i < snapshot.n_stalls; i++)
+		printf("  %.1f ms in %s, %d s ago\n",
+		       snapshot.stalls[i].duration / 1000.0,
+		       snapshot.stalls[i].what,
+		       (int) ((now - snapshot.stalls[i].start) /
+			      G_USEC_PER_SEC));
+}
+
+static void
+print_memory_stats (void)
+{
+	MemoryStats stats;
+	GHashTableIter iter;
+	gpointer key, value;
+	int i;
+
+	memory_stats_collect (&stats);
+	printf("Device tables: %u servers, %u renderers, %" G_GSIZE_FORMAT " bytes\n",
+	       stats.servers,
+	       stats.renderers,
+	       stats.device_bytes);
+	printf("Browse cache: %u objects, %" G_GSIZE_FORMAT " bytes",
+	       stats.objects,
+	       stats.cache_bytes);
+	if (cache_budget != 0)
+		printf(" of %" G_GSIZE_FORMAT "\n", cache_budget);
+	else
+		printf(", unlimited\n");
+
+	g_hash_table_iter_init (&iter, stats.per_server);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		ServerCacheStats *server = (ServerCacheStats *) value;
+
+		printf("  %s->%s: %u containers, %u objects, %" G_GSIZE_FORMAT " bytes\n",
+		       server->name ? server->name : "(gone)",
+		       (const char *) key,
+		       server->containers,
+		       server->objects,
+		       server->bytes);
+	}
+	memory_stats_clear (&stats);
+
+	if (alloc_stats) {
+		MemSnapshot snapshots[N_MEM_TAGS];
+
+		mem_snapshot (snapshots);
+		printf("%-14s %12s %8s %12s %10s\n",
+		       "Subsystem", "Live bytes", "Blocks", "Peak bytes", "Allocs/s");
+		for (i = 0; i < N_MEM_TAGS; i++)
+			printf("%-14s %12" G_GSSIZE_FORMAT " %8" G_GSSIZE_FORMAT
+			       " %12" G_GSSIZE_FORMAT " %10.1f\n",
+			       mem_tag_names[i],
+			       snapshots[i].counters.live_bytes,
+			       snapshots[i].counters.live_blocks,
+			       snapshots[i].counters.peak_bytes,
+			       snapshots[i].alloc_rate);
+	} else
+		puts("Allocation accounting is off, start with --alloc-stats");
+
+	printf("Discovery: %d fetched, %d ignored, %d duplicates, %d delayed\n",
+	       g_atomic_int_get (&discovery_fetched),
+	       g_atomic_int_get (&discovery_ignored),
+	       g_atomic_int_get (&discovery_duplicates),
+	       g_atomic_int_get (&discovery_delayed));
+	for (i = 0; i < N_FILTER_PROFILES; i++)
+		printf("Filter %-8s %12" G_GSIZE_FORMAT " DIDL bytes for %"
+		       G_GSIZE_FORMAT " objects\n",
+		       filter_profile_names[i],
+		       (gsize) g_atomic_pointer_get (&filter_bytes[i]),
+		       (gsize) g_atomic_pointer_get (&filter_objects[i]));
+	printf("Hydration: %d objects in %d requests\n",
+	       g_atomic_int_get (&hydrate_objects),
+	       g_atomic_int_get (&hydrate_requests));
+	printf("Album art: %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " bytes, "
+	       "%d hits, %d from disk, %d downloads, %d not modified, %d failed\n",
+	       art_bytes,
+	       art_budget,
+	       g_atomic_int_get (&art_hits),
+	       g_atomic_int_get (&art_disk_hits),
+	       g_atomic_int_get (&art_downloads),
+	       g_atomic_int_get (&art_not_modified),
+	       g_atomic_int_get (&art_failures));
+	print_watchdog_stats ();
+}
+
+/* The fields of a DIDL-Lite object the tool uses.  Strings belong to the
+ * parser and are only valid during the callback. */
+typedef struct
+{
+	char *id;
+	char *parent_id;
+	char *title;
+	char *upnp_class;
+	char *artist;
+	char *album;
+	char *art_uri;
+	char *uri;
+	char *protocol_info;
+	char *duration;
+	char *res_size;
+	char *fragment;
+	gboolean is_container;
+} DidlObject;
+
+typedef void (* DidlObjectFunc) (DidlObject *object,
+                                 gpointer    user_data);
+
+#define DIDL_PARSE_OPTIONS (XML_PARSE_NONET | XML_PARSE_COMPACT | \
+                            XML_PARSE_NOCDATA | XML_PARSE_HUGE)
+
+/* One reader per thread, reset for every page instead of rebuilt */
+static GPrivate didl_reader_key = G_PRIVATE_INIT ((GDestroyNotify) xmlFreeTextReader);
+
+static void
+didl_object_clear (DidlObject *object)
+{
+	xmlFree (object->id);
+	xmlFree (object->parent_id);
+	xmlFree (object->title);
+	xmlFree (object->upnp_class);
+	xmlFree (object->artist);
+	xmlFree (object->album);
+	xmlFree (object->art_uri);
+	xmlFree (object->uri);
+	xmlFree (object->protocol_info);
+	xmlFree (object->duration);
+	xmlFree (object->res_size);
+	xmlFree (object->fragment);
+	memset (object, 0, sizeof (DidlObject));
+}
+
+/* Streams through @didl and calls @func for every item and container.
+ * Only id, parentID, dc:title, upnp:class, the artist, upnp:album, the
+ * album art and the first res are looked at, nothing is built for the
+ * rest of the document.  With @keep_markup items also keep their
+ * markup, to be handed to a renderer as they are; only worth it for
+ * items about to be played. */
+static gboolean
+didl_parse (const char     *didl,
+            gsize           length,
+            gboolean        keep_markup,
+            DidlObjectFunc  func,
+            gpointer        user_data,
+            GError        **error)
+{
+	xmlTextReaderPtr reader;
+	DidlObject object;
+	int object_depth = -1;
+	int ret;
+
+	reader = g_private_get (&didl_reader_key);
+	if (reader == NULL) {
+		reader = xmlReaderForMemory (didl, length, NULL, NULL,
+					     DIDL_PARSE_OPTIONS);
+		g_private_set (&didl_reader_key, reader);
+	} else if (xmlReaderNewMemory (reader, didl, length, NULL, NULL,
+				       DIDL_PARSE_OPTIONS) < 0)
+		reader = NULL;
+
+	if (reader == NULL) {
+		g_set_error_literal (error,
+				     G_MARKUP_ERROR,
+				     G_MARKUP_ERROR_PARSE,
+				     "Could not create DIDL-Lite reader");
+
+		return FALSE;
+	}
+
+	memset (&object, 0, sizeof (DidlObject));
+
+	while ((ret = xmlTextReaderRead (reader)) == 1) {
+		const char *name;
+		int type, depth;
+
+		type = xmlTextReaderNodeType (reader);
+		if (type != XML_READER_TYPE_ELEMENT &&
+		    type != XML_READER_TYPE_END_ELEMENT)
+			continue;
+
+		name = (const char *) xmlTextReaderConstLocalName (reader);
+		depth = xmlTextReaderDepth (reader);
+
+		if (object_depth < 0) {
+			if (type != XML_READER_TYPE_ELEMENT ||
+			    (strcmp (name, "item") && strcmp (name, "container")))
+				continue;
+
+			object_depth = depth;
+			object.is_container = name[0] == 'c';
+			object.id = (char *) xmlTextReaderGetAttribute
+				(reader, BAD_CAST "id");
+			object.parent_id = (char *) xmlTextReaderGetAttribute
+				(reader, BAD_CAST "parentID");
+			if (keep_markup && !object.is_container)
+				object.fragment = (char *)
+					xmlTextReaderReadOuterXml (reader);
+
+			if (!xmlTextReaderIsEmptyElement (reader))
+				continue;
+		} else if (type == XML_READER_TYPE_ELEMENT) {
+			/* Only direct children, whatever hides in desc is
+			 * vendor specific */
+			if (depth != object_depth + 1)
+				continue;
+
+			if (object.title == NULL && !strcmp (name, "title"))
+				object.title = (char *) xmlTextReaderReadString
+					(reader);
+			else if (object.upnp_class == NULL &&
+				 !strcmp (name, "class"))
+				object.upnp_class = (char *) xmlTextReaderReadString
+					(reader);
+			else if (object.artist == NULL &&
+				 (!strcmp (name, "artist") ||
+				  !strcmp (name, "creator")))
+				object.artist = (char *) xmlTextReaderReadString
+					(reader);
+			else if (object.album == NULL && !strcmp (name, "album"))
+				object.album = (char *) xmlTextReaderReadString
+					(reader);
+			else if (!strcmp (name, "albumArtURI")) {
+				/* Beats any thumbnail res */
+				xmlFree (object.art_uri);
+				object.art_uri = (char *) xmlTextReaderReadString
+					(reader);
+			} else if (object.uri == NULL && !strcmp (name, "res")) {
+				object.protocol_info = (char *)
+					xmlTextReaderGetAttribute
+						(reader, BAD_CAST "protocolInfo");
+				object.duration = (char *)
+					xmlTextReaderGetAttribute
+						(reader, BAD_CAST "duration");
+				object.res_size = (char *)
+					xmlTextReaderGetAttribute
+						(reader, BAD_CAST "size");
+				object.uri = (char *) xmlTextReaderReadString
+					(reader);
+			} else if (object.art_uri == NULL &&
+				   !strcmp (name, "res")) {
+				xmlChar *info;
+
+				info = xmlTextReaderGetAttribute
+					(reader, BAD_CAST "protocolInfo");
+				if (info != NULL &&
+				    (strstr ((char *) info, "DLNA.ORG_PN=JPEG_TN") ||
+				     strstr ((char *) info, "DLNA.ORG_PN=PNG_TN")))
+					object.art_uri = (char *)
+						xmlTextReaderReadString (reader);
+				xmlFree (info);
+			}
+
+			continue;
+		} else if (depth != object_depth)
+			continue;
+
+		/* End of an item or container */
+		if (object.id != NULL)
+			func (&object, user_data);
+		didl_object_clear (&object);
+		object_depth = -1;
+	}
+
+	didl_object_clear (&object);
+
+	if (ret < 0) {
+		g_set_error_literal (error,
+				     G_MARKUP_ERROR,
+				     G_MARKUP_ERROR_PARSE,
+				     "Malformed DIDL-Lite");
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+didl_first_title_cb (DidlObject *object,
+                     gpointer    user_data)
+{
+	char **title = (char **) user_data;
+
+	if (*title == NULL)
+		*title = g_strdup (object->title);
+}
+
+/* The title of the first object in @didl, or NULL */
+static char *
+didl_first_title (const char *didl)
+{
+	char *title = NULL;
+
+	didl_parse (didl, strlen (didl), FALSE, didl_first_title_cb, &title, NULL);
+
+	return title;
+}
+
+/* One Browse answer on its way through didl_pool: the Result goes in,
+ * ready-made Containers come out */
+typedef struct
+{
+	BrowseData *data;
+
+	char *didl_xml;
+	guint32 number_returned;
+	guint32 total_matches;
+
+	/* ids[i] is the object id of objects[i] */
+	GPtrArray *ids;
+	GPtrArray *objects;
+	GError *error;
+} DidlBatch;
+
+/* Runs on a didl_pool thread, must not touch the object store */
+static void
+on_didl_object_available (DidlObject *object,
+                          gpointer    user_data)
+{
+        DidlBatch    *batch;
+	char *id;
+
+	batch = (DidlBatch *) user_data;
+
+	Container *c = (Container*)malloc(sizeof(Container));
+
+	c->owner = NULL;
+	
+	c->title = g_strdup(object->title);
+	c->parent_id = g_strdup(object->parent_id);
+	c->class = g_strdup(object->upnp_class);
+	c->artist = g_strdup(object->artist);
+	c->album = g_strdup(object->album);
+	c->art_uri = g_strdup(object->art_uri);
+	c->uri = g_strdup(object->uri);
+	c->protocol_info = g_strdup(object->protocol_info);
+	c->detail = batch->data->profile;
+	if (object->uri != NULL)
+		c->detail = MAX (c->detail, FILTER_PLAYBACK);
+	/* A title alone would make every "Intro" the same track */
+	c->fingerprint = c->detail >= FILTER_PLAYBACK ?
+		container_fingerprint (c, object->duration, object->res_size) :
+		0;
+
+	id = g_strdup(object->id);
+	c->size = container_size (id, c);
+	mem_alloc (MEM_DIDL_PARSE, c->size);
+
+	g_ptr_array_add (batch->ids, id);
+	g_ptr_array_add (batch->objects, c);
+	
+        return;
+}
+
+/* Moves a parsed page into browse_table and the cache in one go and
+ * wakes up whoever asked for it */
+static gboolean
+didl_batch_commit (gpointer user_data)
+{
+	DidlBatch *batch = (DidlBatch *) user_data;
+	BrowseData *data = batch->data;
+	gint64 start = trace_begin ();
+	guint i;
+
+	data->cache = cache_begin_browse (data->content_dir, data->id);
+
+	for (i = 0; i < batch->objects->len; i++) {
+		Container *c = g_ptr_array_index (batch->objects, i);
+		char *id = g_ptr_array_index (batch->ids, i);
+
+		mem_free (MEM_DIDL_PARSE, c->size);
+		/* The key has the UDN in front of the id */
+		c->size += strlen (data->cache->udn) + 1;
+
+		c->owner = data->cache;
+		c->owner->bytes += c->size;
+		art_known_ref (c->art_uri);
+		cache_bytes += c->size;
+		mem_alloc (MEM_BROWSE_CACHE, c->size);
+		g_ptr_array_add (c->owner->children, id);
+
+		g_hash_table_insert (browse_table,
+				     browse_object_key (c->owner->udn, id),
+				     c);
+	}
+	browse_generation++;
+
+	if (batch->error != NULL) {
+		g_warning ("Error while browsing %s: %s",
+			   data->id,
+			   batch->error->message);
+		g_error_free (batch->error);
+	} else
+		data->cache->complete = TRUE;
+
+	cache_enforce_budget (data->cache);
+	trace_complete ("didl commit", data->id, start);
+	sem_post(&browse_sem);
+
+	/* The cache owns the ids and objects now */
+	g_ptr_array_free (batch->ids, TRUE);
+	g_ptr_array_free (batch->objects, TRUE);
+	browse_data_free (data);
+	g_slice_free (DidlBatch, batch);
+	mem_free (MEM_DIDL_PARSE, sizeof (DidlBatch));
+
+	return FALSE;
+}
+
+static gboolean aggregate_commit (gpointer user_data);
+static void aggregate_browse_done (BrowseData *data);
+static gboolean hydrate_commit (gpointer user_data);
+static void hydrate_browse_done (BrowseData *data);
+
+static void
+didl_batch_parse (gpointer job,
+                  gpointer user_data)
+{
+	DidlBatch *batch = (DidlBatch *) job;
+	gint64 start = trace_begin ();
+	gsize length = strlen (batch->didl_xml);
+
+	/* Only try to parse DIDL if server claims that there was a
+	 * result */
+	if (batch->number_returned > 0)
+		didl_parse (batch->didl_xml,
+			    length,
+			    FALSE,
+			    on_didl_object_available,
+			    batch,
+			    &batch->error);
+
+	g_free (batch->didl_xml);
+	batch->didl_xml = NULL;
+	mem_free (MEM_DIDL_PARSE, length + 1);
+	trace_complete ("didl parse", batch->data->id, start);
+
+	g_atomic_pointer_add (&filter_bytes[batch->data->profile], length);
+	g_atomic_pointer_add (&filter_objects[batch->data->profile],
+			      batch->objects->len);
+
+	if (batch->data->aggregate != NULL)
+		message_post (main_messages, aggregate_commit, batch);
+	else if (batch->data->hydrate != NULL)
+		message_post (main_messages, hydrate_commit, batch);
+	else
+		message_post (main_messages, didl_batch_commit, batch);
+}
+
+static void
+browse_cb (GUPnPServiceProxy       *content_dir,
+           GUPnPServiceProxyAction *action,
+           gpointer                 user_data)
+{
+	BrowseData *data;
+        char       *didl_xml;
+        guint32     number_returned;
+        guint32     total_matches;
+        GError     *error;
+
+        data = (BrowseData *) user_data;
+        didl_xml = NULL;
+        error = NULL;
+
+        action_end (content_dir,
+                    action,
+                    &error,
+                    /* OUT args */
+                    "Result",
+                    G_TYPE_STRING,
+                    &didl_xml,
+                    "NumberReturned",
+                    G_TYPE_UINT,
+                    &number_returned,
+                    "TotalMatches",
+                    G_TYPE_UINT,
+                    &total_matches,
+                    NULL);
+        if (didl_xml) {
+                DidlBatch *batch;
+
+                /* Parsing a large page here would hold up discovery and
+                 * transport commands, the pool hands it back when done */
+                batch = g_slice_new0 (DidlBatch);
+                mem_alloc (MEM_DIDL_PARSE, sizeof (DidlBatch));
+                mem_alloc (MEM_DIDL_PARSE, strlen (didl_xml) + 1);
+                batch->data = data;
+                batch->didl_xml = didl_xml;
+                batch->number_returned = number_returned;
+                batch->total_matches = total_matches;
+                batch->ids = g_ptr_array_new ();
+                batch->objects = g_ptr_array_new ();
+
+                g_thread_pool_push (didl_pool, batch, NULL);
+
+                return;
+	}
+
+        g_warning ("Failed to browse '%s': %s",
+                   gupnp_service_info_get_location
+                        (GUPNP_SERVICE_INFO (content_dir)),
+                   error ? error->message : "no result");
+
+        g_clear_error (&error);
+
+        if (data->aggregate != NULL) {
+                aggregate_browse_done (data);
+
+                return;
+        }
+
+        if (data->hydrate != NULL) {
+                hydrate_browse_done (data);
+
+                return;
+        }
+
+	sem_post(&browse_sem);
+
+        browse_data_free (data);
+}
+
+
+static void
+browse_data_send (BrowseData *data,
+                  guint32     requested_count)
+{
+        action_begin
+		(data->content_dir,
+		 "Browse",
+		 browse_cb,
+		 data,
+		 /* IN args */
+		 "ObjectID",
+		 G_TYPE_STRING,
+		 data->id,
+		 "BrowseFlag",
+		 G_TYPE_STRING,
+		 "BrowseDirectChildren",
+		 "Filter",
+		 G_TYPE_STRING,
+		 filter_profile_filters[data->profile],
+		 "StartingIndex",
+		 G_TYPE_UINT,
+		 data->starting_index,
+		 "RequestedCount",
+		 G_TYPE_UINT,
+		 requested_count,
+		 "SortCriteria",
+		 G_TYPE_STRING,
+		 "",
+		 NULL);
+}
+
+/* Lazy detail.  cache_hydrate () fills in a profile for objects of
+ * browse_table that were listed with less: it looks up where they sit
+ * among their siblings and sends one Browse of the parent per run of
+ * at most HYDRATE_BATCH siblings, so the tracks of an album come in a
+ * single request.  hydrate_commit () merges the answers into the
+ * objects already cached. */
+#define HYDRATE_BATCH 32
+#define HYDRATE_TIMEOUT_SECONDS 10
+
+struct _Hydrate
+{
+	/* browse_table keys */
+	GPtrArray *ids;
+	FilterProfile profile;
+
+	GMutex lock;
+	GCond cond;
+	/* Browse requests on the wire, guarded by lock */
+	guint pending;
+	gboolean started;
+
+	gint ref_count;
+};
+
+static Hydrate *
+hydrate_ref (Hydrate *hydrate)
+{
+	g_atomic_int_inc (&hydrate->ref_count);
+
+	return hydrate;
+}
+
+static void
+hydrate_unref (Hydrate *hydrate)
+{
+	if (!g_atomic_int_dec_and_test (&hydrate->ref_count))
+		return;
+
+	g_ptr_array_unref (hydrate->ids);
+	g_mutex_clear (&hydrate->lock);
+	g_cond_clear (&hydrate->cond);
+	g_slice_free (Hydrate, hydrate);
+}
+
+/* Called once for every page hydrate_start_cb () asked for */
+static void
+hydrate_browse_done (BrowseData *data)
+{
+	Hydrate *hydrate = data->hydrate;
+
+	browse_data_free (data);
+
+	g_mutex_lock (&hydrate->lock);
+	hydrate->pending--;
+	g_cond_signal (&hydrate->cond);
+	g_mutex_unlock (&hydrate->lock);
+
+	hydrate_unref (hydrate);
+}
+
+static void
+hydrate_send (CachedContainer *owner,
+              Hydrate         *hydrate,
+              guint            first,
+              guint            last)
+{
+	MediaServers *server;
+	BrowseData *data;
+
+	server = g_hash_table_lookup (server_table, owner->udn);
+	if (server == NULL)
+		return;
+
+	g_mutex_lock (&hydrate->lock);
+	hydrate->pending++;
+	g_mutex_unlock (&hydrate->lock);
+
+	data = browse_data_new (server->content_dir, owner->id, first);
+	data->profile = hydrate->profile;
+	data->hydrate = hydrate_ref (hydrate);
+	browse_data_send (data, last - first + 1);
+	g_atomic_int_inc (&hydrate_requests);
+}
+
+static gboolean
+hydrate_start_cb (gpointer user_data)
+{
+	Hydrate *hydrate = (Hydrate *) user_data;
+	GHashTable *wanted, *owners;
+	GHashTableIter iter;
+	gpointer key;
+	guint i;
+
+	wanted = g_hash_table_new (NULL, NULL);
+	owners = g_hash_table_new (NULL, NULL);
+	for (i = 0; i < hydrate->ids->len; i++) {
+		char *key = g_ptr_array_index (hydrate->ids, i);
+		Container *c;
+
+		c = g_hash_table_lookup (browse_table, key);
+		if (c == NULL || c->owner == NULL ||
+		    c->detail >= hydrate->profile)
+			continue;
+
+		g_hash_table_add (wanted, c);
+		g_hash_table_add (owners, c->owner);
+	}
+
+	/* children is in the order of the server, indices are
+	 * StartingIndex */
+	g_hash_table_iter_init (&iter, owners);
+	while (g_hash_table_iter_next (&iter, &key, NULL)) {
+		CachedContainer *owner = (CachedContainer *) key;
+		gboolean in_run = FALSE;
+		guint first = 0, last = 0;
+
+		for (i = 0; i < owner->children->len; i++) {
+			if (!g_hash_table_contains
+				(wanted,
+				 browse_lookup (owner->udn,
+						g_ptr_array_index (owner->children,
+								   i))))
+				continue;
+
+			if (in_run && i - first >= HYDRATE_BATCH) {
+				hydrate_send (owner, hydrate, first, last);
+				in_run = FALSE;
+			}
+			if (!in_run)
+				first = i;
+			last = i;
+			in_run = TRUE;
+		}
+
+		if (in_run)
+			hydrate_send (owner, hydrate, first, last);
+	}
+
+	g_hash_table_destroy (wanted);
+	g_hash_table_destroy (owners);
+
+	g_mutex_lock (&hydrate->lock);
+	hydrate->started = TRUE;
+	g_cond_signal (&hydrate->cond);
+	g_mutex_unlock (&hydrate->lock);
+
+	hydrate_unref (hydrate);
+
+	return FALSE;
+}
+
+/* Fills in @profile for the browse_table objects @ids, waiting at most
+ * HYDRATE_TIMEOUT_SECONDS.  Not to be called on the main thread. */
+static void
+cache_hydrate (GPtrArray     *ids,
+               FilterProfile  profile)
+{
+	Hydrate *hydrate;
+	gint64 deadline, start = trace_begin ();
+	guint i;
+
+	if (ids->len == 0)
+		return;
+
+	hydrate = g_slice_new0 (Hydrate);
+	hydrate->ids = g_ptr_array_new_with_free_func (g_free);
+	for (i = 0; i < ids->len; i++)
+		g_ptr_array_add (hydrate->ids,
+				 g_strdup (g_ptr_array_index (ids, i)));
+	hydrate->profile = profile;
+	g_mutex_init (&hydrate->lock);
+	g_cond_init (&hydrate->cond);
+	hydrate->ref_count = 2;
+
+	main_invoke (hydrate_start_cb, hydrate);
+
+	deadline = g_get_monotonic_time () +
+		(gint64) HYDRATE_TIMEOUT_SECONDS * G_USEC_PER_SEC;
+	g_mutex_lock (&hydrate->lock);
+	while (!hydrate->started || hydrate->pending > 0)
+		if (!g_cond_wait_until (&hydrate->cond, &hydrate->lock, deadline))
+			break;
+	g_mutex_unlock (&hydrate->lock);
+
+	trace_complete ("hydrate", filter_profile_names[profile], start);
+	hydrate_unref (hydrate);
+}
+
+/* Moves what @fresh has beyond the listing into @c, keeping @c where
+ * it is in the cache */
+static void
+container_merge_detail (const char *key,
+                        Container  *c,
+                        Container  *fresh)
+{
+	gsize old_size = c->size;
+
+#define SWAP_FIELD(field) \
+	G_STMT_START { \
+		char *tmp = c->field; \
+		c->field = fresh->field; \
+		fresh->field = tmp; \
+	} G_STMT_END
+
+	art_known_ref (fresh->art_uri);
+	art_known_unref (c->art_uri);
+	SWAP_FIELD (artist);
+	SWAP_FIELD (album);
+	SWAP_FIELD (art_uri);
+	SWAP_FIELD (uri);
+	SWAP_FIELD (protocol_info);
+#undef SWAP_FIELD
+	c->fingerprint = fresh->fingerprint;
+	c->detail = fresh->detail;
+
+	c->size = container_size (key, c);
+	c->owner->bytes += c->size - old_size;
+	cache_bytes += c->size - old_size;
+	mem_free (MEM_BROWSE_CACHE, old_size);
+	mem_alloc (MEM_BROWSE_CACHE, c->size);
+}
+
+static gboolean
+hydrate_commit (gpointer user_data)
+{
+	DidlBatch *batch = (DidlBatch *) user_data;
+	BrowseData *data = batch->data;
+	const char *udn;
+	CachedContainer *owner = NULL;
+	gint64 start = trace_begin ();
+	guint i;
+
+	udn = gupnp_service_info_get_udn (GUPNP_SERVICE_INFO
+					  (data->content_dir));
+
+	for (i = 0; i < batch->objects->len; i++) {
+		Container *fresh = g_ptr_array_index (batch->objects, i);
+		char *id = g_ptr_array_index (batch->ids, i);
+		char *key;
+		Container *c;
+
+		mem_free (MEM_DIDL_PARSE, fresh->size);
+
+		/* Evicted or browsed again meanwhile */
+		key = browse_object_key (udn, id);
+		c = g_hash_table_lookup (browse_table, key);
+		if (c != NULL && c->owner != NULL &&
+		    c->detail < fresh->detail &&
+		    !g_strcmp0 (c->parent_id, data->id)) {
+			container_merge_detail (key, c, fresh);
+			owner = c->owner;
+			g_atomic_int_inc (&hydrate_objects);
+		}
+
+		container_free (fresh);
+		g_free (key);
+		g_free (id);
+	}
+
+	if (owner != NULL) {
+		/* Artists and albums to look playlists up by */
+		browse_generation++;
+		cache_enforce_budget (owner);
+	}
+
+	if (batch->error != NULL) {
+		g_warning ("Error while filling in %s: %s",
+			   data->id,
+			   batch->error->message);
+		g_error_free (batch->error);
+	}
+	trace_complete ("hydrate commit", data->id, start);
+
+	g_ptr_array_free (batch->ids, TRUE);
+	g_ptr_array_free (batch->objects, TRUE);
+	g_slice_free (DidlBatch, batch);
+	mem_free (MEM_DIDL_PARSE, sizeof (DidlBatch));
+
+	hydrate_browse_done (data);
+
+	return FALSE;
+}
+
+static void
+browse_with_profile (GUPnPServiceProxy *content_dir,
+                     const char        *container_id,
+                     guint32            starting_index,
+                     guint32            requested_count,
+                     FilterProfile      profile)
+{
+        BrowseData *data;
+
+        data = browse_data_new (content_dir, container_id, starting_index);
+        data->profile = profile;
+        browse_data_send (data, requested_count);
+}
+
+static void
+browse (GUPnPServiceProxy *content_dir,
+        const char        *container_id,
+        guint32            starting_index,
+        guint32            requested_count)
+{
+        browse_with_profile (content_dir,
+                             container_id,
+                             starting_index,
+                             requested_count,
+                             FILTER_LISTING);
+}
+
+/* Aggregated view.  One query browses the matching top level
+ * containers of every server at once and merges their children into a
+ * single list as the pages come in, each item remembering the server
+ * it came from.  The list is sorted by title with ties broken by
+ * server and object id, so the order never depends on who answered
+ * first and the whole view takes as long as the slowest server.  Copies
+ * of a track on several servers are collapsed into the one on the
+ * server device_health_prefer () picks, unless --keep-duplicates. */
+#define AGGREGATE_MAX_ITEMS 4096
+#define AGGREGATE_TIMEOUT_SECONDS 15
+
+typedef struct
+{
+	char *sort_key;
+	char *id;
+	Container *object;
+	AggregateServer *server;
+	/* Copies collapsed into this one */
+	guint duplicates;
+} AggregateItem;
+
+typedef struct
+{
+	/* Casefolded container title, or a upnp:class prefix */
+	char *query;
+	gboolean by_class;
+
+	GMutex lock;
+	GCond cond;
+
+	/* Everything below is guarded by lock */
+	GSequence *items;
+	/* Fingerprint -> GSequenceIter of the copy in items, and the
+	 * copies that lost, kept until the end as a caller may still
+	 * look at them */
+	FingerprintSet *fingerprints;
+	GSequence *collapsed;
+	GPtrArray *servers;
+	/* Servers that finished and were not reported yet */
+	GQueue finished;
+	guint busy_servers;
+	gboolean started;
+
+	gint64 start;
+	gint ref_count;
+} Aggregate;
+
+struct _AggregateServer
+{
+	Aggregate *aggregate;
+	GUPnPServiceProxy *content_dir;
+	char *udn;
+	char *name;
+
+	/* Browse requests on the wire, guarded by the aggregate's lock */
+	guint pending;
+	guint containers;
+	guint items;
+	gint64 finished;
+};
+
+static void
+aggregate_item_free (AggregateItem *item)
+{
+	mem_free (MEM_BROWSE_CACHE, item->object->size);
+	container_free (item->object);
+	g_free (item->sort_key);
+	g_free (item->id);
+	g_slice_free (AggregateItem, item);
+}
+
+static gint
+aggregate_item_compare (gconstpointer a,
+                        gconstpointer b,
+                        gpointer      user_data)
+{
+	const AggregateItem *item_a = a;
+	const AggregateItem *item_b = b;
+	int ret;
+
+	ret = strcmp (item_a->sort_key, item_b->sort_key);
+	if (ret == 0)
+		ret = strcmp (item_a->server->udn, item_b->server->udn);
+	if (ret == 0)
+		ret = strcmp (item_a->id, item_b->id);
+
+	return ret;
+}
+
+static void
+aggregate_server_free (AggregateServer *server)
+{
+	g_object_unref (server->content_dir);
+	g_free (server->udn);
+	g_free (server->name);
+	g_slice_free (AggregateServer, server);
+}
+
+static Aggregate *
+aggregate_new (const char *query)
+{
+	Aggregate *aggregate;
+
+	aggregate = g_slice_new0 (Aggregate);
+	aggregate->by_class = g_str_has_prefix (query, "object.");
+	aggregate->query = aggregate->by_class ?
+		g_strdup (query) : g_utf8_casefold (query, -1);
+	g_mutex_init (&aggregate->lock);
+	g_cond_init (&aggregate->cond);
+	aggregate->items = g_sequence_new ((GDestroyNotify)
+					   aggregate_item_free);
+	aggregate->collapsed = g_sequence_new ((GDestroyNotify)
+					       aggregate_item_free);
+	if (!keep_duplicates)
+		aggregate->fingerprints = fingerprint_set_new (0);
+	aggregate->servers = g_ptr_array_new_with_free_func
+		((GDestroyNotify) aggregate_server_free);
+	g_queue_init (&aggregate->finished);
+	aggregate->start = g_get_monotonic_time ();
+	aggregate->ref_count = 1;
+
+	return aggregate;
+}
+
+static Aggregate *
+aggregate_ref (Aggregate *aggregate)
+{
+	g_atomic_int_inc (&aggregate->ref_count);
+
+	return aggregate;
+}
+
+static void
+aggregate_unref (Aggregate *aggregate)
+{
+	if (!g_atomic_int_dec_and_test (&aggregate->ref_count))
+		return;
+
+	g_sequence_free (aggregate->items);
+	g_sequence_free (aggregate->collapsed);
+	if (aggregate->fingerprints != NULL)
+		fingerprint_set_free (aggregate->fingerprints);
+	g_ptr_array_unref (aggregate->servers);
+	g_queue_clear (&aggregate->finished);
+	g_mutex_clear (&aggregate->lock);
+	g_cond_clear (&aggregate->cond);
+	g_free (aggregate->query);
+	g_slice_free (Aggregate, aggregate);
+}
+
+static gboolean
+aggregate_matches (Aggregate       *aggregate,
+                   const Container *c)
+{
+	char *title;
+	gboolean match;
+
+	if (c->class == NULL ||
+	    strncmp (c->class,
+		     OBJECT_CLASS_CONTAINER,
+		     strlen (OBJECT_CLASS_CONTAINER)))
+		return FALSE;
+
+	if (aggregate->by_class)
+		return g_str_has_prefix (c->class, aggregate->query);
+
+	if (c->title == NULL)
+		return FALSE;
+
+	title = g_utf8_casefold (c->title, -1);
+	match = !strcmp (title, aggregate->query);
+	g_free (title);
+
+	return match;
+}
+
+/* Asks @server for a page of @id, the page comes back through
+ * aggregate_commit () or aggregate_browse_done () */
+static void
+aggregate_browse (AggregateServer *server,
+                  const char      *id,
+                  guint32          starting_index)
+{
+	BrowseData *data;
+
+	g_mutex_lock (&server->aggregate->lock);
+	server->pending++;
+	g_mutex_unlock (&server->aggregate->lock);
+
+	aggregate_ref (server->aggregate);
+	data = browse_data_new (server->content_dir, id, starting_index);
+	data->aggregate = server;
+	/* Collapsing copies needs their fingerprints, and the view plays
+	 * items without going through browse_table */
+	data->profile = keep_duplicates ? FILTER_LISTING : FILTER_PLAYBACK;
+	browse_data_send (data, MAX_BROWSE);
+}
+
+/* Called once for every page aggregate_browse () asked for, on any
+ * thread */
+static void
+aggregate_browse_done (BrowseData *data)
+{
+	AggregateServer *server = data->aggregate;
+	Aggregate *aggregate = server->aggregate;
+
+	browse_data_free (data);
+
+	g_mutex_lock (&aggregate->lock);
+	if (--server->pending == 0) {
+		server->finished = g_get_monotonic_time ();
+		g_queue_push_tail (&aggregate->finished, server);
+		aggregate->busy_servers--;
+		g_cond_broadcast (&aggregate->cond);
+	}
+	g_mutex_unlock (&aggregate->lock);
+
+	aggregate_unref (aggregate);
+}
+
+/* Adds @item to the view sorted by title, or counts it as a copy of the
+ * same track from a preferred server.  Must be called with the
+ * aggregate's lock held. */
+static void
+aggregate_insert (Aggregate     *aggregate,
+                  AggregateItem *item)
+{
+	GSequenceIter **slot, *iter;
+	AggregateItem *kept;
+
+	if (aggregate->fingerprints == NULL || item->object->fingerprint == 0) {
+		g_sequence_insert_sorted (aggregate->items,
+					  item,
+					  aggregate_item_compare,
+					  NULL);
+
+		return;
+	}
+
+	slot = (GSequenceIter **) fingerprint_set_slot
+		(aggregate->fingerprints, item->object->fingerprint);
+	if (*slot != NULL) {
+		kept = g_sequence_get (*slot);
+		if (!device_health_prefer (item->server->udn,
+					   kept->server->udn)) {
+			kept->duplicates++;
+			g_sequence_append (aggregate->collapsed, item);
+
+			return;
+		}
+
+		item->duplicates = kept->duplicates + 1;
+		iter = *slot;
+		g_sequence_move_range (g_sequence_get_end_iter
+					(aggregate->collapsed),
+				       iter,
+				       g_sequence_iter_next (iter));
+	}
+
+	*slot = g_sequence_insert_sorted (aggregate->items,
+					  item,
+					  aggregate_item_compare,
+					  NULL);
+}
+
+/* didl_batch_commit () for aggregated pages.  The root page of a server
+ * says which of its containers to browse, the pages of those are merged
+ * into the view. */
+static gboolean
+aggregate_commit (gpointer user_data)
+{
+	DidlBatch *batch = (DidlBatch *) user_data;
+	BrowseData *data = batch->data;
+	AggregateServer *server = data->aggregate;
+	Aggregate *aggregate = server->aggregate;
+	gboolean root = !strcmp (data->id, "0");
+	GPtrArray *matches;
+	guint i;
+
+	matches = g_ptr_array_new_with_free_func (g_free);
+
+	g_mutex_lock (&aggregate->lock);
+	for (i = 0; i < batch->objects->len; i++) {
+		Container *c = g_ptr_array_index (batch->objects, i);
+		char *id = g_ptr_array_index (batch->ids, i);
+		AggregateItem *item;
+
+		mem_free (MEM_DIDL_PARSE, c->size);
+
+		if (root && aggregate_matches (aggregate, c)) {
+			server->containers++;
+			g_ptr_array_add (matches, id);
+			id = NULL;
+		}
+
+		if (root ||
+		    g_sequence_get_length (aggregate->items) >=
+		    AGGREGATE_MAX_ITEMS) {
+			container_free (c);
+			g_free (id);
+
+			continue;
+		}
+
+		mem_alloc (MEM_BROWSE_CACHE, c->size);
+		item = g_slice_new (AggregateItem);
+		item->id = id;
+		item->object = c;
+		item->server = server;
+		item->duplicates = 0;
+		item->sort_key = g_utf8_collate_key (c->title ? c->title : "",
+						     -1);
+		server->items++;
+		aggregate_insert (aggregate, item);
+	}
+	g_mutex_unlock (&aggregate->lock);
+
+	if (batch->error != NULL) {
+		g_warning ("Error while browsing %s on %s: %s",
+			   data->id,
+			   server->name,
+			   batch->error->message);
+		g_error_free (batch->error);
+	} else if (!root &&
+		   batch->number_returned > 0 &&
+		   data->starting_index + batch->number_returned <
+		   batch->total_matches &&
+		   server->items < AGGREGATE_MAX_ITEMS)
+		aggregate_browse (server,
+				  data->id,
+				  data->starting_index +
+				  batch->number_returned);
+
+	/* Sent before this page counts as done, or the server would look
+	 * finished in between */
+	for (i = 0; i < matches->len; i++)
+		aggregate_browse (server, g_ptr_array_index (matches, i), 0);
+	g_ptr_array_unref (matches);
+
+	g_ptr_array_free (batch->ids, TRUE);
+	g_ptr_array_free (batch->objects, TRUE);
+	g_slice_free (DidlBatch, batch);
+	mem_free (MEM_DIDL_PARSE, sizeof (DidlBatch));
+
+	aggregate_browse_done (data);
+
+	return FALSE;
+}
+
+static gboolean
+aggregate_start_cb (gpointer user_data)
+{
+	Aggregate *aggregate = (Aggregate *) user_data;
+	GHashTableIter iter;
+	gpointer key, value;
+	guint i;
+
+	g_mutex_lock (&aggregate->lock);
+	g_hash_table_iter_init (&iter, server_table);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		MediaServers *s = (MediaServers *) value;
+		AggregateServer *server;
+
+		server = g_slice_new0 (AggregateServer);
+		server->aggregate = aggregate;
+		server->content_dir = g_object_ref (s->content_dir);
+		server->udn = g_strdup (key);
+		server->name = g_strdup (s->friendly_name);
+		g_ptr_array_add (aggregate->servers, server);
+	}
+	aggregate->busy_servers = aggregate->servers->len;
+	aggregate->started = TRUE;
+	g_cond_broadcast (&aggregate->cond);
+	g_mutex_unlock (&aggregate->lock);
+
+	/* Every server at once, the view waits for the slowest only */
+	for (i = 0; i < aggregate->servers->len; i++)
+		aggregate_browse (g_ptr_array_index (aggregate->servers, i),
+				  "0",
+				  0);
+
+	aggregate_unref (aggregate);
+
+	return FALSE;
+}
+
+/* Reports servers as they finish while waiting for all of them, at
+ * most AGGREGATE_TIMEOUT_SECONDS.  Returns whether every server
+ * answered, late answers are still merged into the view. */
+static gboolean
+aggregate_wait (Aggregate *aggregate,
+                gboolean   verbose)
+{
+	gint64 deadline;
+	gboolean done;
+
+	deadline = g_get_monotonic_time () +
+		(gint64) AGGREGATE_TIMEOUT_SECONDS * G_USEC_PER_SEC;
+
+	g_mutex_lock (&aggregate->lock);
+	for (;;) {
+		AggregateServer *server;
+
+		while ((server = g_queue_pop_head (&aggregate->finished)))
+			if (verbose)
+				printf("  %s: %u containers, %u items after "
+				       "%.1f ms\n",
+				       server->name,
+				       server->containers,
+				       server->items,
+				       (server->finished -
+					aggregate->start) / 1000.0);
+
+		done = aggregate->started && aggregate->busy_servers == 0;
+		if (done ||
+		    !g_cond_wait_until (&aggregate->cond,
+					&aggregate->lock,
+					deadline))
+			break;
+	}
+	g_mutex_unlock (&aggregate->lock);
+
+	trace_complete ("aggregate", aggregate->query, aggregate->start);
+
+	return done;
+}
+
+/* Browses @query on every server, see Aggregate */
+static Aggregate *
+aggregate_run (const char *query,
+               gboolean    verbose)
+{
+	Aggregate *aggregate;
+
+	aggregate = aggregate_new (query);
+	main_invoke (aggregate_start_cb, aggregate_ref (aggregate));
+
+	if (!aggregate_wait (aggregate, verbose))
+		g_warning ("Not every server answered within %d seconds",
+			   AGGREGATE_TIMEOUT_SECONDS);
+
+	return aggregate;
+}
+
+
+/* Path addressing.  "NAS/Music/Albums/Kind of Blue/So What" names the
+ * server by friendly name or UDN and then one title per level, case
+ * does not matter.  Levels are looked up in the title index of cached
+ * containers, only the ones missing are browsed.  Siblings sharing a
+ * title are all followed, browsed together, so every uncached level
+ * costs a single round trip. */
+typedef struct
+{
+	char **components;
+	guint level;
+
+	GUPnPServiceProxy *content_dir;
+	/* Containers the current level is looked for in */
+	GPtrArray *candidates;
+	/* Of those, the ones to browse first */
+	GPtrArray *missing;
+	/* Children titled like the current level */
+	GPtrArray *found;
+	char *found_class;
+} PathLookup;
+
+static sem_t path_sem;
+
+static void
+path_lookup_set (GPtrArray **array)
+{
+	if (*array != NULL)
+		g_ptr_array_unref (*array);
+	*array = g_ptr_array_new_with_free_func (g_free);
+}
+
+static gboolean
+path_server_cb (gpointer user_data)
+{
+	PathLookup *lookup = (PathLookup *) user_data;
+	GHashTableIter iter;
+	gpointer key, value;
+	char *name;
+
+	name = g_utf8_casefold (lookup->components[0], -1);
+
+	g_hash_table_iter_init (&iter, server_table);
+	while (lookup->content_dir == NULL &&
+	       g_hash_table_iter_next (&iter, &key, &value)) {
+		MediaServers *s = (MediaServers *) value;
+		char *friendly_name;
+
+		friendly_name = g_utf8_casefold (s->friendly_name, -1);
+		if (!strcmp (key, lookup->components[0]) ||
+		    !strcmp (friendly_name, name))
+			lookup->content_dir = g_object_ref (s->content_dir);
+		g_free (friendly_name);
+	}
+
+	g_free (name);
+	sem_post(&path_sem);
+
+	return FALSE;
+}
+
+static gboolean
+path_missing_cb (gpointer user_data)
+{
+	PathLookup *lookup = (PathLookup *) user_data;
+	guint i;
+
+	/* Browsing the missing ones must not evict the others before
+	 * path_match_cb () reads them */
+	path_lookup_set (&lookup->missing);
+	for (i = 0; i < lookup->candidates->len; i++) {
+		const char *id = g_ptr_array_index (lookup->candidates, i);
+
+		cache_pin (lookup->content_dir, id);
+		if (cache_lookup (lookup->content_dir, id) == NULL)
+			g_ptr_array_add (lookup->missing, g_strdup (id));
+	}
+
+	sem_post(&path_sem);
+
+	return FALSE;
+}
+
+static gboolean
+path_match_cb (gpointer user_data)
+{
+	PathLookup *lookup = (PathLookup *) user_data;
+	const char *title = lookup->components[lookup->level];
+	guint i, j;
+
+	path_lookup_set (&lookup->found);
+	g_clear_pointer (&lookup->found_class, g_free);
+
+	for (i = 0; i < lookup->candidates->len; i++) {
+		CachedContainer *entry;
+		GPtrArray *ids;
+
+		entry = cache_lookup (lookup->content_dir,
+				      g_ptr_array_index (lookup->candidates, i));
+		if (entry == NULL)
+			continue;
+
+		ids = cache_find_children (entry, title);
+		for (j = 0; ids != NULL && j < ids->len; j++) {
+			const char *id = g_ptr_array_index (ids, j);
+
+			if (lookup->found_class == NULL) {
+				Container *c;
+
+				c = browse_lookup (entry->udn, id);
+				lookup->found_class = g_strdup (c != NULL &&
+								c->class != NULL ?
+								c->class : "");
+			}
+			g_ptr_array_add (lookup->found, g_strdup (id));
+		}
+	}
+
+	for (i = 0; i < lookup->candidates->len; i++)
+		cache_unpin (lookup->content_dir,
+			     g_ptr_array_index (lookup->candidates, i));
+
+	sem_post(&path_sem);
+
+	return FALSE;
+}
+
+static void
+path_invoke_named (GSourceFunc  func,
+                   PathLookup  *lookup,
+                   const char  *name)
+{
+	main_invoke_named (func, lookup, name);
+	sem_wait(&path_sem);
+}
+
+#define path_invoke(func, lookup) path_invoke_named (func, lookup, #func)
+
+/* Resolves @path to the object it names, the first one if siblings
+ * share titles.  @id is the object id, @class its upnp:class. */
+static gboolean
+path_resolve (const char         *path,
+              GUPnPServiceProxy **content_dir,
+              char              **id,
+              char              **class,
+              GError            **error)
+{
+	PathLookup lookup;
+	char **components;
+	guint n, i;
+	gboolean ok = FALSE;
+
+	/* Empty components, as in "NAS//Music/", are skipped */
+	components = g_strsplit (path, "/", -1);
+	for (i = 0, n = 0; components[i] != NULL; i++) {
+		if (components[i][0] != '\0')
+			components[n++] = components[i];
+		else
+			g_free (components[i]);
+	}
+	components[n] = NULL;
+
+	memset (&lookup, 0, sizeof (PathLookup));
+	lookup.components = components;
+
+	if (n == 0) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_ARGUMENT,
+			     "Empty path");
+		goto out;
+	}
+
+	path_invoke (path_server_cb, &lookup);
+	if (lookup.content_dir == NULL) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_NOT_FOUND,
+			     "No server called '%s'",
+			     components[0]);
+		goto out;
+	}
+
+	path_lookup_set (&lookup.candidates);
+	g_ptr_array_add (lookup.candidates, g_strdup ("0"));
+
+	for (lookup.level = 1; lookup.level < n; lookup.level++) {
+		path_invoke (path_missing_cb, &lookup);
+
+		/* All at once, and waited for together */
+		for (i = 0; i < lookup.missing->len; i++)
+			browse (lookup.content_dir,
+				g_ptr_array_index (lookup.missing, i),
+				0,
+				MAX_BROWSE);
+		for (i = 0; i < lookup.missing->len; i++)
+			trace_sem_wait (&browse_sem, "wait browse");
+
+		path_invoke (path_match_cb, &lookup);
+		if (lookup.found->len == 0) {
+			g_set_error (error,
+				     G_IO_ERROR,
+				     G_IO_ERROR_NOT_FOUND,
+				     "Nothing called '%s' in level %u of '%s'",
+				     components[lookup.level],
+				     lookup.level,
+				     path);
+			goto out;
+		}
+
+		g_ptr_array_unref (lookup.candidates);
+		lookup.candidates = lookup.found;
+		lookup.found = NULL;
+	}
+
+	*content_dir = g_object_ref (lookup.content_dir);
+	*id = g_strdup (g_ptr_array_index (lookup.candidates, 0));
+	*class = g_strdup (n > 1 ? lookup.found_class : OBJECT_CLASS_CONTAINER);
+	ok = TRUE;
+
+out:
+	g_clear_object (&lookup.content_dir);
+	g_clear_pointer (&lookup.candidates, g_ptr_array_unref);
+	g_clear_pointer (&lookup.missing, g_ptr_array_unref);
+	g_clear_pointer (&lookup.found, g_ptr_array_unref);
+	g_free (lookup.found_class);
+	g_strfreev (components);
+
+	return ok;
+}
+
+/* Playlist import.  M3U and XSPF entries are matched in one pass on
+ * the main thread against an index of everything browsed so far, by
+ * res URI or by title, artist and album.  Only what is left is looked
+ * for with a ContentDirectory Search on every server, and the tracks
+ * found are queued on a renderer. */
+#define PLAYLIST_SEARCHES 8
+#define PLAYLIST_TIMEOUT_SECONDS 30
+#define PLAYLIST_SEARCH_ITEMS "upnp:class derivedfrom \"object.item\""
+
+typedef struct
+{
+	char *location;
+	char *title;
+	char *artist;
+	char *album;
+
+	/* Set once resolved, guarded by the import's lock */
+	char *uri;
+	char *metadata;
+	/* browse_table key of a match listed without its res */
+	char *cache_id;
+} PlaylistEntry;
+
+typedef struct
+{
+	GPtrArray *entries;
+
+	GMutex lock;
+	GCond cond;
+
+	/* Guarded by lock */
+	GQueue searches;
+	guint in_flight;
+	/* UDNs of the servers without Search */
+	GHashTable *no_search;
+	gboolean indexed;
+
+	guint cached;
+	guint searched;
+	gint64 start;
+	gint64 indexed_time;
+	gint ref_count;
+} PlaylistImport;
+
+typedef struct
+{
+	PlaylistImport *import;
+	PlaylistEntry *entry;
+	GUPnPServiceProxy *content_dir;
+} PlaylistSearch;
+
+/* "u:" res URI or "t:" casefolded title, artist and album -> Container
+ * of browse_table, rebuilt when browse_generation moves on.  Only used
+ * on the main thread. */
+static GHashTable *library_index = NULL;
+static guint library_generation = 0;
+
+static void
+playlist_entry_free (PlaylistEntry *entry)
+{
+	g_free (entry->location);
+	g_free (entry->title);
+	g_free (entry->artist);
+	g_free (entry->album);
+	g_free (entry->uri);
+	g_free (entry->metadata);
+	g_free (entry->cache_id);
+	g_slice_free (PlaylistEntry, entry);
+}
+
+static PlaylistEntry *
+playlist_entry_new (const char *location,
+                    const char *title,
+                    const char *artist,
+                    const char *album)
+{
+	PlaylistEntry *entry;
+
+	entry = g_slice_new0 (PlaylistEntry);
+	entry->location = g_strdup (location);
+	entry->title = g_strdup (title);
+	entry->artist = g_strdup (artist);
+	entry->album = g_strdup (album);
+
+	return entry;
+}
+
+static void
+playlist_search_free (PlaylistSearch *search)
+{
+	g_object_unref (search->content_dir);
+	g_slice_free (PlaylistSearch, search);
+}
+
+static void
+playlist_import_unref (PlaylistImport *import)
+{
+	if (!g_atomic_int_dec_and_test (&import->ref_count))
+		return;
+
+	g_queue_foreach (&import->searches,
+			 (GFunc) playlist_search_free,
+			 NULL);
+	g_queue_clear (&import->searches);
+	g_hash_table_unref (import->no_search);
+	g_ptr_array_unref (import->entries);
+	g_mutex_clear (&import->lock);
+	g_cond_clear (&import->cond);
+	g_slice_free (PlaylistImport, import);
+}
+
+/* #EXTINF:<seconds>,<artist> - <title> before each location, plus the
+ * #EXTALB and #EXTART extensions */
+static void
+playlist_parse_m3u (const char *contents,
+                    GPtrArray  *entries)
+{
+	char **lines;
+	char *title = NULL, *artist = NULL, *album = NULL;
+	guint i;
+
+	lines = g_strsplit (contents, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		char *line = g_strstrip (lines[i]);
+
+		if (line[0] == '\0')
+			continue;
+
+		if (g_str_has_prefix (line, "#EXTINF:")) {
+			char *info = strchr (line, ',');
+			char *dash;
+
+			g_free (title);
+			title = NULL;
+			if (info == NULL)
+				continue;
+
+			dash = strstr (info + 1, " - ");
+			if (dash != NULL) {
+				g_free (artist);
+				artist = g_strndup (info + 1, dash - info - 1);
+				title = g_strdup (dash + 3);
+			} else
+				title = g_strdup (info + 1);
+		} else if (g_str_has_prefix (line, "#EXTALB:")) {
+			g_free (album);
+			album = g_strdup (line + 8);
+		} else if (g_str_has_prefix (line, "#EXTART:")) {
+			g_free (artist);
+			artist = g_strdup (line + 8);
+		} else if (line[0] != '#') {
+			char *name = NULL;
+
+			/* A file name is better than nothing */
+			if (title == NULL && strstr (line, "://") == NULL) {
+				char *dot;
+
+				name = g_path_get_basename (line);
+				dot = strrchr (name, '.');
+				if (dot != NULL && dot != name)
+					*dot = '\0';
+			}
+
+			g_ptr_array_add (entries,
+					 playlist_entry_new (line,
+							     title ? title : name,
+							     artist,
+							     album));
+			g_free (name);
+			g_clear_pointer (&title, g_free);
+			g_clear_pointer (&artist, g_free);
+			g_clear_pointer (&album, g_free);
+		}
+	}
+
+	g_free (title);
+	g_free (artist);
+	g_free (album);
+	g_strfreev (lines);
+}
+
+static char *
+playlist_xspf_child (xmlNodePtr  track,
+                     const char *name)
+{
+	xmlNodePtr node;
+
+	for (node = track->children; node != NULL; node = node->next) {
+		if (node->type == XML_ELEMENT_NODE &&
+		    !strcmp ((const char *) node->name, name)) {
+			xmlChar *content = xmlNodeGetContent (node);
+			char *value;
+
+			value = g_strstrip (g_strdup ((const char *) content));
+			xmlFree (content);
+
+			return value;
+		}
+	}
+
+	return NULL;
+}
+
+static gboolean
+playlist_parse_xspf (const char *contents,
+                     gsize       length,
+                     GPtrArray  *entries,
+                     GError    **error)
+{
+	xmlDocPtr doc;
+	xmlNodePtr root, list, track;
+
+	doc = xmlReadMemory (contents, length, NULL, NULL, XML_PARSE_NONET);
+	if (doc == NULL) {
+		g_set_error_literal (error,
+				     G_MARKUP_ERROR,
+				     G_MARKUP_ERROR_PARSE,
+				     "Malformed XSPF playlist");
+
+		return FALSE;
+	}
+
+	root = xmlDocGetRootElement (doc);
+	for (list = root != NULL ? root->children : NULL;
+	     list != NULL;
+	     list = list->next) {
+		if (list->type != XML_ELEMENT_NODE ||
+		    strcmp ((const char *) list->name, "trackList"))
+			continue;
+
+		for (track = list->children; track != NULL; track = track->next) {
+			PlaylistEntry *entry;
+
+			if (track->type != XML_ELEMENT_NODE ||
+			    strcmp ((const char *) track->name, "track"))
+				continue;
+
+			entry = g_slice_new0 (PlaylistEntry);
+			entry->location = playlist_xspf_child (track, "location");
+			entry->title = playlist_xspf_child (track, "title");
+			entry->artist = playlist_xspf_child (track, "creator");
+			entry->album = playlist_xspf_child (track, "album");
+			g_ptr_array_add (entries, entry);
+		}
+	}
+
+	xmlFreeDoc (doc);
+
+	return TRUE;
+}
+
+/* A new copy of the browse_table key of @c, NULL once evicted */
+static char *
+cache_object_key (Container *c)
+{
+	guint i;
+
+	if (c->owner == NULL)
+		return NULL;
+
+	for (i = 0; i < c->owner->children->len; i++) {
+		const char *id = g_ptr_array_index (c->owner->children, i);
+
+		if (browse_lookup (c->owner->udn, id) == c)
+			return browse_object_key (c->owner->udn, id);
+	}
+
+	return NULL;
+}
+
+static char *
+library_key (const char *title,
+             const char *artist,
+             const char *album)
+{
+	char *t, *a, *b, *key;
+
+	t = g_utf8_casefold (title, -1);
+	a = g_utf8_casefold (artist ? artist : "", -1);
+	b = g_utf8_casefold (album ? album : "", -1);
+	key = g_strconcat ("t:", t, "\x1f", a, "\x1f", b, NULL);
+	g_free (t);
+	g_free (a);
+	g_free (b);
+
+	return key;
+}
+
+static void
+library_index_add (char      *key,
+                   Container *c)
+{
+	Container *indexed;
+
+	/* Copies on several servers queue the one the healthiest
+	 * server has */
+	indexed = g_hash_table_lookup (library_index, key);
+	if (indexed == NULL ||
+	    (indexed->owner != NULL && c->owner != NULL &&
+	     strcmp (c->owner->udn, indexed->owner->udn) &&
+	     device_health_prefer (c->owner->udn, indexed->owner->udn)))
+		g_hash_table_replace (library_index, key, c);
+	else
+		g_free (key);
+}
+
+static void
+library_index_update (void)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (library_index != NULL && library_generation == browse_generation)
+		return;
+
+	if (library_index == NULL)
+		library_index = g_hash_table_new_full (g_str_hash,
+						       g_str_equal,
+						       g_free,
+						       NULL);
+	else
+		g_hash_table_remove_all (library_index);
+
+	g_hash_table_iter_init (&iter, browse_table);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		Container *c = (Container *) value;
+
+		if (c->class != NULL &&
+		    g_str_has_prefix (c->class, OBJECT_CLASS_CONTAINER))
+			continue;
+
+		/* Listed items have no res yet, playlist_hydrate ()
+		 * fetches it for the ones a playlist wants */
+		if (c->uri != NULL)
+			library_index_add (g_strconcat ("u:", c->uri, NULL), c);
+		if (c->title == NULL)
+			continue;
+
+		/* Looser keys for playlists that know less */
+		library_index_add (library_key (c->title, c->artist, c->album),
+				   c);
+		if (c->album != NULL)
+			library_index_add (library_key (c->title,
+							c->artist,
+							NULL),
+					   c);
+		if (c->artist != NULL)
+			library_index_add (library_key (c->title, NULL, NULL),
+					   c);
+	}
+
+	library_generation = browse_generation;
+}
+
+static Container *
+library_lookup (PlaylistEntry *entry)
+{
+	Container *c = NULL;
+	char *key;
+
+	if (entry->location != NULL && strstr (entry->location, "://")) {
+		key = g_strconcat ("u:", entry->location, NULL);
+		c = g_hash_table_lookup (library_index, key);
+		g_free (key);
+	}
+
+	if (c == NULL && entry->title != NULL) {
+		key = library_key (entry->title, entry->artist, entry->album);
+		c = g_hash_table_lookup (library_index, key);
+		g_free (key);
+	}
+
+	if (c == NULL && entry->title != NULL && entry->album != NULL) {
+		key = library_key (entry->title, entry->artist, NULL);
+		c = g_hash_table_lookup (library_index, key);
+		g_free (key);
+	}
+
+	/* The playlist or the server may spell the artist differently */
+	if (c == NULL && entry->title != NULL && entry->artist != NULL) {
+		key = library_key (entry->title, NULL, NULL);
+		c = g_hash_table_lookup (library_index, key);
+		g_free (key);
+	}
+
+	return c;
+}
+
+/* Escapes @value for a quoted SearchCriteria string */
+static char *
+playlist_search_quote (const char *value)
+{
+	GString *quoted;
+	const char *c;
+
+	quoted = g_string_new ("\"");
+	for (c = value; *c != '\0'; c++) {
+		if (*c == '"' || *c == '\\')
+			g_string_append_c (quoted, '\\');
+		g_string_append_c (quoted, *c);
+	}
+	g_string_append_c (quoted, '"');
+
+	return g_string_free (quoted, FALSE);
+}
+
+static void playlist_search_pump (PlaylistImport *import);
+
+static void
+playlist_search_found (DidlObject *object,
+                       gpointer    user_data)
+{
+	PlaylistEntry *entry = (PlaylistEntry *) user_data;
+
+	if (entry->uri != NULL || object->is_container || object->uri == NULL)
+		return;
+
+	entry->uri = g_strdup (object->uri);
+	if (object->fragment != NULL)
+		entry->metadata = g_strconcat (DIDL_LITE_HEADER,
+					       object->fragment,
+					       DIDL_LITE_FOOTER,
+					       NULL);
+}
+
+static void
+playlist_search_cb (GUPnPServiceProxy       *content_dir,
+                    GUPnPServiceProxyAction *action,
+                    gpointer                 user_data)
+{
+	PlaylistSearch *search = (PlaylistSearch *) user_data;
+	PlaylistImport *import = search->import;
+	PlaylistEntry found;
+	gboolean resolved;
+	char *didl_xml = NULL;
+	GError *error = NULL;
+
+	action_end (content_dir,
+		    action,
+		    &error,
+		    "Result",
+		    G_TYPE_STRING,
+		    &didl_xml,
+		    NULL);
+
+	/* Parsed into @found without the lock, the user thread and the
+	 * other searches wait on it */
+	memset (&found, 0, sizeof (PlaylistEntry));
+	g_mutex_lock (&import->lock);
+	resolved = search->entry->uri != NULL;
+	g_mutex_unlock (&import->lock);
+	if (didl_xml != NULL && !resolved)
+		didl_parse (didl_xml,
+			    strlen (didl_xml),
+			    TRUE,
+			    playlist_search_found,
+			    &found,
+			    NULL);
+
+	g_mutex_lock (&import->lock);
+	if (found.uri != NULL) {
+		/* Another server may have answered meanwhile */
+		if (search->entry->uri == NULL) {
+			search->entry->uri = found.uri;
+			search->entry->metadata = found.metadata;
+			found.uri = NULL;
+			found.metadata = NULL;
+			import->searched++;
+		}
+	} else if (g_error_matches (error,
+				    GUPNP_CONTROL_ERROR,
+				    GUPNP_CONTROL_ERROR_INVALID_ACTION))
+		g_hash_table_add (import->no_search,
+				  g_strdup (gupnp_service_info_get_udn
+					    (GUPNP_SERVICE_INFO (content_dir))));
+	import->in_flight--;
+	g_mutex_unlock (&import->lock);
+
+	g_free (found.uri);
+	g_free (found.metadata);
+	g_free (didl_xml);
+	g_clear_error (&error);
+	playlist_search_free (search);
+
+	playlist_search_pump (import);
+	playlist_import_unref (import);
+}
+
+/* Keeps PLAYLIST_SEARCHES on the wire, skipping entries resolved on
+ * another server meanwhile */
+static void
+playlist_search_pump (PlaylistImport *import)
+{
+	for (;;) {
+		PlaylistSearch *search;
+		char *criteria, *title, *artist = NULL;
+
+		g_mutex_lock (&import->lock);
+		while ((search = g_queue_peek_head (&import->searches)) != NULL &&
+		       (search->entry->uri != NULL ||
+			g_hash_table_contains
+				(import->no_search,
+				 gupnp_service_info_get_udn
+					(GUPNP_SERVICE_INFO
+						(search->content_dir)))))
+			playlist_search_free (g_queue_pop_head
+						(&import->searches));
+
+		if (search == NULL || import->in_flight >= PLAYLIST_SEARCHES) {
+			if (search == NULL && import->in_flight == 0)
+				g_cond_broadcast (&import->cond);
+			g_mutex_unlock (&import->lock);
+
+			return;
+		}
+
+		g_queue_pop_head (&import->searches);
+		import->in_flight++;
+		g_mutex_unlock (&import->lock);
+
+		title = playlist_search_quote (search->entry->title);
+		if (search->entry->artist != NULL)
+			artist = playlist_search_quote (search->entry->artist);
+		if (artist != NULL)
+			criteria = g_strconcat (PLAYLIST_SEARCH_ITEMS
+						" and dc:title = ",
+						title,
+						" and upnp:artist = ",
+						artist,
+						NULL);
+		else
+			criteria = g_strconcat (PLAYLIST_SEARCH_ITEMS
+						" and dc:title = ",
+						title,
+						NULL);
+
+		g_atomic_int_inc (&import->ref_count);
+		action_begin (search->content_dir,
+			      "Search",
+			      playlist_search_cb,
+			      search,
+			      "ContainerID",
+			      G_TYPE_STRING,
+			      "0",
+			      "SearchCriteria",
+			      G_TYPE_STRING,
+			      criteria,
+			      "Filter",
+			      G_TYPE_STRING,
+			      filter_profile_filters[FILTER_PLAYBACK],
+			      "StartingIndex",
+			      G_TYPE_UINT,
+			      0,
+			      "RequestedCount",
+			      G_TYPE_UINT,
+			      1,
+			      "SortCriteria",
+			      G_TYPE_STRING,
+			      "",
+			      NULL);
+
+		g_free (criteria);
+		g_free (title);
+		g_free (artist);
+	}
+}
+
+/* Resolves what the library index knows and queues a Search on every
+ * server for the rest */
+static gboolean
+playlist_resolve_cb (gpointer user_data)
+{
+	PlaylistImport *import = (PlaylistImport *) user_data;
+	GHashTableIter iter;
+	gpointer value;
+	char *key;
+	guint i;
+
+	library_index_update ();
+
+	g_mutex_lock (&import->lock);
+	for (i = 0; i < import->entries->len; i++) {
+		PlaylistEntry *entry = g_ptr_array_index (import->entries, i);
+		Container *c;
+
+		/* An object whose key can not be found is searched for
+		 * like one that is not cached */
+		c = library_lookup (entry);
+		key = c != NULL ? cache_object_key (c) : NULL;
+		if (key != NULL) {
+			if (c->detail >= FILTER_PLAYBACK) {
+				entry->uri = g_strdup (c->uri);
+				entry->metadata = container_metadata
+					(browse_key_id (key, c), c);
+				g_free (key);
+			} else
+				entry->cache_id = key;
+			import->cached++;
+
+			continue;
+		}
+
+		if (entry->title == NULL)
+			continue;
+
+		g_hash_table_iter_init (&iter, server_table);
+		while (g_hash_table_iter_next (&iter, NULL, &value)) {
+			MediaServers *s = (MediaServers *) value;
+			PlaylistSearch *search;
+
+			search = g_slice_new (PlaylistSearch);
+			search->import = import;
+			search->entry = entry;
+			search->content_dir = g_object_ref (s->content_dir);
+			g_queue_push_tail (&import->searches, search);
+		}
+	}
+	import->indexed = TRUE;
+	import->indexed_time = g_get_monotonic_time ();
+	g_mutex_unlock (&import->lock);
+
+	playlist_search_pump (import);
+	playlist_import_unref (import);
+
+	return FALSE;
+}
+
+/* Copies what hydrating brought for the matches that were only listed
+ * into their entries, browse_table is only read here */
+static gboolean
+playlist_hydrate_cb (gpointer user_data)
+{
+	PlaylistImport *import = (PlaylistImport *) user_data;
+	guint i;
+
+	g_mutex_lock (&import->lock);
+	for (i = 0; i < import->entries->len; i++) {
+		PlaylistEntry *entry = g_ptr_array_index (import->entries, i);
+		Container *c;
+
+		if (entry->cache_id == NULL || entry->uri != NULL)
+			continue;
+
+		c = g_hash_table_lookup (browse_table, entry->cache_id);
+		if (c != NULL && c->detail >= FILTER_PLAYBACK) {
+			entry->uri = g_strdup (c->uri);
+			entry->metadata = container_metadata
+				(browse_key_id (entry->cache_id, c), c);
+		}
+	}
+	g_mutex_unlock (&import->lock);
+
+	return FALSE;
+}
+
+/* Fills in the res of the matches that were only listed, the tracks
+ * of one album come in one Browse */
+static void
+playlist_hydrate (PlaylistImport *import)
+{
+	GPtrArray *ids;
+	guint i;
+
+	ids = g_ptr_array_new ();
+	g_mutex_lock (&import->lock);
+	for (i = 0; i < import->entries->len; i++) {
+		PlaylistEntry *entry = g_ptr_array_index (import->entries, i);
+
+		if (entry->cache_id != NULL && entry->uri == NULL)
+			g_ptr_array_add (ids, entry->cache_id);
+	}
+	g_mutex_unlock (&import->lock);
+
+	cache_hydrate (ids, FILTER_PLAYBACK);
+	g_ptr_array_unref (ids);
+
+	main_call (playlist_hydrate_cb, import);
+}
+
+/* Reads and resolves the playlist at @path, waiting at most
+ * PLAYLIST_TIMEOUT_SECONDS for searches */
+static PlaylistImport *
+playlist_import (const char *path,
+                 GError    **error)
+{
+	PlaylistImport *import;
+	GPtrArray *entries;
+	char *contents;
+	gsize length;
+	gint64 deadline;
+	gboolean ok = TRUE;
+
+	if (!g_file_get_contents (path, &contents, &length, error))
+		return NULL;
+
+	entries = g_ptr_array_new_with_free_func ((GDestroyNotify)
+						  playlist_entry_free);
+	if (g_str_has_suffix (path, ".xspf") ||
+	    g_str_has_prefix (contents, "<?xml"))
+		ok = playlist_parse_xspf (contents, length, entries, error);
+	else
+		playlist_parse_m3u (contents, entries);
+	g_free (contents);
+
+	if (!ok) {
+		g_ptr_array_unref (entries);
+
+		return NULL;
+	}
+
+	import = g_slice_new0 (PlaylistImport);
+	import->entries = entries;
+	g_mutex_init (&import->lock);
+	g_cond_init (&import->cond);
+	g_queue_init (&import->searches);
+	import->no_search = g_hash_table_new_full (g_str_hash,
+						   g_str_equal,
+						   g_free,
+						   NULL);
+	import->start = g_get_monotonic_time ();
+	import->ref_count = 2;
+
+	main_invoke (playlist_resolve_cb, import);
+
+	deadline = g_get_monotonic_time () +
+		(gint64) PLAYLIST_TIMEOUT_SECONDS * G_USEC_PER_SEC;
+	g_mutex_lock (&import->lock);
+	while (!import->indexed ||
+	       import->in_flight > 0 ||
+	       !g_queue_is_empty (&import->searches))
+		if (!g_cond_wait_until (&import->cond, &import->lock, deadline))
+			break;
+	g_mutex_unlock (&import->lock);
+
+	playlist_hydrate (import);
+	trace_complete ("playlist import", path, import->start);
+
+	return import;
+}
+
+/* Queues what @import resolved on @udn, returns how many tracks */
+static guint
+playlist_queue (PlaylistImport *import,
+                const char     *udn)
+{
+	GPtrArray *queue;
+	guint i, n;
+
+	queue = g_ptr_array_new ();
+	g_mutex_lock (&import->lock);
+	for (i = 0; i < import->entries->len; i++) {
+		PlaylistEntry *entry = g_ptr_array_index (import->entries, i);
+
+		if (entry->uri != NULL)
+			g_ptr_array_add (queue,
+					 queue_entry_new (entry->uri,
+							  entry->metadata));
+	}
+	g_mutex_unlock (&import->lock);
+
+	n = queue->len;
+	renderer_queue_load (udn, queue);
+
+	return n;
+}
+
+static BrowseMetadataData *
+browse_metadata_data_new (MetadataFunc callback,
+                          const char  *id,
+                          gpointer     user_data)
+{
+
+        BrowseMetadataData *data;
+
+        data = g_slice_new (BrowseMetadataData);
+        data->callback = callback;
+        data->id = g_strdup (id);
+        data->user_data = user_data;
+
+        return data;
+}
+
+static void
+on_didl_item_available (GUPnPDIDLLiteParser *parser,
+                        GUPnPDIDLLiteObject *object,
+                        gpointer             user_data)
+{
+
+        GUPnPDIDLLiteResource **resource;
+        char                   *sink_protocol_info = NULL;
+        gboolean                lenient_mode = FALSE;
+	RendererData *data = NULL;
+
+        resource = (GUPnPDIDLLiteResource **) user_data;
+
+
+	g_mutex_lock (&renderer_state_lock);
+	data = (RendererData*)g_hash_table_lookup(renderer_table, current_renderer);
+	if (data != NULL)
+		sink_protocol_info = g_strdup (data->sink_protocol_info);
+	g_mutex_unlock (&renderer_state_lock);
+
+	/* GetProtocolInfo may not have answered yet, take whatever the
+	 * object offers first and let the renderer decide */
+	if (sink_protocol_info == NULL) {
+		GList *resources;
+
+		resources = gupnp_didl_lite_object_get_resources (object);
+		if (resources != NULL) {
+			*resource = g_object_ref (resources->data);
+			g_list_free_full (resources, g_object_unref);
+		}
+
+		return;
+	}
+
+        *resource = gupnp_didl_lite_object_get_compat_resource
+		(object,
+		 sink_protocol_info,
+		 lenient_mode);
+	g_free (sink_protocol_info);
+}
+
+
+static GUPnPDIDLLiteResource *
+find_compat_res_from_metadata (const char *metadata)
+{
+
+        GUPnPDIDLLiteParser   *parser;
+        GUPnPDIDLLiteResource *resource;
+        GError                *error;
+
+        parser = gupnp_didl_lite_parser_new ();
+        resource = NULL;
+        error = NULL;
+
+        g_signal_connect (parser,
+                          "item-available",
+                          G_CALLBACK (on_didl_item_available),
+                          &resource);
+
+        /* Assumption: metadata only contains a single didl object */
+        gupnp_didl_lite_parser_parse_didl (parser, metadata, &error);
+        if (error) {
+                g_warning ("%s\n", error->message);
+
+                g_error_free (error);
+        }
+
+        g_object_unref (parser);
+
+        return resource;
+}
+
+static void
+browse_metadata_data_free (BrowseMetadataData *data)
+{
+
+        g_free (data->id);
+        g_slice_free (BrowseMetadataData, data);
+}
+
+static SetAVTransportURIData *
+set_av_transport_uri_data_new (GCallback   callback,
+                               const char *uri,
+                               PlayWait   *wait)
+{
+        printf("On %s function\n",__func__);
+        SetAVTransportURIData *data;
+
+        data = g_slice_new (SetAVTransportURIData);
+
+        data->callback = callback;
+        data->uri = g_strdup (uri);
+        data->wait = wait;
+
+        return data;
+}
+
+static void
+set_av_transport_uri_data_free (SetAVTransportURIData *data)
+{
+        printf("On %s function\n",__func__);
+        g_free (data->uri);
+        g_slice_free (SetAVTransportURIData, data);
+}
+
+
+typedef void (* TransportReadyFunc) (GUPnPServiceProxy *av_transport,
+                                     PlayWait          *wait);
+
+/* Every playback request carries its own PlayWait, so concurrent
+ * requests cannot wake each other or see each other's result */
+static void
+play_wait_init (PlayWait *wait)
+{
+        sem_init (&wait->sem, 0, 0);
+        wait->ok = FALSE;
+}
+
+static void
+play_wait_done (PlayWait *wait,
+                gboolean  ok)
+{
+        wait->ok = ok;
+        sem_post (&wait->sem);
+}
+
+/* Blocks until play_wait_done (), returns whether it is playing */
+static gboolean
+play_wait_finish (PlayWait *wait)
+{
+        trace_sem_wait (&wait->sem, "wait play");
+        sem_destroy (&wait->sem);
+
+        return wait->ok;
+}
+
+static void
+play_started_cb (GUPnPServiceProxy       *av_transport,
+                 GUPnPServiceProxyAction *action,
+                 gpointer                 user_data)
+{
+        GError *error;
+        gboolean ok;
+
+        error = NULL;
+        ok = action_end (av_transport,
+                         action,
+                         &error,
+                         NULL);
+        if (ok)
+                renderer_set_status (gupnp_service_info_get_udn
+                                        (GUPNP_SERVICE_INFO (av_transport)),
+                                     PLAYING);
+        else {
+                g_warning ("Failed to send action 'Play' to '%s': %s",
+                           gupnp_service_info_get_udn
+                                (GUPNP_SERVICE_INFO (av_transport)),
+                           error->message);
+                g_error_free (error);
+        }
+
+        play_wait_done ((PlayWait *) user_data, ok);
+}
+
+/* Sent straight from the SetAVTransportURI completion, the waiting
+ * thread only wakes up once the renderer is playing */
+static void
+play_after_uri_set (GUPnPServiceProxy *av_transport,
+                    PlayWait          *wait)
+{
+        action_begin_template (av_transport,
+                               TEMPLATE_PLAY,
+                               NULL,
+                               play_started_cb,
+                               wait);
+}
+
+static void
+set_av_transport_uri_cb (GUPnPServiceProxy       *av_transport,
+                         GUPnPServiceProxyAction *action,
+                         gpointer                 user_data)
+{
+        printf("On %s function\n",__func__);
+        SetAVTransportURIData *data;
+        GError                *error;
+
+        data = (SetAVTransportURIData *) user_data;
+
+        error = NULL;
+        if (action_end (av_transport,
+                        action,
+                        &error,
+                        NULL)) {
+		if (data->callback != NULL)
+			((TransportReadyFunc) data->callback) (av_transport,
+							       data->wait);
+		else
+			play_wait_done (data->wait, TRUE);
+		
+	} else {
+                const char *udn;
+
+                udn = gupnp_service_info_get_udn
+			(GUPNP_SERVICE_INFO (av_transport));
+
+                g_warning ("Failed to set URI '%s' on %s: %s",
+                           data->uri,
+                           udn,
+                           error->message);
+
+                g_error_free (error);
+
+                play_wait_done (data->wait, FALSE);
+        }
+	
+        set_av_transport_uri_data_free (data);
+//        g_object_unref (av_transport);
+}
+
+
+
+void set_av_transport_uri(const char *metadata, GUPnPServiceProxy *av_transport, PlayWait *wait)
+{
+	GUPnPDIDLLiteResource *resource;
+	const char *uri;
+	SetAVTransportURIData *data;
+
+
+
+	resource = find_compat_res_from_metadata (metadata);
+	if (resource == NULL) {
+		g_warning ("no compatible URI found.");
+
+		play_wait_done (wait, FALSE);
+		
+		return;
+	}
+
+	uri = gupnp_didl_lite_resource_get_uri (resource);
+	data = set_av_transport_uri_data_new (G_CALLBACK (play_after_uri_set), uri, wait);
+	puts(uri);
+//	puts(metadata);
+	action_begin (av_transport,
+                      "SetAVTransportURI",
+                      set_av_transport_uri_cb,
+                      data,
+                      "InstanceID",
+                      G_TYPE_UINT,
+                      0,
+                      "CurrentURI",
+                      G_TYPE_STRING,
+                      uri,
+                      "CurrentURIMetaData",
+                      G_TYPE_STRING,
+                      metadata,
+                      NULL);
+
+	g_object_unref (resource);
+}
+
+
+static void
+browse_metadata_cb (GUPnPServiceProxy       *content_dir,
+                    GUPnPServiceProxyAction *action,
+                    gpointer                 user_data)
+{
+	BrowseMetadataData *data;
+        GUPnPServiceProxy  *av_transport;
+        char               *metadata;
+        GError             *error;
+	char *udn;
+
+	data = (BrowseMetadataData *) user_data;
+        metadata = NULL;
+        error = NULL;
+
+        action_end (content_dir,
+                    action,
+                    &error,
+                    /* OUT args */
+                    "Result",
+                    G_TYPE_STRING,
+                    &metadata,
+                    NULL);
+        av_transport = renderer_ref_av_transport (current_renderer);
+        if (metadata && av_transport) {
+		set_av_transport_uri(metadata, av_transport, data->user_data);
+
+                g_free (metadata);
+        } else if (metadata) {
+                g_warning ("Renderer '%s' is gone", current_renderer);
+                g_free (metadata);
+
+                play_wait_done (data->user_data, FALSE);
+        } else {
+                g_warning ("Failed to get metadata for '%s': %s",
+                           data->id,
+                           error ? error->message : "no result");
+
+                g_clear_error (&error);
+
+                play_wait_done (data->user_data, FALSE);
+        }
+
+        g_clear_object (&av_transport);
+        browse_metadata_data_free (data);
+        g_object_unref (content_dir);
+}
+
+
+static void
+browse_metadata (GUPnPServiceProxy *content_dir,
+                 const char        *id,
+                 PlayWait          *wait)
+{
+ 
+        BrowseMetadataData *data;
+
+        data = browse_metadata_data_new (NULL, id, wait);
+
+        action_begin
+		(g_object_ref (content_dir),
+		 "Browse",
+		 browse_metadata_cb,
+		 data,
+		 /* IN args */
+		 "ObjectID",
+		 G_TYPE_STRING,
+		 data->id,
+		 "BrowseFlag",
+		 G_TYPE_STRING,
+		 "BrowseMetadata",
+		 "Filter",
+		 G_TYPE_STRING,
+		 filter_profile_filters[FILTER_PLAYBACK],
+		 "StartingIndex",
+		 G_TYPE_UINT,
+		 0,
+		 "RequestedCount",
+		 G_TYPE_UINT, 0,
+		 "SortCriteria",
+		 G_TYPE_STRING,
+		 "",
+		 NULL);
+}
+
+static void player_control(void);
+
+static void
+av_transport_action_cb (GUPnPServiceProxy       *av_transport,
+                        GUPnPServiceProxyAction *action,
+                        gpointer                 user_data)
+{
+
+        char *action_name;
+        GError *error;
+
+        action_name = (const char *) user_data;
+
+        error = NULL;
+        if (!action_end (av_transport,
+                         action,
+                         &error,
+                         NULL)) {
+                const char *udn;
+
+                udn = gupnp_service_info_get_udn
+			(GUPNP_SERVICE_INFO (av_transport));
+
+                g_warning ("Failed to send action '%s' to '%s': %s",
+                           action_name,
+                           udn,
+                           error->message);
+
+                g_error_free (error);
+
+                /* The guess made when sending was wrong */
+                renderer_query_transport (av_transport);
+        }
+}
+
+static void
+g_value_free (gpointer data)
+{
+	g_value_unset ((GValue *) data);
+	g_slice_free (GValue, data);
+}
+
+
+void
+av_transport_send_action (char *action)
+                          
+{
+
+	GUPnPServiceProxy *av_transport = renderer_ref_av_transport(current_renderer);
+
+	ActionTemplateId template_id;
+
+	if(av_transport == NULL)
+		return;
+
+	if(!strcmp(action, "Play"))
+		template_id = TEMPLATE_PLAY;
+	else if(!strcmp(action, "Pause"))
+		template_id = TEMPLATE_PAUSE;
+	else if(!strcmp(action, "Stop"))
+		template_id = TEMPLATE_STOP;
+	else {
+		action_begin (av_transport,
+			      action,
+			      av_transport_action_cb,
+			      action,
+			      "InstanceID", G_TYPE_UINT, 0,
+			      NULL);
+		g_object_unref (av_transport);
+
+		return;
+	}
+
+	if(template_id == TEMPLATE_STOP)
+		renderer_queue_halt(current_renderer);
+
+	/* Whoever asks next can tell what is valid without a round trip */
+	renderer_set_status(current_renderer,
+			    template_id == TEMPLATE_PLAY ? PLAYING :
+			    template_id == TEMPLATE_PAUSE ? PAUSED : STOPPED);
+
+	action_begin_template (av_transport,
+			       template_id,
+			       NULL,
+			       av_transport_action_cb,
+			       action);
+	g_object_unref (av_transport);
+}
+
+static void play_file (void)
+{
+
+        av_transport_send_action ("Play");
+	
+}
+
+static void pause_file()
+{
+	av_transport_send_action ("Pause");
+}
+
+static void stop_file()
+{
+	av_transport_send_action ("Stop");
+}
+
+
+
+static void
+get_position_info_cb (GUPnPServiceProxy       *av_transport,
+                      GUPnPServiceProxyAction *action,
+                      gpointer                 user_data)
+{
+	//      printf("On %s function\n",__func__);
+        gchar       *position;
+	gchar *duration;
+        const gchar *udn;
+        GError      *error;
+	char curr_pos[64];
+	static char track_duration[64];
+	
+	
+        udn = gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (av_transport));
+        error = NULL;
+        if (!action_end (av_transport,
+                         action,
+                         &error,
+                         "RelTime",
+                         G_TYPE_STRING,
+                         &position,
+			 "TrackDuration",
+			 G_TYPE_STRING,
+			 &duration,
+			 NULL)) {
+                printf("Failed to get current media position"
+                           "from media renderer '%s':%s\n",
+                           udn,
+                           error->message);
+                g_error_free (error);
+                goto return_point;
+        }
+	/* Polls are what keeps the seek position honest.  Seek is sent
+	 * as REL_TIME, so the position has to be RelTime as well */
+	if (parse_duration(position) >= 0) {
+		RendererData *r;
+
+		g_mutex_lock (&renderer_state_lock);
+		r = (RendererData*)g_hash_table_lookup(renderer_table, udn);
+		if (r != NULL)
+			r->duration = parse_duration(duration);
+		g_mutex_unlock (&renderer_state_lock);
+
+		renderer_report (udn, CONTROL_SEEK, parse_duration(position));
+	}
+
+	memset(curr_pos, 0, sizeof(curr_pos));
+	strncpy(curr_pos, position, strlen(position) - 1);
+	curr_pos[strlen(position)] = '\0';
+
+	memset(track_duration, 0, sizeof(track_duration));
+	strncpy(track_duration, duration, strlen(duration) - 1);
+	track_duration[strlen(duration)] = '\0';
+	
+
+
+	printf("\r%s:%s", track_duration, curr_pos);
+
+	fflush(stdout);
+
+	g_free(position);
+	g_free(duration);
+	
+return_point:
+	sem_post(&duration_sem);
+	return;
+
+//        g_object_unref (av_transport);
+}
+
+void *duration_update_func(void *ptr)
+{
+	printf("on %s\n",__func__);
+
+	RendererData *r;
+	GUPnPServiceProxy *av_transport;
+
+	g_mutex_lock(&renderer_state_lock);
+	r = (RendererData*)g_hash_table_lookup(renderer_table, current_renderer);
+	if(r != NULL)
+		printf("renderer name: %s\n",(const char*)r->friendly_name);
+	g_mutex_unlock(&renderer_state_lock);
+	while(1)
+	{
+		/* The renderer may have left, its proxy with it */
+		av_transport = renderer_ref_av_transport(current_renderer);
+		if(av_transport == NULL)
+			break;
+
+		action_begin_template (av_transport,
+				       TEMPLATE_GET_POSITION_INFO,
+				       NULL,
+				       get_position_info_cb,
+				       NULL);
+		g_object_unref (av_transport);
+
+		sem_wait(&duration_sem);
+		/* A queue stops between tracks */
+		if(renderer_get_status(current_renderer) == STOPPED &&
+		   !renderer_queue_is_playing(current_renderer))
+			break;
+
+		/* Refused polls come back at once, don't spin on them */
+		if(device_health_is_failing(current_renderer))
+			sleep(1);
+		
+	}
+}
+
+
+static void player_control()
+{
+	char user_input[256];
+	char *c;
+	int volume;
+	gboolean mute;
+	
+	GThread *duration_update;
+
+	duration_update = g_thread_new("duration_update",(GThreadFunc)duration_update_func, NULL);
+	sleep(1);
+	while(1) {
+		printf("\nEnter u/U to pause \nEnter p/P to play\nEnter s/S to stop\n");
+		printf("Enter +/- to change the volume, v/V to set it\n");
+		printf("Enter m/M to toggle mute\n");
+		printf("Enter f/F or b/B to skip 10 seconds forward or back\n");
+		printf("Enter j/J to jump to a position\n");
+		printf("Enter n/N to skip to the next queued track\n");
+		printf("> ");
+		memset(user_input, 0, sizeof(user_input));
+		fgets(user_input, sizeof(user_input), stdin);
+
+		if(!renderer_get_levels(current_renderer, &volume, &mute)) {
+			printf("Renderer is gone\n");
+			break;
+		}
+
+		switch(user_input[0])
+		{
+		case 'u':
+		case 'U':
+			if(renderer_get_status(current_renderer) == PLAYING)
+				pause_file();
+			break;
+		case 'p':
+		case 'P':
+			if(renderer_get_status(current_renderer) == PAUSED)
+				play_file();
+			break;
+		case 's':
+		case 'S':
+			if(renderer_get_status(current_renderer) != STOPPED)
+				stop_file();
+			break;
+		case '+':
+		case '-':
+			/* "+++" steps three times, the last two steps go
+			 * out together behind the first */
+			for (c = user_input; *c == '+' || *c == '-'; c++)
+				renderer_change_volume(current_renderer, *c == '+' ? 5 : -5);
+			renderer_get_levels(current_renderer, &volume, &mute);
+			if (volume >= 0)
+				printf("Volume %d\n", volume);
+			else
+				puts("Volume not known yet, asking the renderer");
+			break;
+		case 'v':
+		case 'V':
+			printf("Volume (0-100): ");
+			fgets(user_input, sizeof(user_input), stdin);
+			renderer_set_volume(current_renderer, atoi(user_input));
+			renderer_get_levels(current_renderer, &volume, &mute);
+			printf("Volume %d\n", volume);
+			break;
+		case 'm':
+		case 'M':
+			renderer_toggle_mute(current_renderer);
+			renderer_get_levels(current_renderer, &volume, &mute);
+			printf(mute ? "Muted\n" : "Unmuted\n");
+			break;
+		case 'f':
+		case 'F':
+		case 'b':
+		case 'B':
+			for (c = user_input; *c != '\0' && strchr("fFbB", *c); c++)
+				renderer_skip(current_renderer, (*c == 'f' || *c == 'F') ? 10 : -10);
+			break;
+		case 'j':
+		case 'J':
+			printf("Position (H:MM:SS): ");
+			fgets(user_input, sizeof(user_input), stdin);
+			if (parse_duration(user_input) >= 0)
+				renderer_seek(current_renderer, parse_duration(user_input));
+			else
+				printf("Enter valid position !!!\n");
+			break;
+		case 'n':
+		case 'N':
+			if(!renderer_queue_next(current_renderer))
+				printf("Nothing queued\n");
+			break;
+		default:
+			printf("Enter valid input !!!\n");
+		}
+		
+		/* A queue stops between tracks */
+		if(renderer_get_status(current_renderer) == STOPPED &&
+		   !renderer_queue_is_playing(current_renderer))
+			break;
+	}
+			
+}
+
+
+/* Status export.  With --status-shm the registry and what every
+ * renderer is doing are mirrored into a POSIX shared memory segment
+ * that monitors map read-only and poll without talking to us.  The
+ * layout is fixed, see StatusShm, and guarded by a seqlock: sequence is
+ * odd while the main thread writes, so a reader copies what it needs,
+ * reads sequence again and retries if it changed or was odd. */
+#define STATUS_SHM_MAGIC 0x53504e44 /* "DNPS" */
+#define STATUS_SHM_VERSION 2
+#define STATUS_SHM_DEVICES 256
+#define STATUS_SHM_INTERVAL_MS 100
+
+typedef enum
+{
+	STATUS_DEVICE_SERVER = 1,
+	STATUS_DEVICE_RENDERER = 2
+} StatusDeviceKind;
+
+typedef struct
+{
+	char udn[64];
+	char name[64];
+	guint32 kind;
+
+	/* Renderers only: player_status, 0-100 (-1 when unknown), 0 or 1 */
+	guint32 state;
+	gint32 volume;
+	guint32 mute;
+	/* Seconds, -1 when unknown */
+	gint64 position;
+	gint64 duration;
+	guint32 queued;
+	guint32 failing;
+
+	char uri[512];
+	char title[128];
+} StatusShmDevice;
+
+typedef struct
+{
+	guint32 magic;
+	guint32 version;
+	guint32 header_size;
+	guint32 device_size;
+	guint32 capacity;
+	guint32 pid;
+
+	/* Odd while an update is being written */
+	volatile guint32 sequence;
+	guint32 count;
+	/* g_get_real_time () of the last update */
+	gint64 updated;
+
+	StatusShmDevice devices[STATUS_SHM_DEVICES];
+} StatusShm;
+
+static StatusShm *status_shm = NULL;
+
+/* What was published last, updates that change nothing are skipped,
+ * and the next update being put together */
+static StatusShmDevice status_shm_staging[STATUS_SHM_DEVICES];
+static StatusShmDevice status_shm_scratch[STATUS_SHM_DEVICES];
+static guint status_shm_count = 0;
+
+static guint
+status_shm_collect (StatusShmDevice *devices)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	guint n = 0, first_renderer, i;
+
+	memset (devices, 0, sizeof (StatusShmDevice) * STATUS_SHM_DEVICES);
+
+	g_hash_table_iter_init (&iter, server_table);
+	while (n < STATUS_SHM_DEVICES &&
+	       g_hash_table_iter_next (&iter, &key, &value)) {
+		MediaServers *s = (MediaServers *) value;
+		StatusShmDevice *device = &devices[n++];
+
+		device->kind = STATUS_DEVICE_SERVER;
+		g_strlcpy (device->udn, key, sizeof (device->udn));
+		g_strlcpy (device->name, s->friendly_name, sizeof (device->name));
+		device->position = -1;
+		device->duration = -1;
+		device->failing = device_health_is_failing (key);
+	}
+
+	first_renderer = n;
+	g_mutex_lock (&renderer_state_lock);
+	g_hash_table_iter_init (&iter, renderer_table);
+	while (n < STATUS_SHM_DEVICES &&
+	       g_hash_table_iter_next (&iter, &key, &value)) {
+		RendererData *r = (RendererData *) value;
+		StatusShmDevice *device = &devices[n++];
+
+		device->kind = STATUS_DEVICE_RENDERER;
+		g_strlcpy (device->udn, key, sizeof (device->udn));
+		g_strlcpy (device->name, r->friendly_name, sizeof (device->name));
+		device->state = r->status;
+		device->volume = r->volume;
+		device->mute = r->mute;
+		device->position = r->position;
+		device->duration = r->duration;
+		device->queued = r->queue.length;
+		if (r->uri != NULL)
+			g_strlcpy (device->uri, r->uri, sizeof (device->uri));
+		if (r->title != NULL)
+			g_strlcpy (device->title, r->title, sizeof (device->title));
+	}
+	g_mutex_unlock (&renderer_state_lock);
+
+	/* Health has its own lock, asked outside renderer_state_lock */
+	for (i = first_renderer; i < n; i++)
+		devices[i].failing = device_health_is_failing (devices[i].udn);
+
+	return n;
+}
+
+static gboolean
+status_shm_update_cb (gpointer user_data)
+{
+	guint n;
+
+	n = status_shm_collect (status_shm_scratch);
+	if (n == status_shm_count &&
+	    !memcmp (status_shm_scratch,
+		     status_shm_staging,
+		     sizeof (status_shm_staging)))
+		return TRUE;
+
+	memcpy (status_shm_staging,
+		status_shm_scratch,
+		sizeof (status_shm_staging));
+	status_shm_count = n;
+
+	/* Both increments are full barriers, the copy can not leak out of
+	 * the odd window */
+	g_atomic_int_inc ((gint *) &status_shm->sequence);
+	memcpy (status_shm->devices,
+		status_shm_staging,
+		sizeof (status_shm_staging));
+	status_shm->count = n;
+	status_shm->updated = g_get_real_time ();
+	g_atomic_int_inc ((gint *) &status_shm->sequence);
+
+	return TRUE;
+}
+
+/* Creates the segment called @name, "/dlna-status" for example */
+static gboolean
+status_shm_open (const char *name)
+{
+	int fd;
+
+	fd = shm_open (name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0) {
+		g_warning ("Could not create shared memory '%s': %s",
+			   name,
+			   g_strerror (errno));
+
+		return FALSE;
+	}
+
+	if (ftruncate (fd, sizeof (StatusShm)) < 0) {
+		g_warning ("Could not size shared memory '%s': %s",
+			   name,
+			   g_strerror (errno));
+		close (fd);
+		shm_unlink (name);
+
+		return FALSE;
+	}
+
+	status_shm = mmap (NULL,
+			   sizeof (StatusShm),
+			   PROT_READ | PROT_WRITE,
+			   MAP_SHARED,
+			   fd,
+			   0);
+	close (fd);
+	if (status_shm == MAP_FAILED) {
+		g_warning ("Could not map shared memory '%s': %s",
+			   name,
+			   g_strerror (errno));
+		status_shm = NULL;
+		shm_unlink (name);
+
+		return FALSE;
+	}
+
+	status_shm->header_size = G_STRUCT_OFFSET (StatusShm, devices);
+	status_shm->device_size = sizeof (StatusShmDevice);
+	status_shm->capacity = STATUS_SHM_DEVICES;
+	status_shm->version = STATUS_SHM_VERSION;
+	status_shm->pid = getpid ();
+	/* Readers check the magic last */
+	g_atomic_int_set ((gint *) &status_shm->magic, STATUS_SHM_MAGIC);
+
+	g_timeout_add (STATUS_SHM_INTERVAL_MS, status_shm_update_cb, NULL);
+
+	return TRUE;
+}
+
+static void
+status_shm_close (const char *name)
+{
+	if (status_shm == NULL)
+		return;
+
+	munmap (status_shm, sizeof (StatusShm));
+	status_shm = NULL;
+	shm_unlink (name);
+}
+
+static gboolean
+select_renderer (void)
+{
+	guint i;
+	RendererData *data = NULL;
+	GHashTableIter iter;
+	gpointer key, value;
+	GPtrArray *listed;
+	gboolean known;
+	char user_input[256];
+	char renderer_selected[256];
+
+	/* UDN and name pairs, status and health take their own locks */
+	listed = g_ptr_array_new_with_free_func(g_free);
+	g_mutex_lock(&renderer_state_lock);
+	g_hash_table_iter_init(&iter, renderer_table);
+	while(g_hash_table_iter_next(&iter, &key, &value))
+	{
+		data = (RendererData*)value;
+		g_ptr_array_add(listed, g_strdup(key));
+		g_ptr_array_add(listed, g_strdup(data->friendly_name));
+	}
+	g_mutex_unlock(&renderer_state_lock);
+
+	if(listed->len != 0) {
+
+		printf("Renderers list:\n");
+		for(i = 0; i < listed->len; i += 2)
+		{
+			key = g_ptr_array_index(listed, i);
+			printf("%u . %s->%s [%s]%s\n", i / 2 + 1,
+			       (const char*)g_ptr_array_index(listed, i + 1), (const char*)key,
+			       player_status_names[renderer_get_status(key)],
+			       device_health_is_failing(key) ? " (not responding)" : "");
+		}
+	}
+	g_ptr_array_unref(listed);
+	printf("Select Renderer: ");
+
+	memset(user_input, 0, sizeof(user_input));
+	memset(renderer_selected, 0, sizeof(renderer_selected));
+
+	fgets(user_input, sizeof(user_input), stdin);
+	strncpy(renderer_selected, user_input, (strlen(user_input) - 1));
+	renderer_selected[strlen(user_input)] = '\0';
+	g_mutex_lock(&renderer_state_lock);
+	known = g_hash_table_contains(renderer_table, renderer_selected);
+	g_mutex_unlock(&renderer_state_lock);
+	if(!known)
+		return FALSE;
+
+	strcpy(current_renderer, renderer_selected);
+
+	return TRUE;
+}
+
+/* Sets @id on the current renderer and starts playing it, blocks until
+ * the renderer is playing.  Objects browsed with their res take a
+ * single SetAVTransportURI with Play chained behind it. */
+static gboolean
+start_playback_media (GUPnPServiceProxy *content_dir,
+                      const char        *id,
+                      FilterProfile      detail,
+                      const char        *uri,
+                      const char        *metadata)
+{
+	GUPnPServiceProxy *av_transport;
+	PlayWait wait;
+
+	renderer_queue_halt(current_renderer);
+	av_transport = renderer_ref_av_transport(current_renderer);
+	if(av_transport == NULL)
+		return FALSE;
+
+	play_wait_init(&wait);
+	if(detail < FILTER_PLAYBACK) {
+		/* Listed without its res, one BrowseMetadata gets it */
+		browse_metadata(g_object_ref(content_dir), id, &wait);
+	} else if(metadata != NULL) {
+		set_av_transport_uri(metadata, av_transport, &wait);
+	} else if(uri != NULL) {
+		SetAVTransportURIData *data;
+
+		data = set_av_transport_uri_data_new (G_CALLBACK (play_after_uri_set), uri, &wait);
+		action_begin (av_transport,
+			      "SetAVTransportURI",
+			      set_av_transport_uri_cb,
+			      data,
+			      "InstanceID",
+			      G_TYPE_UINT,
+			      0,
+			      "CurrentURI",
+			      G_TYPE_STRING,
+			      uri,
+			      "CurrentURIMetaData",
+			      G_TYPE_STRING,
+			      "",
+			      NULL);
+	} else {
+
+		browse_metadata(g_object_ref(content_dir), id, &wait);
+	}
+	g_object_unref(av_transport);
+
+	return play_wait_finish(&wait);
+}
+
+/* start_playback_media () for @c, which the caller keeps alive */
+static gboolean
+start_playback_object (GUPnPServiceProxy *content_dir,
+                       const char        *id,
+                       Container         *c)
+{
+	char *metadata = c != NULL ? container_metadata (id, c) : NULL;
+	gboolean ret;
+
+	ret = start_playback_media (content_dir,
+				    id,
+				    c != NULL ? c->detail : FILTER_LISTING,
+				    c != NULL ? c->uri : NULL,
+				    metadata);
+	g_free (metadata);
+
+	return ret;
+}
+
+/* start_playback_media () for @id as cached, from any thread but the
+ * main one */
+static gboolean
+start_playback (GUPnPServiceProxy *content_dir,
+                const char        *id)
+{
+	CacheCopy copy;
+	gboolean ret;
+
+	cache_copy (gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (content_dir)),
+		    id,
+		    &copy);
+	ret = start_playback_media (content_dir,
+				    id,
+				    copy.found ? copy.detail : FILTER_LISTING,
+				    copy.uri,
+				    copy.metadata);
+	cache_copy_clear (&copy);
+
+	return ret;
+}
+
+void play(GUPnPServiceProxy *content_dir, char *id)
+{
+	char id_copy[256];
+	
+	strncpy(id_copy, id, strlen(id));
+	id_copy[strlen(id)] = '\0';
+
+	puts(id_copy);
+
+	while(!select_renderer())
+		puts("Wrong input !! Enter valid renderer..");
+
+	if(start_playback(content_dir, id_copy))
+		player_control();
+}
+
+static void
+local_media_free (LocalMedia *media)
+{
+        g_free (media->path);
+        g_free (media->mime_type);
+        g_slice_free (LocalMedia, media);
+}
+
+/* The id @uri was published under by local_media_publish (), 0 if it
+ * points somewhere else */
+static guint
+local_media_id (const char *uri)
+{
+        char  *prefix;
+        guint  id = 0;
+
+        if (uri == NULL || http_service == NULL || local_host_ip == NULL)
+                return 0;
+
+        prefix = g_strdup_printf ("http://%s:%d" MEDIA_HTTP_PATH,
+                                  local_host_ip,
+                                  http_port);
+        if (g_str_has_prefix (uri, prefix))
+                id = (guint) g_ascii_strtoull (uri + strlen (prefix),
+                                               NULL,
+                                               10);
+        g_free (prefix);
+
+        return id;
+}
+
+/* Stops serving the file @uri points at once no renderer plays it any
+ * more.  Must be called with renderer_state_lock held. */
+static void
+local_media_release (const char *uri)
+{
+        GHashTableIter  iter;
+        RendererData   *renderer;
+        guint           id;
+
+        id = local_media_id (uri);
+        if (id == 0)
+                return;
+
+        g_hash_table_iter_init (&iter, renderer_table);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &renderer))
+                if (local_media_id (renderer->uri) == id)
+                        return;
+
+        g_mutex_lock (&local_media_lock);
+        g_hash_table_remove (local_media_table, GUINT_TO_POINTER (id));
+        g_mutex_unlock (&local_media_lock);
+}
+
+/* Returns a copy, the entry may be released while the file is sent */
+static LocalMedia *
+local_media_lookup (const char *request_path)
+{
+        LocalMedia *media, *copy = NULL;
+        guint       id;
+
+        if (!g_str_has_prefix (request_path, MEDIA_HTTP_PATH))
+                return NULL;
+
+        /* Everything after the id is the escaped file name, it is only
+         * there to make the URI readable on the renderer */
+        id = (guint) g_ascii_strtoull (request_path + strlen (MEDIA_HTTP_PATH),
+                                       NULL,
+                                       10);
+
+        g_mutex_lock (&local_media_lock);
+        media = g_hash_table_lookup (local_media_table, GUINT_TO_POINTER (id));
+        if (media != NULL) {
+                copy = g_slice_new (LocalMedia);
+                copy->path = g_strdup (media->path);
+                copy->mime_type = g_strdup (media->mime_type);
+                copy->size = media->size;
+        }
+        g_mutex_unlock (&local_media_lock);
+
+        return copy;
+}
+
+/* Parses a single "bytes=" range against a file of @size bytes.  Returns
+ * FALSE if the range can not be satisfied. */
+static gboolean
+parse_range_header (const char *range,
+                    goffset     size,
+                    goffset    *start,
+                    goffset    *end)
+{
+        const char *spec;
+        char       *endptr;
+
+        if (!g_str_has_prefix (range, "bytes="))
+                return FALSE;
+
+        spec = range + strlen ("bytes=");
+        if (*spec == '-') {
+                guint64 suffix;
+
+                suffix = g_ascii_strtoull (spec + 1, &endptr, 10);
+                if (endptr == spec + 1 || suffix == 0)
+                        return FALSE;
+
+                *start = suffix > (guint64) size ? 0 : size - suffix;
+                *end = size - 1;
+        } else {
+                *start = g_ascii_strtoull (spec, &endptr, 10);
+                if (endptr == spec || *endptr != '-')
+                        return FALSE;
+
+                spec = endptr + 1;
+                if (*spec == '\0' || *spec == ',')
+                        *end = size - 1;
+                else
+                        *end = g_ascii_strtoull (spec, NULL, 10);
+
+                if (*end >= size)
+                        *end = size - 1;
+        }
+
+        return *start <= *end && *start < size;
+}
+
+static gboolean
+http_send_all (GSocket    *socket,
+               const char *buffer,
+               gsize       size)
+{
+        gsize sent = 0;
+
+        while (sent < size) {
+                gssize ret;
+
+                ret = g_socket_send (socket,
+                                     buffer + sent,
+                                     size - sent,
+                                     NULL,
+                                     NULL);
+                if (ret <= 0)
+                        return FALSE;
+
+                sent += ret;
+        }
+
+        return TRUE;
+}
+
+/* Pushes @length bytes of @fd starting at @offset to the socket, using
+ * sendfile so the data never passes through user space.  Falls back to
+ * writing from a mapping of the file if the kernel refuses. */
+static gboolean
+http_send_file (GSocket *socket,
+                int      fd,
+                goffset  offset,
+                goffset  length)
+{
+        off_t   pos = offset;
+        goffset remaining = length;
+        int     sock_fd;
+
+        sock_fd = g_socket_get_fd (socket);
+
+        while (remaining > 0) {
+                ssize_t sent;
+
+                sent = sendfile (sock_fd, fd, &pos, MIN (remaining, G_MAXINT));
+                if (sent > 0) {
+                        remaining -= sent;
+
+                        continue;
+                }
+
+                if (sent == 0)
+                        return FALSE;
+
+                if (errno == EINTR)
+                        continue;
+
+                if (errno == EAGAIN) {
+                        /* GSocket keeps the descriptor non-blocking */
+                        if (!g_socket_condition_wait (socket,
+                                                      G_IO_OUT,
+                                                      NULL,
+                                                      NULL))
+                                return FALSE;
+
+                        continue;
+                }
+
+                if (errno == EINVAL || errno == ENOSYS)
+                        break;
+
+                return FALSE;
+        }
+
+        if (remaining > 0) {
+                GMappedFile *mapped;
+                gboolean     ret;
+
+                mapped = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+                if (mapped == NULL)
+                        return FALSE;
+
+                ret = http_send_all (socket,
+                                     g_mapped_file_get_contents (mapped) + pos,
+                                     remaining);
+                g_mapped_file_unref (mapped);
+
+                return ret;
+        }
+
+        return TRUE;
+}
+
+static gboolean
+http_send_status (GSocket    *socket,
+                  const char *status,
+                  gboolean    keep_alive)
+{
+        char *response;
+        gboolean ret;
+
+        response = g_strdup_printf ("HTTP/1.1 %s\r\n"
+                                    "Content-Length: 0\r\n"
+                                    "Connection: %s\r\n"
+                                    "\r\n",
+                                    status,
+                                    keep_alive ? "keep-alive" : "close");
+        ret = http_send_all (socket, response, strlen (response));
+        g_free (response);
+
+        return ret;
+}
+
+/* Serves a single GET or HEAD request for a registered local file.
+ * Returns FALSE if the connection should be dropped. */
+static gboolean
+http_serve_request (GSocket    *socket,
+                    const char *method,
+                    const char *path,
+                    const char *range,
+                    const char *transfer_mode,
+                    gboolean    keep_alive)
+{
+        LocalMedia *media;
+        GString    *headers;
+        goffset     start, end, size;
+        struct stat st;
+        gboolean    head, ret;
+        int         fd;
+
+        head = !strcmp (method, "HEAD");
+        if (!head && strcmp (method, "GET"))
+                return http_send_status (socket,
+                                         "405 Method Not Allowed",
+                                         keep_alive);
+
+        media = local_media_lookup (path);
+        if (media == NULL)
+                return http_send_status (socket, "404 Not Found", keep_alive);
+
+        fd = open (media->path, O_RDONLY);
+        if (fd < 0 || fstat (fd, &st) < 0) {
+                if (fd >= 0)
+                        close (fd);
+                local_media_free (media);
+
+                return http_send_status (socket, "404 Not Found", keep_alive);
+        }
+
+        size = st.st_size;
+        start = 0;
+        end = size - 1;
+
+        headers = g_string_new (NULL);
+        if (range != NULL) {
+                if (!parse_range_header (range, size, &start, &end)) {
+                        g_string_free (headers, TRUE);
+                        close (fd);
+                        local_media_free (media);
+
+                        return http_send_status
+                                (socket,
+                                 "416 Requested Range Not Satisfiable",
+                                 keep_alive);
+                }
+
+                g_string_append_printf (headers,
+                                        "HTTP/1.1 206 Partial Content\r\n"
+                                        "Content-Range: bytes %" G_GINT64_FORMAT
+                                        "-%" G_GINT64_FORMAT
+                                        "/%" G_GINT64_FORMAT "\r\n",
+                                        (gint64) start,
+                                        (gint64) end,
+                                        (gint64) size);
+        } else
+                g_string_append (headers, "HTTP/1.1 200 OK\r\n");
+
+        g_string_append_printf (headers,
+                                "Content-Type: %s\r\n"
+                                "Content-Length: %" G_GINT64_FORMAT "\r\n"
+                                "Accept-Ranges: bytes\r\n"
+                                "Connection: %s\r\n",
+                                media->mime_type,
+                                (gint64) (size > 0 ? end - start + 1 : 0),
+                                keep_alive ? "keep-alive" : "close");
+        if (transfer_mode != NULL)
+                g_string_append_printf (headers,
+                                        "transferMode.dlna.org: %s\r\n",
+                                        transfer_mode);
+        g_string_append (headers, "\r\n");
+
+        ret = http_send_all (socket, headers->str, headers->len);
+        if (ret && !head && size > 0)
+                ret = http_send_file (socket, fd, start, end - start + 1);
+
+        g_string_free (headers, TRUE);
+        close (fd);
+        local_media_free (media);
+
+        return ret;
+}
+
+/* Runs on one of the service's worker threads, so a renderer that reads
+ * slowly only ever stalls its own stream */
+static gboolean
+http_server_run_cb (GThreadedSocketService *service,
+                    GSocketConnection      *connection,
+                    GObject                *source_object,
+                    gpointer                user_data)
+{
+        GDataInputStream *input;
+        GSocket          *socket;
+        gboolean          keep_alive = TRUE;
+
+        socket = g_socket_connection_get_socket (connection);
+        input = g_data_input_stream_new
+                (g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+        g_data_input_stream_set_newline_type (input,
+                                              G_DATA_STREAM_NEWLINE_TYPE_ANY);
+        g_filter_input_stream_set_close_base_stream
+                (G_FILTER_INPUT_STREAM (input), FALSE);
+
+        while (keep_alive) {
+                char   *request_line, *line;
+                char  **tokens;
+                char   *range = NULL;
+                char   *transfer_mode = NULL;
+                gsize   header_size = 0;
+
+                request_line = g_data_input_stream_read_line (input,
+                                                              NULL,
+                                                              NULL,
+                                                              NULL);
+                if (request_line == NULL)
+                        break;
+
+                tokens = g_strsplit (request_line, " ", 3);
+                if (g_strv_length (tokens) < 3) {
+                        g_strfreev (tokens);
+                        g_free (request_line);
+
+                        break;
+                }
+
+                keep_alive = !strcmp (tokens[2], "HTTP/1.1");
+
+                while ((line = g_data_input_stream_read_line (input,
+                                                              NULL,
+                                                              NULL,
+                                                              NULL))) {
+                        char *value;
+
+                        header_size += strlen (line);
+                        if (*line == '\0' || header_size > MAX_HTTP_HEADER) {
+                                g_free (line);
+
+                                break;
+                        }
+
+                        value = strchr (line, ':');
+                        if (value != NULL) {
+                                *value++ = '\0';
+                                value = g_strstrip (value);
+
+                                if (!g_ascii_strcasecmp (line, "Range")) {
+                                        g_free (range);
+                                        range = g_strdup (value);
+                                } else if (!g_ascii_strcasecmp
+                                           (line, "transferMode.dlna.org")) {
+                                        g_free (transfer_mode);
+                                        transfer_mode = g_strdup (value);
+                                } else if (!g_ascii_strcasecmp
+                                           (line, "Connection")) {
+                                        keep_alive = !g_ascii_strcasecmp
+                                                (value, "keep-alive");
+                                }
+                        }
+
+                        g_free (line);
+                }
+
+                if (header_size > MAX_HTTP_HEADER)
+                        keep_alive = FALSE;
+                else if (!http_serve_request (socket,
+                                              tokens[0],
+                                              tokens[1],
+                                              range,
+                                              transfer_mode,
+                                              keep_alive))
+                        keep_alive = FALSE;
+
+                g_free (range);
+                g_free (transfer_mode);
+                g_strfreev (tokens);
+                g_free (request_line);
+        }
+
+        g_object_unref (input);
+
+        return FALSE;
+}
+
+static gboolean
+http_server_start (void)
+{
+        GError *error = NULL;
+
+        local_media_table = g_hash_table_new_full (g_direct_hash,
+                                                   g_direct_equal,
+                                                   NULL,
+                                                   (GDestroyNotify) local_media_free);
+
+        http_service = G_THREADED_SOCKET_SERVICE
+                (g_threaded_socket_service_new (http_threads));
+
+        if (http_port == 0)
+                http_port = g_socket_listener_add_any_inet_port
+                        (G_SOCKET_LISTENER (http_service), NULL, &error);
+        else
+                g_socket_listener_add_inet_port
+                        (G_SOCKET_LISTENER (http_service),
+                         http_port,
+                         NULL,
+                         &error);
+
+        if (error) {
+                g_warning ("Failed to start media server: %s",
+                           error->message);
+                g_error_free (error);
+                g_clear_object (&http_service);
+
+                return FALSE;
+        }
+
+        g_signal_connect (http_service,
+                          "run",
+                          G_CALLBACK (http_server_run_cb),
+                          NULL);
+
+        g_socket_service_start (G_SOCKET_SERVICE (http_service));
+
+        return TRUE;
+}
+
+static const char *
+upnp_class_for_mime_type (const char *mime_type)
+{
+        if (g_str_has_prefix (mime_type, "audio/"))
+                return "object.item.audioItem.musicTrack";
+        else if (g_str_has_prefix (mime_type, "video/"))
+                return "object.item.videoItem";
+        else if (g_str_has_prefix (mime_type, "image/"))
+                return "object.item.imageItem.photo";
+
+        return "object.item";
+}
+
+/* Registers @path with the built-in media server and returns DIDL-Lite
+ * metadata describing it, ready for CurrentURIMetaData.  The entry goes
+ * away again through local_media_release () once no renderer plays it. */
+static char *
+local_media_publish (const char *path,
+                     guint      *published_id)
+{
+        GUPnPDIDLLiteWriter *writer;
+        GUPnPDIDLLiteObject *object;
+        GUPnPDIDLLiteResource *res;
+        GUPnPProtocolInfo   *protocol_info;
+        LocalMedia          *media;
+        struct stat          st;
+        char *content_type, *basename, *escaped, *uri, *id, *metadata;
+        guint media_id;
+
+        if (http_service == NULL || local_host_ip == NULL) {
+                g_warning ("Media server is not running");
+
+                return NULL;
+        }
+
+        if (stat (path, &st) < 0 || !S_ISREG (st.st_mode)) {
+                g_warning ("'%s' is not a regular file", path);
+
+                return NULL;
+        }
+
+        media = g_slice_new (LocalMedia);
+        media->path = g_strdup (path);
+        media->size = st.st_size;
+        content_type = g_content_type_guess (path, NULL, 0, NULL);
+        media->mime_type = g_content_type_get_mime_type (content_type);
+        if (media->mime_type == NULL)
+                media->mime_type = g_strdup ("application/octet-stream");
+        g_free (content_type);
+
+        g_mutex_lock (&local_media_lock);
+        media_id = local_media_next_id++;
+        g_hash_table_insert (local_media_table,
+                             GUINT_TO_POINTER (media_id),
+                             media);
+        g_mutex_unlock (&local_media_lock);
+        *published_id = media_id;
+
+        basename = g_path_get_basename (path);
+        escaped = g_uri_escape_string (basename, NULL, FALSE);
+        uri = g_strdup_printf ("http://%s:%d" MEDIA_HTTP_PATH "%u/%s",
+                               local_host_ip,
+                               http_port,
+                               media_id,
+                               escaped);
+        id = g_strdup_printf ("local-%u", media_id);
+
+        writer = gupnp_didl_lite_writer_new (NULL);
+        object = GUPNP_DIDL_LITE_OBJECT
+                (gupnp_didl_lite_writer_add_item (writer));
+        gupnp_didl_lite_object_set_id (object, id);
+        gupnp_didl_lite_object_set_parent_id (object, "-1");
+        gupnp_didl_lite_object_set_restricted (object, TRUE);
+        gupnp_didl_lite_object_set_title (object, basename);
+        gupnp_didl_lite_object_set_upnp_class
+                (object,
+                 upnp_class_for_mime_type (media->mime_type));
+
+        protocol_info = gupnp_protocol_info_new ();
+        gupnp_protocol_info_set_protocol (protocol_info, "http-get");
+        gupnp_protocol_info_set_network (protocol_info, "*");
+        gupnp_protocol_info_set_mime_type (protocol_info, media->mime_type);
+        gupnp_protocol_info_set_dlna_operation (protocol_info,
+                                                GUPNP_DLNA_OPERATION_RANGE);
+
+        res = gupnp_didl_lite_object_add_resource (object);
+        gupnp_didl_lite_resource_set_uri (res, uri);
+        gupnp_didl_lite_resource_set_size64 (res, media->size);
+        gupnp_didl_lite_resource_set_protocol_info (res, protocol_info);
+
+        metadata = gupnp_didl_lite_writer_get_string (writer);
+
+        g_object_unref (protocol_info);
+        g_object_unref (res);
+        g_object_unref (object);
+        g_object_unref (writer);
+        g_free (id);
+        g_free (uri);
+        g_free (escaped);
+        g_free (basename);
+
+        return metadata;
+}
+
+static gint
+compare_file_names (gconstpointer a,
+                    gconstpointer b)
+{
+        return g_strcmp0 (*(const char **) a, *(const char **) b);
+}
+
+static char *
+choose_local_file (const char *path)
+{
+        GPtrArray  *files;
+        GDir       *dir;
+        const char *name;
+        char        user_input[256];
+        char       *chosen = NULL;
+        guint       i, index;
+
+        if (!g_file_test (path, G_FILE_TEST_IS_DIR))
+                return g_strdup (path);
+
+        dir = g_dir_open (path, 0, NULL);
+        if (dir == NULL)
+                return NULL;
+
+        files = g_ptr_array_new_with_free_func (g_free);
+        while ((name = g_dir_read_name (dir))) {
+                char *file;
+
+                file = g_build_filename (path, name, NULL);
+                if (g_file_test (file, G_FILE_TEST_IS_REGULAR))
+                        g_ptr_array_add (files, file);
+                else
+                        g_free (file);
+        }
+        g_dir_close (dir);
+
+        g_ptr_array_sort (files, (GCompareFunc) compare_file_names);
+        for (i = 0; i < files->len; i++) {
+                char *basename;
+
+                basename = g_path_get_basename (files->pdata[i]);
+                printf("  %u . %s\n", i + 1, basename);
+                g_free (basename);
+        }
+
+        printf("Enter the number of the file to play: ");
+        memset(user_input, 0, sizeof(user_input));
+        fgets(user_input, sizeof(user_input), stdin);
+
+        index = (guint) g_ascii_strtoull (user_input, NULL, 10);
+        if (index >= 1 && index <= files->len)
+                chosen = g_strdup (files->pdata[index - 1]);
+
+        g_ptr_array_unref (files);
+
+        return chosen;
+}
+
+/* Publishes @file and starts playing it on the current renderer */
+static gboolean
+start_local_playback (const char *file)
+{
+        GUPnPServiceProxy *av_transport;
+        PlayWait           wait;
+        char              *metadata;
+        guint              media_id;
+        gboolean           ok;
+
+        av_transport = renderer_ref_av_transport (current_renderer);
+        if (av_transport == NULL)
+                return FALSE;
+
+        metadata = local_media_publish (file, &media_id);
+        if (metadata == NULL) {
+                g_object_unref (av_transport);
+
+                return FALSE;
+        }
+
+        play_wait_init (&wait);
+        set_av_transport_uri (metadata, av_transport, &wait);
+        g_object_unref (av_transport);
+        g_free (metadata);
+
+        ok = play_wait_finish (&wait);
+
+        /* Nothing plays it, so nothing would ever release it */
+        if (!ok) {
+                g_mutex_lock (&local_media_lock);
+                g_hash_table_remove (local_media_table,
+                                     GUINT_TO_POINTER (media_id));
+                g_mutex_unlock (&local_media_lock);
+        }
+
+        return ok;
+}
+
+static void
+play_local_file (const char *path)
+{
+        char *file;
+
+        file = choose_local_file (path);
+        if (file == NULL) {
+                puts("Wrong input !! No such file..");
+
+                return;
+        }
+
+        while(!select_renderer())
+                puts("Wrong input !! Enter valid renderer..");
+
+        if (start_local_playback (file))
+                player_control();
+
+        g_free (file);
+}
+
+typedef JsonNode *(* RpcMethodFunc) (JsonObject *params,
+                                     GError    **error);
+
+typedef struct
+{
+        const char   *name;
+        RpcMethodFunc func;
+        gboolean      exclusive;
+} RpcMethod;
+
+enum
+{
+        RPC_ERROR_PARSE = -32700,
+        RPC_ERROR_INVALID_REQUEST = -32600,
+        RPC_ERROR_METHOD_NOT_FOUND = -32601,
+        RPC_ERROR_INVALID_PARAMS = -32602,
+        RPC_ERROR_FAILED = -32000
+};
+
+#define RPC_ERROR rpc_error_quark ()
+G_DEFINE_QUARK (control-point-rpc-error-quark, rpc_error)
+
+/* browse_sem and current_renderer are shared with the
+ * interactive code, so only one client may drive the network at a time */
+static GMutex rpc_lock;
+
+/* Whether @params' @member, if it is there, holds a @type: G_TYPE_STRING,
+ * G_TYPE_INT64 or G_TYPE_BOOLEAN */
+static gboolean
+rpc_check_member (JsonObject *params,
+                  const char *member,
+                  GType       type,
+                  GError    **error)
+{
+        JsonNode *node;
+
+        if (!json_object_has_member (params, member))
+                return TRUE;
+
+        node = json_object_get_member (params, member);
+        if (JSON_NODE_HOLDS_VALUE (node) &&
+            json_node_get_value_type (node) == type)
+                return TRUE;
+
+        g_set_error (error,
+                     RPC_ERROR,
+                     RPC_ERROR_INVALID_PARAMS,
+                     "Parameter '%s' must be %s",
+                     member,
+                     type == G_TYPE_STRING ? "a string" :
+                     type == G_TYPE_BOOLEAN ? "a boolean" : "an integer");
+
+        return FALSE;
+}
+
+static const char *
+rpc_get_string (JsonObject *params,
+                const char *member,
+                GError    **error)
+{
+        const char *value = NULL;
+
+        if (!rpc_check_member (params, member, G_TYPE_STRING, error))
+                return NULL;
+
+        if (json_object_has_member (params, member))
+                value = json_object_get_string_member (params, member);
+
+        if (value == NULL)
+                g_set_error (error,
+                             RPC_ERROR,
+                             RPC_ERROR_INVALID_PARAMS,
+                             "Missing string parameter '%s'",
+                             member);
+
+        return value;
+}
+
+/* A reference to the ContentDirectory of @params' server */
+static GUPnPServiceProxy *
+rpc_get_server (JsonObject *params,
+                GError    **error)
+{
+        GUPnPServiceProxy *content_dir;
+        const char        *udn;
+
+        udn = rpc_get_string (params, "server", error);
+        if (udn == NULL)
+                return NULL;
+
+        content_dir = server_ref_content_dir (udn);
+        if (content_dir == NULL)
+                g_set_error (error,
+                             RPC_ERROR,
+                             RPC_ERROR_INVALID_PARAMS,
+                             "Unknown server '%s'",
+                             udn);
+
+        return content_dir;
+}
+
+/* Makes @params' renderer the current one and returns its UDN, must be
+ * called with rpc_lock held */
+static const char *
+rpc_select_renderer (JsonObject *params,
+                     GError    **error)
+{
+        const char *udn;
+        gboolean    known;
+
+        udn = rpc_get_string (params, "renderer", error);
+        if (udn == NULL)
+                return NULL;
+
+        g_mutex_lock (&renderer_state_lock);
+        known = g_hash_table_contains (renderer_table, udn);
+        g_mutex_unlock (&renderer_state_lock);
+        if (!known) {
+                g_set_error (error,
+                             RPC_ERROR,
+                             RPC_ERROR_INVALID_PARAMS,
+                             "Unknown renderer '%s'",
+                             udn);
+
+                return NULL;
+        }
+
+        g_strlcpy (current_renderer, udn, sizeof (current_renderer));
+
+        return udn;
+}
+
+/* Runs on the main loop, server_table is its own */
+static gboolean
+rpc_list_servers_cb (gpointer user_data)
+{
+        JsonBuilder   *builder;
+        GHashTableIter iter;
+        gpointer       key, value;
+
+        builder = json_builder_new ();
+        json_builder_begin_array (builder);
+
+        g_hash_table_iter_init (&iter, server_table);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+                MediaServers *server = (MediaServers *) value;
+
+                json_builder_begin_object (builder);
+                json_builder_set_member_name (builder, "udn");
+                json_builder_add_string_value (builder, key);
+                json_builder_set_member_name (builder, "name");
+                json_builder_add_string_value (builder, server->friendly_name);
+                json_builder_set_member_name (builder, "health");
+                json_builder_add_double_value (builder,
+                                               device_health_score (key));
+                json_builder_set_member_name (builder, "responding");
+                json_builder_add_boolean_value
+                        (builder, !device_health_is_failing (key));
+                json_builder_end_object (builder);
+        }
+
+        json_builder_end_array (builder);
+        *(JsonNode **) user_data = json_builder_get_root (builder);
+        g_object_unref (builder);
+
+        return FALSE;
+}
+
+static JsonNode *
+rpc_list_servers (JsonObject *params,
+                  GError    **error)
+{
+        JsonNode *result;
+
+        main_call (rpc_list_servers_cb, &result);
+
+        return result;
+}
+
+static JsonNode *
+rpc_list_renderers (JsonObject *params,
+                    GError    **error)
+{
+        JsonBuilder   *builder;
+        JsonNode      *result;
+        GHashTableIter iter;
+        GPtrArray     *listed;
+        gpointer       key, value;
+        guint          i;
+
+        /* UDN and name pairs, status and health take their own locks */
+        listed = g_ptr_array_new_with_free_func (g_free);
+        g_mutex_lock (&renderer_state_lock);
+        g_hash_table_iter_init (&iter, renderer_table);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+                RendererData *renderer = (RendererData *) value;
+
+                g_ptr_array_add (listed, g_strdup (key));
+                g_ptr_array_add (listed, g_strdup (renderer->friendly_name));
+        }
+        g_mutex_unlock (&renderer_state_lock);
+
+        builder = json_builder_new ();
+        json_builder_begin_array (builder);
+
+        for (i = 0; i < listed->len; i += 2) {
+                key = g_ptr_array_index (listed, i);
+
+                json_builder_begin_object (builder);
+                json_builder_set_member_name (builder, "udn");
+                json_builder_add_string_value (builder, key);
+                json_builder_set_member_name (builder, "name");
+                json_builder_add_string_value (builder,
+                                               g_ptr_array_index (listed,
+                                                                  i + 1));
+                json_builder_set_member_name (builder, "health");
+                json_builder_add_double_value (builder,
+                                               device_health_score (key));
+                json_builder_set_member_name (builder, "responding");
+                json_builder_add_boolean_value
+                        (builder, !device_health_is_failing (key));
+                json_builder_set_member_name (builder, "state");
+                json_builder_add_string_value
+                        (builder,
+                         player_status_names[renderer_get_status (key)]);
+                json_builder_end_object (builder);
+        }
+        g_ptr_array_unref (listed);
+
+        json_builder_end_array (builder);
+        result = json_builder_get_root (builder);
+        g_object_unref (builder);
+
+        return result;
+}
+
+/* The optional "detail" member, one of filter_profile_names */
+static gboolean
+rpc_get_profile (JsonObject    *params,
+                 FilterProfile *profile,
+                 GError       **error)
+{
+        const char *name;
+        int         i;
+
+        if (!json_object_has_member (params, "detail"))
+                return TRUE;
+
+        if (!rpc_check_member (params, "detail", G_TYPE_STRING, error))
+                return FALSE;
+
+        name = json_object_get_string_member (params, "detail");
+        for (i = 0; i < N_FILTER_PROFILES; i++)
+                if (name != NULL && !strcmp (name, filter_profile_names[i])) {
+                        *profile = (FilterProfile) i;
+
+                        return TRUE;
+                }
+
+        g_set_error (error,
+                     RPC_ERROR,
+                     RPC_ERROR_INVALID_PARAMS,
+                     "Unknown detail '%s', use listing, playback or full",
+                     name ? name : "");
+
+        return FALSE;
+}
+
+/* @prefetch fetches the art meanwhile, it is likely asked for next */
+static void
+rpc_add_container (JsonBuilder *builder,
+                   const char  *id,
+                   Container   *c,
+                   gboolean     prefetch)
+{
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "id");
+        json_builder_add_string_value (builder, id);
+        json_builder_set_member_name (builder, "title");
+        json_builder_add_string_value (builder, c->title);
+        json_builder_set_member_name (builder, "class");
+        json_builder_add_string_value (builder, c->class);
+        json_builder_set_member_name (builder, "detail");
+        json_builder_add_string_value (builder,
+                                       filter_profile_names[c->detail]);
+        if (c->artist != NULL) {
+                json_builder_set_member_name (builder, "artist");
+                json_builder_add_string_value (builder, c->artist);
+        }
+        if (c->album != NULL) {
+                json_builder_set_member_name (builder, "album");
+                json_builder_add_string_value (builder, c->album);
+        }
+        if (c->uri != NULL) {
+                json_builder_set_member_name (builder, "uri");
+                json_builder_add_string_value (builder, c->uri);
+        }
+        if (c->art_uri != NULL) {
+                json_builder_set_member_name (builder, "art");
+                json_builder_add_string_value (builder, c->art_uri);
+                if (prefetch)
+                        art_request (c->art_uri, ART_PREFETCH, NULL, NULL);
+        }
+        json_builder_end_object (builder);
+}
+
+/* One browse call: the lookups and the answer are made on the main
+ * loop, the RPC thread only waits */
+typedef struct
+{
+        GUPnPServiceProxy *content_dir;
+        const char        *id;
+        FilterProfile      profile;
+
+        gboolean   cached;
+        /* browse_table keys of the children listed with less than
+         * profile */
+        GPtrArray *thin;
+        JsonNode  *result;
+} RpcBrowse;
+
+static gboolean
+rpc_browse_lookup_cb (gpointer user_data)
+{
+        RpcBrowse       *browse = (RpcBrowse *) user_data;
+        CachedContainer *entry;
+        guint            i;
+
+        entry = cache_lookup (browse->content_dir, browse->id);
+        if (entry == NULL)
+                return FALSE;
+
+        browse->cached = TRUE;
+        for (i = 0; i < entry->children->len; i++) {
+                const char *id = g_ptr_array_index (entry->children, i);
+                Container  *c = browse_lookup (entry->udn, id);
+
+                if (c != NULL && c->detail < browse->profile)
+                        g_ptr_array_add (browse->thin,
+                                         browse_object_key (entry->udn, id));
+        }
+
+        return FALSE;
+}
+
+static gboolean
+rpc_browse_result_cb (gpointer user_data)
+{
+        RpcBrowse       *browse = (RpcBrowse *) user_data;
+        CachedContainer *entry;
+        JsonBuilder     *builder;
+        char            *key;
+        guint            i, listed = 0;
+
+        builder = json_builder_new ();
+        json_builder_begin_array (builder);
+
+        key = browse_cache_key (browse->content_dir, browse->id);
+        entry = g_hash_table_lookup (browsed_table, key);
+        g_free (key);
+
+        for (i = 0; entry != NULL && i < entry->children->len; i++) {
+                const char *id = g_ptr_array_index (entry->children, i);
+                Container  *c = browse_lookup (entry->udn, id);
+
+                if (c != NULL && c->owner == entry)
+                        rpc_add_container (builder,
+                                           id,
+                                           c,
+                                           listed++ < ART_PREFETCH_ITEMS);
+        }
+
+        json_builder_end_array (builder);
+        browse->result = json_builder_get_root (builder);
+        g_object_unref (builder);
+
+        return FALSE;
+}
+
+static JsonNode *
+rpc_browse (JsonObject *params,
+            GError    **error)
+{
+        RpcBrowse browse;
+
+        memset (&browse, 0, sizeof (RpcBrowse));
+        browse.id = "0";
+        browse.profile = FILTER_LISTING;
+
+        if (!rpc_check_member (params, "id", G_TYPE_STRING, error))
+                return NULL;
+        if (json_object_has_member (params, "id"))
+                browse.id = json_object_get_string_member (params, "id");
+
+        if (!rpc_get_profile (params, &browse.profile, error))
+                return NULL;
+
+        browse.content_dir = rpc_get_server (params, error);
+        if (browse.content_dir == NULL)
+                return NULL;
+
+        /* Containers browsed before, by any client, are answered from
+         * browse_table without a round trip, or one per
+         * HYDRATE_BATCH children if they need more detail */
+        browse.thin = g_ptr_array_new_with_free_func (g_free);
+        main_call (rpc_browse_lookup_cb, &browse);
+        if (!browse.cached) {
+                browse_with_profile (browse.content_dir,
+                                     browse.id,
+                                     0,
+                                     MAX_BROWSE,
+                                     browse.profile);
+                trace_sem_wait (&browse_sem, "wait browse");
+        } else if (browse.thin->len > 0)
+                cache_hydrate (browse.thin, browse.profile);
+
+        main_call (rpc_browse_result_cb, &browse);
+
+        g_ptr_array_unref (browse.thin);
+        g_object_unref (browse.content_dir);
+
+        return browse.result;
+}
+
+/* Fills in "detail" (playback unless given) for the "ids" of "server"
+ * a client shows or is about to play and returns them like browse */
+/* The answer of rpc_hydrate (), written on the main loop */
+typedef struct
+{
+        GPtrArray *keys;
+        JsonNode  *result;
+} RpcHydrate;
+
+static gboolean
+rpc_hydrate_result_cb (gpointer user_data)
+{
+        RpcHydrate  *hydrate = (RpcHydrate *) user_data;
+        JsonBuilder *builder;
+        guint        i;
+
+        builder = json_builder_new ();
+        json_builder_begin_array (builder);
+        for (i = 0; i < hydrate->keys->len; i++) {
+                const char *key = g_ptr_array_index (hydrate->keys, i);
+                Container  *c = g_hash_table_lookup (browse_table, key);
+
+                if (c != NULL)
+                        rpc_add_container (builder,
+                                           browse_key_id (key, c),
+                                           c,
+                                           i < ART_PREFETCH_ITEMS);
+        }
+        json_builder_end_array (builder);
+        hydrate->result = json_builder_get_root (builder);
+        g_object_unref (builder);
+
+        return FALSE;
+}
+
+static JsonNode *
+rpc_hydrate (JsonObject *params,
+             GError    **error)
+{
+        RpcHydrate     hydrate;
+        JsonArray     *array;
+        GPtrArray     *keys;
+        FilterProfile  profile = FILTER_PLAYBACK;
+        const char    *udn;
+        guint          i;
+
+        udn = rpc_get_string (params, "server", error);
+        if (udn == NULL)
+                return NULL;
+
+        if (!json_object_has_member (params, "ids") ||
+            !JSON_NODE_HOLDS_ARRAY (json_object_get_member (params, "ids"))) {
+                g_set_error_literal (error,
+                                     RPC_ERROR,
+                                     RPC_ERROR_INVALID_PARAMS,
+                                     "Missing array 'ids'");
+
+                return NULL;
+        }
+
+        if (!rpc_get_profile (params, &profile, error))
+                return NULL;
+
+        array = json_object_get_array_member (params, "ids");
+        keys = g_ptr_array_new_with_free_func (g_free);
+        for (i = 0; i < json_array_get_length (array); i++) {
+                const char *id = json_array_get_string_element (array, i);
+
+                if (id != NULL)
+                        g_ptr_array_add (keys, browse_object_key (udn, id));
+        }
+
+        cache_hydrate (keys, profile);
+
+        hydrate.keys = keys;
+        hydrate.result = NULL;
+        main_call (rpc_hydrate_result_cb, &hydrate);
+
+        g_ptr_array_unref (keys);
+
+        return hydrate.result;
+}
+
+/* Like browse, for a container title or class on every server at once */
+static JsonNode *
+rpc_browse_all (JsonObject *params,
+                GError    **error)
+{
+        Aggregate     *aggregate;
+        GSequenceIter *iter;
+        JsonBuilder   *builder;
+        JsonNode      *result;
+        const char    *query;
+        guint          listed = 0;
+
+        query = rpc_get_string (params, "query", error);
+        if (query == NULL)
+                return NULL;
+
+        aggregate = aggregate_run (query, FALSE);
+
+        builder = json_builder_new ();
+        json_builder_begin_array (builder);
+
+        g_mutex_lock (&aggregate->lock);
+        for (iter = g_sequence_get_begin_iter (aggregate->items);
+             !g_sequence_iter_is_end (iter);
+             iter = g_sequence_iter_next (iter)) {
+                AggregateItem *item = g_sequence_get (iter);
+                Container     *c = item->object;
+
+                json_builder_begin_object (builder);
+                json_builder_set_member_name (builder, "server");
+                json_builder_add_string_value (builder, item->server->udn);
+                json_builder_set_member_name (builder, "server_name");
+                json_builder_add_string_value (builder, item->server->name);
+                json_builder_set_member_name (builder, "id");
+                json_builder_add_string_value (builder, item->id);
+                json_builder_set_member_name (builder, "duplicates");
+                json_builder_add_int_value (builder, item->duplicates);
+                json_builder_set_member_name (builder, "title");
+                json_builder_add_string_value (builder, c->title);
+                json_builder_set_member_name (builder, "class");
+                json_builder_add_string_value (builder, c->class);
+                if (c->uri != NULL) {
+                        json_builder_set_member_name (builder, "uri");
+                        json_builder_add_string_value (builder, c->uri);
+                }
+                if (c->art_uri != NULL) {
+                        json_builder_set_member_name (builder, "art");
+                        json_builder_add_string_value (builder, c->art_uri);
+                        /* Likely asked for next, fetch the first
+                         * screen's meanwhile */
+                        if (listed < ART_PREFETCH_ITEMS)
+                                art_request (c->art_uri,
+                                             ART_PREFETCH,
+                                             NULL,
+                                             NULL);
+                }
+                listed++;
+                json_builder_end_object (builder);
+        }
+        g_mutex_unlock (&aggregate->lock);
+
+        aggregate_unref (aggregate);
+
+        json_builder_end_array (builder);
+        result = json_builder_get_root (builder);
+        g_object_unref (builder);
+
+        return result;
+}
+
+/* Resolves the "path" of @params, see path_resolve () */
+static gboolean
+rpc_get_path (JsonObject         *params,
+              GUPnPServiceProxy **content_dir,
+              char              **id,
+              char              **class,
+              GError            **error)
+{
+        const char *path;
+        GError     *path_error = NULL;
+
+        path = rpc_get_string (params, "path", error);
+        if (path == NULL)
+                return FALSE;
+
+        if (!path_resolve (path, content_dir, id, class, &path_error)) {
+                g_set_error_literal (error,
+                                     RPC_ERROR,
+                                     RPC_ERROR_INVALID_PARAMS,
+                                     path_error->message);
+                g_error_free (path_error);
+
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+static JsonNode *
+rpc_resolve (JsonObject *params,
+             GError    **error)
+{
+        GUPnPServiceProxy *content_dir;
+        JsonBuilder       *builder;
+        JsonNode          *result;
+        char              *id, *class;
+
+        if (!rpc_get_path (params, &content_dir, &id, &class, error))
+                return NULL;
+
+        builder = json_builder_new ();
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "server");
+        json_builder_add_string_value (builder,
+                                       gupnp_service_info_get_udn
+                                        (GUPNP_SERVICE_INFO (content_dir)));
+        json_builder_set_member_name (builder, "id");
+        json_builder_add_string_value (builder, id);
+        json_builder_set_member_name (builder, "class");
+        json_builder_add_string_value (builder, class);
+        json_builder_end_object (builder);
+        result = json_builder_get_root (builder);
+        g_object_unref (builder);
+
+        g_object_unref (content_dir);
+        g_free (id);
+        g_free (class);
+
+        return result;
+}
+
+/* play with a "path" instead of "server" and "id" */
+static JsonNode *
+rpc_play_path (JsonObject *params,
+               GError    **error)
+{
+        GUPnPServiceProxy *content_dir;
+        JsonNode          *result = NULL;
+        char              *id, *class;
+
+        if (!rpc_get_path (params, &content_dir, &id, &class, error))
+                return NULL;
+
+        if (g_str_has_prefix (class, OBJECT_CLASS_CONTAINER))
+                g_set_error (error,
+                             RPC_ERROR,
+                             RPC_ERROR_INVALID_PARAMS,
+                             "'%s' is a container",
+                             json_object_get_string_member (params, "path"));
+        else if (rpc_select_renderer (params, error) != NULL) {
+                if (start_playback (content_dir, id))
+                        result = json_node_init_boolean (json_node_alloc (),
+                                                         TRUE);
+                else
+                        g_set_error (error,
+                                     RPC_ERROR,
+                                     RPC_ERROR_FAILED,
+                                     "Renderer did not start playing '%s'",
+                                     json_object_get_string_member
+                                        (params, "path"));
+        }
+
+        g_object_unref (content_dir);
+        g_free (id);
+        g_free (class);
+
+        return result;
+}
+
+/* Resolves a playlist "file" and queues it on the "renderer" */
+static JsonNode *
+rpc_import_playlist (JsonObject *params,
+                     GError    **error)
+{
+        PlaylistImport *import;
+        JsonBuilder    *builder;
+        JsonNode       *result;
+        const char     *file;
+        GError         *import_error = NULL;
+        guint           queued;
+
+        file = rpc_get_string (params, "file", error);
+        if (file == NULL)
+                return NULL;
+
+        if (rpc_select_renderer (params, error) == NULL)
+                return NULL;
+
+        import = playlist_import (file, &import_error);
+        if (import == NULL) {
+                g_set_error_literal (error,
+                                     RPC_ERROR,
+                                     RPC_ERROR_INVALID_PARAMS,
+                                     import_error->message);
+                g_error_free (import_error);
+
+                return NULL;
+        }
+
+        queued = playlist_queue (import, current_renderer);
+
+        builder = json_builder_new ();
+        json_builder_begin_object (builder);
+        g_mutex_lock (&import->lock);
+        json_builder_set_member_name (builder, "entries");
+        json_builder_add_int_value (builder, import->entries->len);
+        json_builder_set_member_name (builder, "cached");
+        json_builder_add_int_value (builder, import->cached);
+        json_builder_set_member_name (builder, "searched");
+        json_builder_add_int_value (builder, import->searched);
+        g_mutex_unlock (&import->lock);
+        json_builder_set_member_name (builder, "queued");
+        json_builder_add_int_value (builder, queued);
+        json_builder_end_object (builder);
+        result = json_builder_get_root (builder);
+        g_object_unref (builder);
+
+        playlist_import_unref (import);
+
+        return result;
+}
+
+typedef struct
+{
+        const char *uri;
+        gboolean    found;
+} RpcArtKnown;
+
+static gboolean
+rpc_art_known_cb (gpointer user_data)
+{
+        RpcArtKnown *known = (RpcArtKnown *) user_data;
+
+        known->found = art_known != NULL &&
+                       g_hash_table_contains (art_known, known->uri);
+
+        return FALSE;
+}
+
+static JsonNode *
+rpc_art (JsonObject *params,
+         GError    **error)
+{
+        RpcArtKnown  known;
+        JsonBuilder *builder;
+        JsonNode    *result;
+        GBytes      *image;
+        const char  *uri;
+        char        *data, *file;
+
+        uri = rpc_get_string (params, "uri", error);
+        if (uri == NULL)
+                return NULL;
+
+        /* Not a way to make the control point GET any URL */
+        known.uri = uri;
+        main_call (rpc_art_known_cb, &known);
+        if (!known.found) {
+                g_set_error (error,
+                             RPC_ERROR,
+                             RPC_ERROR_INVALID_PARAMS,
+                             "'%s' is not the art of a browsed object",
+                             uri);
+
+                return NULL;
+        }
+
+        image = art_wait (uri);
+        if (image == NULL) {
+                g_set_error (error,
+                             RPC_ERROR,
+                             RPC_ERROR_FAILED,
+                             "Could not fetch '%s'",
+                             uri);
+
+                return NULL;
+        }
+
+        data = g_base64_encode (g_bytes_get_data (image, NULL),
+                                g_bytes_get_size (image));
+        file = art_disk_path (uri, NULL);
+
+        builder = json_builder_new ();
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "size");
+        json_builder_add_int_value (builder, g_bytes_get_size (image));
+        json_builder_set_member_name (builder, "file");
+        json_builder_add_string_value (builder, file);
+        json_builder_set_member_name (builder, "data");
+        json_builder_add_string_value (builder, data);
+        json_builder_end_object (builder);
+        result = json_builder_get_root (builder);
+        g_object_unref (builder);
+
+        g_free (data);
+        g_free (file);
+        g_bytes_unref (image);
+
+        return result;
+}
+
+static JsonNode *
+rpc_play (JsonObject *params,
+          GError    **error)
+{
+        GUPnPServiceProxy *content_dir;
+        JsonNode          *result = NULL;
+        CacheCopy          copy;
+        const char        *id;
+
+        if (json_object_has_member (params, "path"))
+                return rpc_play_path (params, error);
+
+        id = rpc_get_string (params, "id", error);
+        if (id == NULL)
+                return NULL;
+
+        content_dir = rpc_get_server (params, error);
+        if (content_dir == NULL)
+                return NULL;
+
+        /* Only what was browsed on this very server */
+        if (!cache_copy (gupnp_service_info_get_udn
+                                (GUPNP_SERVICE_INFO (content_dir)),
+                         id,
+                         &copy))
+                g_set_error (error,
+                             RPC_ERROR,
+                             RPC_ERROR_INVALID_PARAMS,
+                             "Object '%s' has not been browsed",
+                             id);
+        else if (rpc_select_renderer (params, error) != NULL) {
+                if (start_playback_media (content_dir,
+                                          id,
+                                          copy.detail,
+                                          copy.uri,
+                                          copy.metadata))
+                        result = json_node_init_boolean (json_node_alloc (),
+                                                         TRUE);
+                else
+                        g_set_error (error,
+                                     RPC_ERROR,
+                                     RPC_ERROR_FAILED,
+                                     "Renderer did not start playing '%s'",
+                                     id);
+        }
+
+        cache_copy_clear (&copy);
+        g_object_unref (content_dir);
+
+        return result;
+}
+
+static JsonNode *
+rpc_play_file (JsonObject *params,
+               GError    **error)
+{
+        const char *path;
+
+        path = rpc_get_string (params, "path", error);
+        if (path == NULL)
+                return NULL;
+
+        if (rpc_select_renderer (params, error) == NULL)
+                return NULL;
+
+        if (!start_local_playback (path)) {
+                g_set_error (error,
+                             RPC_ERROR,
+                             RPC_ERROR_FAILED,
+                             "Can not serve '%s'",
+                             path);
+
+                return NULL;
+        }
+
+        return json_node_init_boolean (json_node_alloc (), TRUE);
+}
+
+static JsonNode *
+rpc_transport_action (JsonObject *params,
+                      char       *action,
+                      GError    **error)
+{
+        if (rpc_select_renderer (params, error) == NULL)
+                return NULL;
+
+        av_transport_send_action (action);
+
+        return json_node_init_boolean (json_node_alloc (), TRUE);
+}
+
+static JsonNode *
+rpc_pause (JsonObject *params,
+           GError    **error)
+{
+        return rpc_transport_action (params, "Pause", error);
+}
+
+static JsonNode *
+rpc_resume (JsonObject *params,
+            GError    **error)
+{
+        return rpc_transport_action (params, "Play", error);
+}
+
+static JsonNode *
+rpc_stop (JsonObject *params,
+          GError    **error)
+{
+        return rpc_transport_action (params, "Stop", error);
+}
+
+/* The local view of @udn, what volume, mute and seek answer */
+static JsonNode *
+rpc_renderer_state (const char *udn,
+                    GError    **error)
+{
+        RendererData *renderer;
+        JsonBuilder  *builder;
+        JsonNode     *result;
+
+        g_mutex_lock (&renderer_state_lock);
+        renderer = g_hash_table_lookup (renderer_table, udn);
+        if (renderer == NULL) {
+                g_mutex_unlock (&renderer_state_lock);
+                g_set_error (error,
+                             RPC_ERROR,
+                             RPC_ERROR_FAILED,
+                             "Renderer '%s' is gone",
+                             udn);
+
+                return NULL;
+        }
+
+        builder = json_builder_new ();
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "state");
+        json_builder_add_string_value (builder,
+                                       player_status_names[renderer->status]);
+        json_builder_set_member_name (builder, "uri");
+        if (renderer->uri != NULL)
+                json_builder_add_string_value (builder, renderer->uri);
+        else
+                json_builder_add_null_value (builder);
+        json_builder_set_member_name (builder, "volume");
+        json_builder_add_int_value (builder, renderer->volume);
+        json_builder_set_member_name (builder, "mute");
+        json_builder_add_boolean_value (builder, renderer->mute);
+        json_builder_set_member_name (builder, "position");
+        json_builder_add_int_value (builder, renderer->position);
+        json_builder_set_member_name (builder, "duration");
+        json_builder_add_int_value (builder, renderer->duration);
+        json_builder_set_member_name (builder, "queued");
+        json_builder_add_int_value (builder, renderer->queue.length);
+        g_mutex_unlock (&renderer_state_lock);
+        json_builder_end_object (builder);
+        result = json_builder_get_root (builder);
+        g_object_unref (builder);
+
+        return result;
+}
+
+/* Either an absolute "volume" or a relative "delta" */
+static JsonNode *
+rpc_volume (JsonObject *params,
+            GError    **error)
+{
+        const char *udn;
+
+        if (!rpc_check_member (params, "volume", G_TYPE_INT64, error) ||
+            !rpc_check_member (params, "delta", G_TYPE_INT64, error))
+                return NULL;
+
+        udn = rpc_select_renderer (params, error);
+        if (udn == NULL)
+                return NULL;
+
+        if (json_object_has_member (params, "volume"))
+                renderer_set_volume (udn,
+                                     json_object_get_int_member (params,
+                                                                 "volume"));
+        else if (json_object_has_member (params, "delta"))
+                renderer_change_volume (udn,
+                                        json_object_get_int_member (params,
+                                                                    "delta"));
+
+        return rpc_renderer_state (udn, error);
+}
+
+static JsonNode *
+rpc_mute (JsonObject *params,
+          GError    **error)
+{
+        const char *udn;
+
+        if (!rpc_check_member (params, "mute", G_TYPE_BOOLEAN, error))
+                return NULL;
+
+        udn = rpc_select_renderer (params, error);
+        if (udn == NULL)
+                return NULL;
+
+        if (json_object_has_member (params, "mute"))
+                renderer_set_mute (udn,
+                                   json_object_get_boolean_member (params,
+                                                                   "mute"));
+        else
+                renderer_toggle_mute (udn);
+
+        return rpc_renderer_state (udn, error);
+}
+
+/* Either an absolute "position" as H:MM:SS or an "offset" in seconds */
+static JsonNode *
+rpc_seek (JsonObject *params,
+          GError    **error)
+{
+        const char *udn;
+
+        if (!rpc_check_member (params, "position", G_TYPE_STRING, error) ||
+            !rpc_check_member (params, "offset", G_TYPE_INT64, error))
+                return NULL;
+
+        udn = rpc_select_renderer (params, error);
+        if (udn == NULL)
+                return NULL;
+
+        if (json_object_has_member (params, "position")) {
+                const char *position;
+
+                position = json_object_get_string_member (params, "position");
+                if (parse_duration (position) < 0) {
+                        g_set_error (error,
+                                     RPC_ERROR,
+                                     RPC_ERROR_INVALID_PARAMS,
+                                     "Invalid position '%s'",
+                                     position != NULL ? position : "");
+
+                        return NULL;
+                }
+                renderer_seek (udn, parse_duration (position));
+        } else if (json_object_has_member (params, "offset"))
+                renderer_skip (udn,
+                               json_object_get_int_member (params, "offset"));
+
+        return rpc_renderer_state (udn, error);
+}
+
+static JsonNode *
+rpc_stats (JsonObject *params,
+           GError    **error)
+{
+        JsonBuilder   *builder;
+        JsonNode      *result;
+        MemoryStats    stats;
+        GHashTableIter iter;
+        gpointer       key, value;
+        int            i;
+
+        memory_stats_collect (&stats);
+
+        builder = json_builder_new ();
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "device_tables_bytes");
+        json_builder_add_int_value (builder, stats.device_bytes);
+        json_builder_set_member_name (builder, "cache_objects");
+        json_builder_add_int_value (builder, stats.objects);
+        json_builder_set_member_name (builder, "cache_bytes");
+        json_builder_add_int_value (builder, stats.cache_bytes);
+        json_builder_set_member_name (builder, "cache_budget");
+        json_builder_add_int_value (builder, cache_budget);
+
+        json_builder_set_member_name (builder, "servers");
+        json_builder_begin_object (builder);
+        g_hash_table_iter_init (&iter, stats.per_server);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+                ServerCacheStats *server = (ServerCacheStats *) value;
+
+                json_builder_set_member_name (builder, key);
+                json_builder_begin_object (builder);
+                json_builder_set_member_name (builder, "containers");
+                json_builder_add_int_value (builder, server->containers);
+                json_builder_set_member_name (builder, "objects");
+                json_builder_add_int_value (builder, server->objects);
+                json_builder_set_member_name (builder, "bytes");
+                json_builder_add_int_value (builder, server->bytes);
+                json_builder_end_object (builder);
+        }
+        memory_stats_clear (&stats);
+        json_builder_end_object (builder);
+
+        if (alloc_stats) {
+                MemSnapshot snapshots[N_MEM_TAGS];
+
+                mem_snapshot (snapshots);
+                json_builder_set_member_name (builder, "memory");
+                json_builder_begin_object (builder);
+                for (i = 0; i < N_MEM_TAGS; i++) {
+                        MemCounters *counters = &snapshots[i].counters;
+
+                        json_builder_set_member_name (builder,
+                                                      mem_tag_names[i]);
+                        json_builder_begin_object (builder);
+                        json_builder_set_member_name (builder, "live_bytes");
+                        json_builder_add_int_value (builder,
+                                                    counters->live_bytes);
+                        json_builder_set_member_name (builder, "live_blocks");
+                        json_builder_add_int_value (builder,
+                                                    counters->live_blocks);
+                        json_builder_set_member_name (builder, "peak_bytes");
+                        json_builder_add_int_value (builder,
+                                                    counters->peak_bytes);
+                        json_builder_set_member_name (builder, "allocs");
+                        json_builder_add_int_value (builder,
+                                                    counters->allocs);
+                        json_builder_set_member_name (builder, "alloc_bytes");
+                        json_builder_add_int_value (builder,
+                                                    counters->alloc_bytes);
+                        json_builder_set_member_name (builder, "alloc_rate");
+                        json_builder_add_double_value
+                                (builder, snapshots[i].alloc_rate);
+                        json_builder_end_object (builder);
+                }
+                json_builder_end_object (builder);
+        }
+
+        json_builder_set_member_name (builder, "discovery");
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "fetched");
+        json_builder_add_int_value (builder,
+                                    g_atomic_int_get (&discovery_fetched));
+        json_builder_set_member_name (builder, "ignored");
+        json_builder_add_int_value (builder,
+                                    g_atomic_int_get (&discovery_ignored));
+        json_builder_set_member_name (builder, "duplicates");
+        json_builder_add_int_value (builder,
+                                    g_atomic_int_get (&discovery_duplicates));
+        json_builder_set_member_name (builder, "delayed");
+        json_builder_add_int_value (builder,
+                                    g_atomic_int_get (&discovery_delayed));
+        json_builder_end_object (builder);
+
+        json_builder_set_member_name (builder, "filters");
+        json_builder_begin_object (builder);
+        for (i = 0; i < N_FILTER_PROFILES; i++) {
+                json_builder_set_member_name (builder,
+                                              filter_profile_names[i]);
+                json_builder_begin_object (builder);
+                json_builder_set_member_name (builder, "bytes");
+                json_builder_add_int_value
+                        (builder,
+                         (gsize) g_atomic_pointer_get (&filter_bytes[i]));
+                json_builder_set_member_name (builder, "objects");
+                json_builder_add_int_value
+                        (builder,
+                         (gsize) g_atomic_pointer_get (&filter_objects[i]));
+                json_builder_end_object (builder);
+        }
+        json_builder_end_object (builder);
+
+        if (watchdog_thread != NULL) {
+                WatchdogSnapshot snapshot;
+                gint64           now = g_get_real_time ();
+
+                watchdog_snapshot (&snapshot);
+                json_builder_set_member_name (builder, "main_loop");
+                json_builder_begin_object (builder);
+                json_builder_set_member_name (builder, "probes");
+                json_builder_add_int_value (builder, snapshot.probes);
+                json_builder_set_member_name (builder, "max_latency_ms");
+                json_builder_add_double_value (builder,
+                                               snapshot.max_lag / 1000.0);
+                /* histogram[i] counts latencies below 2^i ms, the last
+                 * one everything above */
+                json_builder_set_member_name (builder, "histogram");
+                json_builder_begin_array (builder);
+                for (i = 0; i < WATCHDOG_BUCKETS; i++)
+                        json_builder_add_int_value (builder,
+                                                    snapshot.histogram[i]);
+                json_builder_end_array (builder);
+                json_builder_set_member_name (builder, "stall_count");
+                json_builder_add_int_value (builder, snapshot.stall_count);
+                json_builder_set_member_name (builder, "stalls");
+                json_builder_begin_array (builder);
+                for (i = 0; i < (int) snapshot.n_stalls; i++) {
+                        WatchdogStall *stall = &snapshot.stalls[i];
+
+                        json_builder_begin_object (builder);
+                        json_builder_set_member_name (builder, "in");
+                        json_builder_add_string_value (builder, stall->what);
+                        json_builder_set_member_name (builder, "ms");
+                        json_builder_add_double_value
+                                (builder, stall->duration / 1000.0);
+                        json_builder_set_member_name (builder, "age_s");
+                        json_builder_add_int_value
+                                (builder,
+                                 (now - stall->start) / G_USEC_PER_SEC);
+                        json_builder_end_object (builder);
+                }
+                json_builder_end_array (builder);
+                json_builder_end_object (builder);
+        }
+
+        json_builder_set_member_name (builder, "hydrate");
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "objects");
+        json_builder_add_int_value (builder,
+                                    g_atomic_int_get (&hydrate_objects));
+        json_builder_set_member_name (builder, "requests");
+        json_builder_add_int_value (builder,
+                                    g_atomic_int_get (&hydrate_requests));
+        json_builder_end_object (builder);
+
+        json_builder_set_member_name (builder, "art");
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "bytes");
+        json_builder_add_int_value (builder, art_bytes);
+        json_builder_set_member_name (builder, "budget");
+        json_builder_add_int_value (builder, art_budget);
+        json_builder_set_member_name (builder, "hits");
+        json_builder_add_int_value (builder, g_atomic_int_get (&art_hits));
+        json_builder_set_member_name (builder, "disk_hits");
+        json_builder_add_int_value (builder,
+                                    g_atomic_int_get (&art_disk_hits));
+        json_builder_set_member_name (builder, "downloads");
+        json_builder_add_int_value (builder,
+                                    g_atomic_int_get (&art_downloads));
+        json_builder_set_member_name (builder, "not_modified");
+        json_builder_add_int_value (builder,
+                                    g_atomic_int_get (&art_not_modified));
+        json_builder_set_member_name (builder, "failures");
+        json_builder_add_int_value (builder,
+                                    g_atomic_int_get (&art_failures));
+        json_builder_end_object (builder);
+
+        json_builder_end_object (builder);
+        result = json_builder_get_root (builder);
+        g_object_unref (builder);
+
+        return result;
+}
+
+/* rpc_duplicates () on the main loop, which owns browse_table */
+typedef struct
+{
+        gint64    limit;
+        JsonNode *result;
+} RpcDuplicates;
+
+static gboolean
+rpc_duplicates_cb (gpointer user_data)
+{
+        RpcDuplicates *duplicates = (RpcDuplicates *) user_data;
+        DuplicateScan  scan;
+        JsonBuilder   *builder;
+        guint64        fingerprint;
+        gpointer       value;
+        gsize          i = 0;
+        gint64         limit = duplicates->limit;
+
+        duplicates_scan (&scan);
+
+        builder = json_builder_new ();
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "objects");
+        json_builder_add_int_value (builder, scan.objects);
+        json_builder_set_member_name (builder, "tracks");
+        json_builder_add_int_value (builder, scan.tracks);
+        json_builder_set_member_name (builder, "duplicates");
+        json_builder_add_int_value (builder, scan.duplicates);
+        json_builder_set_member_name (builder, "bytes");
+        json_builder_add_int_value (builder, scan.bytes);
+
+        json_builder_set_member_name (builder, "groups");
+        json_builder_begin_array (builder);
+        while (limit > 0 &&
+               fingerprint_set_next (scan.copies, &i, &fingerprint, &value)) {
+                const char *id;
+                Container  *c;
+                char       *hex;
+
+                id = fingerprint_set_lookup (scan.preferred, fingerprint);
+                c = g_hash_table_lookup (browse_table, id);
+                hex = g_strdup_printf ("%016" G_GINT64_MODIFIER "x",
+                                       fingerprint);
+
+                json_builder_begin_object (builder);
+                json_builder_set_member_name (builder, "fingerprint");
+                json_builder_add_string_value (builder, hex);
+                json_builder_set_member_name (builder, "title");
+                json_builder_add_string_value (builder, c->title);
+                if (c->artist != NULL) {
+                        json_builder_set_member_name (builder, "artist");
+                        json_builder_add_string_value (builder, c->artist);
+                }
+                if (c->album != NULL) {
+                        json_builder_set_member_name (builder, "album");
+                        json_builder_add_string_value (builder, c->album);
+                }
+                json_builder_set_member_name (builder, "copies");
+                json_builder_add_int_value (builder,
+                                            GPOINTER_TO_UINT (value));
+                json_builder_set_member_name (builder, "server");
+                json_builder_add_string_value (builder, c->owner->udn);
+                json_builder_set_member_name (builder, "id");
+                json_builder_add_string_value (builder,
+                                               browse_key_id (id, c));
+                json_builder_end_object (builder);
+
+                g_free (hex);
+                limit--;
+        }
+        json_builder_end_array (builder);
+        json_builder_end_object (builder);
+        duplicates->result = json_builder_get_root (builder);
+        g_object_unref (builder);
+
+        duplicates_scan_clear (&scan);
+
+        return FALSE;
+}
+
+static JsonNode *
+rpc_duplicates (JsonObject *params,
+                GError    **error)
+{
+        RpcDuplicates duplicates;
+
+        if (!rpc_check_member (params, "limit", G_TYPE_INT64, error))
+                return NULL;
+
+        duplicates.limit = 100;
+        if (json_object_has_member (params, "limit"))
+                duplicates.limit = json_object_get_int_member (params,
+                                                               "limit");
+        duplicates.result = NULL;
+        main_call (rpc_duplicates_cb, &duplicates);
+
+        return duplicates.result;
+}
+
+static const RpcMethod rpc_methods[] =
+{
+        { "list_servers", rpc_list_servers, FALSE },
+        { "list_renderers", rpc_list_renderers, FALSE },
+        { "browse", rpc_browse, TRUE },
+        { "browse_all", rpc_browse_all, FALSE },
+        { "hydrate", rpc_hydrate, TRUE },
+        { "resolve", rpc_resolve, TRUE },
+        { "import_playlist", rpc_import_playlist, TRUE },
+        { "art", rpc_art, FALSE },
+        { "duplicates", rpc_duplicates, TRUE },
+        { "play", rpc_play, TRUE },
+        { "play_file", rpc_play_file, TRUE },
+        { "pause", rpc_pause, TRUE },
+        { "resume", rpc_resume, TRUE },
+        { "stop", rpc_stop, TRUE },
+        { "volume", rpc_volume, TRUE },
+        { "mute", rpc_mute, TRUE },
+        { "seek", rpc_seek, TRUE },
+        { "stats", rpc_stats, TRUE },
+        { NULL }
+};
+
+static JsonNode *
+rpc_dispatch (const char *method,
+              JsonObject *params,
+              GError    **error)
+{
+        const RpcMethod *m;
+        JsonNode        *result;
+
+        for (m = rpc_methods; m->name != NULL; m++)
+                if (!strcmp (m->name, method))
+                        break;
+
+        if (m->name == NULL) {
+                g_set_error (error,
+                             RPC_ERROR,
+                             RPC_ERROR_METHOD_NOT_FOUND,
+                             "Unknown method '%s'",
+                             method);
+
+                return NULL;
+        }
+
+        if (!m->exclusive)
+                return m->func (params, error);
+
+        g_mutex_lock (&rpc_lock);
+        result = m->func (params, error);
+        g_mutex_unlock (&rpc_lock);
+
+        return result;
+}
+
+/* Handles one JSON-RPC 2.0 request line and returns the response line */
+static char *
+rpc_handle_request (const char *request)
+{
+        JsonParser  *parser;
+        JsonBuilder *builder;
+        JsonNode    *root, *id = NULL, *result = NULL;
+        JsonObject  *object, *params = NULL;
+        JsonGenerator *generator;
+        const char  *method = NULL;
+        GError      *error = NULL;
+        char        *response;
+
+        parser = json_parser_new ();
+        if (json_parser_load_from_data (parser, request, -1, &error)) {
+                root = json_parser_get_root (parser);
+
+                if (JSON_NODE_HOLDS_OBJECT (root)) {
+                        object = json_node_get_object (root);
+
+                        id = json_object_get_member (object, "id");
+                        if (json_object_has_member (object, "method"))
+                                method = json_object_get_string_member
+                                        (object, "method");
+                        if (json_object_has_member (object, "params") &&
+                            JSON_NODE_HOLDS_OBJECT
+                                (json_object_get_member (object, "params")))
+                                params = json_object_get_object_member
+                                        (object, "params");
+                }
+
+                /* The methods count on an object to look members up in */
+                if (method == NULL)
+                        g_set_error_literal (&error,
+                                             RPC_ERROR,
+                                             RPC_ERROR_INVALID_REQUEST,
+                                             "Not a JSON-RPC request");
+                else if (params == NULL)
+                        g_set_error_literal (&error,
+                                             RPC_ERROR,
+                                             RPC_ERROR_INVALID_PARAMS,
+                                             "Missing object 'params'");
+                else
+                        result = rpc_dispatch (method, params, &error);
+        } else {
+                GError *parse_error = error;
+
+                error = NULL;
+                g_set_error_literal (&error,
+                                     RPC_ERROR,
+                                     RPC_ERROR_PARSE,
+                                     parse_error->message);
+                g_error_free (parse_error);
+        }
+
+        builder = json_builder_new ();
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "jsonrpc");
+        json_builder_add_string_value (builder, "2.0");
+        json_builder_set_member_name (builder, "id");
+        if (id != NULL)
+                json_builder_add_value (builder, json_node_copy (id));
+        else
+                json_builder_add_null_value (builder);
+
+        if (error) {
+                json_builder_set_member_name (builder, "error");
+                json_builder_begin_object (builder);
+                json_builder_set_member_name (builder, "code");
+                json_builder_add_int_value (builder,
+                                            error->domain == RPC_ERROR ?
+                                            error->code : RPC_ERROR_FAILED);
+                json_builder_set_member_name (builder, "message");
+                json_builder_add_string_value (builder, error->message);
+                json_builder_end_object (builder);
+
+                g_error_free (error);
+                if (result != NULL)
+                        json_node_unref (result);
+        } else {
+                json_builder_set_member_name (builder, "result");
+                json_builder_add_value (builder, result);
+        }
+
+        json_builder_end_object (builder);
+
+        generator = json_generator_new ();
+        root = json_builder_get_root (builder);
+        json_generator_set_root (generator, root);
+        response = json_generator_to_data (generator, NULL);
+
+        json_node_unref (root);
+        g_object_unref (generator);
+        g_object_unref (builder);
+        g_object_unref (parser);
+
+        return response;
+}
+
+static gboolean
+rpc_run_cb (GThreadedSocketService *service,
+            GSocketConnection      *connection,
+            GObject                *source_object,
+            gpointer                user_data)
+{
+        GDataInputStream *input;
+        GOutputStream    *output;
+        char             *request;
+
+        input = g_data_input_stream_new
+                (g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+        output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+
+        /* One request per line, a client may send as many as it likes */
+        while ((request = g_data_input_stream_read_line (input,
+                                                         NULL,
+                                                         NULL,
+                                                         NULL))) {
+                char    *response;
+                gboolean ok;
+
+                response = rpc_handle_request (request);
+                ok = g_output_stream_write_all (output,
+                                                response,
+                                                strlen (response),
+                                                NULL,
+                                                NULL,
+                                                NULL) &&
+                     g_output_stream_write_all (output,
+                                                "\n",
+                                                1,
+                                                NULL,
+                                                NULL,
+                                                NULL);
+                g_free (response);
+                g_free (request);
+
+                if (!ok)
+                        break;
+        }
+
+        g_object_unref (input);
+
+        return FALSE;
+}
+
+static gboolean
+rpc_server_start (const char *path)
+{
+        GThreadedSocketService *service;
+        GSocketAddress         *address;
+        GError                 *error = NULL;
+
+        /* A previous daemon may have left its socket behind */
+        unlink (path);
+
+        service = G_THREADED_SOCKET_SERVICE
+                (g_threaded_socket_service_new (-1));
+        address = g_unix_socket_address_new (path);
+
+        if (!g_socket_listener_add_address (G_SOCKET_LISTENER (service),
+                                            address,
+                                            G_SOCKET_TYPE_STREAM,
+                                            G_SOCKET_PROTOCOL_DEFAULT,
+                                            NULL,
+                                            NULL,
+                                            &error)) {
+                g_printerr ("Failed to listen on %s: %s\n",
+                            path,
+                            error->message);
+                g_error_free (error);
+                g_object_unref (address);
+                g_object_unref (service);
+
+                return FALSE;
+        }
+        g_object_unref (address);
+
+        g_signal_connect (service,
+                          "run",
+                          G_CALLBACK (rpc_run_cb),
+                          NULL);
+        g_socket_service_start (G_SOCKET_SERVICE (service));
+
+        return TRUE;
+}
+
+/* Client side of the daemon: sends a single request and prints the
+ * result, returns the process exit status */
+static int
+rpc_call (const char *path,
+          const char *method,
+          const char *params)
+{
+        GSocketClient     *client;
+        GSocketConnection *connection;
+        GSocketAddress    *address;
+        GDataInputStream  *input;
+        GOutputStream     *output;
+        JsonParser        *params_parser;
+        JsonBuilder       *builder;
+        JsonGenerator     *generator;
+        JsonNode          *root;
+        GError            *error = NULL;
+        char              *request, *response;
+        int                status = 1;
+
+        /* Checked before connecting, the daemon would only say the same */
+        params_parser = json_parser_new ();
+        if (!json_parser_load_from_data (params_parser,
+                                         params != NULL ? params : "{}",
+                                         -1,
+                                         &error)) {
+                g_printerr ("Invalid parameters: %s\n", error->message);
+                g_error_free (error);
+                g_object_unref (params_parser);
+
+                return 1;
+        }
+
+        client = g_socket_client_new ();
+        address = g_unix_socket_address_new (path);
+        connection = g_socket_client_connect (client,
+                                              G_SOCKET_CONNECTABLE (address),
+                                              NULL,
+                                              &error);
+        g_object_unref (address);
+        g_object_unref (client);
+
+        if (connection == NULL) {
+                g_printerr ("Failed to connect to %s: %s\n",
+                            path,
+                            error->message);
+                g_error_free (error);
+                g_object_unref (params_parser);
+
+                return 1;
+        }
+
+        builder = json_builder_new ();
+        json_builder_begin_object (builder);
+        json_builder_set_member_name (builder, "jsonrpc");
+        json_builder_add_string_value (builder, "2.0");
+        json_builder_set_member_name (builder, "id");
+        json_builder_add_int_value (builder, 1);
+        json_builder_set_member_name (builder, "method");
+        json_builder_add_string_value (builder, method);
+        json_builder_set_member_name (builder, "params");
+        json_builder_add_value (builder,
+                                json_node_copy (json_parser_get_root
+                                                (params_parser)));
+        json_builder_end_object (builder);
+
+        generator = json_generator_new ();
+        root = json_builder_get_root (builder);
+        json_generator_set_root (generator, root);
+        response = json_generator_to_data (generator, NULL);
+        /* One request per line */
+        request = g_strconcat (response, "\n", NULL);
+        g_free (response);
+
+        json_node_unref (root);
+        g_object_unref (generator);
+        g_object_unref (builder);
+        g_object_unref (params_parser);
+
+        output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+        input = g_data_input_stream_new
+                (g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+
+        if (g_output_stream_write_all (output,
+                                       request,
+                                       strlen (request),
+                                       NULL,
+                                       NULL,
+                                       &error) &&
+            (response = g_data_input_stream_read_line (input,
+                                                       NULL,
+                                                       NULL,
+                                                       &error))) {
+                JsonParser *parser;
+
+                puts (response);
+
+                parser = json_parser_new ();
+                if (json_parser_load_from_data (parser, response, -1, NULL) &&
+                    JSON_NODE_HOLDS_OBJECT (json_parser_get_root (parser)))
+                        status = json_object_has_member
+                                (json_node_get_object
+                                        (json_parser_get_root (parser)),
+                                 "error");
+                g_object_unref (parser);
+                g_free (response);
+        } else if (error) {
+                g_printerr ("%s\n", error->message);
+                g_error_free (error);
+        }
 
-	resource = find_compat_res_from_metadata (metadata);
-	if (resource == NULL) {
-		g_warning ("no compatible URI found.");
-		
-		return;
+        g_free (request);
+        g_object_unref (input);
+        g_object_unref (connection);
+
+        return status;
+}
+
+static gint64
+bench_gupnp_objects = 0;
+
+static void
+bench_gupnp_object_cb (GUPnPDIDLLiteParser *parser,
+                       GUPnPDIDLLiteObject *object,
+                       gpointer             user_data)
+{
+	GList *resources;
+	char *id, *title, *parent_id, *class, *uri = NULL;
+
+	/* The same copies the old browse path made for every object */
+	title = g_strdup (gupnp_didl_lite_object_get_title (object));
+	parent_id = g_strdup (gupnp_didl_lite_object_get_parent_id (object));
+	class = g_strdup (gupnp_didl_lite_object_get_upnp_class (object));
+	id = g_strdup (gupnp_didl_lite_object_get_id (object));
+
+	resources = gupnp_didl_lite_object_get_resources (object);
+	if (resources != NULL) {
+		uri = g_strdup (gupnp_didl_lite_resource_get_uri (resources->data));
+		g_list_free_full (resources, g_object_unref);
 	}
 
-	data = set_av_transport_uri_data_new (NULL, resource);
-	uri = gupnp_didl_lite_resource_get_uri (resource);
-	puts(uri);
-//	puts(metadata);
-	gupnp_service_proxy_begin_action (av_transport,
-                                          "SetAVTransportURI",
-                                          set_av_transport_uri_cb,
-                                          data,
-                                          "InstanceID",
-                                          G_TYPE_UINT,
-                                          0,
-                                          "CurrentURI",
-                                          G_TYPE_STRING,
-                                          uri,
-                                          "CurrentURIMetaData",
-                                          G_TYPE_STRING,
-                                          metadata,
-                                          NULL);
+	g_free (id);
+	g_free (title);
+	g_free (parent_id);
+	g_free (class);
+	g_free (uri);
+
+	bench_gupnp_objects++;
 }
 
+static void
+bench_fast_object_cb (DidlObject *object,
+                      gpointer    user_data)
+{
+	gint64 *objects = (gint64 *) user_data;
+	char *id, *title, *parent_id, *class, *uri;
+
+	id = g_strdup (object->id);
+	title = g_strdup (object->title);
+	parent_id = g_strdup (object->parent_id);
+	class = g_strdup (object->upnp_class);
+	uri = g_strdup (object->uri);
+
+	g_free (id);
+	g_free (title);
+	g_free (parent_id);
+	g_free (class);
+	g_free (uri);
+
+	(*objects)++;
+}
 
 static void
-browse_metadata_cb (GUPnPServiceProxy       *content_dir,
-                    GUPnPServiceProxyAction *action,
-                    gpointer                 user_data)
+bench_pool_parse (gpointer payload,
+                  gpointer user_data)
 {
-	BrowseMetadataData *data;
-        char               *metadata;
-        GError             *error;
-	char *udn;
+	gint64 objects = 0;
+
+	didl_parse (payload,
+		    strlen (payload),
+		    FALSE,
+		    bench_fast_object_cb,
+		    &objects,
+		    NULL);
+	g_atomic_int_add ((gint *) user_data, (gint) objects);
+}
 
-	data = (BrowseMetadataData *) user_data;
-        metadata = NULL;
-        error = NULL;
+static char *
+bench_synthetic_didl (guint n_items)
+{
+	GString *didl;
+	guint i;
+
+	didl = g_string_new ("<DIDL-Lite "
+			     "xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+			     "xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" "
+			     "xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\">");
+
+	for (i = 0; i < n_items; i++)
+		g_string_append_printf
+			(didl,
+			 "<item id=\"64$%u\" parentID=\"64\" restricted=\"1\">"
+			 "<dc:title>Track %u</dc:title>"
+			 "<dc:creator>Artist %u</dc:creator>"
+			 "<upnp:artist>Artist %u</upnp:artist>"
+			 "<upnp:album>Album %u</upnp:album>"
+			 "<upnp:genre>Jazz</upnp:genre>"
+			 "<upnp:originalTrackNumber>%u</upnp:originalTrackNumber>"
+			 "<upnp:albumArtURI>http://192.168.1.2:8200/AlbumArt/%u.jpg"
+			 "</upnp:albumArtURI>"
+			 "<upnp:class>object.item.audioItem.musicTrack</upnp:class>"
+			 "<res size=\"8734210\" duration=\"0:05:21.000\" "
+			 "bitrate=\"40000\" sampleFrequency=\"44100\" "
+			 "nrAudioChannels=\"2\" protocolInfo=\"http-get:*:audio/mpeg:"
+			 "DLNA.ORG_PN=MP3;DLNA.ORG_OP=01;DLNA.ORG_CI=0\">"
+			 "http://192.168.1.2:8200/MediaItems/%u.mp3</res>"
+			 "</item>",
+			 i, i, i % 97, i % 97, i / 12, i % 12 + 1, i / 12, i);
+
+	g_string_append (didl, "</DIDL-Lite>");
+
+	return g_string_free (didl, FALSE);
+}
 
-        gupnp_service_proxy_end_action (content_dir,
-                                        action,
-                                        &error,
-                                        /* OUT args */
-                                        "Result",
-                                        G_TYPE_STRING,
-                                        &metadata,
-                                        NULL);
-        if (metadata) {
-                
-		RendererData *data = (RendererData*)g_hash_table_lookup(renderer_table, current_renderer);
-		puts(data->friendly_name);
+static xmlNodePtr
+bench_find_element (xmlNodePtr  node,
+                    const char *name)
+{
+	for (; node != NULL; node = xmlNextElementSibling (node)) {
+		xmlNodePtr found;
 
-		set_av_transport_uri(metadata,(GUPnPServiceProxy*)data->av_transport);
+		if (!xmlStrcmp (node->name, BAD_CAST name))
+			return node;
 
-                g_free (metadata);
-        } else if (error) {
-                g_warning ("Failed to get metadata for '%s': %s",
-                           data->id,
-                           error->message);
+		found = bench_find_element (xmlFirstElementChild (node), name);
+		if (found != NULL)
+			return found;
+	}
 
-                g_error_free (error);
+	return NULL;
+}
+
+/* Pulls the Result out of every Browse answer in a --record capture */
+static void
+bench_load_capture (const char *contents,
+                    GPtrArray  *payloads)
+{
+	char **lines;
+	guint i;
+
+	lines = g_strsplit (contents, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		JsonParser *parser;
+		JsonObject *record;
+		const char *response;
+		xmlDocPtr doc;
+
+		if (strstr (lines[i], "ContentDirectory:1#Browse") == NULL)
+			continue;
+
+		parser = json_parser_new ();
+		if (!json_parser_load_from_data (parser, lines[i], -1, NULL) ||
+		    !JSON_NODE_HOLDS_OBJECT (json_parser_get_root (parser))) {
+			g_object_unref (parser);
+
+			continue;
+		}
+
+		/* Failed and timed out exchanges are recorded without one */
+		record = json_node_get_object (json_parser_get_root (parser));
+		response = json_object_has_member (record, "response") ?
+			   json_object_get_string_member (record, "response") :
+			   NULL;
+		if (response == NULL) {
+			g_object_unref (parser);
+
+			continue;
+		}
+
+		doc = xmlReadMemory (response, strlen (response), NULL, NULL,
+				     DIDL_PARSE_OPTIONS);
+		if (doc != NULL) {
+			xmlNodePtr node;
+
+			node = bench_find_element (xmlDocGetRootElement (doc),
+						   "Result");
+			if (node != NULL) {
+				xmlChar *result = xmlNodeGetContent (node);
+
+				g_ptr_array_add (payloads,
+						 g_strdup ((char *) result));
+				xmlFree (result);
+			}
+			xmlFreeDoc (doc);
+		}
+
+		g_object_unref (parser);
+	}
+	g_strfreev (lines);
+}
+
+#define BENCH_DIDL_HEAD \
+	"<DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\" " \
+	"xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" " \
+	"xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\">"
+
+/* Pages didl_parse has to get right before its speed means anything,
+ * and what it has to make of their first object */
+static const struct
+{
+	const char *name;
+	const char *didl;
+	gboolean valid;
+	guint objects;
+	const char *id;
+	const char *parent_id;
+	const char *title;
+	const char *upnp_class;
+	const char *artist;
+	const char *album;
+	const char *art_uri;
+	const char *uri;
+	gboolean is_container;
+} bench_fixtures[] = {
+	{ "track",
+	  BENCH_DIDL_HEAD
+	  "<item id=\"1$2\" parentID=\"1\" restricted=\"1\">"
+	  "<dc:title>Rock &amp; Roll</dc:title>"
+	  "<upnp:class>object.item.audioItem.musicTrack</upnp:class>"
+	  "<upnp:artist>Artist</upnp:artist>"
+	  "<upnp:album>Album</upnp:album>"
+	  "<res protocolInfo=\"http-get:*:audio/mpeg:*\" size=\"123\">"
+	  "http://host/a.mp3?x=1&amp;y=2</res>"
+	  "<res protocolInfo=\"http-get:*:image/jpeg:DLNA.ORG_PN=JPEG_TN\">"
+	  "http://host/a.jpg</res>"
+	  "</item></DIDL-Lite>",
+	  TRUE, 1, "1$2", "1", "Rock & Roll",
+	  "object.item.audioItem.musicTrack", "Artist", "Album",
+	  "http://host/a.jpg", "http://host/a.mp3?x=1&y=2", FALSE },
+	{ "containers",
+	  BENCH_DIDL_HEAD
+	  "<container id=\"1\" parentID=\"0\" childCount=\"3\">"
+	  "<dc:title>Music</dc:title>"
+	  "<upnp:class>object.container.storageFolder</upnp:class>"
+	  "</container>"
+	  "<container id=\"2\" parentID=\"0\"/>"
+	  "</DIDL-Lite>",
+	  TRUE, 2, "1", "0", "Music", "object.container.storageFolder",
+	  NULL, NULL, NULL, NULL, TRUE },
+	{ "vendor desc",
+	  BENCH_DIDL_HEAD
+	  "<item id=\"7\" parentID=\"1\">"
+	  "<desc id=\"x\" nameSpace=\"urn:x\">"
+	  "<dc:title>Vendor</dc:title></desc>"
+	  "<dc:title>Real</dc:title>"
+	  "<dc:creator>Creator</dc:creator>"
+	  "<res protocolInfo=\"http-get:*:image/jpeg:DLNA.ORG_PN=JPEG_TN\">"
+	  "http://host/tn.jpg</res>"
+	  "<upnp:albumArtURI>http://host/art.jpg</upnp:albumArtURI>"
+	  "</item></DIDL-Lite>",
+	  TRUE, 1, "7", "1", "Real", NULL, "Creator", NULL,
+	  "http://host/art.jpg", "http://host/tn.jpg", FALSE },
+	{ "empty",
+	  BENCH_DIDL_HEAD "</DIDL-Lite>",
+	  TRUE, 0 },
+	{ "truncated",
+	  BENCH_DIDL_HEAD "<item id=\"1\" parentID=\"0\"><dc:title>Cut",
+	  FALSE, 0 },
+};
+
+typedef struct
+{
+	guint objects;
+	gboolean matches;
+	guint fixture;
+} BenchCheck;
+
+static void
+bench_check_object_cb (DidlObject *object,
+                       gpointer    user_data)
+{
+	BenchCheck *check = (BenchCheck *) user_data;
+	guint i = check->fixture;
+
+	if (check->objects++ > 0)
+		return;
+
+	check->matches =
+		!g_strcmp0 (object->id, bench_fixtures[i].id) &&
+		!g_strcmp0 (object->parent_id, bench_fixtures[i].parent_id) &&
+		!g_strcmp0 (object->title, bench_fixtures[i].title) &&
+		!g_strcmp0 (object->upnp_class, bench_fixtures[i].upnp_class) &&
+		!g_strcmp0 (object->artist, bench_fixtures[i].artist) &&
+		!g_strcmp0 (object->album, bench_fixtures[i].album) &&
+		!g_strcmp0 (object->art_uri, bench_fixtures[i].art_uri) &&
+		!g_strcmp0 (object->uri, bench_fixtures[i].uri) &&
+		object->is_container == bench_fixtures[i].is_container;
+}
+
+static void
+bench_quiet_error (void       *ctx,
+                   const char *msg,
+                   ...)
+{
+}
+
+/* Runs didl_parse over bench_fixtures, FALSE if any comes out wrong */
+static gboolean
+bench_check_fixtures (void)
+{
+	gboolean ok = TRUE;
+	guint i;
+
+	/* Some of them are broken on purpose */
+	xmlSetGenericErrorFunc (NULL, bench_quiet_error);
+	for (i = 0; i < G_N_ELEMENTS (bench_fixtures); i++) {
+		BenchCheck check = { 0, TRUE, i };
+		const char *didl = bench_fixtures[i].didl;
+		gboolean valid;
+
+		valid = didl_parse (didl,
+				    strlen (didl),
+				    FALSE,
+				    bench_check_object_cb,
+				    &check,
+				    NULL);
+		if (valid != bench_fixtures[i].valid ||
+		    (valid && (check.objects != bench_fixtures[i].objects ||
+			       !check.matches))) {
+			g_printerr ("didl_parse gets fixture \"%s\" wrong\n",
+				    bench_fixtures[i].name);
+			ok = FALSE;
+		}
+	}
+	xmlSetGenericErrorFunc (NULL, NULL);
+
+	return ok;
+}
+
+static void
+bench_report (const char *name,
+              gsize       bytes,
+              gint64      objects,
+              gint64      elapsed)
+{
+	double seconds = elapsed / (double) G_USEC_PER_SEC;
+
+	printf("%-10s %10.2f MB/s %12.0f objects/s\n",
+	       name,
+	       bytes / seconds / (1024 * 1024),
+	       objects / seconds);
+}
+
+/* Checks didl_parse against bench_fixtures, then feeds every payload
+ * through the GUPnP-AV parser the way browse_cb used to and through
+ * didl_parse, for at least a second each, then through didl_parse on all
+ * cores */
+static int
+bench_didl (char **files,
+            int    synthetic)
+{
+	GPtrArray *payloads;
+	gsize total = 0, bytes, rounds, round;
+	gint64 start, elapsed, objects;
+	GThreadPool *pool;
+	gint pool_objects;
+	guint i;
+
+	if (!bench_check_fixtures ())
+		return 1;
+
+	payloads = g_ptr_array_new_with_free_func (g_free);
+
+	for (i = 0; files != NULL && files[i] != NULL; i++) {
+		GError *error = NULL;
+		char *contents;
+
+		if (!g_file_get_contents (files[i], &contents, NULL, &error)) {
+			g_printerr ("Failed to read %s: %s\n",
+				    files[i],
+				    error->message);
+			g_error_free (error);
+
+			continue;
+		}
+
+		if (contents[0] == '{') {
+			bench_load_capture (contents, payloads);
+			g_free (contents);
+		} else
+			g_ptr_array_add (payloads, contents);
+	}
+
+	if (synthetic > 0)
+		g_ptr_array_add (payloads, bench_synthetic_didl (synthetic));
+
+	if (payloads->len == 0) {
+		g_printerr ("No DIDL-Lite payloads to parse\n");
+		g_ptr_array_unref (payloads);
+
+		return 1;
+	}
+
+	for (i = 0; i < payloads->len; i++)
+		total += strlen (g_ptr_array_index (payloads, i));
+	printf("%u payloads, %" G_GSIZE_FORMAT " bytes\n", payloads->len, total);
+
+	bytes = 0;
+	bench_gupnp_objects = 0;
+	start = g_get_monotonic_time ();
+	do {
+		for (i = 0; i < payloads->len; i++) {
+			GUPnPDIDLLiteParser *parser;
+
+			parser = gupnp_didl_lite_parser_new ();
+			g_signal_connect (parser,
+					  "object-available",
+					  G_CALLBACK (bench_gupnp_object_cb),
+					  NULL);
+			gupnp_didl_lite_parser_parse_didl
+				(parser, g_ptr_array_index (payloads, i), NULL);
+			g_object_unref (parser);
+		}
+		bytes += total;
+		elapsed = g_get_monotonic_time () - start;
+	} while (elapsed < G_USEC_PER_SEC);
+	bench_report ("gupnp-av", bytes, bench_gupnp_objects, elapsed);
+
+	bytes = 0;
+	objects = 0;
+	start = g_get_monotonic_time ();
+	do {
+		for (i = 0; i < payloads->len; i++) {
+			const char *didl = g_ptr_array_index (payloads, i);
+
+			didl_parse (didl,
+				    strlen (didl),
+				    FALSE,
+				    bench_fast_object_cb,
+				    &objects,
+				    NULL);
+		}
+		bytes += total;
+		elapsed = g_get_monotonic_time () - start;
+	} while (elapsed < G_USEC_PER_SEC);
+	bench_report ("didl_parse", bytes, objects, elapsed);
+
+	/* The same amount of work again, spread over the cores the way
+	 * browse_cb hands pages to didl_pool */
+	rounds = bytes / total;
+	pool_objects = 0;
+	pool = g_thread_pool_new (bench_pool_parse,
+				  &pool_objects,
+				  g_get_num_processors (),
+				  TRUE,
+				  NULL);
+	start = g_get_monotonic_time ();
+	for (round = 0; round < rounds; round++)
+		for (i = 0; i < payloads->len; i++)
+			g_thread_pool_push (pool,
+					    g_ptr_array_index (payloads, i),
+					    NULL);
+	g_thread_pool_free (pool, FALSE, TRUE);
+	elapsed = g_get_monotonic_time () - start;
+	bench_report ("didl_pool", bytes, pool_objects, elapsed);
+
+	g_ptr_array_unref (payloads);
+
+	return 0;
+}
+
+static int
+compare_int64 (gconstpointer a,
+               gconstpointer b)
+{
+	gint64 x = *(const gint64 *) a;
+	gint64 y = *(const gint64 *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Waits for the mock renderer to show up like any other renderer, then
+ * times playback of a single browsed item from start to PLAYING */
+static gpointer
+bench_play_thread (gpointer user_data)
+{
+	int rounds = GPOINTER_TO_INT (user_data);
+	GUPnPServiceProxy *av_transport = NULL;
+	RendererData *renderer;
+	MockRenderer *mock;
+	gint64 *samples, start;
+	char *didl;
+	int i, failed = 0;
+
+	for (i = 0; i < 100 && av_transport == NULL; i++) {
+		g_usleep (100 * 1000);
+
+		mock = g_atomic_pointer_get (&bench_renderer);
+		if (mock == NULL)
+			continue;
+
+		g_mutex_lock (&renderer_state_lock);
+		renderer = (RendererData*)g_hash_table_lookup(renderer_table, mock->udn);
+		if (renderer != NULL && renderer->sink_protocol_info != NULL)
+			av_transport = g_object_ref (renderer->av_transport);
+		g_mutex_unlock (&renderer_state_lock);
+	}
+
+	if (av_transport == NULL) {
+		g_printerr ("Mock renderer did not show up\n");
+		g_main_loop_quit (main_loop);
+
+		return NULL;
+	}
+
+	g_strlcpy (current_renderer, mock->udn, sizeof (current_renderer));
+
+	didl = bench_synthetic_didl (1);
+	samples = g_new (gint64, rounds);
+
+	for (i = 0; i < rounds; i++) {
+		PlayWait wait;
+
+		play_wait_init (&wait);
+		start = g_get_monotonic_time ();
+		set_av_transport_uri (didl, av_transport, &wait);
+		if (!play_wait_finish (&wait))
+			failed++;
+		samples[i] = g_get_monotonic_time () - start;
+	}
+
+	qsort (samples, rounds, sizeof (gint64), compare_int64);
+	printf("%d rounds, %d failed, mock latency %d ms\n",
+	       rounds,
+	       failed,
+	       mock_latency_ms);
+	printf("select-to-PLAYING: min %.2f ms, median %.2f ms, "
+	       "p95 %.2f ms, max %.2f ms\n",
+	       samples[0] / 1000.0,
+	       samples[rounds / 2] / 1000.0,
+	       samples[(rounds * 95) / 100] / 1000.0,
+	       samples[rounds - 1] / 1000.0);
+
+	g_free (samples);
+	g_free (didl);
+	g_object_unref (av_transport);
+	g_main_loop_quit (main_loop);
+
+	return NULL;
+}
+
+/* --soak: churns mock devices, browses them and drives playback for the
+ * given time while watching for drift in RSS, open descriptors, main
+ * loop stalls and action latency.  The first sample, taken after one
+ * interval of warm-up, is the baseline. */
+#define SOAK_PROBE_MS 50
+#define SOAK_BROWSES 8
+#define SOAK_MIN_FD_GROWTH 4
+
+typedef struct
+{
+        gsize  rss;
+        guint  fds;
+        gint64 stall;
+        guint  actions;
+        gint64 p50;
+        gint64 p95;
+        gint64 p99;
+} SoakSample;
+
+static GMutex soak_lock;
+static GArray *soak_latencies = NULL;
+static gint64 soak_stall = 0;
+static gint64 soak_probe_last = 0;
+static gboolean soak_failed = FALSE;
+static sem_t soak_sem;
+
+/* Answers of a successful action, see action_end () */
+static void
+soak_record_action (gint64 latency)
+{
+        if (soak_seconds == 0)
+                return;
+
+        g_mutex_lock (&soak_lock);
+        g_array_append_val (soak_latencies, latency);
+        g_mutex_unlock (&soak_lock);
+}
+
+/* Fires every SOAK_PROBE_MS on the main loop, whatever it is late by is
+ * time the loop spent on something else */
+static gboolean
+soak_probe_cb (gpointer user_data)
+{
+        gint64 now = g_get_monotonic_time ();
+        gint64 lag;
+
+        if (soak_probe_last != 0) {
+                lag = now - soak_probe_last - SOAK_PROBE_MS * 1000;
+
+                g_mutex_lock (&soak_lock);
+                if (lag > soak_stall)
+                        soak_stall = lag;
+                g_mutex_unlock (&soak_lock);
         }
+        soak_probe_last = now;
 
-        browse_metadata_data_free (data);
-        g_object_unref (content_dir);
+        return TRUE;
+}
+
+static gsize
+soak_read_rss (void)
+{
+        char         *statm = NULL;
+        unsigned long size, resident = 0;
+
+        if (!g_file_get_contents ("/proc/self/statm", &statm, NULL, NULL))
+                return 0;
+
+        if (sscanf (statm, "%lu %lu", &size, &resident) != 2)
+                resident = 0;
+        g_free (statm);
+
+        return (gsize) resident * sysconf (_SC_PAGESIZE);
 }
 
+static guint
+soak_count_fds (void)
+{
+        GDir  *dir;
+        guint  fds = 0;
+
+        dir = g_dir_open ("/proc/self/fd", 0, NULL);
+        if (dir == NULL)
+                return 0;
+
+        while (g_dir_read_name (dir) != NULL)
+                fds++;
+        g_dir_close (dir);
+
+        /* Not counting the one GDir had open */
+        return fds - 1;
+}
 
+/* Takes the interval's stall and latencies and starts a new interval */
 static void
-browse_metadata (GUPnPServiceProxy *content_dir,
-                 const char        *id)
+soak_take_sample (SoakSample *sample)
 {
- 
-        BrowseMetadataData *data;
+        GArray *latencies;
+        guint   n;
+
+        sample->rss = soak_read_rss ();
+        sample->fds = soak_count_fds ();
+
+        g_mutex_lock (&soak_lock);
+        latencies = soak_latencies;
+        soak_latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+        sample->stall = soak_stall;
+        soak_stall = 0;
+        g_mutex_unlock (&soak_lock);
+
+        n = latencies->len;
+        sample->actions = n;
+        sample->p50 = sample->p95 = sample->p99 = 0;
+        if (n > 0) {
+                gint64 *values = (gint64 *) latencies->data;
+
+                qsort (values, n, sizeof (gint64), compare_int64);
+                sample->p50 = values[n / 2];
+                sample->p95 = values[(n * 95) / 100];
+                sample->p99 = values[(n * 99) / 100];
+        }
+        g_array_free (latencies, TRUE);
+}
 
-        data = browse_metadata_data_new (NULL, id, NULL);
+/* Returns why @sample drifted too far from @baseline, or NULL */
+static char *
+soak_check_sample (const SoakSample *baseline,
+                   const SoakSample *sample)
+{
+        guint fd_growth;
+
+        if (sample->rss > baseline->rss +
+                          baseline->rss * soak_max_growth / 100)
+                return g_strdup_printf ("RSS grew from %" G_GSIZE_FORMAT
+                                        " to %" G_GSIZE_FORMAT " bytes",
+                                        baseline->rss,
+                                        sample->rss);
+
+        fd_growth = MAX (baseline->fds * soak_max_growth / 100,
+                         SOAK_MIN_FD_GROWTH);
+        if (sample->fds > baseline->fds + fd_growth)
+                return g_strdup_printf ("open descriptors grew from %u to %u",
+                                        baseline->fds,
+                                        sample->fds);
+
+        if (sample->stall > (gint64) soak_max_stall_ms * 1000)
+                return g_strdup_printf ("main loop stalled for %.1f ms",
+                                        sample->stall / 1000.0);
+
+        if (sample->p95 > (gint64) soak_max_p95_ms * 1000)
+                return g_strdup_printf ("action latency p95 is %.1f ms",
+                                        sample->p95 / 1000.0);
+
+        return NULL;
+}
 
-        gupnp_service_proxy_begin_action
-		(g_object_ref (content_dir),
-		 "Browse",
-		 browse_metadata_cb,
-		 data,
-		 /* IN args */
-		 "ObjectID",
-		 G_TYPE_STRING,
-		 data->id,
-		 "BrowseFlag",
-		 G_TYPE_STRING,
-		 "BrowseMetadata",
-		 "Filter",
-		 G_TYPE_STRING,
-		 "*",
-		 "StartingIndex",
-		 G_TYPE_UINT,
-		 0,
-		 "RequestedCount",
-		 G_TYPE_UINT, 0,
-		 "SortCriteria",
-		 G_TYPE_STRING,
-		 "",
-		 NULL);
+static void
+soak_print_sample (gint64            elapsed,
+                   const SoakSample *sample)
+{
+        printf("soak %6" G_GINT64_FORMAT " s: rss %.1f MiB, %u fds, "
+               "main loop stall %.1f ms, %u actions p50 %.1f ms "
+               "p95 %.1f ms p99 %.1f ms\n",
+               elapsed / G_USEC_PER_SEC,
+               sample->rss / (1024.0 * 1024.0),
+               sample->fds,
+               sample->stall / 1000.0,
+               sample->actions,
+               sample->p50 / 1000.0,
+               sample->p95 / 1000.0,
+               sample->p99 / 1000.0);
+        fflush(stdout);
 }
 
-static void player_control(void);
+typedef struct
+{
+        MockServer   *server;
+        MockRenderer *renderer;
+        guint         generation;
+} SoakDevices;
+
+/* The mocks belong to the thread owning mock_context */
+static gboolean
+soak_devices_create_cb (gpointer user_data)
+{
+        SoakDevices *devices = (SoakDevices *) user_data;
+        char        *name;
+
+        name = g_strdup_printf ("Soak server %u", devices->generation);
+        devices->server = mock_server_new (mock_context,
+                                           name,
+                                           mock_latency_ms);
+        g_free (name);
 
+        name = g_strdup_printf ("Soak renderer %u", devices->generation);
+        devices->renderer = mock_renderer_new (mock_context,
+                                               name,
+                                               mock_latency_ms);
+        g_free (name);
+
+        sem_post(&soak_sem);
+
+        return FALSE;
+}
+
+static gboolean
+soak_devices_free_cb (gpointer user_data)
+{
+        SoakDevices *devices = (SoakDevices *) user_data;
+
+        if (devices->server != NULL)
+                mock_server_free (devices->server);
+        if (devices->renderer != NULL)
+                mock_renderer_free (devices->renderer);
+        devices->server = NULL;
+        devices->renderer = NULL;
+
+        sem_post(&soak_sem);
+
+        return FALSE;
+}
+
+/* Waits for the control point to pick up the generation's devices,
+ * returns a reference to the server's ContentDirectory */
+static GUPnPServiceProxy *
+soak_wait_for_devices (SoakDevices *devices)
+{
+        GUPnPServiceProxy *content_dir;
+        RendererData      *renderer = NULL;
+        int                i;
+
+        for (i = 0; i < 100; i++) {
+                g_mutex_lock(&renderer_state_lock);
+                renderer = g_hash_table_lookup (renderer_table,
+                                                devices->renderer->udn);
+                if (renderer != NULL && renderer->sink_protocol_info == NULL)
+                        renderer = NULL;
+                g_mutex_unlock(&renderer_state_lock);
+
+                /* server_table belongs to the main loop */
+                if (renderer != NULL) {
+                        content_dir = server_ref_content_dir
+                                (devices->server->udn);
+                        if (content_dir != NULL)
+                                return content_dir;
+                }
+
+                g_usleep (100 * 1000);
+        }
+
+        return NULL;
+}
+
+/* One round of everything a user does: browse around the server's tree
+ * and play, pause and stop a track */
 static void
-av_transport_action_cb (GUPnPServiceProxy       *av_transport,
-                        GUPnPServiceProxyAction *action,
-                        gpointer                 user_data)
+soak_exercise (SoakDevices       *devices,
+               GUPnPServiceProxy *content_dir,
+               const char        *didl)
+{
+        GUPnPServiceProxy *av_transport;
+        PlayWait           wait;
+        GString           *id;
+        guint              i, depth;
+
+        for (i = 0; i < SOAK_BROWSES; i++) {
+                id = g_string_new ("0");
+                for (depth = g_random_int_range (0, MOCK_SERVER_DEPTH + 1);
+                     depth > 0;
+                     depth--)
+                        g_string_append_printf
+                                (id,
+                                 "/%d",
+                                 g_random_int_range (0,
+                                                     MOCK_SERVER_CONTAINERS));
+
+                browse (content_dir, id->str, 0, MAX_BROWSE);
+                trace_sem_wait (&browse_sem, "wait browse");
+                g_string_free (id, TRUE);
+        }
+
+        av_transport = renderer_ref_av_transport (devices->renderer->udn);
+        if (av_transport == NULL)
+                return;
+
+        g_strlcpy (current_renderer,
+                   devices->renderer->udn,
+                   sizeof (current_renderer));
+        play_wait_init (&wait);
+        set_av_transport_uri (didl, av_transport, &wait);
+        g_object_unref (av_transport);
+        play_wait_finish (&wait);
+
+        pause_file ();
+        g_usleep ((mock_latency_ms + 50) * 1000);
+        stop_file ();
+        g_usleep ((mock_latency_ms + 50) * 1000);
+}
+
+static gpointer
+soak_thread (gpointer user_data)
+{
+        SoakDevices        devices = { NULL, NULL, 0 };
+        SoakSample         baseline, sample;
+        GUPnPServiceProxy *content_dir;
+        gboolean           have_baseline = FALSE;
+        gint64             start, deadline, next_sample, now;
+        char              *didl, *failure = NULL;
+        int                i;
+
+        for (i = 0; i < 100 && g_atomic_pointer_get (&mock_context) == NULL;
+             i++)
+                g_usleep (100 * 1000);
+
+        if (g_atomic_pointer_get (&mock_context) == NULL) {
+                g_printerr ("No network context for the soak devices\n");
+                soak_failed = TRUE;
+                g_main_loop_quit (main_loop);
+
+                return NULL;
+        }
+
+        didl = bench_synthetic_didl (1);
+        start = g_get_monotonic_time ();
+        deadline = start + (gint64) soak_seconds * G_USEC_PER_SEC;
+        next_sample = start + (gint64) soak_interval * G_USEC_PER_SEC;
+
+        while (failure == NULL && g_get_monotonic_time () < deadline) {
+                /* Every round brings new devices and says goodbye to
+                 * them, so discovery keeps adding and removing */
+                devices.generation++;
+                context_invoke (mock_context, soak_devices_create_cb, &devices);
+                sem_wait(&soak_sem);
+
+                if (devices.server == NULL || devices.renderer == NULL)
+                        failure = g_strdup ("could not create mock devices");
+                else if ((content_dir = soak_wait_for_devices (&devices)) ==
+                         NULL)
+                        failure = g_strdup ("mock devices were not discovered");
+                else {
+                        soak_exercise (&devices, content_dir, didl);
+                        g_clear_object (&content_dir);
+                }
+
+                context_invoke (mock_context, soak_devices_free_cb, &devices);
+                sem_wait(&soak_sem);
+
+                now = g_get_monotonic_time ();
+                if (failure != NULL || now < next_sample)
+                        continue;
+                next_sample = now + (gint64) soak_interval * G_USEC_PER_SEC;
+
+                soak_take_sample (&sample);
+                soak_print_sample (now - start, &sample);
+
+                if (!have_baseline) {
+                        baseline = sample;
+                        have_baseline = TRUE;
+                } else
+                        failure = soak_check_sample (&baseline, &sample);
+        }
+
+        if (failure != NULL) {
+                printf("soak FAILED after %u rounds: %s\n",
+                       devices.generation,
+                       failure);
+                soak_failed = TRUE;
+                g_free (failure);
+        } else
+                printf("soak passed, %u rounds\n", devices.generation);
+
+        g_free (didl);
+        g_main_loop_quit (main_loop);
+
+        return NULL;
+}
+
+/* --farm-servers and --farm-renderers: a crowd of mock devices on the
+ * mock context, to see how long discovery takes to find them all, what
+ * each one costs and how fast one command reaches all renderers */
+#define FARM_WAIT_SECONDS 300
+#define FARM_FANOUT_ROUNDS 5
+#define FARM_CHURN_SECONDS 10
+/* The churn timer ticks in whole milliseconds */
+#define FARM_CHURN_MAX 1000
+
+typedef struct
+{
+        GMutex     lock;
+        GPtrArray *servers;
+        GPtrArray *renderers;
+
+        /* UDNs of the devices churn replaced */
+        GPtrArray *departed;
+        guint      generation;
+        guint      churn_source;
+} DeviceFarm;
+
+typedef struct
+{
+        guint servers;
+        guint renderers;
+        guint stale;
+} FarmCount;
+
+static DeviceFarm farm;
+static sem_t farm_sem;
+static gint farm_fanout_pending;
+static gint farm_fanout_failed;
+
+static MockServer *
+farm_server_new (void)
 {
+        MockServer *server;
+        char       *name;
+
+        name = g_strdup_printf ("Farm server %u", farm.generation++);
+        server = mock_server_new (mock_context, name, mock_latency_ms);
+        g_free (name);
+
+        return server;
+}
+
+static MockRenderer *
+farm_renderer_new (void)
+{
+        MockRenderer *renderer;
+        char         *name;
+
+        name = g_strdup_printf ("Farm renderer %u", farm.generation++);
+        renderer = mock_renderer_new (mock_context, name, mock_latency_ms);
+        g_free (name);
+
+        return renderer;
+}
 
-        char *action_name;
-        GError *error;
+/* Runs on the thread owning mock_context */
+static gboolean
+farm_create_cb (gpointer user_data)
+{
+        int i;
 
-        action_name = (const char *) user_data;
+        g_mutex_lock (&farm.lock);
+        for (i = 0; i < farm_servers; i++) {
+                MockServer *server = farm_server_new ();
 
-        error = NULL;
-        if (!gupnp_service_proxy_end_action (av_transport,
-                                             action,
-                                             &error,
-                                             NULL)) {
-                const char *udn;
+                if (server != NULL)
+                        g_ptr_array_add (farm.servers, server);
+        }
+        for (i = 0; i < farm_renderers; i++) {
+                MockRenderer *renderer = farm_renderer_new ();
 
-                udn = gupnp_service_info_get_udn
-			(GUPNP_SERVICE_INFO (av_transport));
+                if (renderer != NULL)
+                        g_ptr_array_add (farm.renderers, renderer);
+        }
+        g_mutex_unlock (&farm.lock);
 
-                g_warning ("Failed to send action '%s' to '%s': %s",
-                           action_name,
-                           udn,
-                           error->message);
+        sem_post(&farm_sem);
 
-                g_error_free (error);
-        } else {
-		if(!strcmp(action_name,"Play"))
-			current_status = PLAYING;
-	}
+        return FALSE;
 }
 
-static void
-g_value_free (gpointer data)
+/* Says goodbye with one random device and brings up a new one */
+static gboolean
+farm_churn_cb (gpointer user_data)
 {
-	g_value_unset ((GValue *) data);
-	g_slice_free (GValue, data);
+        guint total, index;
+
+        g_mutex_lock (&farm.lock);
+        total = farm.servers->len + farm.renderers->len;
+        if (total > 0) {
+                index = g_random_int_range (0, total);
+                if (index < farm.servers->len) {
+                        MockServer *server;
+
+                        server = g_ptr_array_index (farm.servers, index);
+                        g_ptr_array_add (farm.departed,
+                                         g_strdup (server->udn));
+                        mock_server_free (server);
+                        g_ptr_array_index (farm.servers, index) =
+                                farm_server_new ();
+                        if (g_ptr_array_index (farm.servers, index) == NULL)
+                                g_ptr_array_remove_index_fast (farm.servers,
+                                                               index);
+                } else {
+                        MockRenderer *renderer;
+
+                        index -= farm.servers->len;
+                        renderer = g_ptr_array_index (farm.renderers, index);
+                        g_ptr_array_add (farm.departed,
+                                         g_strdup (renderer->udn));
+                        mock_renderer_free (renderer);
+                        g_ptr_array_index (farm.renderers, index) =
+                                farm_renderer_new ();
+                        if (g_ptr_array_index (farm.renderers, index) == NULL)
+                                g_ptr_array_remove_index_fast (farm.renderers,
+                                                               index);
+                }
+        }
+        g_mutex_unlock (&farm.lock);
+
+        return TRUE;
 }
 
+static gboolean
+farm_churn_start_cb (gpointer user_data)
+{
+        GSource *source;
+
+        source = g_timeout_source_new (1000 / farm_churn);
+        g_source_set_callback (source, farm_churn_cb, NULL, NULL);
+        farm.churn_source = g_source_attach (source,
+                                             g_main_context_get_thread_default ());
+        g_source_unref (source);
+
+        sem_post(&farm_sem);
+
+        return FALSE;
+}
 
-static GHashTable *
-create_av_transport_args_hash (char **additional_args)
+static gboolean
+farm_free_cb (gpointer user_data)
 {
-        printf("On %s function\n",__func__);
-        GHashTable *args;
-        GValue     *instance_id;
-        gint        i;
+        if (farm.churn_source != 0) {
+                g_source_destroy (g_main_context_find_source_by_id
+                                        (g_main_context_get_thread_default (),
+                                         farm.churn_source));
+                farm.churn_source = 0;
+        }
+
+        g_mutex_lock (&farm.lock);
+        g_ptr_array_foreach (farm.servers, (GFunc) mock_server_free, NULL);
+        g_ptr_array_set_size (farm.servers, 0);
+        g_ptr_array_foreach (farm.renderers, (GFunc) mock_renderer_free, NULL);
+        g_ptr_array_set_size (farm.renderers, 0);
+        g_mutex_unlock (&farm.lock);
 
-        args = g_hash_table_new_full (g_str_hash,
-                                      g_str_equal,
-                                      NULL,
-                                      g_value_free);
+        sem_post(&farm_sem);
 
-        instance_id = g_slice_alloc0 (sizeof (GValue));
-        g_value_init (instance_id, G_TYPE_UINT);
-        g_value_set_uint (instance_id, 0);
+        return FALSE;
+}
 
-        g_hash_table_insert (args, "InstanceID", instance_id);
+/* The device tables belong to the main loop, count there */
+static gboolean
+farm_count_cb (gpointer user_data)
+{
+        FarmCount *count = (FarmCount *) user_data;
+        guint      i;
 
-        if (additional_args != NULL) {
-                for (i = 0; additional_args[i]; i += 2) {
-                        GValue *value;
+        memset (count, 0, sizeof (FarmCount));
 
-                        value = g_slice_alloc0 (sizeof (GValue));
-                        g_value_init (value, G_TYPE_STRING);
-                        g_value_set_string (value, additional_args[i + 1]);
+        g_mutex_lock (&farm.lock);
+        g_mutex_lock (&renderer_state_lock);
+        for (i = 0; i < farm.servers->len; i++) {
+                MockServer *server = g_ptr_array_index (farm.servers, i);
 
-                        g_hash_table_insert (args, additional_args[i], value);
-                }
+                if (g_hash_table_lookup (server_table, server->udn) != NULL)
+                        count->servers++;
         }
+        for (i = 0; i < farm.renderers->len; i++) {
+                MockRenderer *mock = g_ptr_array_index (farm.renderers, i);
+                RendererData *renderer;
 
-        return args;
-}
+                renderer = g_hash_table_lookup (renderer_table, mock->udn);
+                if (renderer != NULL && renderer->sink_protocol_info != NULL)
+                        count->renderers++;
+        }
+        for (i = 0; i < farm.departed->len; i++) {
+                const char *udn = g_ptr_array_index (farm.departed, i);
 
+                if (g_hash_table_lookup (server_table, udn) != NULL ||
+                    g_hash_table_lookup (renderer_table, udn) != NULL)
+                        count->stale++;
+        }
+        g_mutex_unlock (&renderer_state_lock);
+        g_mutex_unlock (&farm.lock);
 
+        sem_post(&farm_sem);
 
-void
-av_transport_send_action (char *action)
-                          
+        return FALSE;
+}
+
+static void
+farm_count (FarmCount *count)
 {
+        main_invoke (farm_count_cb, count);
+        sem_wait(&farm_sem);
+}
 
-	RendererData *r = (RendererData*)g_hash_table_lookup(renderer_table, current_renderer);
+/* Hands out a reference to the RenderingControl of every farm renderer
+ * the control point knows */
+static gboolean
+farm_collect_cb (gpointer user_data)
+{
+        GPtrArray *proxies = (GPtrArray *) user_data;
+        guint      i;
+
+        g_mutex_lock (&farm.lock);
+        g_mutex_lock (&renderer_state_lock);
+        for (i = 0; i < farm.renderers->len; i++) {
+                MockRenderer *mock = g_ptr_array_index (farm.renderers, i);
+                RendererData *renderer;
+
+                renderer = g_hash_table_lookup (renderer_table, mock->udn);
+                if (renderer != NULL)
+                        g_ptr_array_add (proxies,
+                                         g_object_ref
+                                                (renderer->rendering_control));
+        }
+        g_mutex_unlock (&renderer_state_lock);
+        g_mutex_unlock (&farm.lock);
 
-	if(!strcmp(action, "Play"))
-		gupnp_service_proxy_begin_action ((GUPnPServiceProxy *)r->av_transport,
-						  action,
-						  av_transport_action_cb,
-						  action,
-						  "InstanceID", G_TYPE_UINT, 0,
-						  "Speed", G_TYPE_UINT, 1,
-						  NULL);
-	else
-		gupnp_service_proxy_begin_action ((GUPnPServiceProxy *)r->av_transport,
-						  action,
-						  av_transport_action_cb,
-						  action,
-						  "InstanceID", G_TYPE_UINT, 0,
-						  NULL);
+        sem_post(&farm_sem);
+
+        return FALSE;
 }
 
-static void play_file (void)
+static void
+farm_fanout_cb (GUPnPServiceProxy       *rendering_control,
+                GUPnPServiceProxyAction *action,
+                gpointer                 user_data)
 {
+        guint volume;
 
-        av_transport_send_action ("Play");
-	
+        if (!action_end (rendering_control,
+                         action,
+                         NULL,
+                         "CurrentVolume", G_TYPE_UINT, &volume,
+                         NULL))
+                g_atomic_int_inc (&farm_fanout_failed);
+
+        if (g_atomic_int_dec_and_test (&farm_fanout_pending))
+                sem_post(&farm_sem);
 }
 
-static void pause_file()
+/* Sends GetVolume to every renderer at once, returns how long it took
+ * until all answered */
+static gint64
+farm_fanout (GPtrArray *proxies)
 {
-	av_transport_send_action ("Pause");
+        gint64 start;
+        guint  i;
+
+        g_atomic_int_set (&farm_fanout_pending, proxies->len);
+        start = g_get_monotonic_time ();
+        for (i = 0; i < proxies->len; i++)
+                action_begin (g_ptr_array_index (proxies, i),
+                              "GetVolume",
+                              farm_fanout_cb,
+                              NULL,
+                              "InstanceID", G_TYPE_UINT, 0,
+                              "Channel", G_TYPE_STRING, "Master",
+                              NULL);
+        sem_wait(&farm_sem);
+
+        return g_get_monotonic_time () - start;
 }
 
-static void stop_file()
+static gssize
+farm_tracked_bytes (void)
 {
-	av_transport_send_action ("Stop");
-}
+        MemSnapshot snapshots[N_MEM_TAGS];
 
+        mem_snapshot (snapshots);
 
+        return snapshots[MEM_DISCOVERY].counters.live_bytes +
+               snapshots[MEM_CONTROL].counters.live_bytes;
+}
 
-static void
-get_position_info_cb (GUPnPServiceProxy       *av_transport,
-                      GUPnPServiceProxyAction *action,
-                      gpointer                 user_data)
+static gpointer
+farm_thread (gpointer user_data)
 {
-	//      printf("On %s function\n",__func__);
-        gchar       *position;
-	gchar *duration;
-        const gchar *udn;
-        GError      *error;
-	char curr_pos[64];
-	static char track_duration[64];
-	
-	
-        udn = gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (av_transport));
-        error = NULL;
-        if (!gupnp_service_proxy_end_action (av_transport,
-                                             action,
-                                             &error,
-                                             "AbsTime",
-                                             G_TYPE_STRING,
-                                             &position,
-					     "TrackDuration",
-					     G_TYPE_STRING,
-					     &duration,
-					     NULL)) {
-                printf("Failed to get current media position"
-                           "from media renderer '%s':%s\n",
-                           udn,
-                           error->message);
-                g_error_free (error);
-                goto return_point;
+        FarmCount  count;
+        GPtrArray *proxies;
+        gint64     start, elapsed, half = 0, fanout;
+        gsize      rss_before;
+        gssize     tracked_before = 0;
+        guint      devices, found, i;
+        int        round;
+
+        for (i = 0; i < 100 && g_atomic_pointer_get (&mock_context) == NULL;
+             i++)
+                g_usleep (100 * 1000);
+
+        if (g_atomic_pointer_get (&mock_context) == NULL) {
+                g_printerr ("No network context for the farm\n");
+                g_main_loop_quit (main_loop);
+
+                return NULL;
         }
-	memset(curr_pos, 0, sizeof(curr_pos));
-	strncpy(curr_pos, position, strlen(position) - 1);
-	curr_pos[strlen(position)] = '\0';
-
-	memset(track_duration, 0, sizeof(track_duration));
-	strncpy(track_duration, duration, strlen(duration) - 1);
-	track_duration[strlen(duration)] = '\0';
-	
 
+        rss_before = soak_read_rss ();
+        if (alloc_stats)
+                tracked_before = farm_tracked_bytes ();
+
+        start = g_get_monotonic_time ();
+        context_invoke (mock_context, farm_create_cb, NULL);
+        sem_wait(&farm_sem);
+        devices = farm.servers->len + farm.renderers->len;
+        printf("Started %u servers and %u renderers in %.1f ms\n",
+               farm.servers->len,
+               farm.renderers->len,
+               (g_get_monotonic_time () - start) / 1000.0);
+
+        do {
+                g_usleep (100 * 1000);
+                farm_count (&count);
+                found = count.servers + count.renderers;
+                elapsed = g_get_monotonic_time () - start;
+                if (half == 0 && found * 2 >= devices)
+                        half = elapsed;
+        } while (found < devices &&
+                 elapsed < (gint64) FARM_WAIT_SECONDS * G_USEC_PER_SEC);
+
+        printf("Discovered %u of %u devices: half after %.2f s, %s %.2f s\n",
+               found,
+               devices,
+               half / (double) G_USEC_PER_SEC,
+               found == devices ? "all after" : "gave up after",
+               elapsed / (double) G_USEC_PER_SEC);
+
+        if (devices > 0) {
+                printf("Memory per device: %.1f KiB RSS (mock and control "
+                       "point)",
+                       (double) (soak_read_rss () - rss_before) /
+                       devices / 1024);
+                if (alloc_stats)
+                        printf(", %.1f KiB tracked by the control point",
+                               (double) (farm_tracked_bytes () -
+                                         tracked_before) /
+                               devices / 1024);
+                printf("\n");
+        }
 
-	printf("\r%s:%s", track_duration, curr_pos);
+        proxies = g_ptr_array_new ();
+        main_invoke (farm_collect_cb, proxies);
+        sem_wait(&farm_sem);
+
+        for (round = 0; round < FARM_FANOUT_ROUNDS && proxies->len > 0;
+             round++) {
+                g_atomic_int_set (&farm_fanout_failed, 0);
+                fanout = farm_fanout (proxies);
+                printf("Fan-out %d: GetVolume to %u renderers in %.1f ms, "
+                       "%.0f actions/s, %d failed\n",
+                       round + 1,
+                       proxies->len,
+                       fanout / 1000.0,
+                       proxies->len / (fanout / (double) G_USEC_PER_SEC),
+                       g_atomic_int_get (&farm_fanout_failed));
+        }
+        g_ptr_array_foreach (proxies, (GFunc) proxy_release, NULL);
+        g_ptr_array_unref (proxies);
+
+        /* The fan-out rounds above ran against a quiet farm, churn only
+         * starts now so that their numbers are not skewed by it */
+        if (farm_churn > 0) {
+                context_invoke (mock_context, farm_churn_start_cb, NULL);
+                sem_wait(&farm_sem);
+
+                /* Let discovery catch up with the churn */
+                g_usleep ((gulong) FARM_CHURN_SECONDS * G_USEC_PER_SEC);
+                farm_count (&count);
+                printf("After %u devices were replaced: %u of %u current "
+                       "devices known, %u departed ones still listed\n",
+                       farm.departed->len,
+                       count.servers + count.renderers,
+                       devices,
+                       count.stale);
+        }
 
-	fflush(stdout);
-	
-return_point:
-	sem_post(&duration_sem);
-	return;
+        context_invoke (mock_context, farm_free_cb, NULL);
+        sem_wait(&farm_sem);
+        g_main_loop_quit (main_loop);
 
-//        g_object_unref (av_transport);
+        return NULL;
 }
 
-void *duration_update_func(void *ptr)
+/* The p/P entry of the server menu, plays an item or lists a container
+ * given by path */
+static void
+path_menu (void)
 {
-	printf("on %s\n",__func__);
+	char user_input[1024];
+	GUPnPServiceProxy *content_dir;
+	char *id, *class;
+	GError *error = NULL;
 
-	RendererData *r = (RendererData*)g_hash_table_lookup(renderer_table, current_renderer);
+	printf("Enter a path such as NAS/Music/Albums: ");
+	memset(user_input, 0, sizeof(user_input));
+	fgets(user_input, sizeof(user_input), stdin);
+	g_strchomp(user_input);
 
-	printf("renderer name: %s\n",(const char*)r->friendly_name);
-	while(1)
-	{
-		gupnp_service_proxy_begin_action ((GUPnPServiceProxy *)r->av_transport,
-                                          "GetPositionInfo",
-                                          get_position_info_cb,
-                                          NULL,
-                                          "InstanceID", G_TYPE_UINT, 0,
-                                          NULL);
+	if(!path_resolve(user_input, &content_dir, &id, &class, &error)) {
+		printf("%s\n", error->message);
+		g_error_free(error);
 
-		sem_wait(&duration_sem);
-		if(current_status == STOPPED)
-			break;
-		
+		return;
 	}
-}
 
+	if(strncmp(class, OBJECT_CLASS_CONTAINER, strlen(OBJECT_CLASS_CONTAINER))) {
+		play(content_dir, id);
+	} else {
+		browse(content_dir, id, 0, MAX_BROWSE);
+		trace_sem_wait (&browse_sem, "wait browse");
 
-static void player_control()
+		cache_print_children(gupnp_service_info_get_udn(GUPNP_SERVICE_INFO(content_dir)), id);
+	}
+
+	g_object_unref(content_dir);
+	g_free(id);
+	g_free(class);
+}
+
+/* The i/I entry of the server menu, queues a playlist on a renderer */
+static void
+playlist_menu (void)
 {
-	char user_input[256];
-	
-	GThread *duration_update;
+	char user_input[1024];
+	PlaylistImport *import;
+	GError *error = NULL;
+	guint queued;
 
-	
-	duration_update = g_thread_new("duration_update",(GThreadFunc)duration_update_func, NULL);
-	sleep(1);
-	while(1) {
-		printf("\nEnter u/U to pause \nEnter p/P to play\nEnter s/S to stop\n");
-		printf("> ");
-		memset(user_input, 0, sizeof(user_input));
-		fgets(user_input, sizeof(user_input), stdin);
-		switch(user_input[0])
-		{
-		case 'u':
-		case 'U':
-			if(current_status == PLAYING) {
-				pause_file();
-				current_status = PAUSED;
-			}
-			break;
-		case 'p':
-		case 'P':
-			if(current_status == PAUSED) {
-				play_file();
-				current_status = PLAYING;
-			}
-			break;
-		case 's':
-		case 'S':
-			if(current_status == PLAYING || current_status == PAUSED) {
-				stop_file();
-				current_status = STOPPED;
-			}
-			break;
-		default:
-			printf("Enter valid input !!!\n");
-		}
-		
-		if(current_status == STOPPED)
-			break;
+	printf("Enter the path of an M3U or XSPF playlist: ");
+	memset(user_input, 0, sizeof(user_input));
+	fgets(user_input, sizeof(user_input), stdin);
+	g_strchomp(user_input);
+
+	import = playlist_import(user_input, &error);
+	if(import == NULL) {
+		printf("%s\n", error->message);
+		g_error_free(error);
+
+		return;
 	}
-			
-}
 
+	g_mutex_lock(&import->lock);
+	printf("%u entries: %u from the cache in %.1f ms, %u found by Search, "
+	       "%u not found after %.1f ms\n",
+	       import->entries->len,
+	       import->cached,
+	       (import->indexed_time - import->start) / 1000.0,
+	       import->searched,
+	       import->entries->len - import->cached - import->searched,
+	       (g_get_monotonic_time() - import->start) / 1000.0);
+	g_mutex_unlock(&import->lock);
+
+	while(!select_renderer())
+		puts("Wrong input !! Enter valid renderer..");
+
+	queued = playlist_queue(import, current_renderer);
+	playlist_import_unref(import);
 
-void play(GUPnPServiceProxy *content_dir, char *id)
+	printf("Queued %u tracks\n", queued);
+	if(queued > 0)
+		player_control();
+}
+
+/* The a/A entry of the server menu, plays from one list merged from
+ * every server */
+static void
+aggregate_menu (void)
 {
-	char id_copy[256];
-	int i = 1;
-	RendererData *data = NULL;
-	GHashTableIter iter;
-	gpointer key, value;
 	char user_input[256];
-	char renderer_selected[256];
-	
-	strncpy(id_copy, id, strlen(id));
-	id_copy[strlen(id)] = '\0';
+	Aggregate *aggregate;
+	GPtrArray *shown;
+	GSequenceIter *iter;
+	AggregateItem *item;
+	guint i;
 
-	puts(id_copy);
-select_renderer:	
-	if(g_hash_table_size(renderer_table) != 0) {
-
-		printf("Renderers list:\n");
-		g_hash_table_iter_init(&iter, renderer_table);
-		while(g_hash_table_iter_next(&iter, &key, &value))
-		{
+	printf("Enter a container title such as Music or a class such as object.container.album: ");
+	memset(user_input, 0, sizeof(user_input));
+	fgets(user_input, sizeof(user_input), stdin);
+	g_strstrip(user_input);
+	if(user_input[0] == '\0')
+		return;
 
-			data = (RendererData*)value;
-			printf("%d . %s->%s\n",i, (const char*)data->friendly_name, (const char*)key);
-			i++;
-		}
-		i = 1;
+	aggregate = aggregate_run(user_input, TRUE);
+
+	/* Late answers keep coming in, the numbers stay those printed */
+	shown = g_ptr_array_new();
+	g_mutex_lock(&aggregate->lock);
+	for(iter = g_sequence_get_begin_iter(aggregate->items);
+	    !g_sequence_iter_is_end(iter);
+	    iter = g_sequence_iter_next(iter))
+		g_ptr_array_add(shown, g_sequence_get(iter));
+	g_mutex_unlock(&aggregate->lock);
+
+	for(i = 0; i < shown->len; i++) {
+		item = g_ptr_array_index(shown, i);
+		printf("  %u . %s [%s]->id:%s", i + 1, item->object->title,
+		       item->server->name, item->id);
+		if(item->duplicates > 0)
+			printf(" (%u more cop%s)", item->duplicates,
+			       item->duplicates == 1 ? "y" : "ies");
+		putchar('\n');
 	}
-	printf("Select Renderer: ");
 
+	printf("Enter the number to play or r/R to previous menu: ");
 	memset(user_input, 0, sizeof(user_input));
-	memset(renderer_selected, 0, sizeof(renderer_selected));
-
 	fgets(user_input, sizeof(user_input), stdin);
-	strncpy(renderer_selected, user_input, (strlen(user_input) - 1));
-	renderer_selected[strlen(user_input)] = '\0';
-	if(NULL != g_hash_table_lookup(renderer_table, renderer_selected)) {
-		Container *c;
-		const char *uri;
-		SetAVTransportURIData *data;
-
-		strcpy(current_renderer, renderer_selected);
-		c = (Container*)g_hash_table_lookup(browse_table, id_copy);
-		if(c->resource != NULL) {
-				data = set_av_transport_uri_data_new (NULL, c->resource);
-				uri = gupnp_didl_lite_resource_get_uri (c->resource);
-				puts(uri);
-//	puts(metadata);
-				RendererData *data = (RendererData*)g_hash_table_lookup(renderer_table, current_renderer);
-				gupnp_service_proxy_begin_action ((GUPnPServiceProxy*)data->av_transport,
-								  "SetAVTransportURI",
-								  set_av_transport_uri_cb,
-								  data,
-								  "InstanceID",
-								  G_TYPE_UINT,
-								  0,
-								  "CurrentURI",
-								  G_TYPE_STRING,
-								  uri,
-								  "CurrentURIMetaData",
-								  G_TYPE_STRING,
-								  "",
-								  NULL);
-		} else {
 
-			browse_metadata(g_object_ref(content_dir), id_copy);
+	i = (guint) atoi(user_input);
+	if(i >= 1 && i <= shown->len) {
+		item = g_ptr_array_index(shown, i - 1);
+		if(item->object->class != NULL &&
+		   g_str_has_prefix(item->object->class, OBJECT_CLASS_CONTAINER))
+			printf("%s is a container, browse it from %s\n",
+			       item->object->title, item->server->name);
+		else {
+			while(!select_renderer())
+				puts("Wrong input !! Enter valid renderer..");
+
+			if(start_playback_object(item->server->content_dir,
+						 item->id, item->object))
+				player_control();
 		}
-		sem_wait(&play_sem);
-		play_file();
-		player_control();
-	} else {
-		puts("Wrong input !! Enter valid renderer..");
-		goto select_renderer;
 	}
-}
 
+	g_ptr_array_unref(shown);
+	aggregate_unref(aggregate);
+}
 
 void *user_interaction(void *ptr)
 {
-	int i = 1;
 	char user_input[256];
 	char curr_server_udn[256];
-	GHashTable *table = (GHashTable*)ptr;
-	MediaServers *s = NULL;
+	GUPnPServiceProxy *content_dir = NULL;
+	CacheCopy copy;
 	char curr_obj_id[256];
+	char parent_obj_id[256];
 
 	while(1)
 	{
-		if(g_hash_table_size((GHashTable*)ptr) != 0)
+		if(server_any_known())
 		{
-			GHashTableIter iter;
-			gpointer key, value;
-
 		refresh:
-			g_hash_table_iter_init(&iter, table);
-			while(g_hash_table_iter_next(&iter, &key, &value))
-			{
-				
-				s = (MediaServers*)value;
-				printf("%d . %s->%s\n",i, (const char*)s->friendly_name, gupnp_device_info_get_udn((GUPnPDeviceInfo*)s->info));
-				i++;
-			}
-			i = 1;
+			server_print_list();
 
 			memset(user_input, 0, sizeof(user_input));
 			memset(curr_server_udn, 0, sizeof(curr_server_udn));
 
-			printf("Enter Server's udn for browse or r/R to refresh: ");
+			printf("Enter Server's udn for browse, a/A to browse all servers, p/P to open a path, i/I to queue a playlist, l/L to play a local file, u/U to find duplicates, m/M for memory stats or r/R to refresh: ");
 			fgets(user_input, sizeof(user_input), stdin);
 			if(user_input[0] == 'r' || user_input[0] == 'R')
 				goto refresh;
+			if((user_input[0] == 'i' || user_input[0] == 'I') && user_input[1] == '\n') {
+				playlist_menu();
+				goto refresh;
+			}
+			if((user_input[0] == 'p' || user_input[0] == 'P') && user_input[1] == '\n') {
+				path_menu();
+				goto refresh;
+			}
+			if((user_input[0] == 'a' || user_input[0] == 'A') && user_input[1] == '\n') {
+				aggregate_menu();
+				goto refresh;
+			}
+			if((user_input[0] == 'm' || user_input[0] == 'M') && user_input[1] == '\n') {
+				print_memory_stats();
+				goto refresh;
+			}
+			if((user_input[0] == 'u' || user_input[0] == 'U') && user_input[1] == '\n') {
+				print_duplicates(20);
+				goto refresh;
+			}
+			if((user_input[0] == 'l' || user_input[0] == 'L') && user_input[1] == '\n') {
+				char local_path[1024];
+
+				printf("Enter the path of a file or directory: ");
+				memset(local_path, 0, sizeof(local_path));
+				fgets(local_path, sizeof(local_path), stdin);
+				g_strchomp(local_path);
+
+				play_local_file(local_path);
+				goto refresh;
+			}
 			strncpy(curr_server_udn, user_input, (strlen(user_input) - 1));
 			curr_server_udn[strlen(user_input)] = '\0';
 
-			if(g_hash_table_lookup(table, curr_server_udn) != NULL)
+			content_dir = server_ref_content_dir(curr_server_udn);
+			if(content_dir != NULL)
 			{
-				GHashTableIter iter;
-				gpointer key, value;
-				Container *c;
 			browse_server:
-				s = (MediaServers*)g_hash_table_lookup(table, curr_server_udn);
-				browse((GUPnPServiceProxy*)s->content_dir, "0", 0, MAX_BROWSE);
-				sem_wait(&browse_sem);
+				cache_set_navigation(curr_server_udn, "0");
+				browse(content_dir, "0", 0, MAX_BROWSE);
+				trace_sem_wait (&browse_sem, "wait browse");
 
-				g_hash_table_iter_init(&iter, browse_table);
-				while(g_hash_table_iter_next(&iter, &key, &value))
-				{
-					c = (Container*)value;
-					if(!strcmp(c->parent_id,"0")) {
-						printf("  %d . %s->id:%s\n", i, (char*)c->title, (char*)key);
-						i++;
-					}
-				}
-				i = 1;
+				cache_print_children(curr_server_udn, "0");
 
 				printf("Enter the id to browse or r/R to previous menu: ");
 
@@ -1226,76 +14813,70 @@ void *user_interaction(void *ptr)
 				memset(curr_obj_id, 0, sizeof(curr_obj_id));
 
 				fgets(user_input, sizeof(user_input), stdin);
-				if(user_input[0] == 'r' || user_input[0] == 'R') 
+				if(user_input[0] == 'r' || user_input[0] == 'R') {
+					g_clear_object(&content_dir);
 					goto refresh;
+				}
 			
 				strncpy(curr_obj_id, user_input, (strlen(user_input) - 1));
 				curr_obj_id[strlen(user_input)] = '\0';
 				
 				puts(curr_obj_id);
 			browse:
-				if(g_hash_table_lookup(browse_table, curr_obj_id) != NULL)
+				if(cache_copy(curr_server_udn, curr_obj_id, &copy))
 				{
 				
-					browse((GUPnPServiceProxy*)s->content_dir, curr_obj_id, 0, MAX_BROWSE);
-					sem_wait(&browse_sem);
-					g_hash_table_iter_init(&iter, browse_table);
-					while(g_hash_table_iter_next(&iter, &key, &value))
-					{
-						c = (Container*)value;
-						if(!strcmp(curr_obj_id, c->parent_id)){
-							printf("  %d . %s->id:%s\n", i, (char*)c->title, (char*)key);
-							i++;
-						}
-					}
+					cache_set_navigation(curr_server_udn, curr_obj_id);
+					browse(content_dir, curr_obj_id, 0, MAX_BROWSE);
+					trace_sem_wait (&browse_sem, "wait browse");
+					cache_print_children(curr_server_udn, curr_obj_id);
 					
-					i = 1;
 					printf("Enter the id to browse/play or r/R to previous menu: ");
 					memset(user_input, 0, sizeof(user_input));
 
 					fgets(user_input, sizeof(user_input), stdin);
 
 					if(user_input[0] == 'r' || user_input[0] == 'R') {
-						c = (Container*)g_hash_table_lookup(browse_table, curr_obj_id);
-						if(!strcmp(c->parent_id,"0"))
+						if(copy.parent_id == NULL || !strcmp(copy.parent_id,"0")) {
+							cache_copy_clear(&copy);
 							goto browse_server;
+						}
 						
-						puts(c->parent_id);
-						memset(curr_obj_id, 0, sizeof(curr_obj_id));
-						
-						strncpy(curr_obj_id, c->parent_id, strlen(c->parent_id));
-						curr_obj_id[strlen(c->parent_id)] = '\0';
+						puts(copy.parent_id);
+						g_strlcpy(curr_obj_id, copy.parent_id, sizeof(curr_obj_id));
+						cache_copy_clear(&copy);
 
 						goto browse;
 					}
+					cache_copy_clear(&copy);
 					
-					puts(c->class);
+					/* Anything but a child shows this container again */
+					g_strlcpy(parent_obj_id, curr_obj_id, sizeof(parent_obj_id));
 					memset(curr_obj_id, 0, sizeof(curr_obj_id));
 					
 					strncpy(curr_obj_id, user_input, strlen(user_input) - 1);
 					curr_obj_id[strlen(user_input)] = '\0';
-					if(g_hash_table_lookup(browse_table, curr_obj_id) == NULL) {
-						memset(curr_obj_id, 0, sizeof(curr_obj_id));
-
-                                                strncpy(curr_obj_id, c->parent_id, strlen(c->parent_id));
-						curr_obj_id[strlen(c->parent_id)] = '\0';
+					if(!cache_copy(curr_server_udn, curr_obj_id, &copy)) {
+						cache_copy_clear(&copy);
+						g_strlcpy(curr_obj_id, parent_obj_id, sizeof(curr_obj_id));
 						goto browse;
 					}
 
-					c = (Container*)g_hash_table_lookup(browse_table, curr_obj_id);
-					if(strncmp(c->class, OBJECT_CLASS_CONTAINER, strlen(OBJECT_CLASS_CONTAINER)))
+					puts(copy.class ? copy.class : "");
+					if(copy.class == NULL ||
+					   strncmp(copy.class, OBJECT_CLASS_CONTAINER, strlen(OBJECT_CLASS_CONTAINER)))
 					{
 						
-						play(((GUPnPServiceProxy*)s->content_dir), curr_obj_id);
-						memset(curr_obj_id, 0, sizeof(curr_obj_id));
-
-                                                strncpy(curr_obj_id, c->parent_id, strlen(c->parent_id));
-						curr_obj_id[strlen(c->parent_id)] = '\0';
+						play(content_dir, curr_obj_id);
+						g_strlcpy(curr_obj_id, parent_obj_id, sizeof(curr_obj_id));
 					}
+					cache_copy_clear(&copy);
 						
 					goto browse;
 						
 				} else {
+					cache_copy_clear(&copy);
+					g_clear_object(&content_dir);
 					goto refresh;
 				}
 				
@@ -1304,28 +14885,92 @@ void *user_interaction(void *ptr)
 				goto refresh;
 			}
 			
-		}
+		} else
+			/* Each check is a main loop round trip */
+			g_usleep(100 * 1000);
 	}
 }
 
 int main(int argc, char **argv)
 {
-	GMainLoop *loop;
 	GError *err = NULL;
 	GThread *user_thread;
+	GOptionContext *option_context;
 
 #if !GLIB_CHECK_VERSION(2, 35, 0)
         g_type_init ();
 #endif
-	server_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
-	browse_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
-	renderer_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+        option_context = g_option_context_new ("- DLNA command line control point");
+        g_option_context_add_main_entries (option_context, entries, NULL);
+        if (!g_option_context_parse (option_context, &argc, &argv, &err)) {
+                g_printerr ("Could not parse options: %s\n", err->message);
+                g_error_free (err);
+
+                return 1;
+        }
+        g_option_context_free (option_context);
+
+        if (socket_path == NULL)
+                socket_path = g_build_filename (g_get_user_runtime_dir (),
+                                                "control-point.sock",
+                                                NULL);
+
+        if (call_method != NULL)
+                return rpc_call (socket_path, call_method, call_params);
+
+        mem_report_time = g_get_monotonic_time ();
+
+        /* libxml2 wants to set itself up before the parse threads use it */
+        xmlInitParser ();
+
+        if (bench_didl_files != NULL || bench_didl_synthetic > 0)
+                return bench_didl (bench_didl_files, bench_didl_synthetic);
+
+	/* Before any thread exists, watchdog_enter () tells the main
+	 * thread by watchdog_main_thread */
+	if (stall_threshold_ms > 0)
+		watchdog_start();
+
+	server_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) media_server_free);
+	browse_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) container_free);
+	renderer_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) renderer_data_free);
+	browsed_table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) cached_container_free);
+	cache_budget = (gsize) cache_budget_kib * 1024;
+	didl_pool = g_thread_pool_new(didl_batch_parse, NULL,
+				      parse_threads > 0 ? parse_threads : (int) g_get_num_processors(),
+				      FALSE, NULL);
+	art_init();
 
 	sem_init(&browse_sem, 0, 0);
-	sem_init(&play_sem, 0, 0);
 	sem_init(&duration_sem, 0, 0);
+	sem_init(&path_sem, 0, 0);
+
+	http_server_start();
 
-	loop = g_main_loop_new(NULL, FALSE);
+	if (record_path != NULL && !capture_open (record_path))
+		return 1;
+	if (replay_path != NULL && !replay_load (replay_path))
+		return 1;
+
+	main_loop = g_main_loop_new(NULL, FALSE);
+	main_messages = message_source_new(NULL);
+
+	if (shard_count > 0 && replay_hosts != NULL) {
+		g_warning ("--replay runs on the main loop, ignoring --shards");
+		shard_count = 0;
+	}
+
+	if (discovery_fetches < 1)
+		discovery_fetches = 1;
+	if (farm_churn > FARM_CHURN_MAX) {
+		g_warning ("--farm-churn is limited to %d devices per second",
+			   FARM_CHURN_MAX);
+		farm_churn = FARM_CHURN_MAX;
+	}
+
+	if (shard_count > 0)
+		shards_start();
+	else {
         context_manager = gupnp_context_manager_create (upnp_port);
         g_assert (context_manager != NULL);
 
@@ -1333,10 +14978,53 @@ int main(int argc, char **argv)
                           "context-available",
                           G_CALLBACK (on_context_available),
                           NULL);
+	}
 
-	user_thread = g_thread_new("user_thread",(GThreadFunc)user_interaction, (void *)server_table);
+	if (bench_play_rounds > 0)
+		g_thread_new("bench_thread", bench_play_thread,
+			     GINT_TO_POINTER (bench_play_rounds));
+	else if (soak_seconds > 0) {
+		soak_latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+		sem_init(&soak_sem, 0, 0);
+		g_timeout_add (SOAK_PROBE_MS, soak_probe_cb, NULL);
+		g_thread_new("soak_thread", soak_thread, NULL);
+	} else if (farm_servers > 0 || farm_renderers > 0) {
+		farm.servers = g_ptr_array_new ();
+		farm.renderers = g_ptr_array_new ();
+		farm.departed = g_ptr_array_new_with_free_func (g_free);
+		sem_init(&farm_sem, 0, 0);
+		g_thread_new("farm_thread", farm_thread, NULL);
+	} else if (daemon_mode) {
+		if (!rpc_server_start (socket_path))
+			return 1;
+	} else
+		user_thread = g_thread_new("user_thread",(GThreadFunc)user_interaction, (void *)server_table);
 	
-	g_main_loop_run(loop);
+	if (status_shm_name != NULL && !status_shm_open (status_shm_name))
+		return 1;
+
+	if (trace_path != NULL || status_shm_name != NULL) {
+		g_unix_signal_add (SIGINT, quit_cb, NULL);
+		g_unix_signal_add (SIGTERM, quit_cb, NULL);
+	}
+
+	g_main_loop_run(main_loop);
+
+	watchdog_stop();
+
+	if (trace_path != NULL)
+		trace_dump (trace_path);
+
+	status_shm_close (status_shm_name);
+
+	if (bench_renderer != NULL)
+		mock_renderer_free (bench_renderer);
+
+	if (mock_dir != NULL) {
+		mock_dir_remove (mock_renderer_services);
+		mock_dir_remove (mock_server_services);
+		g_rmdir (mock_dir);
+	}
 
-        return 0;
+        return soak_failed ? 1 : 0;
 }